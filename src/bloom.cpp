@@ -90,6 +90,13 @@ bool CBloomFilter::contains(const uint256& hash) const
     return contains(data);
 }
 
+void CBloomFilter::clear()
+{
+    vData.assign(vData.size(), 0);
+    isFull = false;
+    isEmpty = true;
+}
+
 bool CBloomFilter::IsWithinSizeConstraints() const
 {
     return vData.size() <= MAX_BLOOM_FILTER_SIZE && nHashFuncs <= MAX_HASH_FUNCS;
@@ -176,3 +183,53 @@ void CBloomFilter::UpdateEmptyFull()
     isFull = full;
     isEmpty = empty;
 }
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double fpRate, unsigned int nTweak) :
+    nBloomSize(nElements),
+    nInsertions(0),
+    b1(nElements, fpRate, nTweak, BLOOM_UPDATE_NONE),
+    b2(nElements, fpRate, nTweak, BLOOM_UPDATE_NONE)
+{
+    clear();
+}
+
+void CRollingBloomFilter::insert(const std::vector<unsigned char>& vKey)
+{
+    if (nInsertions == 0)
+        b1.clear();
+    else if (nInsertions == nBloomSize / 2)
+        b2.clear();
+    b1.insert(vKey);
+    b2.insert(vKey);
+    if (++nInsertions == nBloomSize)
+        nInsertions = 0;
+}
+
+void CRollingBloomFilter::insert(const uint256& hash)
+{
+    std::vector<unsigned char> data(hash.begin(), hash.end());
+    insert(data);
+}
+
+bool CRollingBloomFilter::contains(const std::vector<unsigned char>& vKey) const
+{
+    // b1 holds everything since the start of the current cycle and b2
+    // everything since the middle of the previous one; ask whichever of
+    // the two currently covers at least the last nBloomSize/2 insertions.
+    if (nInsertions < nBloomSize / 2)
+        return b2.contains(vKey);
+    return b1.contains(vKey);
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash) const
+{
+    std::vector<unsigned char> data(hash.begin(), hash.end());
+    return contains(data);
+}
+
+void CRollingBloomFilter::clear()
+{
+    b1.clear();
+    b2.clear();
+    nInsertions = 0;
+}
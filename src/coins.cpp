@@ -4,6 +4,9 @@
 
 #include "coins.h"
 
+#include "hash.h"
+#include "version.h"
+
 #include <assert.h>
 
 //Calculate number of bytes for the bitmask, and its number of non-zero bytes
@@ -48,13 +51,58 @@ bool CCoins::Spend(int nPos) {
 }
 
 
+static void GetCoinsStatsEntry(const uint256 &txid, const CCoins &coins, uint64_t &nOutputs, int64_t &nAmount, uint64_t &nSize, uint256 &hash) {
+    nOutputs = 0;
+    nAmount = 0;
+    BOOST_FOREACH(const CTxOut &out, coins.vout) {
+        if (!out.IsNull()) {
+            nOutputs++;
+            nAmount += out.nValue;
+        }
+    }
+    // Same accounting as the full scan: key (txid) plus the record as stored
+    nSize = 32 + ::GetSerializeSize(coins, SER_DISK, CLIENT_VERSION);
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << txid << coins;
+    hash = ss.GetHash();
+}
+
+void CCoinsStats::AddCoins(const uint256 &txid, const CCoins &coins) {
+    if (coins.IsPruned())
+        return;
+    uint64_t nOutputs, nSize;
+    int64_t nAmount;
+    uint256 hash;
+    GetCoinsStatsEntry(txid, coins, nOutputs, nAmount, nSize, hash);
+    nTransactions++;
+    nTransactionOutputs += nOutputs;
+    nTotalAmount += nAmount;
+    nSerializedSize += nSize;
+    hashMultiset += hash;
+}
+
+void CCoinsStats::RemoveCoins(const uint256 &txid, const CCoins &coins) {
+    if (coins.IsPruned())
+        return;
+    uint64_t nOutputs, nSize;
+    int64_t nAmount;
+    uint256 hash;
+    GetCoinsStatsEntry(txid, coins, nOutputs, nAmount, nSize, hash);
+    nTransactions--;
+    nTransactionOutputs -= nOutputs;
+    nTotalAmount -= nAmount;
+    nSerializedSize -= nSize;
+    hashMultiset -= hash;
+}
+
 bool CCoinsView::GetCoins(const uint256 &txid, CCoins &coins) { return false; }
 bool CCoinsView::SetCoins(const uint256 &txid, const CCoins &coins) { return false; }
 bool CCoinsView::HaveCoins(const uint256 &txid) { return false; }
 uint256 CCoinsView::GetBestBlock() { return uint256(0); }
 bool CCoinsView::SetBestBlock(const uint256 &hashBlock) { return false; }
-bool CCoinsView::BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock) { return false; }
+bool CCoinsView::BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock, const CCoinsStats *pstats) { return false; }
 bool CCoinsView::GetStats(CCoinsStats &stats) { return false; }
+bool CCoinsView::GetRunningStats(CCoinsStats &stats) { return false; }
 
 
 CCoinsViewBacked::CCoinsViewBacked(CCoinsView &viewIn) : base(&viewIn) { }
@@ -64,10 +112,11 @@ bool CCoinsViewBacked::HaveCoins(const uint256 &txid) { return base->HaveCoins(t
 uint256 CCoinsViewBacked::GetBestBlock() { return base->GetBestBlock(); }
 bool CCoinsViewBacked::SetBestBlock(const uint256 &hashBlock) { return base->SetBestBlock(hashBlock); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
-bool CCoinsViewBacked::BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock) { return base->BatchWrite(mapCoins, hashBlock); }
+bool CCoinsViewBacked::BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock, const CCoinsStats *pstats) { return base->BatchWrite(mapCoins, hashBlock, pstats); }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) { return base->GetStats(stats); }
+bool CCoinsViewBacked::GetRunningStats(CCoinsStats &stats) { return base->GetRunningStats(stats); }
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), hashBlock(0) { }
+CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), hashBlock(0), fRunningStats(false) { }
 
 bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) {
     if (cacheCoins.count(txid)) {
@@ -119,15 +168,29 @@ bool CCoinsViewCache::SetBestBlock(const uint256 &hashBlockIn) {
     return true;
 }
 
-bool CCoinsViewCache::BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlockIn) {
+bool CCoinsViewCache::BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlockIn, const CCoinsStats *pstats) {
     for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
         cacheCoins[it->first] = it->second;
     hashBlock = hashBlockIn;
+    if (pstats)
+        SetRunningStats(*pstats);
     return true;
 }
 
+bool CCoinsViewCache::GetRunningStats(CCoinsStats &stats) {
+    if (!fRunningStats)
+        return base->GetRunningStats(stats);
+    stats = statsRunning;
+    return true;
+}
+
+void CCoinsViewCache::SetRunningStats(const CCoinsStats &stats) {
+    statsRunning = stats;
+    fRunningStats = true;
+}
+
 bool CCoinsViewCache::Flush() {
-    bool fOk = base->BatchWrite(cacheCoins, hashBlock);
+    bool fOk = base->BatchWrite(cacheCoins, hashBlock, fRunningStats ? &statsRunning : NULL);
     if (fOk)
         cacheCoins.clear();
     return fOk;
@@ -197,8 +197,29 @@ struct CCoinsStats
     uint64_t nSerializedSize;
     uint256 hashSerialized;
     int64_t nTotalAmount;
-
-    CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), nTotalAmount(0) {}
+    uint256 hashMultiset;
+
+    CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), nTotalAmount(0), hashMultiset(0) {}
+
+    //Account for (or take back) one CCoins record of the set. Every field is
+    //a plain sum, so the statistics can be kept up to date one change at a
+    //time; hashMultiset adds up the hash of every record modulo 2^256, which
+    //makes it independent of the order the records were added in. Unlike
+    //hashSerialized it is only meant to detect accidental divergence, not to
+    //resist deliberately constructed collisions.
+    void AddCoins(const uint256 &txid, const CCoins &coins);
+    void RemoveCoins(const uint256 &txid, const CCoins &coins);
+
+    //Only the incrementally maintained fields; hashSerialized needs a full scan
+    IMPLEMENT_SERIALIZE(
+        READWRITE(nHeight);
+        READWRITE(hashBlock);
+        READWRITE(nTransactions);
+        READWRITE(nTransactionOutputs);
+        READWRITE(nSerializedSize);
+        READWRITE(nTotalAmount);
+        READWRITE(hashMultiset);
+    )
 };
 
 
@@ -221,12 +242,17 @@ public:
     //Modify the currently active block hash
     virtual bool SetBestBlock(const uint256 &hashBlock);
 
-    //Do a bulk modification (multiple SetCoins + one SetBestBlock)
-    virtual bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock);
+    //Do a bulk modification (multiple SetCoins + one SetBestBlock), and store
+    //the running statistics that go with it if pstats is not NULL
+    virtual bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock, const CCoinsStats *pstats);
 
     //Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats &stats);
 
+    //Retrieve the statistics kept up to date block by block, without a scan.
+    //Returns false if they are not tracked for this view.
+    virtual bool GetRunningStats(CCoinsStats &stats);
+
     //As we use CCoinsViews polymorphically, have a virtual destructor
     virtual ~CCoinsView() {}
 };
@@ -246,8 +272,9 @@ public:
     uint256 GetBestBlock();
     bool SetBestBlock(const uint256 &hashBlock);
     void SetBackend(CCoinsView &viewIn);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock);
+    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock, const CCoinsStats *pstats);
     bool GetStats(CCoinsStats &stats);
+    bool GetRunningStats(CCoinsStats &stats);
 };
 
 
@@ -257,6 +284,8 @@ class CCoinsViewCache : public CCoinsViewBacked
 protected:
     uint256 hashBlock;
     std::map<uint256,CCoins> cacheCoins;
+    bool fRunningStats;
+    CCoinsStats statsRunning;
 
 public:
     CCoinsViewCache(CCoinsView &baseIn, bool fDummy = false);
@@ -267,7 +296,11 @@ public:
     bool HaveCoins(const uint256 &txid);
     uint256 GetBestBlock();
     bool SetBestBlock(const uint256 &hashBlock);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock);
+    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock, const CCoinsStats *pstats);
+    bool GetRunningStats(CCoinsStats &stats);
+
+    //Replace the running statistics; they are passed on to the base on Flush()
+    void SetRunningStats(const CCoinsStats &stats);
 
     //Return a modifiable reference to a CCoins. Check HaveCoins first.
     CCoins &GetCoins(const uint256 &txid);
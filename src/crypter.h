@@ -129,6 +129,9 @@ protected:
 
     bool Unlock(const CKeyingMaterial& vMasterKeyIn);
 
+    // Encrypt the secret of a key with the master key, without adding it to the store
+    bool EncryptKey(const CKey& key, const CPubKey &pubkey, std::vector<unsigned char> &vchCryptedSecret) const;
+
 public:
     CCryptoKeyStore() : fUseCrypto(false)
     {
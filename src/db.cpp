@@ -10,6 +10,7 @@
 #include "protocol.h"
 #include "util.h"
 
+#include <errno.h>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -53,6 +54,8 @@ CDBEnv::CDBEnv() : dbenv(DB_CXX_NO_EXCEPTIONS)
 CDBEnv::~CDBEnv()
 {
     EnvShutdown();
+    for (std::map<std::string, CWalletStore*>::iterator mi = mapStores.begin(); mi != mapStores.end(); mi++)
+        delete (*mi).second;
 }
 
 void CDBEnv::Close()
@@ -209,6 +212,59 @@ bool CDBEnv::Salvage(std::string strFile, bool fAggressive,
 }
 
 
+bool CDBEnv::OpenLogStore(const std::string& strFile)
+{
+    LOCK(cs_db);
+    assert(mapFileUseCount.count(strFile) == 0);
+    if (mapStores.count(strFile))
+        return true;
+
+    boost::filesystem::path pathLog = GetLogStorePath(strFile);
+    if (!boost::filesystem::exists(pathLog) && boost::filesystem::exists(path / strFile))
+    {
+        // Copy the Berkeley DB records into a new log, which only takes the
+        // place of the log once all of them are in it
+        int64_t nStart = GetTimeMillis();
+        boost::filesystem::path pathMigrate = pathLog.string() + ".migrate";
+        boost::filesystem::remove(pathMigrate);
+        bool fSuccess;
+        unsigned int nRecords;
+        {
+            CWalletLog log(pathMigrate);
+            if (!log.Open())
+                return false;
+            fSuccess = CDB::CopyToStore(strFile, log, nRecords);
+            log.Close();
+        }
+        // Leave nothing of the Berkeley DB file open, it is not used again
+        CloseDb(strFile);
+        CheckpointLSN(strFile);
+        mapFileUseCount.erase(strFile);
+        if (fSuccess)
+            fSuccess = RenameOver(pathMigrate, pathLog);
+        if (!fSuccess)
+            return error("CDBEnv::OpenLogStore : failed to copy %s to %s", strFile, pathLog.string());
+        LogPrintf("CDBEnv::OpenLogStore : copied %u records from %s to %s in %dms, %s itself is left as it was\n",
+                  nRecords, strFile, pathLog.string(), GetTimeMillis() - nStart, strFile);
+    }
+
+    CWalletLog* plog = new CWalletLog(pathLog);
+    if (!plog->Open())
+    {
+        delete plog;
+        return false;
+    }
+    mapStores[strFile] = plog;
+    return true;
+}
+
+CWalletStore* CDBEnv::GetStore(const std::string& strFile)
+{
+    LOCK(cs_db);
+    std::map<std::string, CWalletStore*>::iterator mi = mapStores.find(strFile);
+    return (mi != mapStores.end() ? (*mi).second : NULL);
+}
+
 void CDBEnv::CheckpointLSN(std::string strFile)
 {
     dbenv.txn_checkpoint(0, 0, 0);
@@ -219,7 +275,7 @@ void CDBEnv::CheckpointLSN(std::string strFile)
 
 
 CDB::CDB(const char *pszFile, const char* pszMode) :
-    pdb(NULL), activeTxn(NULL)
+    pdb(NULL), activeTxn(NULL), pstore(NULL), pstoreTxn(NULL)
 {
     int ret;
     if (pszFile == NULL)
@@ -231,6 +287,21 @@ CDB::CDB(const char *pszFile, const char* pszMode) :
     if (fCreate)
         nFlags |= DB_CREATE;
 
+    pstore = bitdb.GetStore(pszFile);
+    if (pstore)
+    {
+        // Berkeley DB is not involved at all
+        strFile = pszFile;
+        if (fCreate && !Exists(std::string("version")))
+        {
+            bool fTmp = fReadOnly;
+            fReadOnly = false;
+            WriteVersion(CLIENT_VERSION);
+            fReadOnly = fTmp;
+        }
+        return;
+    }
+
     {
         LOCK(bitdb.cs_db);
         if (!bitdb.Open(GetDataDir()))
@@ -283,7 +354,8 @@ CDB::CDB(const char *pszFile, const char* pszMode) :
 
 void CDB::Flush()
 {
-    if (activeTxn)
+    // Wallet store commits are on disk when they return
+    if (activeTxn || pstore)
         return;
 
     // Flush database activity from memory pool to disk log
@@ -296,6 +368,13 @@ void CDB::Flush()
 
 void CDB::Close()
 {
+    if (pstore)
+    {
+        delete pstoreTxn;
+        pstoreTxn = NULL;
+        pstore = NULL;
+        return;
+    }
     if (!pdb)
         return;
     if (activeTxn)
@@ -311,6 +390,99 @@ void CDB::Close()
     }
 }
 
+bool CDB::StoreRead(const CDataStream& ssKey, CDataStream& ssValue)
+{
+    CSerializeData vchKey(ssKey.begin(), ssKey.end());
+    CSerializeData vchValue;
+    if (pstoreTxn)
+    {
+        // The active transaction's own writes come first
+        const CWalletStoreOp* pop = pstoreTxn->Find(vchKey);
+        if (pop)
+        {
+            if (pop->fErase)
+                return false;
+            vchValue = pop->value;
+        }
+        else if (!pstore->Read(vchKey, vchValue))
+            return false;
+    }
+    else if (!pstore->Read(vchKey, vchValue))
+        return false;
+    ssValue.write(vchValue.empty() ? NULL : &vchValue[0], vchValue.size());
+    return true;
+}
+
+bool CDB::StoreWrite(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite)
+{
+    if (!fOverwrite && StoreExists(ssKey))
+        return false;
+    CSerializeData vchKey(ssKey.begin(), ssKey.end());
+    CSerializeData vchValue(ssValue.begin(), ssValue.end());
+    if (pstoreTxn)
+    {
+        pstoreTxn->Write(vchKey, vchValue);
+        return true;
+    }
+    CWalletStoreBatch batch;
+    batch.Write(vchKey, vchValue);
+    return pstore->Commit(batch);
+}
+
+bool CDB::StoreErase(const CDataStream& ssKey)
+{
+    CSerializeData vchKey(ssKey.begin(), ssKey.end());
+    if (pstoreTxn)
+    {
+        pstoreTxn->Erase(vchKey);
+        return true;
+    }
+    CWalletStoreBatch batch;
+    batch.Erase(vchKey);
+    return pstore->Commit(batch);
+}
+
+bool CDB::StoreExists(const CDataStream& ssKey)
+{
+    CSerializeData vchKey(ssKey.begin(), ssKey.end());
+    if (pstoreTxn)
+    {
+        const CWalletStoreOp* pop = pstoreTxn->Find(vchKey);
+        if (pop)
+            return !pop->fErase;
+    }
+    return pstore->Exists(vchKey);
+}
+
+int CDB::ReadAtStoreCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags)
+{
+    // Wallet code only steps a cursor forward or seeks it, which is all the
+    // store supports; Berkeley DB answers other flags it rejects with EINVAL
+    assert(fFlags == DB_NEXT || fFlags == DB_SET_RANGE);
+    if (fFlags != DB_NEXT && fFlags != DB_SET_RANGE)
+        return EINVAL;
+
+    // Like Berkeley DB cursors outside a transaction, this only sees committed records
+    CSerializeData vchKey, vchValue;
+    bool fFound;
+    if (fFlags == DB_NEXT)
+        fFound = pcursor->pstore->Seek(pcursor->vchKey, pcursor->fStarted, vchKey, vchValue);
+    else
+        fFound = pcursor->pstore->Seek(CSerializeData(ssKey.begin(), ssKey.end()), false, vchKey, vchValue);
+    if (!fFound)
+        return DB_NOTFOUND;
+    pcursor->vchKey = vchKey;
+    pcursor->fStarted = true;
+
+    ssKey.SetType(SER_DISK);
+    ssKey.clear();
+    ssKey.write(vchKey.empty() ? NULL : &vchKey[0], vchKey.size());
+    ssValue.SetType(SER_DISK);
+    ssValue.clear();
+    ssValue.write(vchValue.empty() ? NULL : &vchValue[0], vchValue.size());
+    return 0;
+}
+
 void CDBEnv::CloseDb(const std::string& strFile)
 {
     {
@@ -335,8 +507,58 @@ bool CDBEnv::RemoveDb(const std::string& strFile)
     return (rc == 0);
 }
 
+bool CDB::CopyToStore(const std::string& strFile, CWalletStore& store, unsigned int& nRecords)
+{
+    nRecords = 0;
+    try {
+        CDB db(strFile.c_str(), "r");
+        CDBCursor* pcursor = db.GetCursor();
+        if (!pcursor)
+            return false;
+        bool fSuccess = true;
+        CWalletStoreBatch batch;
+        while (fSuccess)
+        {
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            int ret = db.ReadAtCursor(pcursor, ssKey, ssValue, DB_NEXT);
+            if (ret == DB_NOTFOUND)
+                break;
+            else if (ret != 0)
+            {
+                fSuccess = false;
+                break;
+            }
+            batch.Write(CSerializeData(ssKey.begin(), ssKey.end()), CSerializeData(ssValue.begin(), ssValue.end()));
+            nRecords++;
+            if (batch.vOps.size() >= 1000)
+            {
+                fSuccess = store.Commit(batch);
+                batch.vOps.clear();
+            }
+        }
+        delete pcursor;
+        return fSuccess && store.Commit(batch);
+    } catch (std::exception &e) {
+        LogPrintf("CDB::CopyToStore : %s\n", e.what());
+        return false;
+    }
+}
+
 bool CDB::Rewrite(const std::string& strFile, const char* pszSkip)
 {
+    CWalletStore* pstore = bitdb.GetStore(strFile);
+    if (pstore)
+    {
+        LogPrintf("CDB::Rewrite : Rewriting %s...\n", strFile);
+        {
+            CDB db(strFile.c_str(), "r+");
+            if (!db.WriteVersion(CLIENT_VERSION))
+                return false;
+        }
+        return pstore->Rewrite(pszSkip);
+    }
+
     while (true)
     {
         {
@@ -367,7 +589,7 @@ bool CDB::Rewrite(const std::string& strFile, const char* pszSkip)
                         fSuccess = false;
                     }
 
-                    Dbc* pcursor = db.GetCursor();
+                    CDBCursor* pcursor = db.GetCursor();
                     if (pcursor)
                         while (fSuccess)
                         {
@@ -376,12 +598,12 @@ bool CDB::Rewrite(const std::string& strFile, const char* pszSkip)
                             int ret = db.ReadAtCursor(pcursor, ssKey, ssValue, DB_NEXT);
                             if (ret == DB_NOTFOUND)
                             {
-                                pcursor->close();
+                                delete pcursor;
                                 break;
                             }
                             else if (ret != 0)
                             {
-                                pcursor->close();
+                                delete pcursor;
                                 fSuccess = false;
                                 break;
                             }
@@ -434,6 +656,12 @@ void CDBEnv::Flush(bool fShutdown)
     int64_t nStart = GetTimeMillis();
     // Flush log data to the actual data file on all files that are not in use
     LogPrint("db", "CDBEnv::Flush : Flush(%s)%s\n", fShutdown ? "true" : "false", fDbEnvInit ? "" : " database not started");
+    if (fShutdown)
+    {
+        LOCK(cs_db);
+        for (std::map<std::string, CWalletStore*>::iterator mi = mapStores.begin(); mi != mapStores.end(); mi++)
+            (*mi).second->Close();
+    }
     if (!fDbEnvInit)
         return;
     {
@@ -9,6 +9,7 @@
 #include "serialize.h"
 #include "sync.h"
 #include "version.h"
+#include "walletlog.h"
 
 #include <map>
 #include <string>
@@ -41,6 +42,7 @@ public:
     DbEnv dbenv;
     std::map<std::string, int> mapFileUseCount;
     std::map<std::string, Db*> mapDb;
+    std::map<std::string, CWalletStore*> mapStores;
 
     CDBEnv();
     ~CDBEnv();
@@ -73,6 +75,17 @@ public:
     void CloseDb(const std::string& strFile);
     bool RemoveDb(const std::string& strFile);
 
+    /*
+     * Keep strFile in an append-only log (see CWalletLog) instead of Berkeley DB
+     * from now on. The first time, the records of the Berkeley DB file are copied
+     * into the log, and the file is left as it is.
+     * This must be called BEFORE strFile is opened.
+     */
+    bool OpenLogStore(const std::string& strFile);
+    boost::filesystem::path GetLogStorePath(const std::string& strFile) const { return path / (strFile + ".log"); }
+    /** Store that serves strFile, NULL for Berkeley DB */
+    CWalletStore* GetStore(const std::string& strFile);
+
     DbTxn *TxnBegin(int flags=DB_TXN_WRITE_NOSYNC)
     {
         DbTxn* ptxn = NULL;
@@ -86,7 +99,25 @@ public:
 extern CDBEnv bitdb;
 
 
-/** RAII class that provides access to a Berkeley database */
+/** Position in a CDB, on a Berkeley DB cursor or on a wallet store */
+class CDBCursor
+{
+public:
+    Dbc* dbc;
+    CWalletStore* pstore;
+    CSerializeData vchKey; // last key read from pstore
+    bool fStarted;
+
+    CDBCursor(Dbc* dbcIn, CWalletStore* pstoreIn) : dbc(dbcIn), pstore(pstoreIn), fStarted(false) {}
+    ~CDBCursor()
+    {
+        if (dbc)
+            dbc->close();
+    }
+};
+
+
+/** RAII class that provides access to a Berkeley database, or to the wallet store kept instead of one */
 class CDB
 {
 protected:
@@ -94,6 +125,10 @@ protected:
     std::string strFile;
     DbTxn *activeTxn;
     bool fReadOnly;
+    // Set instead of pdb when strFile is kept in a wallet store, with the
+    // writes of the active transaction
+    CWalletStore* pstore;
+    CWalletStoreBatch* pstoreTxn;
 
     explicit CDB(const char* pszFile, const char* pszMode="r+");
     ~CDB() { Close(); }
@@ -104,17 +139,37 @@ private:
     CDB(const CDB&);
     void operator=(const CDB&);
 
+    bool StoreRead(const CDataStream& ssKey, CDataStream& ssValue);
+    bool StoreWrite(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite);
+    bool StoreErase(const CDataStream& ssKey);
+    bool StoreExists(const CDataStream& ssKey);
+    int ReadAtStoreCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags);
+
 protected:
     template<typename K, typename T>
     bool Read(const K& key, T& value)
     {
-        if (!pdb)
+        if (!pdb && !pstore)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (pstore)
+        {
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            if (!StoreRead(ssKey, ssValue))
+                return false;
+            try {
+                ssValue >> value;
+            }
+            catch (std::exception &e) {
+                return false;
+            }
+            return true;
+        }
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Read
@@ -143,7 +198,7 @@ protected:
     template<typename K, typename T>
     bool Write(const K& key, const T& value, bool fOverwrite=true)
     {
-        if (!pdb)
+        if (!pdb && !pstore)
             return false;
         if (fReadOnly)
             assert(!"Write called on database in read-only mode");
@@ -158,6 +213,8 @@ protected:
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
         ssValue.reserve(10000);
         ssValue << value;
+        if (pstore)
+            return StoreWrite(ssKey, ssValue, fOverwrite);
         Dbt datValue(&ssValue[0], ssValue.size());
 
         // Write
@@ -172,7 +229,7 @@ protected:
     template<typename K>
     bool Erase(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !pstore)
             return false;
         if (fReadOnly)
             assert(!"Erase called on database in read-only mode");
@@ -181,6 +238,8 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+        if (pstore)
+            return StoreErase(ssKey);
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Erase
@@ -194,13 +253,15 @@ protected:
     template<typename K>
     bool Exists(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !pstore)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+        if (pstore)
+            return StoreExists(ssKey);
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Exists
@@ -211,19 +272,25 @@ protected:
         return (ret == 0);
     }
 
-    Dbc* GetCursor()
+    /** New cursor before the first record, the caller deletes it */
+    CDBCursor* GetCursor()
     {
+        if (pstore)
+            return new CDBCursor(NULL, pstore);
         if (!pdb)
             return NULL;
         Dbc* pcursor = NULL;
         int ret = pdb->cursor(NULL, &pcursor, 0);
         if (ret != 0)
             return NULL;
-        return pcursor;
+        return new CDBCursor(pcursor, NULL);
     }
 
-    int ReadAtCursor(Dbc* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags=DB_NEXT)
+    int ReadAtCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags=DB_NEXT)
     {
+        if (pcursor->pstore)
+            return ReadAtStoreCursor(pcursor, ssKey, ssValue, fFlags);
+
         // Read at cursor
         Dbt datKey;
         if (fFlags == DB_SET || fFlags == DB_SET_RANGE || fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE)
@@ -239,7 +306,7 @@ protected:
         }
         datKey.set_flags(DB_DBT_MALLOC);
         datValue.set_flags(DB_DBT_MALLOC);
-        int ret = pcursor->get(&datKey, &datValue, fFlags);
+        int ret = pcursor->dbc->get(&datKey, &datValue, fFlags);
         if (ret != 0)
             return ret;
         else if (datKey.get_data() == NULL || datValue.get_data() == NULL)
@@ -264,6 +331,13 @@ protected:
 public:
     bool TxnBegin()
     {
+        if (pstore)
+        {
+            if (pstoreTxn)
+                return false;
+            pstoreTxn = new CWalletStoreBatch();
+            return true;
+        }
         if (!pdb || activeTxn)
             return false;
         DbTxn* ptxn = bitdb.TxnBegin();
@@ -275,6 +349,15 @@ public:
 
     bool TxnCommit()
     {
+        if (pstore)
+        {
+            if (!pstoreTxn)
+                return false;
+            bool fOK = pstore->Commit(*pstoreTxn);
+            delete pstoreTxn;
+            pstoreTxn = NULL;
+            return fOK;
+        }
         if (!pdb || !activeTxn)
             return false;
         int ret = activeTxn->commit(0);
@@ -284,6 +367,14 @@ public:
 
     bool TxnAbort()
     {
+        if (pstore)
+        {
+            if (!pstoreTxn)
+                return false;
+            delete pstoreTxn;
+            pstoreTxn = NULL;
+            return true;
+        }
         if (!pdb || !activeTxn)
             return false;
         int ret = activeTxn->abort();
@@ -303,6 +394,8 @@ public:
     }
 
     bool static Rewrite(const std::string& strFile, const char* pszSkip = NULL);
+    /** Copy every record of strFile, which must be in Berkeley DB, to store */
+    bool static CopyToStore(const std::string& strFile, CWalletStore& store, unsigned int& nRecords);
 };
 
 #endif // BITCOIN_DB_H
@@ -126,6 +126,10 @@ inline uint160 Hash160(const std::vector<unsigned char>& vch)
 
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
+/** SipHash-2-4 of a 256-bit value with the 128-bit key (k0, k1). Much cheaper
+ *  than SHA256 when a keyed, collision-resistant short hash is all that is needed. */
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+
 typedef struct
 {
     SHA512_CTX ctxInner;
@@ -136,4 +140,14 @@ int HMAC_SHA512_Init(HMAC_SHA512_CTX *pctx, const void *pkey, size_t len);
 int HMAC_SHA512_Update(HMAC_SHA512_CTX *pctx, const void *pdata, size_t len);
 int HMAC_SHA512_Final(unsigned char *pmd, HMAC_SHA512_CTX *pctx);
 
+typedef struct
+{
+    SHA256_CTX ctxInner;
+    SHA256_CTX ctxOuter;
+} HMAC_SHA256_CTX;
+
+int HMAC_SHA256_Init(HMAC_SHA256_CTX *pctx, const void *pkey, size_t len);
+int HMAC_SHA256_Update(HMAC_SHA256_CTX *pctx, const void *pdata, size_t len);
+int HMAC_SHA256_Final(unsigned char *pmd, HMAC_SHA256_CTX *pctx);
+
 #endif
@@ -203,10 +203,14 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -dbcache=<n>           " + strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache) + "\n";
     strUsage += "  -keypool=<n>           " + _("Set key pool size to <n> (default: 100)") + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + " " + _("on startup") + "\n";
+    strUsage += "  -maxmempool=<n>        " + strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE) + "\n";
+    strUsage += "  -mempoolexpiry=<n>     " + strprintf(_("Do not keep transactions in the mempool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY) + "\n";
     strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n";
     strUsage += "  -pid=<file>            " + _("Specify pid file (default: auroracoind.pid)") + "\n";
     strUsage += "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + " " + _("on startup") + "\n";
     strUsage += "  -txindex               " + _("Maintain a full transaction index (default: 0)") + "\n";
+    strUsage += "  -compacttxindex        " + _("Maintain a full transaction index keyed by truncated transaction ids, about half the size (default: 0)") + "\n";
+    strUsage += "  -addressindex          " + _("Maintain an index of outputs and spends by address, and of spent outputs (default: 0)") + "\n";
 
     strUsage += "\n" + _("Connection options:") + "\n";
     strUsage += "  -addnode=<ip>          " + _("Add a node to connect to and attempt to keep the connection open") + "\n";
@@ -245,6 +249,7 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -spendzeroconfchange   " + _("Spend unconfirmed change when sending transactions (default: 1)") + "\n";
     strUsage += "  -upgradewallet         " + _("Upgrade wallet to latest format") + " " + _("on startup") + "\n";
     strUsage += "  -wallet=<file>         " + _("Specify wallet file (within data directory)") + " " + _("(default: wallet.dat)") + "\n";
+    strUsage += "  -walletlog             " + _("Keep the wallet in an append-only log next to it instead of Berkeley DB, copying it over on first use and required from then on (default: 0)") + "\n";
     strUsage += "  -walletnotify=<cmd>    " + _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)") + "\n";
     strUsage += "  -zapwallettxes         " + _("Clear list of wallet transactions (diagnostic tool; implies -rescan)") + "\n";
 #endif
@@ -274,6 +279,10 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -logtimestamps         " + _("Prepend debug output with timestamp (default: 1)") + "\n";
     if (GetBoolArg("-help-debug", false))
     {
+        strUsage += "  -limitancestorcount=<n>   " + strprintf(_("Do not accept transactions if number of in-mempool ancestors is <n> or more (default: %u)"), DEFAULT_ANCESTOR_LIMIT) + "\n";
+        strUsage += "  -limitancestorsize=<n>    " + strprintf(_("Do not accept transactions whose size with all in-mempool ancestors exceeds <n> kilobytes (default: %u)"), DEFAULT_ANCESTOR_SIZE_LIMIT) + "\n";
+        strUsage += "  -limitdescendantcount=<n> " + strprintf(_("Do not accept transactions if any ancestor would have <n> or more in-mempool descendants (default: %u)"), DEFAULT_DESCENDANT_LIMIT) + "\n";
+        strUsage += "  -limitdescendantsize=<n>  " + strprintf(_("Do not accept transactions if any ancestor would have more than <n> kilobytes of in-mempool descendants (default: %u)"), DEFAULT_DESCENDANT_SIZE_LIMIT) + "\n";
         strUsage += "  -limitfreerelay=<n>    " + _("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default:15)") + "\n";
         strUsage += "  -maxsigcachesize=<n>   " + _("Limit size of signature cache to <n> entries (default: 50000)") + "\n";
     }
@@ -301,7 +310,10 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -rpcpassword=<pw>      " + _("Password for JSON-RPC connections") + "\n";
     strUsage += "  -rpcport=<port>        " + _("Listen for JSON-RPC connections on <port> (default: 8332)") + "\n";
     strUsage += "  -rpcallowip=<ip>       " + _("Allow JSON-RPC connections from specified IP address") + "\n";
-    strUsage += "  -rpcthreads=<n>        " + _("Set the number of threads to service RPC calls (default: 4)") + "\n";
+    strUsage += "  -rest                  " + _("Accept public REST requests on the RPC port (default: 0)") + "\n";
+    strUsage += "  -rpcthreads=<n>        " + strprintf(_("Set the number of threads to service RPC calls (default: %d)"), DEFAULT_RPC_THREADS) + "\n";
+    strUsage += "  -rpcworkqueue=<n>      " + strprintf(_("Set the depth of the work queue to service RPC calls (default: %d)"), DEFAULT_RPC_WORK_QUEUE) + "\n";
+    strUsage += "  -rpcservertimeout=<n>  " + strprintf(_("Timeout in seconds for idle RPC connections and for reading a request or writing its reply (default: %d)"), DEFAULT_RPC_SERVER_TIMEOUT) + "\n";
 
     strUsage += "\n" + _("RPC SSL options: (see the Bitcoin Wiki for SSL setup instructions)") + "\n";
     strUsage += "  -rpcssl                                  " + _("Use OpenSSL (https) for JSON-RPC connections") + "\n";
@@ -581,6 +593,13 @@ bool AppInit2(boost::thread_group& threadGroup)
             return InitError(strprintf(_("Invalid amount for -minrelaytxfee=<amount>: '%s'"), mapArgs["-minrelaytxfee"]));
     }
 
+    // The pool has to hold at least one full package of descendants, at
+    // about 40 bytes of memory for every byte of transaction
+    int64_t nMempoolSizeMax = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    int64_t nMempoolSizeMin = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000 * 40;
+    if (nMempoolSizeMax < 0 || nMempoolSizeMax < nMempoolSizeMin)
+        return InitError(strprintf(_("-maxmempool must be at least %d MB"), (nMempoolSizeMin + 999999) / 1000000));
+
 #ifdef ENABLE_WALLET
     if (mapArgs.count("-paytxfee"))
     {
@@ -660,14 +679,22 @@ bool AppInit2(boost::thread_group& threadGroup)
             }
         }
 
-        if (GetBoolArg("-salvagewallet", false))
+        // Once the wallet is in a log, the Berkeley DB file is not looked at again
+        // and is out of date, so it must not be loaded in its place
+        bool fWalletLog = GetBoolArg("-walletlog", false);
+        boost::filesystem::path pathWalletLog = bitdb.GetLogStorePath(strWalletFile);
+        if (!fWalletLog && boost::filesystem::exists(pathWalletLog))
+            return InitError(strprintf(_("The wallet has been moved to %s. Start with -walletlog to use it."), pathWalletLog.string()));
+        bool fWalletBDB = !fWalletLog || !boost::filesystem::exists(pathWalletLog);
+
+        if (fWalletBDB && GetBoolArg("-salvagewallet", false))
         {
             // Recover readable keypairs:
             if (!CWalletDB::Recover(bitdb, strWalletFile, true))
                 return false;
         }
 
-        if (boost::filesystem::exists(pathDataDir / strWalletFile))
+        if (fWalletBDB && boost::filesystem::exists(pathDataDir / strWalletFile))
         {
             CDBEnv::VerifyResult r = bitdb.Verify(strWalletFile, CWalletDB::Recover);
             if (r == CDBEnv::RECOVER_OK)
@@ -681,6 +708,9 @@ bool AppInit2(boost::thread_group& threadGroup)
             if (r == CDBEnv::RECOVER_FAIL)
                 return InitError(_("wallet.dat corrupt, salvage failed"));
         }
+
+        if (fWalletLog && !bitdb.OpenLogStore(strWalletFile))
+            return InitError(strprintf(_("Error opening wallet log %s"), bitdb.GetLogStorePath(strWalletFile).string()));
     } // (!fDisableWallet)
 #endif // ENABLE_WALLET
     // ********************************************************* Step 6: network initialization
@@ -796,7 +826,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     else if (nTotalCache > (nMaxDbCache << 20))
         nTotalCache = (nMaxDbCache << 20); // total cache cannot be greater than nMaxDbCache
     size_t nBlockTreeDBCache = nTotalCache / 8;
-    if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", false))
+    if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", false) && !GetBoolArg("-compacttxindex", false) && !GetBoolArg("-addressindex", false))
         nBlockTreeDBCache = (1 << 21); // block tree db cache shouldn't be larger than 2 MiB
     nTotalCache -= nBlockTreeDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
@@ -842,17 +872,51 @@ bool AppInit2(boost::thread_group& threadGroup)
                 }
 
                 // Check for changed -txindex state
-                if (fTxIndex != GetBoolArg("-txindex", false)) {
+                if (fTxIndex != (GetBoolArg("-txindex", false) || GetBoolArg("-compacttxindex", false)) ||
+                    fCompactTxIndex != GetBoolArg("-compacttxindex", false)) {
                     strLoadError = _("You need to rebuild the database using -reindex to change -txindex");
                     break;
                 }
 
+                // Check for changed -addressindex state
+                if (fAddressIndex != GetBoolArg("-addressindex", false)) {
+                    strLoadError = _("You need to rebuild the database using -reindex to change -addressindex");
+                    break;
+                }
+
+                // The address index is written as each block connects, the
+                // coin database only when its cache is flushed, so after an
+                // unclean shutdown the two can be at different blocks
+                if (fAddressIndex) {
+                    uint256 hashAddressIndex = 0;
+                    pblocktree->ReadAddressIndexBestBlock(hashAddressIndex);
+                    if (hashAddressIndex != pcoinsTip->GetBestBlock()) {
+                        strLoadError = _("The address index does not match the chain state");
+                        break;
+                    }
+                }
+
                 uiInterface.InitMessage(_("Verifying blocks..."));
                 if (!VerifyDB(GetArg("-checklevel", 3),
                               GetArg("-checkblocks", 288))) {
                     strLoadError = _("Corrupted block database detected");
                     break;
                 }
+
+                // Chainstates written before the UTXO set statistics were kept
+                // up to date, or advanced since without them, get them from
+                // one full scan
+                CCoinsStats statsRunning;
+                if (!pcoinsTip->GetRunningStats(statsRunning)) {
+                    uiInterface.InitMessage(_("Computing UTXO set statistics..."));
+                    if (!pcoinsTip->Flush() || !pcoinsdbview->GetStats(statsRunning)) {
+                        strLoadError = _("Error loading block database");
+                        break;
+                    }
+                    pcoinsTip->SetRunningStats(statsRunning);
+                    pcoinsTip->Flush();
+                    LogPrintf("UTXO set statistics computed at height %d\n", statsRunning.nHeight);
+                }
             } catch(std::exception &e) {
                 if (fDebug) LogPrintf("%s\n", e.what());
                 strLoadError = _("Error opening block database");
@@ -1016,6 +1080,20 @@ bool AppInit2(boost::thread_group& threadGroup)
             else
                 pindexRescan = chainActive.Genesis();
         }
+        {
+            // Go back as far as a rescan that was interrupted got to
+            CWalletDB walletdb(strWalletFile);
+            CBlockLocator locator;
+            if (walletdb.ReadRescanBlock(locator))
+            {
+                CBlockIndex *pindexResume = chainActive.FindFork(locator);
+                if (pindexResume && pindexRescan && pindexResume->nHeight < pindexRescan->nHeight)
+                {
+                    LogPrintf("Resuming interrupted rescan at block %i\n", pindexResume->nHeight);
+                    pindexRescan = pindexResume;
+                }
+            }
+        }
         if (chainActive.Tip() && chainActive.Tip() != pindexRescan)
         {
             uiInterface.InitMessage(_("Rescanning..."));
@@ -6,6 +6,8 @@
 
 #include "key.h"
 
+#include "hash.h"
+
 #include <openssl/opensslv.h>     // For using openssl 1.0 and 1.1 branches.
 #include <openssl/bn.h>
 #include <openssl/ecdsa.h>
@@ -114,7 +116,7 @@ int ECDSA_SIG_recover_key_GFp(EC_KEY *eckey, ECDSA_SIG *ecsig, const unsigned ch
     if (!BN_bin2bn(msg, msglen, e)) { ret=-1; goto err; }
     if (8*msglen > n) BN_rshift(e, e, 8-(n & 7));
     zero = BN_CTX_get(ctx);
-    if (!BN_zero(zero)) { ret=-1; goto err; }
+    BN_zero(zero);
     if (!BN_mod_sub(e, zero, e, order, ctx)) { ret=-1; goto err; }
     rr = BN_CTX_get(ctx);
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
@@ -146,6 +148,187 @@ err:
     return ret;
 }
 
+// The secp256k1 group with its order, built once and shared by signing and
+// public key computation instead of being set up again for every call
+class CECGroup {
+public:
+    EC_GROUP *group;
+    BIGNUM *order;
+    BIGNUM *halforder;
+
+    CECGroup() {
+        group = EC_GROUP_new_by_curve_name(NID_secp256k1);
+        assert(group != NULL);
+        order = BN_new();
+        halforder = BN_new();
+        bool ret = order && halforder && EC_GROUP_get_order(group, order, NULL) && BN_rshift1(halforder, order);
+        assert(ret);
+    }
+
+    ~CECGroup() {
+        BN_free(halforder);
+        BN_free(order);
+        EC_GROUP_free(group);
+    }
+};
+
+const CECGroup &GetECGroup() {
+    static CECGroup ecgroup;
+    return ecgroup;
+}
+
+// Nonce generation for ECDSA as in RFC6979 section 3.2, with HMAC-SHA256 and
+// qlen == hlen == 256 so that every candidate is a single V
+class CRFC6979 {
+private:
+    unsigned char K[32];
+    unsigned char V[32];
+    bool fRetry;
+
+    // K = HMAC_K(V || tag [|| secret || hash]), V = HMAC_K(V)
+    void Reseed(unsigned char tag, const unsigned char *pchSecret, const unsigned char *pchHash) {
+        HMAC_SHA256_CTX ctx;
+        HMAC_SHA256_Init(&ctx, K, 32);
+        HMAC_SHA256_Update(&ctx, V, 32);
+        HMAC_SHA256_Update(&ctx, &tag, 1);
+        if (pchSecret) {
+            HMAC_SHA256_Update(&ctx, pchSecret, 32);
+            HMAC_SHA256_Update(&ctx, pchHash, 32);
+        }
+        HMAC_SHA256_Final(K, &ctx);
+        NextV();
+    }
+
+    void NextV() {
+        HMAC_SHA256_CTX ctx;
+        HMAC_SHA256_Init(&ctx, K, 32);
+        HMAC_SHA256_Update(&ctx, V, 32);
+        HMAC_SHA256_Final(V, &ctx);
+    }
+
+public:
+    CRFC6979(const unsigned char vchSecret[32], const unsigned char vchHash[32]) {
+        memset(V, 0x01, 32);
+        memset(K, 0x00, 32);
+        Reseed(0x00, vchSecret, vchHash);
+        Reseed(0x01, vchSecret, vchHash);
+        fRetry = false;
+    }
+
+    ~CRFC6979() {
+        OPENSSL_cleanse(K, 32);
+        OPENSSL_cleanse(V, 32);
+    }
+
+    void Generate(unsigned char vchNonce[32]) {
+        if (fRetry)
+            Reseed(0x00, NULL, NULL);
+        NextV();
+        memcpy(vchNonce, V, 32);
+        fRetry = true;
+    }
+};
+
+// ECDSA-sign hash with the given secret and its RFC6979 nonce, directly on the
+// shared group. r and s are returned with s low, rec is the recovery id that
+// goes with them.
+bool SignRFC6979(const unsigned char vchSecret[32], const uint256 &hash, BIGNUM *r, BIGNUM *s, int &rec, BN_CTX *ctx)
+{
+    const CECGroup &ec = GetECGroup();
+    BN_CTX_start(ctx);
+    BIGNUM *d = BN_CTX_get(ctx);
+    BIGNUM *e = BN_CTX_get(ctx);
+    BIGNUM *k = BN_CTX_get(ctx);
+    BIGNUM *kinv = BN_CTX_get(ctx);
+    BIGNUM *x = BN_CTX_get(ctx);
+    BIGNUM *y = BN_CTX_get(ctx);
+    EC_POINT *R = EC_POINT_new(ec.group);
+    bool fOk = y != NULL && R != NULL &&
+               BN_bin2bn(vchSecret, 32, d) && BN_bin2bn((const unsigned char*)&hash, sizeof(hash), e);
+    if (fOk) {
+        BN_set_flags(d, BN_FLG_CONSTTIME);
+        BN_set_flags(k, BN_FLG_CONSTTIME);
+    }
+
+    CRFC6979 rng(vchSecret, (const unsigned char*)&hash);
+    unsigned char vchNonce[32];
+    while (fOk) {
+        rng.Generate(vchNonce);
+        if (!BN_bin2bn(vchNonce, 32, k)) {
+            fOk = false;
+            break;
+        }
+        if (BN_is_zero(k) || BN_cmp(k, ec.order) >= 0)
+            continue;
+        // R = k*G, r = R.x mod n
+        if (!EC_POINT_mul(ec.group, R, k, NULL, NULL, ctx) ||
+            !EC_POINT_get_affine_coordinates_GFp(ec.group, R, x, y, ctx) ||
+            !BN_nnmod(r, x, ec.order, ctx)) {
+            fOk = false;
+            break;
+        }
+        if (BN_is_zero(r))
+            continue;
+        // s = k^-1 * (e + r*d) mod n
+        if (!BN_mod_inverse(kinv, k, ec.order, ctx) ||
+            !BN_mod_mul(s, r, d, ec.order, ctx) ||
+            !BN_mod_add(s, s, e, ec.order, ctx) ||
+            !BN_mod_mul(s, s, kinv, ec.order, ctx)) {
+            fOk = false;
+            break;
+        }
+        if (BN_is_zero(s))
+            continue;
+        rec = (BN_is_odd(y) ? 1 : 0) | (BN_cmp(x, ec.order) >= 0 ? 2 : 0);
+        if (BN_cmp(s, ec.halforder) > 0) {
+            // enforce low S values, by negating the value (modulo the order) if above order/2.
+            // (r, -s) is the signature made with -R, whose y has the other parity.
+            BN_sub(s, ec.order, s);
+            rec ^= 1;
+        }
+        break;
+    }
+
+    OPENSSL_cleanse(vchNonce, 32);
+    if (y != NULL) {
+        BN_clear(d);
+        BN_clear(k);
+        BN_clear(kinv);
+    }
+    if (R != NULL)
+        EC_POINT_clear_free(R);
+    BN_CTX_end(ctx);
+    return fOk;
+}
+
+// DER-serialize (r, s) the way i2d_ECDSA_SIG does
+void SerializeDERSig(const BIGNUM *r, const BIGNUM *s, std::vector<unsigned char>& vchSig)
+{
+    // One spare byte in front: DER integers are signed, so a set top bit needs a zero prefix
+    unsigned char vchR[33], vchS[33];
+    unsigned char *pR = vchR + 1, *pS = vchS + 1;
+    int nR = BN_bn2bin(r, pR);
+    int nS = BN_bn2bin(s, pS);
+    if (pR[0] & 0x80) {
+        *--pR = 0;
+        nR++;
+    }
+    if (pS[0] & 0x80) {
+        *--pS = 0;
+        nS++;
+    }
+    vchSig.clear();
+    vchSig.reserve(6 + nR + nS);
+    vchSig.push_back(0x30);
+    vchSig.push_back(4 + nR + nS);
+    vchSig.push_back(0x02);
+    vchSig.push_back(nR);
+    vchSig.insert(vchSig.end(), pR, pR + nR);
+    vchSig.push_back(0x02);
+    vchSig.push_back(nS);
+    vchSig.insert(vchSig.end(), pS, pS + nS);
+}
+
 // RAII Wrapper around OpenSSL's EC_KEY
 class CECKey {
 private:
@@ -232,48 +415,6 @@ public:
         return o2i_ECPublicKey(&pkey, &pbegin, pubkey.size());
     }
 
-    bool Sign(const uint256 &hash, std::vector<unsigned char>& vchSig) {
-        vchSig.clear();
-        ECDSA_SIG *sig = ECDSA_do_sign((unsigned char*)&hash, sizeof(hash), pkey);
-        if (sig == NULL)
-            return false;
-        BN_CTX *ctx = BN_CTX_new();
-        BN_CTX_start(ctx);
-        const EC_GROUP *group = EC_KEY_get0_group(pkey);
-        BIGNUM *order = BN_CTX_get(ctx);
-        BIGNUM *halforder = BN_CTX_get(ctx);
-        EC_GROUP_get_order(group, order, ctx);
-        BN_rshift1(halforder, order);
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-        if (BN_cmp(sig->s, halforder) > 0) {
-            // enforce low S values, by negating the value (modulo the order) if above order/2.
-            BN_sub(sig->s, order, sig->s);
-        }
-#else
-        const BIGNUM *r;
-        const BIGNUM *s;
-        r = BN_secure_new();
-        s = BN_secure_new();
-        ECDSA_SIG_get0(sig, &r, &s);
-        BIGNUM *s1;
-        s1 = BN_secure_new();
-        BN_copy(s1,s);
-        if (BN_cmp(s, halforder) > 0) {
-            // enforce low S values, by negating the value (modulo the order) if above order/2.
-            BN_sub(s1, order, s1);
-        }
-#endif
-        BN_CTX_end(ctx);
-        BN_CTX_free(ctx);
-        unsigned int nSize = ECDSA_size(pkey);
-        vchSig.resize(nSize); // Make sure it is big enough
-        unsigned char *pos = &vchSig[0];
-        nSize = i2d_ECDSA_SIG(sig, &pos);
-        ECDSA_SIG_free(sig);
-        vchSig.resize(nSize); // Shrink to fit actual size
-        return true;
-    }
-
     bool Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) {
         // -1 = error, 0 = bad sig, 1 = good
         if (ECDSA_verify(0, (unsigned char*)&hash, sizeof(hash), &vchSig[0], vchSig.size(), pkey) != 1)
@@ -281,52 +422,6 @@ public:
         return true;
     }
 
-    bool SignCompact(const uint256 &hash, unsigned char *p64, int &rec) {
-        bool fOk = false;
-        ECDSA_SIG *sig = ECDSA_do_sign((unsigned char*)&hash, sizeof(hash), pkey);
-        if (sig==NULL)
-            return false;
-        memset(p64, 0, 64);
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-        int nBitsR = BN_num_bits(sig->r);
-        int nBitsS = BN_num_bits(sig->s);
-#else
-        const BIGNUM *r;
-        const BIGNUM *s;
-        r = BN_secure_new();
-        s = BN_secure_new();
-        ECDSA_SIG_get0(sig, &r, &s);
-        int nBitsR = BN_num_bits(r);
-        int nBitsS = BN_num_bits(s);
-#endif
-        if (nBitsR <= 256 && nBitsS <= 256) {
-            CPubKey pubkey;
-            GetPubKey(pubkey, true);
-            for (int i=0; i<4; i++) {
-                CECKey keyRec;
-                if (ECDSA_SIG_recover_key_GFp(keyRec.pkey, sig, (unsigned char*)&hash, sizeof(hash), i, 1) == 1) {
-                    CPubKey pubkeyRec;
-                    keyRec.GetPubKey(pubkeyRec, true);
-                    if (pubkeyRec == pubkey) {
-                        rec = i;
-                        fOk = true;
-                        break;
-                    }
-                }
-            }
-            assert(fOk);
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-            BN_bn2bin(sig->r,&p64[32-(nBitsR+7)/8]);
-            BN_bn2bin(sig->s,&p64[64-(nBitsS+7)/8]);
-#else
-            BN_bn2bin(r,&p64[32-(nBitsR+7)/8]);
-            BN_bn2bin(s,&p64[64-(nBitsS+7)/8]);
-#endif
-        }
-        ECDSA_SIG_free(sig);
-        return fOk;
-    }
-
     // reconstruct public key from a compact signature
     // This is only slightly more CPU intensive than just verifying it.
     // If this function succeeds, the recovered public key is guaranteed to be valid
@@ -340,15 +435,7 @@ public:
         BN_bin2bn(&p64[0],  32, sig->r);
         BN_bin2bn(&p64[32], 32, sig->s);
 #else
-        const BIGNUM *r;
-        const BIGNUM *s;
-        r = BN_secure_new();
-        s = BN_secure_new();
-        BIGNUM *r1;
-        BIGNUM *s1;
-        ECDSA_SIG_get0(sig, &r, &s);
-        BN_bin2bn(&p64[0],  32, r1);
-        BN_bin2bn(&p64[32], 32, s1);
+        ECDSA_SIG_set0(sig, BN_bin2bn(&p64[0], 32, NULL), BN_bin2bn(&p64[32], 32, NULL));
 #endif
         bool ret = ECDSA_SIG_recover_key_GFp(pkey, sig, (unsigned char*)&hash, sizeof(hash), rec, 0) == 1;
         ECDSA_SIG_free(sig);
@@ -462,33 +549,69 @@ CPrivKey CKey::GetPrivKey() const {
 
 CPubKey CKey::GetPubKey() const {
     assert(fValid);
-    CECKey key;
-    key.SetSecretBytes(vch);
+    const CECGroup &ec = GetECGroup();
+    BN_CTX *ctx = BN_CTX_new();
+    assert(ctx != NULL);
+    BN_CTX_start(ctx);
+    BIGNUM *bn = BN_CTX_get(ctx);
+    EC_POINT *point = EC_POINT_new(ec.group);
+    bool ret = bn != NULL && point != NULL && BN_bin2bn(vch, 32, bn);
+    assert(ret);
+    BN_set_flags(bn, BN_FLG_CONSTTIME);
+    ret = EC_POINT_mul(ec.group, point, bn, NULL, NULL, ctx);
+    assert(ret);
+    unsigned char c[65];
+    size_t nSize = EC_POINT_point2oct(ec.group, point, fCompressed ? POINT_CONVERSION_COMPRESSED : POINT_CONVERSION_UNCOMPRESSED, c, sizeof(c), ctx);
+    assert(nSize == (fCompressed ? 33 : 65));
+    BN_clear(bn);
+    EC_POINT_free(point);
+    BN_CTX_end(ctx);
+    BN_CTX_free(ctx);
     CPubKey pubkey;
-    key.GetPubKey(pubkey, fCompressed);
+    pubkey.Set(&c[0], &c[nSize]);
     return pubkey;
 }
 
 bool CKey::Sign(const uint256 &hash, std::vector<unsigned char>& vchSig) const {
     if (!fValid)
         return false;
-    CECKey key;
-    key.SetSecretBytes(vch);
-    return key.Sign(hash, vchSig);
+    BN_CTX *ctx = BN_CTX_new();
+    if (ctx == NULL)
+        return false;
+    BN_CTX_start(ctx);
+    BIGNUM *r = BN_CTX_get(ctx);
+    BIGNUM *s = BN_CTX_get(ctx);
+    int rec = -1;
+    bool ret = s != NULL && SignRFC6979(vch, hash, r, s, rec, ctx);
+    if (ret)
+        SerializeDERSig(r, s, vchSig);
+    BN_CTX_end(ctx);
+    BN_CTX_free(ctx);
+    return ret;
 }
 
 bool CKey::SignCompact(const uint256 &hash, std::vector<unsigned char>& vchSig) const {
     if (!fValid)
         return false;
-    CECKey key;
-    key.SetSecretBytes(vch);
-    vchSig.resize(65);
-    int rec = -1;
-    if (!key.SignCompact(hash, &vchSig[1], rec))
+    BN_CTX *ctx = BN_CTX_new();
+    if (ctx == NULL)
         return false;
-    assert(rec != -1);
-    vchSig[0] = 27 + rec + (fCompressed ? 4 : 0);
-    return true;
+    BN_CTX_start(ctx);
+    BIGNUM *r = BN_CTX_get(ctx);
+    BIGNUM *s = BN_CTX_get(ctx);
+    int rec = -1;
+    bool ret = s != NULL && SignRFC6979(vch, hash, r, s, rec, ctx);
+    if (ret) {
+        // The recovery id comes out of signing, no trial recoveries needed
+        assert(rec != -1);
+        vchSig.assign(65, 0);
+        vchSig[0] = 27 + rec + (fCompressed ? 4 : 0);
+        BN_bn2bin(r, &vchSig[33 - BN_num_bytes(r)]);
+        BN_bn2bin(s, &vchSig[65 - BN_num_bytes(s)]);
+    }
+    BN_CTX_end(ctx);
+    BN_CTX_free(ctx);
+    return ret;
 }
 
 bool CKey::Load(CPrivKey &privkey, CPubKey &vchPubKey, bool fSkipCheck=false) {
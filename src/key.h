@@ -251,10 +251,11 @@ public:
     CPrivKey GetPrivKey() const;
 
     // Compute the public key from a private key.
-    // This is expensive.
+    // This is a point multiplication; key stores keep the result around.
     CPubKey GetPubKey() const;
 
-    // Create a DER-serialized signature.
+    // Create a DER-serialized signature, with a low S value and the
+    // deterministic nonce of RFC6979: the same key and hash always give the same signature.
     bool Sign(const uint256 &hash, std::vector<unsigned char>& vchSig) const;
 
     // Create a compact signature (65 bytes), which allows reconstructing the used public key.
@@ -262,6 +263,7 @@ public:
     // The header byte: 0x1B = first key with even y, 0x1C = first key with odd y,
     //                  0x1D = second key with even y, 0x1E = second key with odd y,
     //                  add 0x04 for compressed keys.
+    // The nonce is the same RFC6979 one as for Sign.
     bool SignCompact(const uint256 &hash, std::vector<unsigned char>& vchSig) const;
 
     // Derive BIP32 child key.
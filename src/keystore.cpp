@@ -28,9 +28,22 @@ bool CBasicKeyStore::AddKeyPubKey(const CKey& key, const CPubKey &pubkey)
 {
     LOCK(cs_KeyStore);
     mapKeys[pubkey.GetID()] = key;
+    mapPubKeys[pubkey.GetID()] = pubkey;
     return true;
 }
 
+bool CBasicKeyStore::GetPubKey(const CKeyID &address, CPubKey &vchPubKeyOut) const
+{
+    LOCK(cs_KeyStore);
+    PubKeyMap::const_iterator mi = mapPubKeys.find(address);
+    if (mi != mapPubKeys.end())
+    {
+        vchPubKeyOut = (*mi).second;
+        return true;
+    }
+    return false;
+}
+
 bool CBasicKeyStore::AddCScript(const CScript& redeemScript)
 {
     LOCK(cs_KeyStore);
@@ -79,6 +79,8 @@ bool fImporting = false;
 bool fReindex = false;
 bool fBenchmark = false;
 bool fTxIndex = false;
+bool fCompactTxIndex = false;
+bool fAddressIndex = false;
 unsigned int nCoinCacheSize = 5000;
 uint256 hashGenesisBlock("0x2a8e100939494904af825b488596ddd536b3a96226ad02e0f7ab7ae472b27a8e");
 
@@ -248,6 +250,11 @@ struct CNodeState {
 	int nBlocksToDownload;
 	int64_t nLastBlockReceive;
 	int64_t nLastBlockProcess;
+	// Block rebuilt from this peer's compact block announcement, waiting for
+	// the transactions we asked for with "getblocktxn".
+	uint256 hashCompactBlock;
+	CBlock blockCompact;
+	std::vector<unsigned int> vCompactMissing;
 
 	CNodeState() {
 		nMisbehavior = 0;
@@ -816,6 +823,21 @@ int64_t GetMinFee(const CTransaction& tx, unsigned int nBytes, bool fAllowFree,
 	return nMinFee;
 }
 
+// Drop what has been waiting longer than age seconds, then evict down to limit bytes
+static void LimitMempoolSize(CTxMemPool& pool, size_t limit, int64_t age)
+{
+	std::list<CTransaction> removed;
+	int expired = pool.Expire(GetTime() - age, &removed);
+	if (expired != 0)
+		LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
+
+	pool.TrimToSize(limit, &removed);
+
+	// Let wallets know about their transactions that left the pool
+	BOOST_FOREACH(const CTransaction &tx, removed)
+		SyncWithWallets(tx.GetHash(), tx, NULL);
+}
+
 
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
 		bool* pfMissingInputs, bool fRejectInsaneFee)
@@ -906,6 +928,11 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
 		if (fLimitFree && nFees < txMinFee)
 			return state.DoS(0, error("AcceptToMemoryPool : not enough fees %s, %d < %d", hash.ToString(), nFees, txMinFee), REJECT_INSUFFICIENTFEE, "insufficient fee");
 
+		// A full pool raises the bar to what it last had to evict
+		int64_t mempoolRejectFee = pool.GetMinFeeRate(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000) * nSize / 1000;
+		if (mempoolRejectFee > 0 && nFees < mempoolRejectFee)
+			return state.DoS(0, error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d", hash.ToString(), nFees, mempoolRejectFee), REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+
 		// Continuously rate-limit free transactions to mitigate micro-transaction flooding.
 		if (fLimitFree && nFees < CTransaction::nMinRelayTxFee)
 		{
@@ -937,8 +964,28 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
 		{
 			return error("AcceptToMemoryPool: : ConnectInputs failed %s", hash.ToString());
 		}
-		// Store transaction in memory
-		pool.addUnchecked(hash, entry);
+		// Don't let chains of unconfirmed transactions grow without bound:
+		// every entry caches totals over its ancestors and descendants, which
+		// are updated whenever a relative enters or leaves the pool
+		CTxMemPool::setEntries setAncestors;
+		size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+		size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
+		size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+		size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000;
+		std::string errString;
+		{
+			LOCK(pool.cs);
+			if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString))
+				return state.DoS(0, error("AcceptToMemoryPool : too long mempool chain %s: %s", hash.ToString(), errString), REJECT_NONSTANDARD, "too-long-mempool-chain");
+
+			// Store transaction in memory
+			pool.addUnchecked(hash, entry, setAncestors);
+		}
+
+		// Making room may well push out the transaction just added
+		LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+		if (!pool.exists(hash))
+			return state.DoS(0, error("AcceptToMemoryPool : mempool full, %s not added", hash.ToString()), REJECT_INSUFFICIENTFEE, "mempool full");
 	}
 
 	g_signals.SyncTransaction(hash, tx, NULL);
@@ -1063,63 +1110,143 @@ bool GetBlockHeightByTx(const uint256 &hash, unsigned int &height)
 }
 
 
-// Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock
-bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock, bool fAllowSlow)
+/**
+ * Positions of the transactions in recently scanned blocks. Once a block
+ * was read to find one of its transactions, others in it are read directly
+ * from their position instead of reading and hashing the whole block again.
+ */
+class CBlockTxPosCache
 {
-	CBlockIndex *pindexSlow = NULL;
+public:
+	static const unsigned int MAX_BLOCKS = 32;
+
+	/** Returns false if the block isn't cached, otherwise sets fFound and pos */
+	bool Lookup(const uint256 &hashBlock, const uint256 &txid, bool &fFound, CDiskTxPos &pos)
 	{
-		LOCK(cs_main);
-		{
-			if (mempool.lookup(hash, txOut))
-			{
-				return true;
-			}
+		LOCK(cs);
+		std::map<uint256, std::map<uint256, CDiskTxPos> >::const_iterator mi = mapBlocks.find(hashBlock);
+		if (mi == mapBlocks.end())
+			return false;
+		std::map<uint256, CDiskTxPos>::const_iterator it = mi->second.find(txid);
+		fFound = it != mi->second.end();
+		if (fFound)
+			pos = it->second;
+		return true;
+	}
+
+	void Insert(const uint256 &hashBlock, const std::map<uint256, CDiskTxPos> &mapPos)
+	{
+		LOCK(cs);
+		if (mapBlocks.count(hashBlock))
+			return;
+		if (vBlocks.size() >= MAX_BLOCKS) {
+			mapBlocks.erase(vBlocks.front());
+			vBlocks.pop_front();
 		}
+		mapBlocks[hashBlock] = mapPos;
+		vBlocks.push_back(hashBlock);
+	}
 
-		if (fTxIndex) {
-			CDiskTxPos postx;
-			if (pblocktree->ReadTxIndex(hash, postx)) {
-				CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-				CBlockHeader header;
-				try {
-					file >> header;
-					fseek(file, postx.nTxOffset, SEEK_CUR);
-					file >> txOut;
-				} catch (std::exception &e) {
-					return error("%s : Deserialize or I/O error - %s", __func__, e.what());
-				}
-				hashBlock = header.GetHash();
-				if (txOut.GetHash() != hash)
-					return error("%s : txid mismatch", __func__);
-				return true;
-			}
+private:
+	CCriticalSection cs;
+	std::map<uint256, std::map<uint256, CDiskTxPos> > mapBlocks;
+	std::deque<uint256> vBlocks; // insertion order, oldest first
+};
+
+static CBlockTxPosCache blockTxPosCache;
+
+// Read the transaction at postx, and the hash of the block containing it
+static bool ReadTxFromDisk(const CDiskTxPos &postx, CTransaction &txOut, uint256 &hashBlock)
+{
+	CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+	if (!file)
+		return error("%s : OpenBlockFile failed", __func__);
+	CBlockHeader header;
+	try {
+		file >> header;
+		fseek(file, postx.nTxOffset, SEEK_CUR);
+		file >> txOut;
+	} catch (std::exception &e) {
+		return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+	}
+	hashBlock = header.GetHash();
+	return true;
+}
+
+// Look for a transaction in the given block, reading only the transaction itself if the block was scanned before
+static bool GetTransactionFromBlock(const uint256 &hash, const CBlockIndex *pindex, CTransaction &txOut, uint256 &hashBlock)
+{
+	const uint256 hashBlockIn = pindex->GetBlockHash();
+	bool fFound = false;
+	CDiskTxPos postx;
+	if (blockTxPosCache.Lookup(hashBlockIn, hash, fFound, postx)) {
+		if (!fFound)
+			return false;
+		return ReadTxFromDisk(postx, txOut, hashBlock) && txOut.GetHash() == hash;
+	}
+
+	CBlock block;
+	if (!ReadBlockFromDisk(block, pindex))
+		return false;
+
+	std::map<uint256, CDiskTxPos> mapPos;
+	CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
+	BOOST_FOREACH(const CTransaction &tx, block.vtx) {
+		const uint256 txid = tx.GetHash();
+		mapPos.insert(std::make_pair(txid, pos));
+		if (txid == hash) {
+			txOut = tx;
+			hashBlock = hashBlockIn;
+			fFound = true;
 		}
+		pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+	}
+	blockTxPosCache.Insert(hashBlockIn, mapPos);
+	return fFound;
+}
 
-		if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
-			int nHeight = -1;
-			{
-				CCoinsViewCache &view = *pcoinsTip;
-				CCoins coins;
-				if (view.GetCoins(hash, coins))
-					nHeight = coins.nHeight;
-			}
-			if (nHeight > 0)
-				pindexSlow = chainActive[nHeight];
+// Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock
+bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock, bool fAllowSlow, const CBlockIndex *pindexHint)
+{
+	if (mempool.lookup(hash, txOut))
+		return true;
+
+	// The transaction index and the block files are only ever appended to,
+	// so they can be read without holding cs_main.
+	if (fTxIndex) {
+		CDiskTxPos postx;
+		if (pblocktree->ReadTxIndex(hash, postx)) {
+			if (!ReadTxFromDisk(postx, txOut, hashBlock))
+				return false;
+			if (txOut.GetHash() == hash)
+				return true;
+			// The compact index only keys on part of the txid, so another
+			// transaction may have taken this one's slot: keep looking.
+			if (!fCompactTxIndex)
+				return error("%s : txid mismatch", __func__);
 		}
 	}
 
-	if (pindexSlow) {
-		CBlock block;
-		if (ReadBlockFromDisk(block, pindexSlow)) {
-			BOOST_FOREACH(const CTransaction &tx, block.vtx) {
-				if (tx.GetHash() == hash) {
-					txOut = tx;
-					hashBlock = pindexSlow->GetBlockHash();
-					return true;
-				}
-			}
+	// The caller knows which block to look in
+	if (pindexHint)
+		return GetTransactionFromBlock(hash, pindexHint, txOut, hashBlock);
+
+	CBlockIndex *pindexSlow = NULL;
+	if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
+		LOCK(cs_main);
+		int nHeight = -1;
+		{
+			CCoinsViewCache &view = *pcoinsTip;
+			CCoins coins;
+			if (view.GetCoins(hash, coins))
+				nHeight = coins.nHeight;
 		}
+		if (nHeight > 0)
+			pindexSlow = chainActive[nHeight];
 	}
+
+	if (pindexSlow)
+		return GetTransactionFromBlock(hash, pindexSlow, txOut, hashBlock);
 	return false;
 }
 
@@ -1187,6 +1314,36 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
 	return true;
 }
 
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& vchBlock, const CBlockIndex* pindex)
+{
+	// The block's size is stored right in front of it, see WriteBlockToDisk
+	CDiskBlockPos pos = pindex->GetBlockPos();
+	if (pos.nPos < sizeof(unsigned int))
+		return error("ReadRawBlockFromDisk : invalid position");
+	pos.nPos -= sizeof(unsigned int);
+
+	CAutoFile filein = CAutoFile(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+	if (!filein)
+		return error("ReadRawBlockFromDisk : OpenBlockFile failed");
+
+	try {
+		unsigned int nSize;
+		filein >> nSize;
+		if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+			return error("ReadRawBlockFromDisk : invalid block size %u", nSize);
+		vchBlock.resize(nSize);
+		filein.read((char*)&vchBlock[0], nSize);
+	}
+	catch (std::exception &e) {
+		return error("%s : I/O error - %s", __func__, e.what());
+	}
+
+	// The header is the first 80 bytes, check it is the block we wanted
+	if (Hash(vchBlock.begin(), vchBlock.begin() + 80) != pindex->GetBlockHash())
+		return error("ReadRawBlockFromDisk : block hash doesn't match index");
+	return true;
+}
+
 uint256 static GetOrphanRoot(const uint256& hash)
 						  {
 	std::map<uint256, COrphanBlock*>::iterator it = mapOrphanBlocks.find(hash);
@@ -1723,6 +1880,12 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
 }
 
 bool CScriptCheck::operator()() const {
+	if (pkeystore) {
+		// Whether this input could be signed is its own business, the
+		// others go on either way
+		*pfSignedRet = SignSignature(*pkeystore, scriptPubKey, *ptxTo, nIn, nHashType, *pscriptSigRet);
+		return true;
+	}
 	const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
 	if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType))
 		return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString());
@@ -1815,7 +1978,35 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, CCoinsViewCach
 }
 
 
-bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
+typedef std::vector<std::pair<CAddressIndexKey, int64_t> > AddressIndexVec;
+typedef std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > AddressUnspentVec;
+typedef std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > SpentIndexVec;
+
+/** Collect the address and spent index entries for a transaction being connected, before view spends its inputs */
+static void AddressIndexConnectTx(const CTransaction& tx, const uint256& txhash, int nHeight, CCoinsViewCache& view,
+		AddressIndexVec& vAddressIndex, AddressUnspentVec& vAddressUnspent, SpentIndexVec& vSpentIndex)
+{
+	if (!tx.IsCoinBase()) {
+		for (unsigned int j = 0; j < tx.vin.size(); j++) {
+			const COutPoint &prevout = tx.vin[j].prevout;
+			const CTxOut &out = view.GetOutputFor(tx.vin[j]);
+			uint160 hashScript = Hash160(out.scriptPubKey);
+			vAddressIndex.push_back(std::make_pair(CAddressIndexKey(hashScript, nHeight, txhash, j, true), -out.nValue));
+			vAddressUnspent.push_back(std::make_pair(CAddressUnspentKey(hashScript, prevout.hash, prevout.n), CAddressUnspentValue()));
+			vSpentIndex.push_back(std::make_pair(CSpentIndexKey(prevout.hash, prevout.n), CSpentIndexValue(txhash, j, nHeight)));
+		}
+	}
+	for (unsigned int k = 0; k < tx.vout.size(); k++) {
+		const CTxOut &out = tx.vout[k];
+		if (out.scriptPubKey.IsUnspendable())
+			continue;
+		uint160 hashScript = Hash160(out.scriptPubKey);
+		vAddressIndex.push_back(std::make_pair(CAddressIndexKey(hashScript, nHeight, txhash, k, false), out.nValue));
+		vAddressUnspent.push_back(std::make_pair(CAddressUnspentKey(hashScript, txhash, k), CAddressUnspentValue(out.nValue, nHeight)));
+	}
+}
+
+bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean, bool fJustCheck)
 {
 	assert(pindex->GetBlockHash() == view.GetBestBlock());
 
@@ -1834,6 +2025,12 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
 	if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
 		return error("DisconnectBlock() : block and undo data inconsistent");
 
+	// Address index entries to remove or restore, written together at the end
+	bool fUpdateAddressIndex = fAddressIndex && !fJustCheck;
+	AddressIndexVec vAddressIndex;
+	AddressUnspentVec vAddressUnspent;
+	SpentIndexVec vSpentIndex;
+
 	// undo transactions in reverse order
 	for (int i = block.vtx.size() - 1; i >= 0; i--) {
 		const CTransaction &tx = block.vtx[i];
@@ -1853,6 +2050,16 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
 
 		// remove outputs
 		outs = CCoins();
+		if (fUpdateAddressIndex) {
+			for (unsigned int k = 0; k < tx.vout.size(); k++) {
+				const CTxOut &out = tx.vout[k];
+				if (out.scriptPubKey.IsUnspendable())
+					continue;
+				uint160 hashScript = Hash160(out.scriptPubKey);
+				vAddressIndex.push_back(std::make_pair(CAddressIndexKey(hashScript, pindex->nHeight, hash, k, false), out.nValue));
+				vAddressUnspent.push_back(std::make_pair(CAddressUnspentKey(hashScript, hash, k), CAddressUnspentValue()));
+			}
+		}
 
 		// restore inputs
 		if (i > 0) { // not coinbases
@@ -1883,10 +2090,27 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
 				coins.vout[out.n] = undo.txout;
 				if (!view.SetCoins(out.hash, coins))
 					return error("DisconnectBlock() : cannot restore coin inputs");
+
+				if (fUpdateAddressIndex) {
+					uint160 hashScript = Hash160(undo.txout.scriptPubKey);
+					vAddressIndex.push_back(std::make_pair(CAddressIndexKey(hashScript, pindex->nHeight, hash, j, true), -undo.txout.nValue));
+					vAddressUnspent.push_back(std::make_pair(CAddressUnspentKey(hashScript, out.hash, out.n), CAddressUnspentValue(undo.txout.nValue, coins.nHeight)));
+					vSpentIndex.push_back(std::make_pair(CSpentIndexKey(out.hash, out.n), CSpentIndexValue()));
+				}
 			}
 		}
 	}
 
+	if (fUpdateAddressIndex) {
+		CLevelDBBatch batch;
+		pblocktree->UpdateAddressIndex(batch, vAddressIndex, true);
+		pblocktree->UpdateAddressUnspentIndex(batch, vAddressUnspent);
+		pblocktree->UpdateSpentIndex(batch, vSpentIndex);
+		pblocktree->WriteAddressIndexBestBlock(batch, pindex->pprev->GetBlockHash());
+		if (!pblocktree->WriteBatch(batch))
+			return state.Abort(_("Failed to write address index"));
+	}
+
 	// move best block pointer to prevout block
 	view.SetBestBlock(pindex->pprev->GetBlockHash());
 
@@ -1930,6 +2154,50 @@ void ThreadScriptCheck() {
 	scriptcheckqueue.Thread();
 }
 
+bool SignSignatures(const CKeyStore& keystore, const std::vector<CTransaction*>& vpTxTo,
+                    const std::vector<std::vector<CScript> >& vScriptPubKeys, int nHashType)
+{
+	// Block validation, the other user of the queue, runs under cs_main too
+	AssertLockHeld(cs_main);
+	assert(vpTxTo.size() == vScriptPubKeys.size());
+
+	// Signature hashes read all inputs of a transaction, so the scriptSigs
+	// are kept aside until every input is signed
+	std::vector<std::vector<CScript> > vScriptSigs(vpTxTo.size());
+	std::vector<std::vector<char> > vfSigned(vpTxTo.size());
+	std::vector<CScriptCheck> vChecks;
+	CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+	for (unsigned int n = 0; n < vpTxTo.size(); n++) {
+		const CTransaction& txTo = *vpTxTo[n];
+		assert(vScriptPubKeys[n].size() == txTo.vin.size());
+		vScriptSigs[n].resize(txTo.vin.size());
+		vfSigned[n].assign(txTo.vin.size(), true);
+		for (unsigned int i = 0; i < txTo.vin.size(); i++) {
+			if (vScriptPubKeys[n][i].empty())
+				continue;
+			CScriptCheck check(keystore, vScriptPubKeys[n][i], txTo, i, nHashType, vScriptSigs[n][i], vfSigned[n][i]);
+			if (nScriptCheckThreads) {
+				vChecks.push_back(CScriptCheck());
+				check.swap(vChecks.back());
+			} else
+				check();
+		}
+	}
+	control.Add(vChecks);
+	control.Wait();
+
+	bool fAllSigned = true;
+	for (unsigned int n = 0; n < vpTxTo.size(); n++) {
+		for (unsigned int i = 0; i < vpTxTo[n]->vin.size(); i++) {
+			if (vScriptPubKeys[n][i].empty())
+				continue;
+			vpTxTo[n]->vin[i].scriptSig.swap(vScriptSigs[n][i]);
+			fAllSigned &= (bool)vfSigned[n][i];
+		}
+	}
+	return fAllSigned;
+}
+
 bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck)
 {
 	AssertLockHeld(cs_main);
@@ -1943,6 +2211,12 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
 
 	// Genesis block exception, skipping connection of its transactions(its coinbase is unspendable)
 	if (block.GetHash() == Params().HashGenesisBlock()) {
+		if (fAddressIndex && !fJustCheck) {
+			CLevelDBBatch batch;
+			pblocktree->WriteAddressIndexBestBlock(batch, pindex->GetBlockHash());
+			if (!pblocktree->WriteBatch(batch))
+				return state.Abort(_("Failed to write address index"));
+		}
 		view.SetBestBlock(pindex->GetBlockHash());
 		return true;
 	}
@@ -1992,6 +2266,9 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
 	CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
 	std::vector<std::pair<uint256, CDiskTxPos> > vPos;
 	vPos.reserve(block.vtx.size());
+	AddressIndexVec vAddressIndex;
+	AddressUnspentVec vAddressUnspent;
+	SpentIndexVec vSpentIndex;
 	for (unsigned int i = 0; i < block.vtx.size(); i++)
 	{
 		const CTransaction &tx = block.vtx[i];
@@ -2031,6 +2308,9 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
 			control.Add(vChecks);
 		}
 
+		if (fAddressIndex && !fJustCheck)
+			AddressIndexConnectTx(tx, block.GetTxHash(i), pindex->nHeight, view, vAddressIndex, vAddressUnspent, vSpentIndex);
+
 		CTxUndo txundo;
 		UpdateCoins(tx, state, view, txundo, pindex->nHeight, block.GetTxHash(i));
 		if (!tx.IsCoinBase())
@@ -2058,6 +2338,10 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
 	if (fJustCheck)
 		return true;
 
+	// The block index update and the transaction and address indexes go
+	// into the block tree database in one batch
+	CLevelDBBatch batch;
+
 	// Write undo information to disk
 	if (pindex->GetUndoPos().IsNull() || (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_SCRIPTS)
 	{
@@ -2076,13 +2360,21 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
 		pindex->nStatus = (pindex->nStatus & ~BLOCK_VALID_MASK) | BLOCK_VALID_SCRIPTS;
 
 		CDiskBlockIndex blockindex(pindex);
-		if (!pblocktree->WriteBlockIndex(blockindex))
-			return state.Abort(_("Failed to write block index"));
+		pblocktree->WriteBlockIndex(batch, blockindex);
 	}
 
 	if (fTxIndex)
-		if (!pblocktree->WriteTxIndex(vPos))
-			return state.Abort(_("Failed to write transaction index"));
+		pblocktree->WriteTxIndex(batch, vPos);
+
+	if (fAddressIndex) {
+		pblocktree->UpdateAddressIndex(batch, vAddressIndex, false);
+		pblocktree->UpdateAddressUnspentIndex(batch, vAddressUnspent);
+		pblocktree->UpdateSpentIndex(batch, vSpentIndex);
+		pblocktree->WriteAddressIndexBestBlock(batch, pindex->GetBlockHash());
+	}
+
+	if (!pblocktree->WriteBatch(batch))
+		return state.Abort(_("Failed to write block index"));
 
 	// add this block to the view's block chain
 	bool ret;
@@ -2132,6 +2424,34 @@ void static UpdateTip(CBlockIndex *pindexNew) {
 
 }
 
+// Txids whose coins a block creates or spends: the only CCoins records that
+// connecting or disconnecting it can change.
+static void GetBlockCoinsTxids(const CBlock& block, std::set<uint256>& setTxids)
+{
+	BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+		setTxids.insert(tx.GetHash());
+		if (!tx.IsCoinBase()) {
+			BOOST_FOREACH(const CTxIn& txin, tx.vin)
+				setTxids.insert(txin.prevout.hash);
+		}
+	}
+}
+
+// Take the given records, as they currently are in view, out of (fAdd=false)
+// or into (fAdd=true) the running UTXO set statistics.
+static void UpdateRunningStats(CCoinsStats& stats, CCoinsViewCache& view, const std::set<uint256>& setTxids, bool fAdd)
+{
+	BOOST_FOREACH(const uint256& txid, setTxids) {
+		CCoins coins;
+		if (!view.GetCoins(txid, coins))
+			continue;
+		if (fAdd)
+			stats.AddCoins(txid, coins);
+		else
+			stats.RemoveCoins(txid, coins);
+	}
+}
+
 // Disconnect chainActive's tip.
 bool static DisconnectTip(CValidationState &state) {
 	CBlockIndex *pindexDelete = chainActive.Tip();
@@ -2145,8 +2465,21 @@ bool static DisconnectTip(CValidationState &state) {
 	int64_t nStart = GetTimeMicros();
 	{
 		CCoinsViewCache view(*pcoinsTip, true);
+		CCoinsStats statsRunning;
+		bool fRunningStats = view.GetRunningStats(statsRunning);
+		std::set<uint256> setTxids;
+		if (fRunningStats) {
+			GetBlockCoinsTxids(block, setTxids);
+			UpdateRunningStats(statsRunning, view, setTxids, false);
+		}
 		if (!DisconnectBlock(block, state, pindexDelete, view))
 			return error("DisconnectTip() : DisconnectBlock %s failed", pindexDelete->GetBlockHash().ToString());
+		if (fRunningStats) {
+			UpdateRunningStats(statsRunning, view, setTxids, true);
+			statsRunning.hashBlock = pindexDelete->pprev->GetBlockHash();
+			statsRunning.nHeight = pindexDelete->pprev->nHeight;
+			view.SetRunningStats(statsRunning);
+		}
 		assert(view.Flush());
 	}
 	if (fBenchmark)
@@ -2155,9 +2488,9 @@ bool static DisconnectTip(CValidationState &state) {
 	if (!WriteChainState(state))
 		return false;
 	// Resurrect mempool transactions from the disconnected block.
+	std::list<CTransaction> removed;
 	BOOST_FOREACH(const CTransaction &tx, block.vtx) {
 		// ignore validation errors in resurrected transactions
-		std::list<CTransaction> removed;
 		CValidationState stateDummy;
 		if (!tx.IsCoinBase())
 			if (!AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
@@ -2170,6 +2503,10 @@ bool static DisconnectTip(CValidationState &state) {
 	BOOST_FOREACH(const CTransaction &tx, block.vtx) {
 		SyncWithWallets(tx.GetHash(), tx, NULL);
 	}
+	// ... and about the ones spending them that left the mempool:
+	BOOST_FOREACH(const CTransaction &tx, removed) {
+		SyncWithWallets(tx.GetHash(), tx, NULL);
+	}
 	return true;
 }
 
@@ -2186,11 +2523,24 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew) {
 	{
 		CCoinsViewCache view(*pcoinsTip, true);
 		CInv inv(MSG_BLOCK, pindexNew->GetBlockHash());
+		CCoinsStats statsRunning;
+		bool fRunningStats = view.GetRunningStats(statsRunning);
+		std::set<uint256> setTxids;
+		if (fRunningStats) {
+			GetBlockCoinsTxids(block, setTxids);
+			UpdateRunningStats(statsRunning, view, setTxids, false);
+		}
 		if (!ConnectBlock(block, state, pindexNew, view)) {
 			if (state.IsInvalid())
 				InvalidBlockFound(pindexNew, state);
 			return error("ConnectTip() : ConnectBlock %s failed", pindexNew->GetBlockHash().ToString());
 		}
+		if (fRunningStats) {
+			UpdateRunningStats(statsRunning, view, setTxids, true);
+			statsRunning.hashBlock = pindexNew->GetBlockHash();
+			statsRunning.nHeight = pindexNew->nHeight;
+			view.SetRunningStats(statsRunning);
+		}
 		mapBlockSource.erase(inv.hash);
 		assert(view.Flush());
 	}
@@ -2199,13 +2549,9 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew) {
 	// Write the chain state to disk, if necessary.
 	if (!WriteChainState(state))
 		return false;
-	// Remove conflicting transactions from the mempool.
+	// Remove confirmed and conflicting transactions from the mempool.
 	std::list<CTransaction> txConflicted;
-	BOOST_FOREACH(const CTransaction &tx, block.vtx) {
-		std::list<CTransaction> unused;
-		mempool.remove(tx, unused);
-		mempool.removeConflicts(tx, txConflicted);
-	}
+	mempool.removeForBlock(block.vtx, txConflicted);
 	mempool.check(pcoinsTip);
 	// Update chainActive & related variables.
 	UpdateTip(pindexNew);
@@ -2726,10 +3072,31 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp)
 	int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
 	if (chainActive.Tip()->GetBlockHash() == hash)
 	{
+		// Peers that understand compact blocks get the new tip pushed directly
+		// as header and short ids, saving the inv/getdata round trip and the
+		// transactions they already have in their memory pool.
+		CInv inv(MSG_BLOCK, hash);
+		bool fCompact = !IsInitialBlockDownload();
+		CCompactBlock cmpctblock;
 		LOCK(cs_vNodes);
 		BOOST_FOREACH(CNode* pnode, vNodes)
 		if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-			pnode->PushInventory(CInv(MSG_BLOCK, hash));
+		{
+			if (fCompact && pnode->nVersion >= COMPACT_BLOCKS_VERSION)
+			{
+				{
+					LOCK(pnode->cs_inventory);
+					if (pnode->filterInventoryKnown.contains(inv.hash))
+						continue;
+					pnode->filterInventoryKnown.insert(inv.hash);
+				}
+				if (cmpctblock.header.IsNull())
+					cmpctblock = CCompactBlock(block);
+				pnode->PushMessage("cmpctblock", cmpctblock);
+			}
+			else
+				pnode->PushInventory(inv);
+		}
 	}
 	//LogPrintf("AcceptBlock() successful: hash = %s\n", hash.ToString());
 	return true;
@@ -2891,6 +3258,89 @@ CMerkleBlock::CMerkleBlock(const CBlock& block, CBloomFilter& filter)
 	txn = CPartialMerkleTree(vHashes, vMatch, block);
 }
 
+// Smallest possible serialized transaction, used to bound the size of a compact block
+static const unsigned int MIN_TRANSACTION_SIZE = 60;
+
+CCompactBlock::CCompactBlock(const CBlock& block) : fShortIDKeys(false)
+{
+	header = block.GetBlockHeader();
+	nNonce = GetRand(std::numeric_limits<uint64_t>::max());
+
+	if (block.vtx.empty())
+		return;
+	vPrefilledTxn.push_back(CPrefilledTransaction(0, block.vtx[0]));
+	vShortTxIDs.reserve(block.vtx.size() - 1);
+	for (unsigned int i = 1; i < block.vtx.size(); i++)
+		vShortTxIDs.push_back(CShortTxID(GetShortID(block.vtx[i].GetHash())));
+}
+
+uint64_t CCompactBlock::GetShortID(const uint256& txhash) const
+{
+	if (!fShortIDKeys) {
+		CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+		ss << header << nNonce;
+		uint256 hashKey = ss.GetHash();
+		nShortIDKey0 = hashKey.Get64(0);
+		nShortIDKey1 = hashKey.Get64(1);
+		fShortIDKeys = true;
+	}
+	return SipHashUint256(nShortIDKey0, nShortIDKey1, txhash) & 0xffffffffffffULL;
+}
+
+bool CCompactBlock::FillBlock(CBlock& block, CTxMemPool& pool, std::vector<unsigned int>& vMissing) const
+{
+	unsigned int nTxCount = BlockTxCount();
+	if (header.IsNull() || nTxCount == 0 || nTxCount > MAX_BLOCK_SIZE / MIN_TRANSACTION_SIZE)
+		return false;
+
+	block = CBlock(header);
+	block.vtx.resize(nTxCount);
+	std::vector<bool> vHave(nTxCount, false);
+
+	BOOST_FOREACH(const CPrefilledTransaction& prefilled, vPrefilledTxn) {
+		if (prefilled.nIndex >= nTxCount || vHave[prefilled.nIndex])
+			return false;
+		block.vtx[prefilled.nIndex] = prefilled.tx;
+		vHave[prefilled.nIndex] = true;
+	}
+
+	// The short ids fill the remaining slots in order
+	std::map<uint64_t, unsigned int> mapShortIDs;
+	std::vector<CShortTxID>::const_iterator itShortID = vShortTxIDs.begin();
+	for (unsigned int i = 0; i < nTxCount; i++) {
+		if (vHave[i])
+			continue;
+		// Two transactions of the block share a short id, give up on it
+		if (!mapShortIDs.insert(std::make_pair((*itShortID++).GetUint64(), i)).second)
+			return false;
+	}
+
+	std::vector<bool> vAmbiguous(nTxCount, false);
+	{
+		LOCK(pool.cs);
+		for (CTxMemPool::indexed_transaction_set::const_iterator mi = pool.mapTx.begin(); mi != pool.mapTx.end(); ++mi) {
+			std::map<uint64_t, unsigned int>::const_iterator it = mapShortIDs.find(GetShortID(mi->GetHash()));
+			if (it == mapShortIDs.end() || vAmbiguous[it->second])
+				continue;
+			if (vHave[it->second]) {
+				// More than one pool transaction matches, let the peer tell us which one
+				block.vtx[it->second] = CTransaction();
+				vHave[it->second] = false;
+				vAmbiguous[it->second] = true;
+				continue;
+			}
+			block.vtx[it->second] = mi->GetTx();
+			vHave[it->second] = true;
+		}
+	}
+
+	vMissing.clear();
+	for (unsigned int i = 0; i < nTxCount; i++)
+		if (!vHave[i])
+			vMissing.push_back(i);
+	return true;
+}
+
 uint256 CPartialMerkleTree::CalcHash(int height, unsigned int pos, const std::vector<uint256> &vTxid) {
 	if (height == 0) {
 		// hash at height 0 is the txids themself
@@ -3141,7 +3591,12 @@ bool static LoadBlockIndexDB()
 
 	// Check whether we have a transaction index
 	pblocktree->ReadFlag("txindex", fTxIndex);
-	LogPrintf("LoadBlockIndexDB(): transaction index %s\n", fTxIndex ? "enabled" : "disabled");
+	pblocktree->ReadFlag("compacttxindex", fCompactTxIndex);
+	LogPrintf("LoadBlockIndexDB(): transaction index %s\n", fTxIndex ? (fCompactTxIndex ? "enabled (compact)" : "enabled") : "disabled");
+
+	// Check whether we have an address index
+	pblocktree->ReadFlag("addressindex", fAddressIndex);
+	LogPrintf("LoadBlockIndexDB(): address index %s\n", fAddressIndex ? "enabled" : "disabled");
 
 	// Load pointer to end of best chain
 	std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
@@ -3198,7 +3653,7 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
 		// check level 3: check for inconsistencies during memory-only disconnect of tip blocks
 		if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= 2*nCoinCacheSize + 32000) {
 			bool fClean = true;
-			if (!DisconnectBlock(block, state, pindex, coins, &fClean))
+			if (!DisconnectBlock(block, state, pindex, coins, &fClean, true))
 				return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
 			pindexState = pindex->pprev;
 			if (!fClean) {
@@ -3253,8 +3708,12 @@ bool InitBlockIndex() {
 		return true;
 
 	// Use the provided setting for -txindex in the new database
-	fTxIndex = GetBoolArg("-txindex", false);
+	fCompactTxIndex = GetBoolArg("-compacttxindex", false);
+	fTxIndex = GetBoolArg("-txindex", false) || fCompactTxIndex;
 	pblocktree->WriteFlag("txindex", fTxIndex);
+	pblocktree->WriteFlag("compacttxindex", fCompactTxIndex);
+	fAddressIndex = GetBoolArg("-addressindex", false);
+	pblocktree->WriteFlag("addressindex", fAddressIndex);
 	LogPrintf("Initializing databases...\n");
 
 	// Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -3557,7 +4016,7 @@ void static ProcessGetData(CNode* pfrom)
 							pfrom->PushMessage("merkleblock", merkleBlock);
 							typedef std::pair<unsigned int, uint256> PairType;
 							BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-							if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+							if (!pfrom->filterInventoryKnown.contains(pair.second))
 								pfrom->PushMessage("tx", block.vtx[pair.first]);
 						}
 					}
@@ -3616,6 +4075,27 @@ void static ProcessGetData(CNode* pfrom)
 	}
 						}
 
+// Requires cs_main. Hand a block rebuilt from a compact announcement to
+// ProcessBlock, or download it in full if the short ids matched the wrong
+// transactions.
+void static ProcessCompactBlock(CNode* pfrom, CBlock& block)
+{
+	uint256 hash = block.GetHash();
+	if (block.BuildMerkleTree() != block.hashMerkleRoot)
+	{
+		LogPrint("net", "compact block %s from peer=%d did not reconstruct, requesting full block\n", hash.ToString(), pfrom->id);
+		AddBlockToQueue(pfrom->GetId(), hash);
+		return;
+	}
+
+	LogPrint("net", "reconstructed compact block %s (%u txs)\n", hash.ToString(), block.vtx.size());
+	mapBlockSource[hash] = pfrom->GetId();
+	MarkBlockAsReceived(hash, pfrom->GetId());
+
+	CValidationState state;
+	ProcessBlock(state, pfrom, &block);
+}
+
 bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vRecv)
 						{
 	RandAddSeedPerfmon();
@@ -4079,6 +4559,133 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
 		CValidationState state;
 		ProcessBlock(state, pfrom, &block);
 	}
+	else if (strCommand == "cmpctblock" && !fImporting && !fReindex)
+	{
+		CCompactBlock cmpctblock;
+		vRecv >> cmpctblock;
+
+		uint256 hash = cmpctblock.header.GetHash();
+		LogPrint("net", "received compact block %s (%u txs, %u prefilled)\n", hash.ToString(),
+				cmpctblock.BlockTxCount(), cmpctblock.vPrefilledTxn.size());
+
+		CInv inv(MSG_BLOCK, hash);
+		pfrom->AddInventoryKnown(inv);
+
+		LOCK(cs_main);
+		if (AlreadyHave(inv))
+			return true;
+
+		if (!CheckProofOfWork(cmpctblock.header.GetPoWHash(cmpctblock.header.GetAlgo()), cmpctblock.header.nBits, cmpctblock.header.GetAlgo()))
+		{
+			Misbehaving(pfrom->GetId(), 50);
+			return error("cmpctblock %s : proof of work failed", hash.ToString());
+		}
+
+		// Without its parent we could not connect it anyway; fetch it the
+		// usual way so the orphan handling asks for the missing blocks.
+		if (!mapBlockIndex.count(cmpctblock.header.hashPrevBlock))
+		{
+			AddBlockToQueue(pfrom->GetId(), hash);
+			return true;
+		}
+
+		CBlock block;
+		std::vector<unsigned int> vMissing;
+		if (!cmpctblock.FillBlock(block, mempool, vMissing))
+		{
+			LogPrint("net", "compact block %s from peer=%d is unusable, requesting full block\n", hash.ToString(), pfrom->id);
+			AddBlockToQueue(pfrom->GetId(), hash);
+			return true;
+		}
+
+		if (vMissing.empty())
+		{
+			ProcessCompactBlock(pfrom, block);
+		}
+		else
+		{
+			LogPrint("net", "compact block %s : requesting %u of %u txs\n", hash.ToString(), vMissing.size(), block.vtx.size());
+			CNodeState *state = State(pfrom->GetId());
+			state->hashCompactBlock = hash;
+			state->blockCompact = block;
+			state->vCompactMissing = vMissing;
+
+			CBlockTxRequest req;
+			req.blockhash = hash;
+			req.vIndexes = vMissing;
+			pfrom->PushMessage("getblocktxn", req);
+		}
+	}
+	else if (strCommand == "getblocktxn")
+	{
+		CBlockTxRequest req;
+		vRecv >> req;
+
+		LOCK(cs_main);
+		std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(req.blockhash);
+		if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA))
+			return true;
+
+		// Only a block just relayed is worth reconstructing; anything older
+		// is fetched whole, so don't let peers make us read it from disk.
+		if (mi->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH)
+		{
+			LogPrint("net", "peer=%d asked for txs of block %s, which is too deep\n", pfrom->id, req.blockhash.ToString());
+			return true;
+		}
+
+		CBlock block;
+		if (!ReadBlockFromDisk(block, mi->second))
+			return error("getblocktxn : failed to read block %s", req.blockhash.ToString());
+
+		// The indexes are strictly increasing by their encoding, so the last
+		// one being in range bounds how many there are and what is copied
+		if (!req.vIndexes.empty() && req.vIndexes.back() >= block.vtx.size())
+		{
+			Misbehaving(pfrom->GetId(), 100);
+			return error("getblocktxn : index %u out of range for block %s", req.vIndexes.back(), req.blockhash.ToString());
+		}
+
+		CBlockTxResponse resp;
+		resp.blockhash = req.blockhash;
+		resp.vtx.reserve(req.vIndexes.size());
+		BOOST_FOREACH(unsigned int nIndex, req.vIndexes)
+			resp.vtx.push_back(block.vtx[nIndex]);
+		pfrom->PushMessage("blocktxn", resp);
+	}
+	else if (strCommand == "blocktxn" && !fImporting && !fReindex)
+	{
+		CBlockTxResponse resp;
+		vRecv >> resp;
+
+		LOCK(cs_main);
+		CNodeState *state = State(pfrom->GetId());
+		if (state->hashCompactBlock == 0 || state->hashCompactBlock != resp.blockhash)
+		{
+			LogPrint("net", "peer=%d sent unrequested blocktxn for %s\n", pfrom->id, resp.blockhash.ToString());
+			return true;
+		}
+
+		CBlock block;
+		block.SetNull();
+		std::swap(block, state->blockCompact);
+		std::vector<unsigned int> vMissing;
+		vMissing.swap(state->vCompactMissing);
+		state->hashCompactBlock = 0;
+
+		if (resp.vtx.size() != vMissing.size())
+		{
+			LogPrint("net", "peer=%d sent %u of %u txs for compact block %s, requesting full block\n", pfrom->id,
+					resp.vtx.size(), vMissing.size(), resp.blockhash.ToString());
+			AddBlockToQueue(pfrom->GetId(), resp.blockhash);
+			return true;
+		}
+		for (unsigned int i = 0; i < vMissing.size(); i++)
+			block.vtx[vMissing[i]] = resp.vtx[i];
+
+		if (!AlreadyHave(CInv(MSG_BLOCK, resp.blockhash)))
+			ProcessCompactBlock(pfrom, block);
+	}
 	else if (strCommand == "getaddr")
 	{
 		pfrom->vAddrToSend.clear();
@@ -4504,38 +5111,25 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 		}
 
 		// Message: inventory
+		// Blocks are announced right away and ahead of any transactions.
+		// Transactions are batched and sent at random intervals, which saves
+		// on small inv messages and makes it harder to tell where they came from.
+		int64_t nNow = GetTimeMicros();
 		std::vector<CInv> vInv;
-		std::vector<CInv> vInvWait;
 		{
 			LOCK(pto->cs_inventory);
-			vInv.reserve(pto->vInventoryToSend.size());
-			vInvWait.reserve(pto->vInventoryToSend.size());
-			BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
+			bool fSendTx = nNow >= pto->nNextInvSend;
+			if (fSendTx)
+				pto->nNextInvSend = PoissonNextSend(nNow, pto->fInbound ? INVENTORY_BROADCAST_INTERVAL : INVENTORY_BROADCAST_INTERVAL / 2);
+			vInv.reserve(std::min(pto->vInventoryBlockToSend.size() + (fSendTx ? pto->vInventoryTxToSend.size() : 0), (size_t)1000));
+			for (int nQueue = 0; nQueue < (fSendTx ? 2 : 1); nQueue++)
 			{
-				if (pto->setInventoryKnown.count(inv))
-					continue;
-
-				// trickle out tx inv to protect privacy
-				if (inv.type == MSG_TX && !fSendTrickle)
+				std::vector<CInv>& vQueue = nQueue == 0 ? pto->vInventoryBlockToSend : pto->vInventoryTxToSend;
+				BOOST_FOREACH(const CInv& inv, vQueue)
 				{
-					// 1/4 of tx invs blast to all immediately
-					static uint256 hashSalt;
-					if (hashSalt == 0)
-						hashSalt = GetRandHash();
-					uint256 hashRand = inv.hash ^ hashSalt;
-					hashRand = Hash(BEGIN(hashRand), END(hashRand));
-					bool fTrickleWait = ((hashRand & 3) != 0);
-
-					if (fTrickleWait)
-					{
-						vInvWait.push_back(inv);
+					if (pto->filterInventoryKnown.contains(inv.hash))
 						continue;
-					}
-				}
-
-				// returns true if wasn't already contained in the set
-				if (pto->setInventoryKnown.insert(inv).second)
-				{
+					pto->filterInventoryKnown.insert(inv.hash);
 					vInv.push_back(inv);
 					if (vInv.size() >= 1000)
 					{
@@ -4543,15 +5137,14 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 						vInv.clear();
 					}
 				}
+				// Release the memory too, a burst shouldn't stay allocated for every peer
+				std::vector<CInv>().swap(vQueue);
 			}
-			pto->vInventoryToSend = vInvWait;
 		}
 		if (!vInv.empty())
 			pto->PushMessage("inv", vInv);
 
-
 		// Detect stalled peers.
-		int64_t nNow = GetTimeMicros();
 		if (!pto->fDisconnect && state.nBlocksInFlight &&
 				state.nLastBlockReceive < state.nLastBlockProcess - BLOCK_DOWNLOAD_TIMEOUT*1000000 &&
 				state.vBlocksInFlight.front().nTime < state.nLastBlockProcess - 2*BLOCK_DOWNLOAD_TIMEOUT*1000000) {
@@ -4588,6 +5181,12 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 					vGetData.clear();
 				}
 			}
+			else
+			{
+				// Nothing left to ask anyone for, so don't let it take up a
+				// slot that a still missing item could use.
+				mapAlreadyAskedFor.erase(inv);
+			}
 			pto->mapAskFor.erase(pto->mapAskFor.begin());
 		}
 		if (!vGetData.empty())
@@ -22,6 +22,7 @@
 
 #include <algorithm>
 #include <exception>
+#include <limits>
 #include <map>
 #include <set>
 #include <stdint.h>
@@ -47,6 +48,18 @@ static const unsigned int DEFAULT_BLOCK_MAX_SIZE = MAX_BLOCK_SIZE;
 static const unsigned int DEFAULT_BLOCK_MIN_SIZE = 0;
 /** Default for -blockprioritysize, maximum space for zero/low-fee transactions **/
 static const unsigned int DEFAULT_BLOCK_PRIORITY_SIZE = 50000;
+/** Default for -limitancestorcount, max number of in-pool ancestors **/
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, maximum kilobytes of tx + all in-pool ancestors **/
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, max number of in-pool descendants **/
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, maximum kilobytes of in-pool descendants **/
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** Default for -maxmempool, maximum megabytes of memory the mempool may use **/
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, hours after which unconfirmed transactions leave the mempool **/
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
 /** The maximum size for transactions we're willing to relay/mine */
 static const unsigned int MAX_STANDARD_TX_SIZE = 100000;
 /** The maximum number of orphan blocks kept in memory */
@@ -69,6 +82,8 @@ static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 128;
 /** Timeout in seconds before considering a block download peer unresponsive. */
 static const unsigned int BLOCK_DOWNLOAD_TIMEOUT = 60;
+/** "getblocktxn" requests for blocks more than this many blocks below the tip are ignored */
+static const int MAX_BLOCKTXN_DEPTH = 10;
 
 #ifdef USE_UPNP
 static const int fHaveUPnP = true;
@@ -99,6 +114,8 @@ extern bool fReindex;
 extern bool fBenchmark;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
+extern bool fCompactTxIndex;
+extern bool fAddressIndex;
 extern unsigned int nCoinCacheSize;
 extern int miningAlgo;
 
@@ -170,8 +187,9 @@ int GetNumBlocksOfPeers();
 bool IsInitialBlockDownload();
 /** Format a string that describes several potential problems detected by the core */
 std::string GetWarnings(std::string strFor);
-/** Retrieve a transaction (from memory pool, or from disk, if possible) */
-bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock, bool fAllowSlow = false);
+/** Retrieve a transaction (from memory pool, or from disk, if possible). pindexHint, if
+ *  given, is the block to look in when the transaction index doesn't have it. */
+bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock, bool fAllowSlow = false, const CBlockIndex *pindexHint = NULL);
 /** Find the best known block, and make it the tip of the block chain */
 bool ActivateBestChain(CValidationState &state);
 int64_t GetBlockValue(int nHeight, int64_t nFees);
@@ -183,6 +201,13 @@ void UpdateTime(CBlockHeader& block, const CBlockIndex* pindexPrev);
 CBlockIndex * InsertBlockIndex(uint256 hash);
 /** Verify a signature */
 bool VerifySignature(const CCoins& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+/** Sign the inputs of the transactions, vScriptPubKeys[n][i] being the output spent by input i of
+ *  the nth transaction, or empty to leave that input alone. The work goes to the script check
+ *  threads, which are idle while cs_main is held. Each scriptSig is set, complete or not, once all
+ *  are done, so that the result doesn't depend on the order they are made in. Returns whether
+ *  every input given was fully signed. */
+bool SignSignatures(const CKeyStore& keystore, const std::vector<CTransaction*>& vpTxTo,
+                    const std::vector<std::vector<CScript> >& vScriptPubKeys, int nHashType = SIGHASH_ALL);
 /** Abort with a message */
 bool AbortNode(const std::string &msg);
 /** Get statistics from node state */
@@ -403,12 +428,21 @@ private:
     unsigned int nIn;
     unsigned int nFlags;
     int nHashType;
+    // Set for a signature to make rather than one to verify, see SignSignatures
+    const CKeyStore *pkeystore;
+    CScript *pscriptSigRet;
+    char *pfSignedRet;
 
 public:
-    CScriptCheck() {}
+    CScriptCheck() : pkeystore(NULL), pscriptSigRet(NULL), pfSignedRet(NULL) {}
     CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
         scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) { }
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn),
+        pkeystore(NULL), pscriptSigRet(NULL), pfSignedRet(NULL) { }
+    CScriptCheck(const CKeyStore& keystoreIn, const CScript& scriptPubKeyIn, const CTransaction& txToIn, unsigned int nInIn, int nHashTypeIn,
+                 CScript& scriptSigRet, char& fSignedRet) :
+        scriptPubKey(scriptPubKeyIn), ptxTo(&txToIn), nIn(nInIn), nFlags(0), nHashType(nHashTypeIn),
+        pkeystore(&keystoreIn), pscriptSigRet(&scriptSigRet), pfSignedRet(&fSignedRet) { }
 
     bool operator()() const;
 
@@ -418,6 +452,9 @@ public:
         std::swap(nIn, check.nIn);
         std::swap(nFlags, check.nFlags);
         std::swap(nHashType, check.nHashType);
+        std::swap(pkeystore, check.pkeystore);
+        std::swap(pscriptSigRet, check.pscriptSigRet);
+        std::swap(pfSignedRet, check.pfSignedRet);
     }
 };
 
@@ -586,6 +623,8 @@ public:
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/** Read a block's serialized bytes as stored on disk, without deserializing it */
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& vchBlock, const CBlockIndex* pindex);
 
 
 /** Functions for validating blocks and updating the block tree */
@@ -594,7 +633,7 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
  *  In case pfClean is provided, operation will try to be tolerant about errors, and *pfClean
  *  will be true if no problems were found. Otherwise, the return value will be false in case
  *  of problems. Note that in any case, coins may be modified. */
-bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL);
+bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL, bool fJustCheck = false);
 
 // Apply the effects of this block (with given index) on the UTXO set represented by coins
 bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool fJustCheck = false);
@@ -1171,6 +1210,150 @@ public:
 };
 
 
+/** A transaction sent in full inside a compact block, with its position in
+ *  the block. The coinbase is always prefilled, as no peer can have it yet.
+ */
+class CPrefilledTransaction
+{
+public:
+    unsigned int nIndex;
+    CTransaction tx;
+
+    CPrefilledTransaction() : nIndex(0) {}
+    CPrefilledTransaction(unsigned int nIndexIn, const CTransaction& txIn) : nIndex(nIndexIn), tx(txIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(VARINT(nIndex));
+        READWRITE(tx);
+    )
+};
+
+/** 48-bit salted transaction id used in compact blocks */
+class CShortTxID
+{
+public:
+    unsigned char data[6];
+
+    CShortTxID() { memset(data, 0, sizeof(data)); }
+    explicit CShortTxID(uint64_t nShortID)
+    {
+        for (unsigned int i = 0; i < sizeof(data); i++)
+            data[i] = (nShortID >> (8 * i)) & 0xff;
+    }
+
+    uint64_t GetUint64() const
+    {
+        uint64_t nShortID = 0;
+        for (unsigned int i = 0; i < sizeof(data); i++)
+            nShortID |= (uint64_t)data[i] << (8 * i);
+        return nShortID;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(FLATDATA(data));
+    )
+};
+
+/** Compact block announcement ("cmpctblock").
+ *
+ * Carries the block header, the prefilled transactions and a short id for
+ * every other transaction. Short ids are SipHash-2-4 of the txid, keyed by the
+ * header and a per-announcement nonce so that collisions can't be precomputed.
+ * The receiver rebuilds the block from its memory pool and only requests the
+ * transactions it is missing with "getblocktxn".
+ */
+class CCompactBlock
+{
+private:
+    mutable uint64_t nShortIDKey0, nShortIDKey1;
+    mutable bool fShortIDKeys;
+
+public:
+    CBlockHeader header;
+    uint64_t nNonce;
+    std::vector<CShortTxID> vShortTxIDs;
+    std::vector<CPrefilledTransaction> vPrefilledTxn;
+
+    CCompactBlock() : fShortIDKeys(false), nNonce(0) {}
+    // Build an announcement for block, prefilling only the coinbase
+    CCompactBlock(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+    unsigned int BlockTxCount() const { return vShortTxIDs.size() + vPrefilledTxn.size(); }
+
+    // Rebuild the block from the prefilled transactions and pool. Transactions
+    // that could not be found are left empty and their indexes returned in
+    // vMissing. Returns false if the announcement is malformed or its short ids
+    // are ambiguous, in which case the full block should be requested instead.
+    bool FillBlock(CBlock& block, CTxMemPool& pool, std::vector<unsigned int>& vMissing) const;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(header);
+        READWRITE(nNonce);
+        READWRITE(vShortTxIDs);
+        READWRITE(vPrefilledTxn);
+        if (fRead)
+            fShortIDKeys = false;
+    )
+};
+
+/** Request for the transactions of a compact block that were not found in
+ *  the memory pool ("getblocktxn"). As in BIP 152, each index goes on the
+ *  wire as its distance from the previous one less one, so the indexes
+ *  can only be strictly increasing. */
+class CBlockTxRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<unsigned int> vIndexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        CBlockTxRequest* pthis = const_cast<CBlockTxRequest*>(this);
+        READWRITE(blockhash);
+        std::vector<unsigned int> vDiffs;
+        if (!fRead)
+        {
+            vDiffs.reserve(vIndexes.size());
+            for (unsigned int i = 0; i < vIndexes.size(); i++)
+                vDiffs.push_back(vIndexes[i] - (i == 0 ? 0 : vIndexes[i-1] + 1));
+        }
+        READWRITE(vDiffs);
+        if (fRead)
+        {
+            pthis->vIndexes.clear();
+            pthis->vIndexes.reserve(vDiffs.size());
+            uint64_t nIndex = 0;
+            for (unsigned int i = 0; i < vDiffs.size(); i++)
+            {
+                nIndex += vDiffs[i];
+                if (nIndex > std::numeric_limits<unsigned int>::max())
+                    throw std::ios_base::failure("CBlockTxRequest : index out of range");
+                pthis->vIndexes.push_back((unsigned int)nIndex);
+                nIndex++;
+            }
+        }
+    )
+};
+
+/** Answer to "getblocktxn", transactions in the requested order ("blocktxn") */
+class CBlockTxResponse
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> vtx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(vtx);
+    )
+};
+
+
 class CWalletInterface {
 protected:
     virtual void SyncTransaction(const uint256 &hash, const CTransaction &tx, const CBlock *pblock) =0;
@@ -0,0 +1,74 @@
+// Copyright (c) 2018 The Auroracoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MEMUSAGE_H
+#define BITCOIN_MEMUSAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <set>
+#include <vector>
+
+/** Estimates of the heap memory used by containers, for memory limits.
+ *  They count what the allocator hands out, not just what was asked for:
+ *  a node based container holding small elements is mostly overhead. */
+namespace memusage
+{
+
+/** Bytes malloc actually reserves for an allocation of alloc bytes */
+static inline size_t MallocUsage(size_t alloc)
+{
+    // Measured on 64-bit glibc: 16 byte granularity, 8 bytes of header,
+    // 32 bytes at least; on 32-bit, 8 bytes granularity and 4 bytes header
+    if (alloc == 0)
+        return 0;
+    if (sizeof(void*) == 8)
+        return ((alloc + 31) >> 4) << 4;
+    if (sizeof(void*) == 4)
+        return ((alloc + 15) >> 3) << 3;
+    return alloc;
+}
+
+// Layout of a red-black tree node in libstdc++, used by std::set and std::map
+template<typename X>
+struct stl_tree_node
+{
+private:
+    int color;
+    void* parent;
+    void* left;
+    void* right;
+    X x;
+};
+
+template<typename X>
+static inline size_t DynamicUsage(const std::vector<X>& v)
+{
+    return MallocUsage(v.capacity() * sizeof(X));
+}
+
+template<typename X, typename Y>
+static inline size_t DynamicUsage(const std::set<X, Y>& s)
+{
+    return MallocUsage(sizeof(stl_tree_node<X>)) * s.size();
+}
+
+/** What one more element adds to a set */
+template<typename X, typename Y>
+static inline size_t IncrementalDynamicUsage(const std::set<X, Y>& s)
+{
+    return MallocUsage(sizeof(stl_tree_node<X>));
+}
+
+template<typename X, typename Y, typename Z>
+static inline size_t DynamicUsage(const std::map<X, Y, Z>& m)
+{
+    return MallocUsage(sizeof(stl_tree_node<std::pair<const X, Y> >)) * m.size();
+}
+
+}
+
+#endif // BITCOIN_MEMUSAGE_H
@@ -8,9 +8,14 @@
 #include "core.h"
 #include "main.h"
 #include "net.h"
+#include "txmempool.h"
 #ifdef ENABLE_WALLET
 #include "wallet.h"
 #endif
+
+#include <algorithm>
+#include <limits>
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // BitcoinMiner
@@ -52,55 +57,136 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
   ((uint32_t*)pstate)[i] = ctx.h[i];
 }
 
-// Some explaining would be appreciated
-class COrphan
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+
+// We want to sort transactions by priority:
+typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
+class TxCoinAgePriorityCompare
 {
 public:
-  const CTransaction* ptx;
-  std::set<uint256> setDependsOn;
-  double dPriority;
-  double dFeePerKb;
-
-  COrphan(const CTransaction* ptxIn)
+  bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b)
   {
-    ptx = ptxIn;
-    dPriority = dFeePerKb = 0;
+    if (a.first == b.first)
+      return CTxMemPool::CompareIteratorByHash()(a.second, b.second);
+    return a.first > b.first;
   }
+};
 
-  void print() const
+// Ancestors sort before their descendants by ancestor count
+class CompareTxIterByAncestorCount
+{
+public:
+  bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b)
   {
-    LogPrintf("COrphan(hash=%s, dPriority=%.1f, dFeePerKb=%.1f)\n",
-    ptx->GetHash().ToString(), dPriority, dFeePerKb);
-    BOOST_FOREACH(uint256 hash, setDependsOn)
-    LogPrintf("   setDependsOn %s\n", hash.ToString());
+    if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+      return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+    return CTxMemPool::CompareIteratorByHash()(a, b);
   }
 };
 
-
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
-
-// We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, const CTransaction*> TxPriority;
-class TxPriorityCompare
+// Fills a block template with pool transactions. The pool's indexes and
+// links are trusted for the order to try transactions in; each one is still
+// checked against the coins of the block so far, so a bad pool entry is
+// left out instead of failing the whole template.
+class CBlockTxCollector
 {
-  bool byFee;
 public:
-  TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
-  bool operator()(const TxPriority& a, const TxPriority& b)
+  uint64_t nBlockSize;
+  uint64_t nBlockTx;
+  int nBlockSigOps;
+  int64_t nFees;
+
+  CBlockTxCollector(CBlockTemplate* pblocktemplateIn, CBlockIndex* pindexPrevIn, CCoinsView& coinsIn,
+                    unsigned int nBlockMaxSizeIn, unsigned int nBlockMaxSigOpsIn, bool fPrintPriorityIn) :
+    nBlockSize(1000), nBlockTx(0), nBlockSigOps(100), nFees(0),
+    pblocktemplate(pblocktemplateIn), pindexPrev(pindexPrevIn), view(coinsIn, true),
+    nBlockMaxSize(nBlockMaxSizeIn), nBlockMaxSigOps(nBlockMaxSigOpsIn), fPrintPriority(fPrintPriorityIn)
   {
-    if (byFee)
-    {
-      if (a.get<1>() == b.get<1>())
-      return a.get<0>() < b.get<0>();
-      return a.get<1>() < b.get<1>();
-    }
-    else
+  }
+
+  bool Tried(CTxMemPool::txiter iter) const
+  {
+    return setTried.count(iter) != 0;
+  }
+
+  // Add the transaction after whatever in-pool ancestors it needs
+  void AddWithAncestors(CTxMemPool::txiter iter)
+  {
+    CTxMemPool::setEntries setAncestors;
+    std::string dummy;
+    mempool.CalculateMemPoolAncestors(*iter, setAncestors, std::numeric_limits<uint64_t>::max(), std::numeric_limits<uint64_t>::max(),
+                                      std::numeric_limits<uint64_t>::max(), std::numeric_limits<uint64_t>::max(), dummy, false);
+    std::vector<CTxMemPool::txiter> vPackage;
+    vPackage.reserve(setAncestors.size() + 1);
+    BOOST_FOREACH(CTxMemPool::txiter ancestor, setAncestors)
+      if (!Tried(ancestor))
+        vPackage.push_back(ancestor);
+    std::sort(vPackage.begin(), vPackage.end(), CompareTxIterByAncestorCount());
+    vPackage.push_back(iter);
+    BOOST_FOREACH(CTxMemPool::txiter it, vPackage)
+      TryAdd(it);
+  }
+
+private:
+  CBlockTemplate* pblocktemplate;
+  CBlockIndex* pindexPrev;
+  CCoinsViewCache view;
+  unsigned int nBlockMaxSize;
+  unsigned int nBlockMaxSigOps;
+  bool fPrintPriority;
+  // Every pool transaction is tried at most once, whether it makes it in or not
+  CTxMemPool::setEntries setTried;
+
+  bool TryAdd(CTxMemPool::txiter iter)
+  {
+    setTried.insert(iter);
+    const CTransaction& tx = iter->GetTx();
+    if (tx.IsCoinBase() || !IsFinalTx(tx, pindexPrev->nHeight + 1))
+      return false;
+
+    // Size limits
+    unsigned int nTxSize = iter->GetTxSize();
+    if (nBlockSize + nTxSize >= nBlockMaxSize)
+      return false;
+
+    // Legacy limits on sigOps:
+    unsigned int nTxSigOps = GetLegacySigOpCount(tx);
+    if (nBlockSigOps + nTxSigOps >= nBlockMaxSigOps)
+      return false;
+
+    // Inputs that didn't make it into the block (or were never there)
+    if (!view.HaveInputs(tx))
+      return false;
+
+    int64_t nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
+
+    nTxSigOps += GetP2SHSigOpCount(tx, view);
+    if (nBlockSigOps + nTxSigOps >= nBlockMaxSigOps)
+      return false;
+
+    CValidationState state;
+    if (!CheckInputs(tx, state, view, true, SCRIPT_VERIFY_P2SH))
+      return false;
+
+    CTxUndo txundo;
+    UpdateCoins(tx, state, view, txundo, pindexPrev->nHeight+1, iter->GetHash());
+
+    // Added
+    pblocktemplate->block.vtx.push_back(tx);
+    pblocktemplate->vTxFees.push_back(nTxFees);
+    pblocktemplate->vTxSigOps.push_back(nTxSigOps);
+    nBlockSize += nTxSize;
+    ++nBlockTx;
+    nBlockSigOps += nTxSigOps;
+    nFees += nTxFees;
+
+    if (fPrintPriority)
     {
-      if (a.get<0>() == b.get<0>())
-      return a.get<1>() < b.get<1>();
-      return a.get<0>() < b.get<0>();
+      LogPrintf("priority %.1f feeperkb %.1f txid %s\n", iter->GetPriority(pindexPrev->nHeight + 1),
+                double(nTxFees) / (double(nTxSize)/1000.0), tx.GetHash().ToString());
     }
+    return true;
   }
 };
 
@@ -183,186 +269,45 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, int algo)
   {
     LOCK2(cs_main, mempool.cs);
     CBlockIndex* pindexPrev = chainActive.Tip();
-    CCoinsViewCache view(*pcoinsTip, true);
-
-    // Priority order to process transactions
-    std::list<COrphan> vOrphan; // list memory doesn't move
-    std::map<uint256, std::vector<COrphan*> > mapDependers;
-    bool fPrintPriority = GetBoolArg("-printpriority", false);
+    CBlockTxCollector collector(pblocktemplate.get(), pindexPrev, *pcoinsTip,
+                                nBlockMaxSize, maxBlockSize/50, GetBoolArg("-printpriority", false));
 
-    // This vector will be sorted into a priority queue:
-    std::vector<TxPriority> vecPriority;
-    vecPriority.reserve(mempool.mapTx.size());
-    for (std::map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();mi != mempool.mapTx.end(); ++mi)
+    // High-priority transactions first, regardless of the fees they pay.
+    // Priority grows with the chain height so it is the one order the pool
+    // can't keep for us; it is computed from what the entries cached.
+    if (nBlockPrioritySize > 0)
     {
-      const CTransaction& tx = mi->second.GetTx();
-      if (tx.IsCoinBase() || !IsFinalTx(tx, pindexPrev->nHeight + 1))
-      continue;
-
-      COrphan* porphan = NULL;
-      double dPriority = 0;
-      int64_t nTotalIn = 0;
-      bool fMissingInputs = false;
-      BOOST_FOREACH(const CTxIn& txin, tx.vin)
-      {
-        // Read prev transaction
-        if (!view.HaveCoins(txin.prevout.hash))
-        {
-          // This should never happen; all transactions in the memory
-          // pool should connect to either transactions in the chain
-          // or other transactions in the memory pool.
-          if (!mempool.mapTx.count(txin.prevout.hash))
-          {
-            LogPrintf("ERROR: mempool transaction missing input\n");
-            if (fDebug) assert("mempool transaction missing input" == 0);
-            fMissingInputs = true;
-            if (porphan)
-            vOrphan.pop_back();
-            break;
-          }
-
-          // Has to wait for dependencies
-          if (!porphan)
-          {
-            // Use list for automatic deletion
-            vOrphan.push_back(COrphan(&tx));
-            porphan = &vOrphan.back();
-          }
-          mapDependers[txin.prevout.hash].push_back(porphan);
-          porphan->setDependsOn.insert(txin.prevout.hash);
-          nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-          continue;
-        }
-        const CCoins &coins = view.GetCoins(txin.prevout.hash);
-
-        int64_t nValueIn = coins.vout[txin.prevout.n].nValue;
-        nTotalIn += nValueIn;
+      std::vector<TxCoinAgePriority> vecPriority;
+      vecPriority.reserve(mempool.mapTx.size());
+      for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        vecPriority.push_back(TxCoinAgePriority(mi->GetPriority(pindexPrev->nHeight + 1), mi));
+      std::sort(vecPriority.begin(), vecPriority.end(), TxCoinAgePriorityCompare());
 
-        int nConf = pindexPrev->nHeight - coins.nHeight + 1;
-
-        dPriority += (double)nValueIn * nConf;
-      }
-      if (fMissingInputs) continue;
-
-      // Priority is sum(valuein * age) / modified_txsize
-      unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-      dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-      // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-      // client code rounds up the size to the nearest 1K. That's good, because it gives an
-      // incentive to create smaller transactions.
-      double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
-
-      if (porphan)
+      BOOST_FOREACH(const TxCoinAgePriority& priority, vecPriority)
       {
-        porphan->dPriority = dPriority;
-        porphan->dFeePerKb = dFeePerKb;
+        if (collector.nBlockSize >= nBlockPrioritySize || !AllowFree(priority.first))
+          break;
+        if (!collector.Tried(priority.second))
+          collector.AddWithAncestors(priority.second);
       }
-      else
-      vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &mi->second.GetTx()));
     }
 
-    // Collect transactions into block
-    uint64_t nBlockSize = 1000;
-    uint64_t nBlockTx = 0;
-    int nBlockSigOps = 100;
-    bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-    TxPriorityCompare comparer(fSortedByFee);
-    std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-    while (!vecPriority.empty())
+    // Then by fee rate, each transaction together with the ancestors it
+    // needs, straight from the pool's ancestor score index. Scores of
+    // transactions whose ancestors are already in the block are not raised
+    // to account for that, they are just tried in the order the pool keeps.
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
+    for (; mi != mempool.mapTx.get<ancestor_score>().end(); ++mi)
     {
-      // Take highest priority transaction off the priority queue:
-      double dPriority = vecPriority.front().get<0>();
-      double dFeePerKb = vecPriority.front().get<1>();
-      const CTransaction& tx = *(vecPriority.front().get<2>());
-
-      std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-      vecPriority.pop_back();
-
-      // Size limits
-      unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-      if (nBlockSize + nTxSize >= nBlockMaxSize)
-      continue;
-
-      unsigned int maxBlockSigops=maxBlockSize/50;
-
-      // Legacy limits on sigOps:
-      unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-      if (nBlockSigOps + nTxSigOps >= maxBlockSigops)
-      {
-        continue;
-      }
-      // Skip free transactions if we're past the minimum block size:
-
-      // Prioritize by fee once past the priority size or we run out of high-priority
-      // transactions:
-      if (!fSortedByFee && ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
-      {
-        fSortedByFee = true;
-        comparer = TxPriorityCompare(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-      }
-
-      if (!view.HaveInputs(tx))
-      {
-        continue;
-      }
-
-      int64_t nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
-
-      nTxSigOps += GetP2SHSigOpCount(tx, view);
-      if (nBlockSigOps + nTxSigOps >= maxBlockSigops)
-      {
-        continue;
-      }
-
-      CValidationState state;
-      if (!CheckInputs(tx, state, view, true, SCRIPT_VERIFY_P2SH))
-      {
-        continue;
-      }
-
-      CTxUndo txundo;
-      uint256 hash = tx.GetHash();
-      UpdateCoins(tx, state, view, txundo, pindexPrev->nHeight+1, hash);
-
-      // Added
-      pblock->vtx.push_back(tx);
-      pblocktemplate->vTxFees.push_back(nTxFees);
-      pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-      nBlockSize += nTxSize;
-      ++nBlockTx;
-      nBlockSigOps += nTxSigOps;
-      nFees += nTxFees;
-
-      if (fPrintPriority)
-      {
-        LogPrintf("priority %.1f feeperkb %.1f txid %s\n",dPriority, dFeePerKb, tx.GetHash().ToString());
-      }
-
-      // Add transactions that depend on this one to the priority queue
-      if (mapDependers.count(hash))
-      {
-        BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-        {
-          if (!porphan->setDependsOn.empty())
-          {
-            porphan->setDependsOn.erase(hash);
-            if (porphan->setDependsOn.empty())
-            {
-              vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-              std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-          }
-        }
-      }
+      CTxMemPool::txiter iter = mempool.mapTx.project<0>(mi);
+      if (!collector.Tried(iter))
+        collector.AddWithAncestors(iter);
     }
 
-    nLastBlockTx = nBlockTx;
-    nLastBlockSize = nBlockSize;
-    LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
+    nFees = collector.nFees;
+    nLastBlockTx = collector.nBlockTx;
+    nLastBlockSize = collector.nBlockSize;
+    LogPrintf("CreateNewBlock(): total size %u\n", collector.nBlockSize);
 
     pblock->vtx[0].vout[0].nValue = GetBlockValue(pindexPrev->nHeight+1, nFees);
     pblocktemplate->vTxFees[0] = -nFees;
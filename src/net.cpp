@@ -14,6 +14,8 @@
 #include "core.h"
 #include "ui_interface.h"
 
+#include <math.h>
+
 #ifdef WIN32
 #include <string.h>
 #else
@@ -421,10 +423,10 @@ void AddressCurrentlyConnected(const CService& addr)
 
 
 
-uint64_t CNode::nTotalBytesRecv = 0;
-uint64_t CNode::nTotalBytesSent = 0;
-CCriticalSection CNode::cs_totalBytesRecv;
-CCriticalSection CNode::cs_totalBytesSent;
+boost::atomic<uint64_t> CNode::nTotalBytesRecv(0);
+boost::atomic<uint64_t> CNode::nTotalBytesSent(0);
+CNetMsgCounter CNode::vTotalSentPerMsgType[NET_MSG_TYPE_COUNT];
+CNetMsgCounter CNode::vTotalRecvPerMsgType[NET_MSG_TYPE_COUNT];
 
 CNode* FindNode(const CNetAddr& ip)
 {
@@ -589,6 +591,19 @@ bool CNode::Ban(const CNetAddr &addr) {
 
 #undef X
 #define X(name) stats.name = name
+static void CopyMsgTypeStats(const CNetMsgCounter* vCounters, mapMsgTypeStats& mapStats)
+{
+    mapStats.clear();
+    for (unsigned int i = 0; i < NET_MSG_TYPE_COUNT; i++) {
+        CNetMsgTypeStats stats;
+        stats.nMsgs = vCounters[i].nMsgs.load(boost::memory_order_relaxed);
+        if (stats.nMsgs == 0)
+            continue;
+        stats.nBytes = vCounters[i].nBytes.load(boost::memory_order_relaxed);
+        mapStats[ppszNetMsgType[i]] = stats;
+    }
+}
+
 void CNode::copyStats(CNodeStats &stats)
 {
     stats.nodeid = this->GetId();
@@ -603,6 +618,11 @@ void CNode::copyStats(CNodeStats &stats)
     X(nStartingHeight);
     X(nSendBytes);
     X(nRecvBytes);
+    X(nSendCalls);
+    stats.nSendQueueMsgs = nSendQueueMsgs;
+    stats.nSendQueueBytes = nSendSize;
+    CopyMsgTypeStats(vSentPerMsgType, stats.mapSentPerMsgType);
+    CopyMsgTypeStats(vRecvPerMsgType, stats.mapRecvPerMsgType);
     stats.fSyncNode = (this == pnodeSync);
 
     // It is common for nodes with good ping times to suddenly become lagged,
@@ -647,6 +667,9 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         if (handled < 0)
                 return false;
 
+        if (msg.complete())
+            RecordMsgRecv(GetNetMsgType(msg.hdr.pchCommand), CMessageHeader::HEADER_SIZE + msg.hdr.nMessageSize);
+
         pch += handled;
         nBytes -= handled;
     }
@@ -681,7 +704,10 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 
     // switch state to reading message data
     in_data = true;
-    vRecv.resize(hdr.nMessageSize);
+
+    // Reserve (without zero-filling) the whole body at once, so that appending
+    // the data as it arrives never reallocates and copies the buffer.
+    vRecv.reserve(std::min(hdr.nMessageSize, MAX_RECV_RESERVE_SIZE));
 
     return nCopy;
 }
@@ -691,7 +717,7 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
+    vRecv.write(pch, nCopy);
     nDataPos += nCopy;
 
     return nCopy;
@@ -705,26 +731,70 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
 
 
+// requires LOCK(cs_vSend)
+// Hand as much of the send queue, starting at it, to the kernel as one
+// system call allows. nGathered is set to the number of bytes offered.
+static int SocketSendGather(CNode *pnode, std::deque<CSerializeData>::iterator it, size_t& nGathered)
+{
+#ifdef WIN32
+    const CSerializeData &data = *it;
+    nGathered = data.size() - pnode->nSendOffset;
+    return send(pnode->hSocket, &data[pnode->nSendOffset], nGathered, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+    struct iovec iov[MAX_SEND_GATHER_BUFFERS];
+    size_t nOffset = pnode->nSendOffset;
+    int nBuffers = 0;
+    nGathered = 0;
+    for (; it != pnode->vSendMsg.end() && nBuffers < MAX_SEND_GATHER_BUFFERS && nGathered < MAX_SEND_GATHER_SIZE; it++) {
+        CSerializeData &data = *it;
+        assert(data.size() > nOffset);
+        iov[nBuffers].iov_base = &data[nOffset];
+        iov[nBuffers].iov_len = data.size() - nOffset;
+        nGathered += iov[nBuffers].iov_len;
+        nBuffers++;
+        nOffset = 0;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = nBuffers;
+    return sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+}
+
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
     std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        size_t nGathered = 0;
+        int nBytes = SocketSendGather(pnode, it, nGathered);
+        pnode->nSendCalls++;
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+
+            // drop the buffers that went out completely
+            size_t nSent = nBytes;
+            while (nSent > 0) {
+                const CSerializeData &data = *it;
+                size_t nLeft = data.size() - pnode->nSendOffset;
+                if (nSent < nLeft) {
+                    pnode->nSendOffset += nSent;
+                    break;
+                }
+                nSent -= nLeft;
                 pnode->nSendOffset = 0;
                 pnode->nSendSize -= data.size();
+                pnode->nSendQueueMsgs--;
                 it++;
-            } else {
-                // could not send full message; stop sending more
+            }
+
+            if ((size_t)nBytes < nGathered) {
+                // could not send everything offered; the socket buffer is full
                 break;
             }
         } else {
@@ -1852,28 +1922,48 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
     }
 }
 
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds)
+{
+    // -log(U) * mean for U uniform in (0, 1], using 48 bits of randomness
+    return nNow + (int64_t)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * average_interval_seconds * -1000000.0 + 0.5);
+}
+
 void CNode::RecordBytesRecv(uint64_t bytes)
 {
-    LOCK(cs_totalBytesRecv);
-    nTotalBytesRecv += bytes;
+    nTotalBytesRecv.fetch_add(bytes, boost::memory_order_relaxed);
 }
 
 void CNode::RecordBytesSent(uint64_t bytes)
 {
-    LOCK(cs_totalBytesSent);
-    nTotalBytesSent += bytes;
+    nTotalBytesSent.fetch_add(bytes, boost::memory_order_relaxed);
+}
+
+void CNode::RecordMsgRecv(unsigned int nMsgType, uint64_t bytes)
+{
+    vRecvPerMsgType[nMsgType].Record(bytes);
+    vTotalRecvPerMsgType[nMsgType].Record(bytes);
+}
+
+void CNode::RecordMsgSent(unsigned int nMsgType, uint64_t bytes)
+{
+    vSentPerMsgType[nMsgType].Record(bytes);
+    vTotalSentPerMsgType[nMsgType].Record(bytes);
 }
 
 uint64_t CNode::GetTotalBytesRecv()
 {
-    LOCK(cs_totalBytesRecv);
-    return nTotalBytesRecv;
+    return nTotalBytesRecv.load(boost::memory_order_relaxed);
 }
 
 uint64_t CNode::GetTotalBytesSent()
 {
-    LOCK(cs_totalBytesSent);
-    return nTotalBytesSent;
+    return nTotalBytesSent.load(boost::memory_order_relaxed);
+}
+
+void CNode::GetTotalMsgTypeStats(mapMsgTypeStats& mapRecv, mapMsgTypeStats& mapSent)
+{
+    CopyMsgTypeStats(vTotalRecvPerMsgType, mapRecv);
+    CopyMsgTypeStats(vTotalSentPerMsgType, mapSent);
 }
 
 void CNode::Fuzz(int nChance)
@@ -18,12 +18,14 @@
 #include "util.h"
 
 #include <deque>
+#include <limits>
 #include <stdint.h>
 
 #ifndef WIN32
 #include <arpa/inet.h>
 #endif
 
+#include <boost/atomic.hpp>
 #include <boost/foreach.hpp>
 #include <boost/signals2/signal.hpp>
 #include <openssl/rand.h>
@@ -38,6 +40,23 @@ namespace boost {
 
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
+/** Messages up to this size get their whole receive buffer reserved as soon as
+ *  the header arrives; larger ones grow with the data actually received, so a
+ *  peer can't make us allocate MAX_SIZE by just sending a header. */
+static const unsigned int MAX_RECV_RESERVE_SIZE = 2 * 1000 * 1000;
+
+/** Limits on how much of the send queue is handed to the kernel in one call */
+static const unsigned int MAX_SEND_GATHER_SIZE = 256 * 1024;
+static const int MAX_SEND_GATHER_BUFFERS = 64;
+/** Number of recent inventory items remembered per peer so they aren't announced back to it */
+static const unsigned int MAX_INVENTORY_KNOWN = 5000;
+/** Maximum number of transaction announcements queued per peer; further ones are dropped */
+static const unsigned int MAX_INVENTORY_TX_QUEUE = 5000;
+/** Average delay in seconds between transaction announcement batches to inbound peers
+ *  (outbound peers get theirs twice as often) */
+static const int INVENTORY_BROADCAST_INTERVAL = 5;
+/** Maximum number of pending getdata requests per peer */
+static const unsigned int MAX_ASKFOR_QUEUE = MAX_INV_SZ;
 
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
@@ -124,6 +143,32 @@ struct LocalServiceInfo {
 extern CCriticalSection cs_mapLocalHost;
 extern std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 
+/** Lock-free traffic counters for one message type */
+class CNetMsgCounter
+{
+public:
+    boost::atomic<uint64_t> nBytes;
+    boost::atomic<uint64_t> nMsgs;
+
+    CNetMsgCounter() : nBytes(0), nMsgs(0) {}
+
+    void Record(uint64_t bytes)
+    {
+        nBytes.fetch_add(bytes, boost::memory_order_relaxed);
+        nMsgs.fetch_add(1, boost::memory_order_relaxed);
+    }
+};
+
+/** Snapshot of a CNetMsgCounter */
+struct CNetMsgTypeStats
+{
+    uint64_t nBytes;
+    uint64_t nMsgs;
+};
+
+/** Non-zero message type counters, by command */
+typedef std::map<std::string, CNetMsgTypeStats> mapMsgTypeStats;
+
 class CNodeStats
 {
 public:
@@ -139,6 +184,11 @@ public:
     int nStartingHeight;
     uint64_t nSendBytes;
     uint64_t nRecvBytes;
+    uint64_t nSendCalls;
+    size_t nSendQueueMsgs;
+    size_t nSendQueueBytes;
+    mapMsgTypeStats mapSentPerMsgType;
+    mapMsgTypeStats mapRecvPerMsgType;
     bool fSyncNode;
     double dPingTime;
     double dPingWait;
@@ -156,7 +206,7 @@ public:
     CMessageHeader hdr;             // complete header
     unsigned int nHdrPos;
 
-    CDataStream vRecv;              // received message data
+    CDataStream vRecv;              // received message data, deserialized in place by ProcessMessage
     unsigned int nDataPos;
 
     CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn) {
@@ -191,18 +241,26 @@ public:
     uint64_t nServices;
     SOCKET hSocket;
     CDataStream ssSend;
-    size_t nSendSize; // total size of all vSendMsg entries
+    boost::atomic<size_t> nSendSize; // total size of all vSendMsg entries
+    boost::atomic<size_t> nSendQueueMsgs; // number of vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
-    uint64_t nSendBytes;
+    boost::atomic<uint64_t> nSendBytes;
+    boost::atomic<uint64_t> nSendCalls; // number of send system calls made
+    unsigned int nSendMsgType; // type of the message being built in ssSend
     std::deque<CSerializeData> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
-    uint64_t nRecvBytes;
+    boost::atomic<uint64_t> nRecvBytes;
     int nRecvVersion;
 
+    // Traffic per message type, indexed by GetNetMsgType(). Updated by the
+    // socket and message handler threads and read by getpeerinfo without locks.
+    CNetMsgCounter vSentPerMsgType[NET_MSG_TYPE_COUNT];
+    CNetMsgCounter vRecvPerMsgType[NET_MSG_TYPE_COUNT];
+
     int64_t nLastSend;
     int64_t nLastRecv;
     int64_t nLastSendEmpty;
@@ -256,8 +314,12 @@ public:
     std::set<uint256> setKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
-    std::vector<CInv> vInventoryToSend;
+    CRollingBloomFilter filterInventoryKnown;
+    // Blocks are announced on the next SendMessages pass, transactions are
+    // batched until nNextInvSend.
+    std::vector<CInv> vInventoryBlockToSend;
+    std::vector<CInv> vInventoryTxToSend;
+    int64_t nNextInvSend;
     CCriticalSection cs_inventory;
     std::multimap<int64_t, CInv> mapAskFor;
 
@@ -267,7 +329,7 @@ public:
     int64_t nPingUsecTime;
     bool fPingQueued;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000), filterInventoryKnown(MAX_INVENTORY_KNOWN, 0.000001, GetRandInt(std::numeric_limits<int>::max()))
     {
         nServices = 0;
         hSocket = hSocketIn;
@@ -275,6 +337,8 @@ public:
         nLastSend = 0;
         nLastRecv = 0;
         nSendBytes = 0;
+        nSendCalls = 0;
+        nSendMsgType = NET_MSG_TYPE_OTHER;
         nRecvBytes = 0;
         nLastSendEmpty = GetTime();
         nTimeConnected = GetTime();
@@ -290,6 +354,7 @@ public:
         fDisconnect = false;
         nRefCount = 0;
         nSendSize = 0;
+        nSendQueueMsgs = 0;
         nSendOffset = 0;
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
@@ -298,7 +363,7 @@ public:
         fStartSync = false;
         fGetAddr = false;
         fRelayTxes = false;
-        setInventoryKnown.max_size(SendBufferSize() / 1000);
+        nNextInvSend = 0;
         pfilter = new CBloomFilter();
         nPingNonceSent = 0;
         nPingUsecStart = 0;
@@ -331,10 +396,10 @@ public:
 
 private:
     // Network usage totals
-    static CCriticalSection cs_totalBytesRecv;
-    static CCriticalSection cs_totalBytesSent;
-    static uint64_t nTotalBytesRecv;
-    static uint64_t nTotalBytesSent;
+    static boost::atomic<uint64_t> nTotalBytesRecv;
+    static boost::atomic<uint64_t> nTotalBytesSent;
+    static CNetMsgCounter vTotalSentPerMsgType[NET_MSG_TYPE_COUNT];
+    static CNetMsgCounter vTotalRecvPerMsgType[NET_MSG_TYPE_COUNT];
 
     CNode(const CNode&);
     void operator=(const CNode&);
@@ -352,6 +417,7 @@ public:
     }
 
     // requires LOCK(cs_vRecvMsg)
+    // Counts the bytes actually buffered, not the sizes announced in headers.
     unsigned int GetTotalRecvSize()
     {
         unsigned int total = 0;
@@ -403,7 +469,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
         }
     }
 
@@ -411,13 +477,22 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
-                vInventoryToSend.push_back(inv);
+            if (filterInventoryKnown.contains(inv.hash))
+                return;
+            if (inv.type != MSG_TX)
+                vInventoryBlockToSend.push_back(inv);
+            else if (vInventoryTxToSend.size() < MAX_INVENTORY_TX_QUEUE)
+                vInventoryTxToSend.push_back(inv);
+            else
+                LogPrint("net", "inventory queue full for peer=%d, dropping %s\n", id, inv.ToString());
         }
     }
 
     void AskFor(const CInv& inv)
     {
+        if (mapAskFor.size() >= MAX_ASKFOR_QUEUE)
+            return;
+
         // We're using mapAskFor as a priority queue,
         // the key is the earliest time the request can be sent
         int64_t nRequestTime;
@@ -452,6 +527,7 @@ public:
         ENTER_CRITICAL_SECTION(cs_vSend);
         assert(ssSend.size() == 0);
         ssSend << CMessageHeader(pszCommand, 0);
+        nSendMsgType = GetNetMsgType(pszCommand);
         LogPrint("net", "sending: %s ", pszCommand);
     }
 
@@ -496,9 +572,12 @@ public:
 
         LogPrint("net", "(%d bytes)\n", nSize);
 
+        RecordMsgSent(nSendMsgType, ssSend.size());
+
         std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
         ssSend.GetAndClear(*it);
         nSendSize += (*it).size();
+        nSendQueueMsgs++;
 
         // If write queue empty, attempt "optimistic write"
         if (it == vSendMsg.begin())
@@ -697,9 +776,13 @@ public:
     // Network stats
     static void RecordBytesRecv(uint64_t bytes);
     static void RecordBytesSent(uint64_t bytes);
+    // Account a complete message (header included) to its type
+    void RecordMsgRecv(unsigned int nMsgType, uint64_t bytes);
+    void RecordMsgSent(unsigned int nMsgType, uint64_t bytes);
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+    static void GetTotalMsgTypeStats(mapMsgTypeStats& mapRecv, mapMsgTypeStats& mapSent);
 };
 
 
@@ -708,6 +791,9 @@ class CTransaction;
 void RelayTransaction(const CTransaction& tx, const uint256& hash);
 void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss);
 
+/** Return a timestamp in the future (in microseconds) for exponentially distributed events. */
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds);
+
 /** Access to the (IP) address database (peers.dat) */
 class CAddrDB
 {
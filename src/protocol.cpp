@@ -19,6 +19,43 @@ static const char* ppszTypeName[] =
     "filtered block"
 };
 
+const char* const ppszNetMsgType[NET_MSG_TYPE_COUNT] =
+{
+    "version",
+    "verack",
+    "addr",
+    "getaddr",
+    "inv",
+    "getdata",
+    "notfound",
+    "getblocks",
+    "getheaders",
+    "headers",
+    "tx",
+    "block",
+    "merkleblock",
+    "cmpctblock",
+    "getblocktxn",
+    "blocktxn",
+    "mempool",
+    "ping",
+    "pong",
+    "alert",
+    "filterload",
+    "filteradd",
+    "filterclear",
+    "reject",
+    "*other*"
+};
+
+unsigned int GetNetMsgType(const char* pszCommand)
+{
+    for (unsigned int i = 0; i < NET_MSG_TYPE_OTHER; i++)
+        if (strncmp(pszCommand, ppszNetMsgType[i], CMessageHeader::COMMAND_SIZE) == 0)
+            return i;
+    return NET_MSG_TYPE_OTHER;
+}
+
 CMessageHeader::CMessageHeader()
 {
     memcpy(pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE);
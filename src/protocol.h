@@ -58,6 +58,16 @@ class CMessageHeader
         unsigned int nChecksum;
 };
 
+/** Message types counted separately in the per-message-type traffic
+ *  statistics; anything else is accounted under NET_MSG_TYPE_OTHER. */
+static const unsigned int NET_MSG_TYPE_COUNT = 25;
+static const unsigned int NET_MSG_TYPE_OTHER = NET_MSG_TYPE_COUNT - 1;
+extern const char* const ppszNetMsgType[NET_MSG_TYPE_COUNT];
+
+/** Index of a command in ppszNetMsgType, NET_MSG_TYPE_OTHER if unknown.
+ *  pszCommand needs not be null terminated if it is COMMAND_SIZE long. */
+unsigned int GetNetMsgType(const char* pszCommand);
+
 /** nServices flags */
 enum
 {
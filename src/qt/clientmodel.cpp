@@ -65,6 +65,19 @@ quint64 ClientModel::getTotalBytesSent() const
     return CNode::GetTotalBytesSent();
 }
 
+void ClientModel::getTotalBytesPerMsgType(QMap<QString, quint64> &mapRecv, QMap<QString, quint64> &mapSent) const
+{
+    mapMsgTypeStats mapRecvStats, mapSentStats;
+    CNode::GetTotalMsgTypeStats(mapRecvStats, mapSentStats);
+
+    mapRecv.clear();
+    mapSent.clear();
+    BOOST_FOREACH(const PAIRTYPE(std::string, CNetMsgTypeStats)& item, mapRecvStats)
+        mapRecv.insert(QString::fromStdString(item.first), item.second.nBytes);
+    BOOST_FOREACH(const PAIRTYPE(std::string, CNetMsgTypeStats)& item, mapSentStats)
+        mapSent.insert(QString::fromStdString(item.first), item.second.nBytes);
+}
+
 QDateTime ClientModel::getLastBlockDate() const
 {
     LOCK(cs_main);
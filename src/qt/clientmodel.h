@@ -5,6 +5,7 @@
 #ifndef CLIENTMODEL_H
 #define CLIENTMODEL_H
 
+#include <QMap>
 #include <QObject>
 
 class AddressTableModel;
@@ -50,6 +51,8 @@ public:
 
     quint64 getTotalBytesRecv() const;
     quint64 getTotalBytesSent() const;
+    //! Return total traffic per network message type (bytes, including headers)
+    void getTotalBytesPerMsgType(QMap<QString, quint64> &mapRecv, QMap<QString, quint64> &mapSent) const;
 
     double getVerificationProgress() const;
     QDateTime getLastBlockDate() const;
@@ -7,6 +7,8 @@
 
 #include <QPainter>
 #include <QColor>
+#include <QMap>
+#include <QStringList>
 #include <QTimer>
 
 #include <cmath>
@@ -144,9 +146,28 @@ void TrafficGraphWidget::updateRates()
         if(f > tmax) tmax = f;
     }
     fMax = tmax;
+    updateToolTip();
     update();
 }
 
+void TrafficGraphWidget::updateToolTip()
+{
+    QMap<QString, quint64> mapRecv, mapSent;
+    clientModel->getTotalBytesPerMsgType(mapRecv, mapSent);
+
+    QStringList types = mapRecv.keys() + mapSent.keys();
+    types.removeDuplicates();
+    types.sort();
+
+    QString tip = tr("Traffic by message type (in / out):");
+    foreach(const QString &type, types) {
+        tip += QString("\n%1: %2 KB / %3 KB").arg(type)
+            .arg(mapRecv.value(type) / 1024.0, 0, 'f', 1)
+            .arg(mapSent.value(type) / 1024.0, 0, 'f', 1);
+    }
+    setToolTip(tip);
+}
+
 void TrafficGraphWidget::setGraphRangeMins(int mins)
 {
     nMins = mins;
@@ -34,6 +34,7 @@ public slots:
 
 private:
     void paintPath(QPainterPath &path, QQueue<float> &samples);
+    void updateToolTip();
 
     QTimer *timer;
     float fMax;
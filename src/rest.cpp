@@ -0,0 +1,277 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "core.h"
+#include "main.h"
+#include "rpcserver.h"
+#include "sync.h"
+#include "util.h"
+
+#include <boost/algorithm/string.hpp>
+#include <boost/foreach.hpp>
+
+//
+// Read-only REST interface on the RPC port, enabled with -rest:
+//
+//   /rest/block/<hash>.<bin|hex|json>
+//   /rest/tx/<txid>.<bin|hex|json>
+//   /rest/headers/<count>/<hash>.<bin|hex|json>
+//
+// Unlike getblock/getrawtransaction, binary replies are the serialized
+// bytes as they are, without hex encoding or JSON wrapping.
+//
+
+enum RetFormat {
+    RF_BINARY,
+    RF_HEX,
+    RF_JSON,
+};
+
+static const struct {
+    enum RetFormat rf;
+    const char *name;
+    const char *contentType;
+} rf_names[] = {
+    { RF_BINARY, "bin",  "application/octet-stream" },
+    { RF_HEX,    "hex",  "text/plain" },
+    { RF_JSON,   "json", "application/json" },
+};
+
+/** Most headers returned by one /rest/headers request */
+static const unsigned int MAX_REST_HEADERS_RESULTS = 2000;
+
+/** Hex is written in slices of this many bytes, so it never has to be held whole */
+static const size_t REST_HEX_SLICE = 32 * 1024;
+
+class RestErr
+{
+public:
+    enum HTTPStatusCode status;
+    std::string message;
+};
+
+static RestErr RESTERR(enum HTTPStatusCode status, std::string message)
+{
+    RestErr re;
+    re.status = status;
+    re.message = message;
+    return re;
+}
+
+/** Split the ".<format>" suffix off the last path component */
+static enum RetFormat ParseDataFormat(std::string& strReq)
+{
+    size_t pos = strReq.rfind('.');
+    if (pos != std::string::npos)
+    {
+        std::string strFormat = strReq.substr(pos + 1);
+        for (unsigned int i = 0; i < ARRAYLEN(rf_names); i++)
+        {
+            if (strFormat == rf_names[i].name)
+            {
+                strReq.resize(pos);
+                return rf_names[i].rf;
+            }
+        }
+    }
+    throw RESTERR(HTTP_NOT_FOUND, "output format not found (available: bin, hex, json)");
+}
+
+static uint256 ParseHashStr(const std::string& strHash)
+{
+    if (strHash.size() != 64 || !IsHex(strHash))
+        throw RESTERR(HTTP_BAD_REQUEST, "Invalid hash: " + strHash);
+    return uint256(strHash);
+}
+
+/** Write raw bytes in the requested binary or hex form */
+static void WriteData(std::ostream& stream, enum RetFormat rf, const unsigned char* pch, size_t nSize, bool fKeepAlive)
+{
+    if (rf == RF_BINARY)
+    {
+        stream << HTTPReplyHeader(HTTP_OK, fKeepAlive, nSize, false, rf_names[RF_BINARY].contentType);
+        stream.write((const char*)pch, nSize);
+    }
+    else
+    {
+        // One line of hex, like getblock/getrawtransaction without the JSON around it
+        stream << HTTPReplyHeader(HTTP_OK, fKeepAlive, 2 * nSize + 1, false, rf_names[RF_HEX].contentType);
+        for (size_t nPos = 0; nPos < nSize; nPos += REST_HEX_SLICE)
+            stream << HexStr(pch + nPos, pch + std::min(nSize, nPos + REST_HEX_SLICE));
+        stream << "\n";
+    }
+    stream << std::flush;
+}
+
+static void WriteJSON(std::ostream& stream, const json_spirit::Value& val, bool fKeepAlive)
+{
+    stream << HTTPReply(HTTP_OK, write_string(val, false) + "\n", fKeepAlive, rf_names[RF_JSON].contentType) << std::flush;
+}
+
+static const CBlockIndex* LookupBlockIndex(const uint256& hash)
+{
+    LOCK(cs_main);
+    std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    if (mi == mapBlockIndex.end())
+        throw RESTERR(HTTP_NOT_FOUND, hash.GetHex() + " not found");
+    if (!(mi->second->nStatus & BLOCK_HAVE_DATA))
+        throw RESTERR(HTTP_NOT_FOUND, hash.GetHex() + " not available (pruned or not yet downloaded)");
+    // Block index entries are never deleted, the pointer stays valid after unlocking
+    return mi->second;
+}
+
+static void rest_block(std::iostream& stream, const std::vector<std::string>& vParams, bool fKeepAlive)
+{
+    if (vParams.size() != 1)
+        throw RESTERR(HTTP_BAD_REQUEST, "Invalid URI format. Expected /rest/block/<hash>.<ext>");
+
+    std::string strHash = vParams[0];
+    enum RetFormat rf = ParseDataFormat(strHash);
+    const CBlockIndex* pblockindex = LookupBlockIndex(ParseHashStr(strHash));
+
+    if (rf == RF_JSON)
+    {
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pblockindex))
+            throw RESTERR(HTTP_NOT_FOUND, strHash + " not found");
+
+        CHTTPReplyStreambuf reply(stream, HTTP_OK, fKeepAlive, false);
+        std::ostream osReply(&reply);
+        CJSONStreamWriter writer(osReply);
+        blockToJSON(block, pblockindex, writer);
+        osReply << "\n";
+        reply.Finish();
+        return;
+    }
+
+    // The bytes go out as they are stored, no deserializing and reserializing
+    std::vector<unsigned char> vchBlock;
+    if (!ReadRawBlockFromDisk(vchBlock, pblockindex))
+        throw RESTERR(HTTP_NOT_FOUND, strHash + " not found");
+    WriteData(stream, rf, &vchBlock[0], vchBlock.size(), fKeepAlive);
+}
+
+static void rest_tx(std::iostream& stream, const std::vector<std::string>& vParams, bool fKeepAlive)
+{
+    if (vParams.size() != 1)
+        throw RESTERR(HTTP_BAD_REQUEST, "Invalid URI format. Expected /rest/tx/<txid>.<ext>");
+
+    std::string strHash = vParams[0];
+    enum RetFormat rf = ParseDataFormat(strHash);
+    uint256 hash = ParseHashStr(strHash);
+
+    CTransaction tx;
+    uint256 hashBlock = 0;
+    if (!GetTransaction(hash, tx, hashBlock, true))
+        throw RESTERR(HTTP_NOT_FOUND, hash.GetHex() + " not found");
+
+    if (rf == RF_JSON)
+    {
+        json_spirit::Object objTx;
+        TxToJSON(tx, hashBlock, objTx);
+        WriteJSON(stream, objTx, fKeepAlive);
+        return;
+    }
+
+    CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+    ssTx << tx;
+    WriteData(stream, rf, (const unsigned char*)&ssTx[0], ssTx.size(), fKeepAlive);
+}
+
+static void rest_headers(std::iostream& stream, const std::vector<std::string>& vParams, bool fKeepAlive)
+{
+    if (vParams.size() != 2)
+        throw RESTERR(HTTP_BAD_REQUEST, "Invalid URI format. Expected /rest/headers/<count>/<hash>.<ext>");
+
+    long nCount = strtol(vParams[0].c_str(), NULL, 10);
+    if (nCount < 1 || nCount > (long)MAX_REST_HEADERS_RESULTS)
+        throw RESTERR(HTTP_BAD_REQUEST, strprintf("Header count out of range: %s", vParams[0]));
+
+    std::string strHash = vParams[1];
+    enum RetFormat rf = ParseDataFormat(strHash);
+    uint256 hash = ParseHashStr(strHash);
+
+    // Headers of the active chain, starting at hash
+    std::vector<const CBlockIndex*> vHeaders;
+    vHeaders.reserve(nCount);
+    {
+        LOCK(cs_main);
+        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        const CBlockIndex* pindex = (mi != mapBlockIndex.end()) ? mi->second : NULL;
+        while (pindex != NULL && chainActive.Contains(pindex))
+        {
+            vHeaders.push_back(pindex);
+            if (vHeaders.size() == (unsigned long)nCount)
+                break;
+            pindex = chainActive.Next(pindex);
+        }
+    }
+
+    if (rf == RF_JSON)
+    {
+        json_spirit::Array jsonHeaders;
+        BOOST_FOREACH(const CBlockIndex *pindex, vHeaders)
+        {
+            json_spirit::Object header;
+            header.push_back(json_spirit::Pair("hash", pindex->GetBlockHash().GetHex()));
+            header.push_back(json_spirit::Pair("height", pindex->nHeight));
+            header.push_back(json_spirit::Pair("version", pindex->nVersion));
+            header.push_back(json_spirit::Pair("merkleroot", pindex->hashMerkleRoot.GetHex()));
+            header.push_back(json_spirit::Pair("time", (int64_t)pindex->nTime));
+            header.push_back(json_spirit::Pair("nonce", (uint64_t)pindex->nNonce));
+            header.push_back(json_spirit::Pair("bits", HexBits(pindex->nBits)));
+            header.push_back(json_spirit::Pair("chainwork", pindex->nChainWork.GetHex()));
+            if (pindex->pprev)
+                header.push_back(json_spirit::Pair("previousblockhash", pindex->pprev->GetBlockHash().GetHex()));
+            jsonHeaders.push_back(header);
+        }
+        WriteJSON(stream, jsonHeaders, fKeepAlive);
+        return;
+    }
+
+    CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_FOREACH(const CBlockIndex *pindex, vHeaders)
+        ssHeader << pindex->GetBlockHeader();
+    WriteData(stream, rf, (const unsigned char*)(ssHeader.empty() ? NULL : &ssHeader[0]), ssHeader.size(), fKeepAlive);
+}
+
+static const struct {
+    const char *prefix;
+    void (*handler)(std::iostream& stream, const std::vector<std::string>& vParams, bool fKeepAlive);
+} uri_prefixes[] = {
+    { "/rest/block/",   rest_block },
+    { "/rest/tx/",      rest_tx },
+    { "/rest/headers/", rest_headers },
+};
+
+bool HTTPReq_REST(std::iostream& stream, const std::string& strURI, bool fKeepAlive)
+{
+    try
+    {
+        for (unsigned int i = 0; i < ARRAYLEN(uri_prefixes); i++)
+        {
+            if (!boost::algorithm::starts_with(strURI, uri_prefixes[i].prefix))
+                continue;
+
+            std::vector<std::string> vParams;
+            std::string strParams = strURI.substr(strlen(uri_prefixes[i].prefix));
+            boost::split(vParams, strParams, boost::is_any_of("/"));
+            uri_prefixes[i].handler(stream, vParams, fKeepAlive);
+            return true;
+        }
+        throw RESTERR(HTTP_NOT_FOUND, "not found");
+    }
+    catch (RestErr& re)
+    {
+        stream << HTTPReply(re.status, re.message + "\r\n", fKeepAlive, "text/plain") << std::flush;
+        return true;
+    }
+    catch (std::exception& e)
+    {
+        // Possibly in the middle of a reply, all we can do is hang up
+        LogPrintf("REST request %s failed: %s\n", strURI, e.what());
+        return false;
+    }
+}
@@ -58,37 +58,54 @@ double GetDifficulty(const CBlockIndex* blockindex, int algo)
 }
 
 
-json_spirit::Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex)
+void blockToJSON(const CBlock& block, const CBlockIndex* blockindex, CJSONWriter& writer)
 {
-    json_spirit::Object result;
-    result.push_back(json_spirit::Pair("hash", block.GetHash().GetHex()));
-    CMerkleTx txGen(block.vtx[0]);
-    txGen.SetMerkleBranch(&block);
-    result.push_back(json_spirit::Pair("confirmations", (int)txGen.GetDepthInMainChain()));
-    result.push_back(json_spirit::Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION)));
-    result.push_back(json_spirit::Pair("height", blockindex->nHeight));
-    result.push_back(json_spirit::Pair("version", block.nVersion));
+    // Only these depend on the current chain, the rest can be written
+    // out without holding cs_main.
+    int nConfirmations;
+    const CBlockIndex *pnext;
+    {
+        RPC_LOCK(cs_main);
+        CMerkleTx txGen(block.vtx[0]);
+        txGen.SetMerkleBranch(&block);
+        nConfirmations = txGen.GetDepthInMainChain();
+        pnext = chainActive.Next(blockindex);
+    }
+
+    writer.beginObject();
+    writer.pair("hash", block.GetHash().GetHex());
+    writer.pair("confirmations", nConfirmations);
+    writer.pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    writer.pair("height", blockindex->nHeight);
+    writer.pair("version", block.nVersion);
     int algo = block.GetAlgo();
-    result.push_back(json_spirit::Pair("pow_algo_id", algo));
-    result.push_back(json_spirit::Pair("pow_algo", GetAlgoName(algo)));
-    result.push_back(json_spirit::Pair("pow_hash", block.GetPoWHash(algo).GetHex()));
-    result.push_back(json_spirit::Pair("merkleroot", block.hashMerkleRoot.GetHex()));
-    json_spirit::Array txs;
+    writer.pair("pow_algo_id", algo);
+    writer.pair("pow_algo", GetAlgoName(algo));
+    writer.pair("pow_hash", block.GetPoWHash(algo).GetHex());
+    writer.pair("merkleroot", block.hashMerkleRoot.GetHex());
+    writer.key("tx");
+    writer.beginArray();
     BOOST_FOREACH(const CTransaction&tx, block.vtx)
-        txs.push_back(tx.GetHash().GetHex());
-    result.push_back(json_spirit::Pair("tx", txs));
-    result.push_back(json_spirit::Pair("time", block.GetBlockTime()));
-    result.push_back(json_spirit::Pair("nonce", (uint64_t)block.nNonce));
-    result.push_back(json_spirit::Pair("bits", HexBits(block.nBits)));
-    result.push_back(json_spirit::Pair("difficulty", GetDifficulty(blockindex, miningAlgo)));
-    result.push_back(json_spirit::Pair("chainwork", blockindex->nChainWork.GetHex()));
+        writer.value(tx.GetHash().GetHex());
+    writer.endArray();
+    writer.pair("time", block.GetBlockTime());
+    writer.pair("nonce", (uint64_t)block.nNonce);
+    writer.pair("bits", HexBits(block.nBits));
+    writer.pair("difficulty", GetDifficulty(blockindex, miningAlgo));
+    writer.pair("chainwork", blockindex->nChainWork.GetHex());
 
     if (blockindex->pprev)
-        result.push_back(json_spirit::Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
-    CBlockIndex *pnext = chainActive.Next(blockindex);
+        writer.pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex());
     if (pnext)
-        result.push_back(json_spirit::Pair("nextblockhash", pnext->GetBlockHash().GetHex()));
-    return result;
+        writer.pair("nextblockhash", pnext->GetBlockHash().GetHex());
+    writer.endObject();
+}
+
+json_spirit::Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex)
+{
+    CJSONValueWriter writer;
+    blockToJSON(block, blockindex, writer);
+    return writer.get().get_obj();
 }
 
 
@@ -105,6 +122,7 @@ json_spirit::Value getblockcount(const json_spirit::Array& params, bool fHelp)
             + HelpExampleRpc("getblockcount", "")
         );
 
+    RPC_LOCK(cs_main);
     return chainActive.Height();
 }
 
@@ -121,6 +139,7 @@ json_spirit::Value getbestblockhash(const json_spirit::Array& params, bool fHelp
             + HelpExampleRpc("getbestblockhash", "")
         );
 
+    RPC_LOCK(cs_main);
     return chainActive.Tip()->GetBlockHash().GetHex();
 }
 
@@ -137,6 +156,7 @@ json_spirit::Value getdifficulty(const json_spirit::Array& params, bool fHelp)
             + HelpExampleRpc("getdifficulty", "")
         );
 
+    RPC_LOCK(cs_main);
     return GetDifficulty(NULL, miningAlgo);
 }
 
@@ -163,6 +183,12 @@ json_spirit::Value getrawmempool(const json_spirit::Array& params, bool fHelp)
             "    \"height\" : n,           (numeric) block height when transaction entered pool\n"
             "    \"startingpriority\" : n, (numeric) priority when transaction entered pool\n"
             "    \"currentpriority\" : n,  (numeric) transaction priority now\n"
+            "    \"descendantcount\" : n,  (numeric) number of in-mempool descendant transactions (including this one)\n"
+            "    \"descendantsize\" : n,   (numeric) size of in-mempool descendants (including this one)\n"
+            "    \"descendantfees\" : n,   (numeric) fees of in-mempool descendants (including this one)\n"
+            "    \"ancestorcount\" : n,    (numeric) number of in-mempool ancestor transactions (including this one)\n"
+            "    \"ancestorsize\" : n,     (numeric) size of in-mempool ancestors (including this one)\n"
+            "    \"ancestorfees\" : n,     (numeric) fees of in-mempool ancestors (including this one)\n"
             "    \"depends\" : [           (array) unconfirmed transactions used as inputs for this transaction\n"
             "        \"transactionid\",    (string) parent transaction id\n"
             "       ... ]\n"
@@ -173,49 +199,147 @@ json_spirit::Value getrawmempool(const json_spirit::Array& params, bool fHelp)
             + HelpExampleRpc("getrawmempool", "true")
         );
 
+    CJSONValueWriter writer;
+    getrawmempool_stream(params, writer);
+    return writer.get();
+}
+
+/** A mempool entry getrawmempool reports, copied out of the pool */
+struct CMempoolEntryInfo
+{
+    uint256 hash;
+    unsigned int nSize;
+    int64_t nFee;
+    int64_t nTime;
+    unsigned int nHeight;
+    double dStartingPriority;
+    double dCurrentPriority;
+    uint64_t nCountWithDescendants;
+    uint64_t nSizeWithDescendants;
+    int64_t nFeesWithDescendants;
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    int64_t nFeesWithAncestors;
+    std::vector<uint256> vDepends;
+};
+
+static void mempoolEntryToJSON(const CMempoolEntryInfo& e, CJSONWriter& writer)
+{
+    writer.beginObject();
+    writer.pair("size", (int)e.nSize);
+    writer.pair("fee", ValueFromAmount(e.nFee));
+    writer.pair("time", e.nTime);
+    writer.pair("height", (int)e.nHeight);
+    writer.pair("startingpriority", e.dStartingPriority);
+    writer.pair("currentpriority", e.dCurrentPriority);
+    writer.pair("descendantcount", e.nCountWithDescendants);
+    writer.pair("descendantsize", e.nSizeWithDescendants);
+    writer.pair("descendantfees", ValueFromAmount(e.nFeesWithDescendants));
+    writer.pair("ancestorcount", e.nCountWithAncestors);
+    writer.pair("ancestorsize", e.nSizeWithAncestors);
+    writer.pair("ancestorfees", ValueFromAmount(e.nFeesWithAncestors));
+    std::set<std::string> setDepends;
+    BOOST_FOREACH(const uint256& hash, e.vDepends)
+        setDepends.insert(hash.ToString());
+    writer.key("depends");
+    writer.beginArray();
+    BOOST_FOREACH(const std::string& strDepend, setDepends)
+        writer.value(strDepend);
+    writer.endArray();
+    writer.endObject();
+}
+
+void getrawmempool_stream(const json_spirit::Array& params, CJSONWriter& writer)
+{
+    if (params.size() > 1)
+        getrawmempool(params, true); // throws the usage text
+
     bool fVerbose = false;
     if (params.size() > 0)
         fVerbose = params[0].get_bool();
 
-    if (fVerbose)
+    if (!fVerbose)
     {
-        LOCK(mempool.cs);
-        json_spirit::Object o;
-        BOOST_FOREACH(const PAIRTYPE(uint256, CTxMemPoolEntry)& entry, mempool.mapTx)
+        std::vector<uint256> vtxid;
+        mempool.queryHashes(vtxid);
+
+        writer.beginArray();
+        BOOST_FOREACH(const uint256& hash, vtxid)
+            writer.value(hash.ToString());
+        writer.endArray();
+        return;
+    }
+
+    // The entries are copied out under the locks at once, so they are a
+    // consistent picture of the pool, as plain entries that take much less
+    // memory than their JSON objects. They are written out after the locks
+    // are released so a slow client doesn't hold up the pool.
+    std::vector<CMempoolEntryInfo> vEntries;
+    {
+        RPC_LOCK2(cs_main, mempool.cs);
+        vEntries.reserve(mempool.mapTx.size());
+        for (CTxMemPool::indexed_transaction_set::const_iterator it = mempool.mapTx.begin(); it != mempool.mapTx.end(); ++it)
         {
-            const uint256& hash = entry.first;
-            const CTxMemPoolEntry& e = entry.second;
-            json_spirit::Object info;
-            info.push_back(json_spirit::Pair("size", (int)e.GetTxSize()));
-            info.push_back(json_spirit::Pair("fee", ValueFromAmount(e.GetFee())));
-            info.push_back(json_spirit::Pair("time", e.GetTime()));
-            info.push_back(json_spirit::Pair("height", (int)e.GetHeight()));
-            info.push_back(json_spirit::Pair("startingpriority", e.GetPriority(e.GetHeight())));
-            info.push_back(json_spirit::Pair("currentpriority", e.GetPriority(chainActive.Height())));
-            const CTransaction& tx = e.GetTx();
-            std::set<std::string> setDepends;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            vEntries.push_back(CMempoolEntryInfo());
+            CMempoolEntryInfo& entry = vEntries.back();
+            entry.hash = it->GetHash();
+            entry.nSize = it->GetTxSize();
+            entry.nFee = it->GetFee();
+            entry.nTime = it->GetTime();
+            entry.nHeight = it->GetHeight();
+            entry.dStartingPriority = it->GetPriority(it->GetHeight());
+            entry.dCurrentPriority = it->GetPriority(chainActive.Height());
+            entry.nCountWithDescendants = it->GetCountWithDescendants();
+            entry.nSizeWithDescendants = it->GetSizeWithDescendants();
+            entry.nFeesWithDescendants = it->GetFeesWithDescendants();
+            entry.nCountWithAncestors = it->GetCountWithAncestors();
+            entry.nSizeWithAncestors = it->GetSizeWithAncestors();
+            entry.nFeesWithAncestors = it->GetFeesWithAncestors();
+            BOOST_FOREACH(const CTxIn& txin, it->GetTx().vin)
             {
                 if (mempool.exists(txin.prevout.hash))
-                    setDepends.insert(txin.prevout.hash.ToString());
+                    entry.vDepends.push_back(txin.prevout.hash);
             }
-            json_spirit::Array depends(setDepends.begin(), setDepends.end());
-            info.push_back(json_spirit::Pair("depends", depends));
-            o.push_back(json_spirit::Pair(hash.ToString(), info));
         }
-        return o;
     }
-    else
+
+    writer.beginObject();
+    BOOST_FOREACH(const CMempoolEntryInfo& entry, vEntries)
     {
-        std::vector<uint256> vtxid;
-        mempool.queryHashes(vtxid);
+        writer.key(entry.hash.ToString());
+        mempoolEntryToJSON(entry, writer);
+    }
+    writer.endObject();
+}
 
-        json_spirit::Array a;
-        BOOST_FOREACH(const uint256& hash, vtxid)
-            a.push_back(hash.ToString());
+json_spirit::Value getmempoolinfo(const json_spirit::Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw std::runtime_error(
+            "getmempoolinfo\n"
+            "\nReturns details on the active state of the transaction memory pool.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"size\": xxxxx,          (numeric) Current number of transactions\n"
+            "  \"bytes\": xxxxx,         (numeric) Sum of all transaction sizes\n"
+            "  \"usage\": xxxxx,         (numeric) Total memory usage for the mempool\n"
+            "  \"maxmempool\": xxxxx,    (numeric) Maximum memory usage for the mempool\n"
+            "  \"mempoolminfee\": xxxxx  (numeric) Minimum fee per kB for a transaction to be accepted\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getmempoolinfo", "")
+            + HelpExampleRpc("getmempoolinfo", "")
+        );
 
-        return a;
-    }
+    size_t nMaxMempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+
+    json_spirit::Object ret;
+    ret.push_back(json_spirit::Pair("size", (int64_t)mempool.size()));
+    ret.push_back(json_spirit::Pair("bytes", (int64_t)mempool.GetTotalTxSize()));
+    ret.push_back(json_spirit::Pair("usage", (int64_t)mempool.DynamicMemoryUsage()));
+    ret.push_back(json_spirit::Pair("maxmempool", (int64_t)nMaxMempool));
+    ret.push_back(json_spirit::Pair("mempoolminfee", ValueFromAmount(mempool.GetMinFeeRate(nMaxMempool))));
+    return ret;
 }
 
 json_spirit::Value getblockhash(const json_spirit::Array& params, bool fHelp)
@@ -234,6 +358,7 @@ json_spirit::Value getblockhash(const json_spirit::Array& params, bool fHelp)
         );
 
     int nHeight = params[0].get_int();
+    RPC_LOCK(cs_main);
     if (nHeight < 0 || nHeight > chainActive.Height())
         throw std::runtime_error("Block number out of range.");
 
@@ -277,6 +402,16 @@ json_spirit::Value getblock(const json_spirit::Array& params, bool fHelp)
             + HelpExampleRpc("getblock", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\"")
         );
 
+    CJSONValueWriter writer;
+    getblock_stream(params, writer);
+    return writer.get();
+}
+
+void getblock_stream(const json_spirit::Array& params, CJSONWriter& writer)
+{
+    if (params.size() < 1 || params.size() > 2)
+        getblock(params, true); // throws the usage text
+
     std::string strHash = params[0].get_str();
     uint256 hash(strHash);
 
@@ -284,31 +419,42 @@ json_spirit::Value getblock(const json_spirit::Array& params, bool fHelp)
     if (params.size() > 1)
         fVerbose = params[1].get_bool();
 
-    if (mapBlockIndex.count(hash) == 0)
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
-
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
-    ReadBlockFromDisk(block, pblockindex);
+    CBlockIndex* pblockindex;
+    {
+        RPC_LOCK(cs_main);
+        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+        pblockindex = mi->second;
+    }
+    // Block files are only appended to, and index entries never go away,
+    // so the block itself can be read without holding cs_main.
+    if (!ReadBlockFromDisk(block, pblockindex))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
 
     if (!fVerbose)
     {
         CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
         ssBlock << block;
-        std::string strHex = HexStr(ssBlock.begin(), ssBlock.end());
-        return strHex;
+        writer.value(HexStr(ssBlock.begin(), ssBlock.end()));
+        return;
     }
 
-    return blockToJSON(block, pblockindex);
+    blockToJSON(block, pblockindex, writer);
 }
 
 json_spirit::Value gettxoutsetinfo(const json_spirit::Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw std::runtime_error(
-            "gettxoutsetinfo\n"
+            "gettxoutsetinfo ( fullscan )\n"
             "\nReturns statistics about the unspent transaction output set.\n"
-            "Note this call may take some time.\n"
+            "By default these are the statistics kept up to date as blocks are connected\n"
+            "and disconnected, which are returned at once. A full scan recomputes them from\n"
+            "the whole set instead; note that may take some time.\n"
+            "\nArguments:\n"
+            "1. fullscan    (boolean, optional, default=false) Scan the whole set, and include hash_serialized\n"
             "\nResult:\n"
             "{\n"
             "  \"height\":n,     (numeric) The current block height (index)\n"
@@ -316,24 +462,46 @@ json_spirit::Value gettxoutsetinfo(const json_spirit::Array& params, bool fHelp)
             "  \"transactions\": n,      (numeric) The number of transactions\n"
             "  \"txouts\": n,            (numeric) The number of output transactions\n"
             "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
-            "  \"hash_serialized\": \"hash\",   (string) The serialized hash\n"
+            "  \"hash_serialized\": \"hash\",   (string) The serialized hash (full scan only)\n"
+            "  \"hash_multiset\": \"hash\",     (string) Order independent hash of the set, the same either way\n"
             "  \"total_amount\": x.xxx          (numeric) The total amount\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("gettxoutsetinfo", "")
+            + HelpExampleCli("gettxoutsetinfo", "true")
             + HelpExampleRpc("gettxoutsetinfo", "")
         );
 
+    bool fFullScan = false;
+    if (params.size() > 0)
+        fFullScan = params[0].get_bool();
+
     json_spirit::Object ret;
 
     CCoinsStats stats;
-    if (pcoinsTip->GetStats(stats)) {
+    bool fHaveStats;
+    {
+        RPC_LOCK(cs_main);
+        // Chainstates that predate the running statistics only have the scan
+        if (!fFullScan && !pcoinsTip->GetRunningStats(stats))
+            fFullScan = true;
+        if (fFullScan) {
+            // The scan reads the database, bring it up to the tip first
+            pcoinsTip->Flush();
+            fHaveStats = pcoinsTip->GetStats(stats);
+        } else {
+            fHaveStats = true;
+        }
+    }
+    if (fHaveStats) {
         ret.push_back(json_spirit::Pair("height", (int64_t)stats.nHeight));
         ret.push_back(json_spirit::Pair("bestblock", stats.hashBlock.GetHex()));
         ret.push_back(json_spirit::Pair("transactions", (int64_t)stats.nTransactions));
         ret.push_back(json_spirit::Pair("txouts", (int64_t)stats.nTransactionOutputs));
         ret.push_back(json_spirit::Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
-        ret.push_back(json_spirit::Pair("hash_serialized", stats.hashSerialized.GetHex()));
+        if (fFullScan)
+            ret.push_back(json_spirit::Pair("hash_serialized", stats.hashSerialized.GetHex()));
+        ret.push_back(json_spirit::Pair("hash_multiset", stats.hashMultiset.GetHex()));
         ret.push_back(json_spirit::Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
     }
     return ret;
@@ -386,22 +554,27 @@ json_spirit::Value gettxout(const json_spirit::Array& params, bool fHelp)
     if (params.size() > 2)
         fMempool = params[2].get_bool();
 
+    // Only the lookup needs the coins view and the tip to be stable
     CCoins coins;
-    if (fMempool) {
-        LOCK(mempool.cs);
-        CCoinsViewMemPool view(*pcoinsTip, mempool);
-        if (!view.GetCoins(hash, coins))
-            return json_spirit::Value::null;
-        mempool.pruneSpent(hash, coins); // TODO: this should be done by the CCoinsViewMemPool
-    } else {
-        if (!pcoinsTip->GetCoins(hash, coins))
-            return json_spirit::Value::null;
+    CBlockIndex *pindex;
+    {
+        RPC_LOCK(cs_main);
+        if (fMempool) {
+            LOCK(mempool.cs);
+            CCoinsViewMemPool view(*pcoinsTip, mempool);
+            if (!view.GetCoins(hash, coins))
+                return json_spirit::Value::null;
+            mempool.pruneSpent(hash, coins); // TODO: this should be done by the CCoinsViewMemPool
+        } else {
+            if (!pcoinsTip->GetCoins(hash, coins))
+                return json_spirit::Value::null;
+        }
+        std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
+        pindex = it->second;
     }
     if (n<0 || (unsigned int)n>=coins.vout.size() || coins.vout[n].IsNull())
         return json_spirit::Value::null;
 
-    std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
-    CBlockIndex *pindex = it->second;
     ret.push_back(json_spirit::Pair("bestblock", pindex->GetBlockHash().GetHex()));
     if ((unsigned int)coins.nHeight == MEMPOOL_HEIGHT)
         ret.push_back(json_spirit::Pair("confirmations", 0));
@@ -78,7 +78,7 @@ json_spirit::Object CallRPC(const std::string& strMethod, const json_spirit::Arr
 
     // Parse reply
     json_spirit::Value valReply;
-    if (!read_string(strReply, valReply))
+    if (!ParseJSON(strReply, valReply))
         throw std::runtime_error("couldn't parse reply from server");
     const json_spirit::Object& reply = valReply.get_obj();
     if (reply.empty())
@@ -150,6 +150,8 @@ json_spirit::Array RPCConvertValues(const std::string &strMethod, const std::vec
     if (strMethod == "listsinceblock"         && n > 1) ConvertTo<int64_t>(params[1]);
     if (strMethod == "sendmany"               && n > 1) ConvertTo<json_spirit::Object>(params[1]);
     if (strMethod == "sendmany"               && n > 2) ConvertTo<int64_t>(params[2]);
+    if (strMethod == "sendbatch"              && n > 0) ConvertTo<json_spirit::Array>(params[0]);
+    if (strMethod == "sendbatch"              && n > 1) ConvertTo<int64_t>(params[1]);
     if (strMethod == "addmultisigaddress"     && n > 0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "addmultisigaddress"     && n > 1) ConvertTo<json_spirit::Array>(params[1]);
     if (strMethod == "createmultisig"         && n > 0) ConvertTo<int64_t>(params[0]);
@@ -159,13 +161,21 @@ json_spirit::Array RPCConvertValues(const std::string &strMethod, const std::vec
     if (strMethod == "listunspent"            && n > 2) ConvertTo<json_spirit::Array>(params[2]);
     if (strMethod == "getblock"               && n > 1) ConvertTo<bool>(params[1]);
     if (strMethod == "getrawtransaction"      && n > 1) ConvertTo<int64_t>(params[1]);
+    if (strMethod == "getrawtransaction"      && n > 2 && params[2].get_str().size() < 64) ConvertTo<int64_t>(params[2]); // height, not a block hash
     if (strMethod == "createrawtransaction"   && n > 0) ConvertTo<json_spirit::Array>(params[0]);
     if (strMethod == "createrawtransaction"   && n > 1) ConvertTo<json_spirit::Object>(params[1]);
     if (strMethod == "signrawtransaction"     && n > 1) ConvertTo<json_spirit::Array>(params[1], true);
     if (strMethod == "signrawtransaction"     && n > 2) ConvertTo<json_spirit::Array>(params[2], true);
     if (strMethod == "sendrawtransaction"     && n > 1) ConvertTo<bool>(params[1], true);
     if (strMethod == "gettxout"               && n > 1) ConvertTo<int64_t>(params[1]);
+    if (strMethod == "getaddressutxos"        && n > 0) ConvertTo<json_spirit::Array>(params[0]);
+    if (strMethod == "getaddresstxids"        && n > 0) ConvertTo<json_spirit::Array>(params[0]);
+    if (strMethod == "getaddresstxids"        && n > 1) ConvertTo<int64_t>(params[1]);
+    if (strMethod == "getaddresstxids"        && n > 2) ConvertTo<int64_t>(params[2]);
+    if (strMethod == "getaddressbalance"      && n > 0) ConvertTo<json_spirit::Array>(params[0]);
+    if (strMethod == "getspentinfo"           && n > 1) ConvertTo<int64_t>(params[1]);
     if (strMethod == "gettxout"               && n > 2) ConvertTo<bool>(params[2]);
+    if (strMethod == "gettxoutsetinfo"        && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "lockunspent"            && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "lockunspent"            && n > 1) ConvertTo<json_spirit::Array>(params[1]);
     if (strMethod == "importprivkey"          && n > 2) ConvertTo<bool>(params[2]);
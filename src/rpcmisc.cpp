@@ -9,6 +9,7 @@
 #include "net.h"
 #include "netbase.h"
 #include "rpcserver.h"
+#include "txdb.h"
 #include "util.h"
 #ifdef ENABLE_WALLET
 #include "wallet.h"
@@ -325,3 +326,213 @@ json_spirit::Value verifymessage(const json_spirit::Array& params, bool fHelp)
 
     return (pubkey.GetID() == keyID);
 }
+
+/** The scripts for the address, or array of addresses, given as an RPC parameter */
+static std::vector<std::pair<std::string, CScript> > ParseAddressesParam(const json_spirit::Value& value)
+{
+    json_spirit::Array addresses;
+    if (value.type() == json_spirit::str_type)
+        addresses.push_back(value);
+    else if (value.type() == json_spirit::array_type)
+        addresses = value.get_array();
+    else
+        throw JSONRPCError(RPC_TYPE_ERROR, "Expected an address or an array of addresses");
+
+    std::vector<std::pair<std::string, CScript> > vScripts;
+    BOOST_FOREACH(const json_spirit::Value& address, addresses)
+    {
+        CBitcoinAddress addr(address.get_str());
+        if (!addr.IsValid())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, std::string("Invalid Auroracoin address: ") + address.get_str());
+        CScript script;
+        script.SetDestination(addr.Get());
+        vScripts.push_back(std::make_pair(address.get_str(), script));
+    }
+    return vScripts;
+}
+
+static void EnsureAddressIndex()
+{
+    if (!fAddressIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled, restart with -addressindex and -reindex");
+}
+
+json_spirit::Value getaddressutxos(const json_spirit::Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw std::runtime_error(
+            "getaddressutxos [\"address\",...]\n"
+            "\nReturns the unspent outputs paying to the addresses, from the address index (requires -addressindex).\n"
+            "Mempool transactions are not included.\n"
+            "\nArguments:\n"
+            "1. [\"address\",...]   (array of strings, required) The auroracoin addresses\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"address\": \"address\",  (string) The address\n"
+            "    \"txid\": \"hash\",        (string) The output's transaction id\n"
+            "    \"outputIndex\": n,      (numeric) The output's index\n"
+            "    \"script\": \"hex\",       (string) The script hex encoded\n"
+            "    \"amount\": x.xxx,       (numeric) The value in auroracoins\n"
+            "    \"height\": n            (numeric) The height of the block containing the output\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddressutxos", "'[\"1PSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\"]'")
+            + HelpExampleRpc("getaddressutxos", "[\"1PSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\"]")
+        );
+
+    EnsureAddressIndex();
+
+    json_spirit::Array result;
+    std::vector<std::pair<std::string, CScript> > vScripts = ParseAddressesParam(params[0]);
+    for (unsigned int i = 0; i < vScripts.size(); i++)
+    {
+        const CScript& script = vScripts[i].second;
+        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+        if (!pblocktree->ReadAddressUnspentIndex(Hash160(script), vUnspent))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read address index");
+
+        std::string strScript = HexStr(script.begin(), script.end());
+        for (unsigned int j = 0; j < vUnspent.size(); j++)
+        {
+            json_spirit::Object output;
+            output.push_back(json_spirit::Pair("address", vScripts[i].first));
+            output.push_back(json_spirit::Pair("txid", vUnspent[j].first.txhash.GetHex()));
+            output.push_back(json_spirit::Pair("outputIndex", (int)vUnspent[j].first.nIndex));
+            output.push_back(json_spirit::Pair("script", strScript));
+            output.push_back(json_spirit::Pair("amount", ValueFromAmount(vUnspent[j].second.nValue)));
+            output.push_back(json_spirit::Pair("height", vUnspent[j].second.nHeight));
+            result.push_back(output);
+        }
+    }
+    return result;
+}
+
+json_spirit::Value getaddresstxids(const json_spirit::Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw std::runtime_error(
+            "getaddresstxids [\"address\",...] ( start end )\n"
+            "\nReturns the ids of the transactions paying to or spending from the addresses, in block chain order\n"
+            "(requires -addressindex). Mempool transactions are not included.\n"
+            "\nArguments:\n"
+            "1. [\"address\",...]   (array of strings, required) The auroracoin addresses\n"
+            "2. start             (numeric, optional) The lowest block height to include\n"
+            "3. end               (numeric, optional) The highest block height to include\n"
+            "\nResult:\n"
+            "[\n"
+            "  \"transactionid\"  (string) The transaction id\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddresstxids", "'[\"1PSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\"]' 100000 200000")
+            + HelpExampleRpc("getaddresstxids", "[\"1PSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\"], 100000, 200000")
+        );
+
+    EnsureAddressIndex();
+
+    int nStart = 0, nEnd = 0;
+    if (params.size() > 1)
+        nStart = params[1].get_int();
+    if (params.size() > 2)
+        nEnd = params[2].get_int();
+    if (nStart < 0 || nEnd < 0 || (nEnd > 0 && nEnd < nStart))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid start or end height");
+
+    // Entries come sorted by height for each address; merge them across addresses
+    std::vector<std::pair<int, uint256> > vTxids;
+    std::vector<std::pair<std::string, CScript> > vScripts = ParseAddressesParam(params[0]);
+    for (unsigned int i = 0; i < vScripts.size(); i++)
+    {
+        std::vector<std::pair<CAddressIndexKey, int64_t> > vEntries;
+        if (!pblocktree->ReadAddressIndex(Hash160(vScripts[i].second), vEntries, nStart, nEnd))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read address index");
+        for (unsigned int j = 0; j < vEntries.size(); j++)
+            vTxids.push_back(std::make_pair(vEntries[j].first.nHeight, vEntries[j].first.txhash));
+    }
+    std::sort(vTxids.begin(), vTxids.end());
+
+    json_spirit::Array result;
+    std::set<uint256> setSeen;
+    for (unsigned int i = 0; i < vTxids.size(); i++)
+        if (setSeen.insert(vTxids[i].second).second)
+            result.push_back(vTxids[i].second.GetHex());
+    return result;
+}
+
+json_spirit::Value getaddressbalance(const json_spirit::Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw std::runtime_error(
+            "getaddressbalance [\"address\",...]\n"
+            "\nReturns the confirmed balance of the addresses, from the address index (requires -addressindex).\n"
+            "\nArguments:\n"
+            "1. [\"address\",...]   (array of strings, required) The auroracoin addresses\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"balance\": x.xxx,   (numeric) The current balance in auroracoins\n"
+            "  \"received\": x.xxx   (numeric) The total amount ever received in auroracoins\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddressbalance", "'[\"1PSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\"]'")
+            + HelpExampleRpc("getaddressbalance", "[\"1PSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\"]")
+        );
+
+    EnsureAddressIndex();
+
+    int64_t nBalance = 0, nReceived = 0;
+    std::vector<std::pair<std::string, CScript> > vScripts = ParseAddressesParam(params[0]);
+    for (unsigned int i = 0; i < vScripts.size(); i++)
+    {
+        // A script without a record has no history
+        CAddressBalanceValue value;
+        pblocktree->ReadAddressBalance(Hash160(vScripts[i].second), value);
+        nBalance += value.nBalance;
+        nReceived += value.nReceived;
+    }
+
+    json_spirit::Object result;
+    result.push_back(json_spirit::Pair("balance", ValueFromAmount(nBalance)));
+    result.push_back(json_spirit::Pair("received", ValueFromAmount(nReceived)));
+    return result;
+}
+
+json_spirit::Value getspentinfo(const json_spirit::Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 2)
+        throw std::runtime_error(
+            "getspentinfo \"txid\" n\n"
+            "\nReturns the input spending a transaction output, from the spent index (requires -addressindex).\n"
+            "\nArguments:\n"
+            "1. \"txid\"   (string, required) The transaction id\n"
+            "2. n        (numeric, required) The output index\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"txid\": \"hash\",  (string) The id of the spending transaction\n"
+            "  \"index\": n,      (numeric) The index of the spending input\n"
+            "  \"height\": n      (numeric) The height of the block containing the spending transaction\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getspentinfo", "\"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\" 0")
+            + HelpExampleRpc("getspentinfo", "\"0437cd7f8525ceed2324359c2d0ba26006d92d856a9c20fa0241106ee5a597c9\", 0")
+        );
+
+    EnsureAddressIndex();
+
+    uint256 txid = ParseHashV(params[0], "txid");
+    int nIndex = params[1].get_int();
+    if (nIndex < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid output index");
+
+    CSpentIndexValue value;
+    if (!pblocktree->ReadSpentIndex(CSpentIndexKey(txid, nIndex), value))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unable to get spent info");
+
+    json_spirit::Object result;
+    result.push_back(json_spirit::Pair("txid", value.txid.GetHex()));
+    result.push_back(json_spirit::Pair("index", (int)value.nIndex));
+    result.push_back(json_spirit::Pair("height", value.nHeight));
+    return result;
+}
@@ -66,6 +66,18 @@ static void CopyNodeStats(std::vector<CNodeStats>& vstats)
     }
 }
 
+static json_spirit::Object MsgTypeStatsToJSON(const mapMsgTypeStats& mapStats)
+{
+    json_spirit::Object ret;
+    BOOST_FOREACH(const PAIRTYPE(std::string, CNetMsgTypeStats)& item, mapStats) {
+        json_spirit::Object entry;
+        entry.push_back(json_spirit::Pair("bytes", item.second.nBytes));
+        entry.push_back(json_spirit::Pair("count", item.second.nMsgs));
+        ret.push_back(json_spirit::Pair(item.first, entry));
+    }
+    return ret;
+}
+
 json_spirit::Value getpeerinfo(const json_spirit::Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -82,6 +94,15 @@ json_spirit::Value getpeerinfo(const json_spirit::Array& params, bool fHelp)
             "    \"lastrecv\": ttt,           (numeric) The time in seconds since epoch (Jan 1 1970 GMT) of the last receive\n"
             "    \"bytessent\": n,            (numeric) The total bytes sent\n"
             "    \"bytesrecv\": n,            (numeric) The total bytes received\n"
+            "    \"sendcalls\": n,            (numeric) The number of send system calls made\n"
+            "    \"sendqueue\": n,            (numeric) The number of messages waiting to be sent\n"
+            "    \"sendqueuebytes\": n,       (numeric) The bytes waiting to be sent\n"
+            "    \"sent_per_msg\": {          (object) Traffic sent by message type, including headers\n"
+            "       \"type\": { \"bytes\": n, \"count\": n }, ...\n"
+            "    },\n"
+            "    \"recv_per_msg\": {          (object) Traffic received by message type, including headers\n"
+            "       \"type\": { \"bytes\": n, \"count\": n }, ...\n"
+            "    },\n"
             "    \"conntime\": ttt,           (numeric) The connection time in seconds since epoch (Jan 1 1970 GMT)\n"
             "    \"pingtime\": n,             (numeric) ping time\n"
             "    \"pingwait\": n,             (numeric) ping wait\n"
@@ -117,6 +138,11 @@ json_spirit::Value getpeerinfo(const json_spirit::Array& params, bool fHelp)
         obj.push_back(json_spirit::Pair("lastrecv", stats.nLastRecv));
         obj.push_back(json_spirit::Pair("bytessent", stats.nSendBytes));
         obj.push_back(json_spirit::Pair("bytesrecv", stats.nRecvBytes));
+        obj.push_back(json_spirit::Pair("sendcalls", stats.nSendCalls));
+        obj.push_back(json_spirit::Pair("sendqueue", (uint64_t)stats.nSendQueueMsgs));
+        obj.push_back(json_spirit::Pair("sendqueuebytes", (uint64_t)stats.nSendQueueBytes));
+        obj.push_back(json_spirit::Pair("sent_per_msg", MsgTypeStatsToJSON(stats.mapSentPerMsgType)));
+        obj.push_back(json_spirit::Pair("recv_per_msg", MsgTypeStatsToJSON(stats.mapRecvPerMsgType)));
         obj.push_back(json_spirit::Pair("conntime", stats.nTimeConnected));
         obj.push_back(json_spirit::Pair("pingtime", stats.dPingTime));
         if (stats.dPingWait > 0.0)
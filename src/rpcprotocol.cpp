@@ -7,7 +7,11 @@
 
 #include "util.h"
 
+#include <limits>
+#include <locale>
+#include <sstream>
 #include <stdint.h>
+#include <string.h>
 
 #include <boost/algorithm/string.hpp>
 #include <boost/asio.hpp>
@@ -49,7 +53,7 @@ static std::string rfc1123Time()
     return DateTimeStrFormat("%a, %d %b %Y %H:%M:%S +0000", GetTime());
 }
 
-std::string HTTPReply(int nStatus, const std::string& strMsg, bool keepalive)
+std::string HTTPReply(int nStatus, const std::string& strMsg, bool keepalive, const char *contentType)
 {
     if (nStatus == HTTP_UNAUTHORIZED)
         return strprintf("HTTP/1.0 401 Authorization Required\r\n"
@@ -68,29 +72,94 @@ std::string HTTPReply(int nStatus, const std::string& strMsg, bool keepalive)
             "</HEAD>\r\n"
             "<BODY><H1>401 Unauthorized.</H1></BODY>\r\n"
             "</HTML>\r\n", rfc1123Time(), FormatFullVersion());
+    return HTTPReplyHeader(nStatus, keepalive, strMsg.size(), false, contentType) + strMsg;
+}
+
+std::string HTTPReplyHeader(int nStatus, bool keepalive, size_t nContentLength, bool fChunked, const char *contentType)
+{
     const char *cStatus;
          if (nStatus == HTTP_OK) cStatus = "OK";
     else if (nStatus == HTTP_BAD_REQUEST) cStatus = "Bad Request";
     else if (nStatus == HTTP_FORBIDDEN) cStatus = "Forbidden";
     else if (nStatus == HTTP_NOT_FOUND) cStatus = "Not Found";
     else if (nStatus == HTTP_INTERNAL_SERVER_ERROR) cStatus = "Internal Server Error";
+    else if (nStatus == HTTP_SERVICE_UNAVAILABLE) cStatus = "Service Unavailable";
     else cStatus = "";
     return strprintf(
             "HTTP/1.1 %d %s\r\n"
             "Date: %s\r\n"
             "Connection: %s\r\n"
-            "Content-Length: %u\r\n"
-            "Content-Type: application/json\r\n"
+            "%s\r\n"
+            "Content-Type: %s\r\n"
             "Server: auroracoin-json-rpc/%s\r\n"
-            "\r\n"
-            "%s",
+            "\r\n",
         nStatus,
         cStatus,
         rfc1123Time(),
         keepalive ? "keep-alive" : "close",
-        strMsg.size(),
-        FormatFullVersion(),
-        strMsg);
+        fChunked ? std::string("Transfer-Encoding: chunked") : strprintf("Content-Length: %u", nContentLength),
+        contentType,
+        FormatFullVersion());
+}
+
+CHTTPReplyStreambuf::CHTTPReplyStreambuf(std::ostream& osIn, int nStatusIn, bool fKeepAliveIn, bool fChunkedIn) :
+    os(osIn), nStatus(nStatusIn), fKeepAlive(fKeepAliveIn), fChunked(fChunkedIn), fStarted(false), vBuf(CHUNK_SIZE)
+{
+    setp(&vBuf[0], &vBuf[0] + vBuf.size());
+}
+
+void CHTTPReplyStreambuf::Drain()
+{
+    strBody.append(pbase(), pptr() - pbase());
+    setp(&vBuf[0], &vBuf[0] + vBuf.size());
+}
+
+void CHTTPReplyStreambuf::SendChunk()
+{
+    if (fnWriteNotify)
+        fnWriteNotify();
+    if (!fStarted)
+    {
+        os << HTTPReplyHeader(nStatus, fKeepAlive, 0, true);
+        fStarted = true;
+    }
+    os << strprintf("%x\r\n", strBody.size()) << strBody << "\r\n";
+    strBody.clear();
+}
+
+CHTTPReplyStreambuf::int_type CHTTPReplyStreambuf::overflow(int_type ch)
+{
+    Drain();
+    if (!traits_type::eq_int_type(ch, traits_type::eof()))
+        strBody += traits_type::to_char_type(ch);
+    if (fChunked && strBody.size() >= CHUNK_SIZE)
+        SendChunk();
+    return traits_type::not_eof(ch);
+}
+
+void CHTTPReplyStreambuf::Discard()
+{
+    setp(&vBuf[0], &vBuf[0] + vBuf.size());
+    strBody.clear();
+}
+
+void CHTTPReplyStreambuf::Finish()
+{
+    Drain();
+    if (fnWriteNotify)
+        fnWriteNotify();
+    if (fStarted)
+    {
+        if (!strBody.empty())
+            SendChunk();
+        os << "0\r\n\r\n";
+    }
+    else
+    {
+        os << HTTPReplyHeader(nStatus, fKeepAlive, strBody.size()) << strBody;
+        strBody.clear();
+    }
+    os << std::flush;
 }
 
 bool ReadHTTPRequestLine(std::basic_istream<char>& stream, int &proto,
@@ -182,7 +251,29 @@ int ReadHTTPMessage(std::basic_istream<char>& stream, std::map<std::string,
         return HTTP_INTERNAL_SERVER_ERROR;
 
     // Read message
-    if (nLen > 0)
+    if (boost::iequals(mapHeadersRet["transfer-encoding"], "chunked"))
+    {
+        while (true)
+        {
+            std::string str;
+            std::getline(stream, str);
+            if (!stream)
+                return HTTP_INTERNAL_SERVER_ERROR;
+            unsigned long nChunk = strtoul(str.c_str(), NULL, 16);
+            if (nChunk == 0)
+                break;
+            if (strMessageRet.size() + nChunk > MAX_SIZE)
+                return HTTP_INTERNAL_SERVER_ERROR;
+            size_t nOld = strMessageRet.size();
+            strMessageRet.resize(nOld + nChunk);
+            stream.read(&strMessageRet[nOld], nChunk);
+            std::getline(stream, str); // CRLF after the chunk data
+        }
+        // Skip any trailers up to the final empty line
+        std::map<std::string, std::string> mapTrailers;
+        ReadHTTPHeaders(stream, mapTrailers);
+    }
+    else if (nLen > 0)
     {
         std::vector<char> vch(nLen);
         stream.read(&vch[0], nLen);
@@ -202,6 +293,320 @@ int ReadHTTPMessage(std::basic_istream<char>& stream, std::map<std::string,
     return HTTP_OK;
 }
 
+//
+// JSON parsing
+//
+
+/** Recursive descent parser building json_spirit values in place */
+class CJSONParser
+{
+public:
+    // Deeper documents are rejected rather than risking the stack
+    static const int MAX_DEPTH = 512;
+
+    CJSONParser(const char* pbeginIn, const char* pendIn) : p(pbeginIn), pend(pendIn), nDepth(0) {}
+
+    bool ParseDocument(json_spirit::Value& val)
+    {
+        if (!ParseValue(val))
+            return false;
+        SkipSpace();
+        return p == pend;
+    }
+
+private:
+    const char* p;
+    const char* pend;
+    int nDepth;
+
+    void SkipSpace()
+    {
+        while (p != pend && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t' || *p == '\f' || *p == '\v'))
+            p++;
+    }
+
+    bool Consume(char c)
+    {
+        SkipSpace();
+        if (p == pend || *p != c)
+            return false;
+        p++;
+        return true;
+    }
+
+    bool ConsumeLiteral(const char* psz)
+    {
+        size_t nLen = strlen(psz);
+        if ((size_t)(pend - p) < nLen || memcmp(p, psz, nLen) != 0)
+            return false;
+        p += nLen;
+        return true;
+    }
+
+    bool ParseValue(json_spirit::Value& val)
+    {
+        SkipSpace();
+        if (p == pend)
+            return false;
+        switch (*p)
+        {
+        case '{':
+            return ParseObject(val);
+        case '[':
+            return ParseArray(val);
+        case '"':
+        {
+            std::string str;
+            if (!ParseString(str))
+                return false;
+            val = json_spirit::Value(str);
+            return true;
+        }
+        case 't':
+            val = json_spirit::Value(true);
+            return ConsumeLiteral("true");
+        case 'f':
+            val = json_spirit::Value(false);
+            return ConsumeLiteral("false");
+        case 'n':
+            val = json_spirit::Value();
+            return ConsumeLiteral("null");
+        default:
+            return ParseNumber(val);
+        }
+    }
+
+    bool ParseObject(json_spirit::Value& val)
+    {
+        if (++nDepth > MAX_DEPTH)
+            return false;
+        p++; // '{'
+        val = json_spirit::Object();
+        json_spirit::Object& obj = val.get_obj();
+        if (!Consume('}'))
+        {
+            do
+            {
+                SkipSpace();
+                std::string strName;
+                if (!ParseString(strName) || !Consume(':'))
+                    return false;
+                obj.push_back(json_spirit::Pair(std::string(), json_spirit::Value()));
+                obj.back().name_.swap(strName);
+                if (!ParseValue(obj.back().value_))
+                    return false;
+            } while (Consume(','));
+            if (!Consume('}'))
+                return false;
+        }
+        nDepth--;
+        return true;
+    }
+
+    bool ParseArray(json_spirit::Value& val)
+    {
+        if (++nDepth > MAX_DEPTH)
+            return false;
+        p++; // '['
+        val = json_spirit::Array();
+        json_spirit::Array& arr = val.get_array();
+        if (!Consume(']'))
+        {
+            do
+            {
+                arr.push_back(json_spirit::Value());
+                if (!ParseValue(arr.back()))
+                    return false;
+            } while (Consume(','));
+            if (!Consume(']'))
+                return false;
+        }
+        nDepth--;
+        return true;
+    }
+
+    static int HexDigit(char c)
+    {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    bool ParseHex4(unsigned int& nRet)
+    {
+        if (pend - p < 4)
+            return false;
+        nRet = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            int n = HexDigit(*p++);
+            if (n < 0)
+                return false;
+            nRet = (nRet << 4) | n;
+        }
+        return true;
+    }
+
+    static void AppendUTF8(std::string& str, unsigned int nCode)
+    {
+        if (nCode < 0x80)
+            str += (char)nCode;
+        else if (nCode < 0x800)
+        {
+            str += (char)(0xc0 | (nCode >> 6));
+            str += (char)(0x80 | (nCode & 0x3f));
+        }
+        else if (nCode < 0x10000)
+        {
+            str += (char)(0xe0 | (nCode >> 12));
+            str += (char)(0x80 | ((nCode >> 6) & 0x3f));
+            str += (char)(0x80 | (nCode & 0x3f));
+        }
+        else
+        {
+            str += (char)(0xf0 | (nCode >> 18));
+            str += (char)(0x80 | ((nCode >> 12) & 0x3f));
+            str += (char)(0x80 | ((nCode >> 6) & 0x3f));
+            str += (char)(0x80 | (nCode & 0x3f));
+        }
+    }
+
+    bool ParseString(std::string& str)
+    {
+        if (p == pend || *p != '"')
+            return false;
+        p++;
+        while (true)
+        {
+            // Copy runs of plain characters in one go
+            const char* pstart = p;
+            while (p != pend && *p != '"' && *p != '\\')
+                p++;
+            str.append(pstart, p);
+            if (p == pend)
+                return false;
+            if (*p++ == '"')
+                return true;
+
+            // Escape sequence
+            if (p == pend)
+                return false;
+            switch (*p++)
+            {
+            case '"':  str += '"'; break;
+            case '\\': str += '\\'; break;
+            case '/':  str += '/'; break;
+            case 'b':  str += '\b'; break;
+            case 'f':  str += '\f'; break;
+            case 'n':  str += '\n'; break;
+            case 'r':  str += '\r'; break;
+            case 't':  str += '\t'; break;
+            case 'u':
+            {
+                unsigned int nCode;
+                if (!ParseHex4(nCode))
+                    return false;
+                // Combine UTF-16 surrogate pairs
+                if (nCode >= 0xd800 && nCode < 0xdc00 && pend - p >= 6 && p[0] == '\\' && p[1] == 'u')
+                {
+                    const char* psave = p;
+                    p += 2;
+                    unsigned int nLow;
+                    if (ParseHex4(nLow) && nLow >= 0xdc00 && nLow < 0xe000)
+                        nCode = 0x10000 + ((nCode - 0xd800) << 10) + (nLow - 0xdc00);
+                    else
+                        p = psave;
+                }
+                AppendUTF8(str, nCode);
+                break;
+            }
+            default:
+                return false;
+            }
+        }
+    }
+
+    bool ParseNumber(json_spirit::Value& val)
+    {
+        const char* pstart = p;
+        bool fNegative = false;
+        if (p != pend && *p == '-')
+        {
+            fNegative = true;
+            p++;
+        }
+
+        // Integer part, accumulated as we go for the common case
+        const char* pdigits = p;
+        uint64_t n = 0;
+        bool fOverflow = false;
+        while (p != pend && *p >= '0' && *p <= '9')
+        {
+            unsigned int nDigit = *p++ - '0';
+            if (n > (std::numeric_limits<uint64_t>::max() - nDigit) / 10)
+                fOverflow = true;
+            n = n * 10 + nDigit;
+        }
+        if (p == pdigits)
+            return false;
+
+        bool fReal = false;
+        if (p != pend && *p == '.')
+        {
+            fReal = true;
+            p++;
+            const char* pfrac = p;
+            while (p != pend && *p >= '0' && *p <= '9')
+                p++;
+            if (p == pfrac)
+                return false;
+        }
+        if (p != pend && (*p == 'e' || *p == 'E'))
+        {
+            fReal = true;
+            p++;
+            if (p != pend && (*p == '+' || *p == '-'))
+                p++;
+            const char* pexp = p;
+            while (p != pend && *p >= '0' && *p <= '9')
+                p++;
+            if (p == pexp)
+                return false;
+        }
+
+        if (fReal)
+        {
+            // Independent of the C locale (the GUI sets it from the environment)
+            std::istringstream is(std::string(pstart, p));
+            is.imbue(std::locale::classic());
+            double d;
+            is >> d;
+            if (is.fail())
+                return false;
+            val = json_spirit::Value(d);
+        }
+        else if (fOverflow)
+            return false;
+        else if (!fNegative && n <= (uint64_t)std::numeric_limits<int64_t>::max())
+            val = json_spirit::Value((int64_t)n);
+        else if (!fNegative)
+            val = json_spirit::Value(n);
+        else if (n <= (uint64_t)std::numeric_limits<int64_t>::max() + 1)
+            val = json_spirit::Value((int64_t)(0 - n));
+        else
+            return false;
+        return true;
+    }
+};
+
+bool ParseJSON(const std::string& strJSON, json_spirit::Value& valRet)
+{
+    const char* pbegin = strJSON.data();
+    CJSONParser parser(pbegin, pbegin + strJSON.size());
+    return parser.ParseDocument(valRet);
+}
+
 //
 // JSON-RPC protocol.  Bitcoin speaks version 1.0 for maximum compatibility,
 // but uses JSON-RPC 1.1/2.0 standards for parts of the 1.0 standard that were
@@ -212,6 +617,102 @@ int ReadHTTPMessage(std::basic_istream<char>& stream, std::map<std::string,
 // http://www.codeproject.com/KB/recipes/JSON_Spirit.aspx
 //
 
+void CJSONStreamWriter::beginObject()
+{
+    if (fNeedComma)
+        os << ',';
+    os << '{';
+    fNeedComma = false;
+}
+
+void CJSONStreamWriter::endObject()
+{
+    os << '}';
+    fNeedComma = true;
+}
+
+void CJSONStreamWriter::beginArray()
+{
+    if (fNeedComma)
+        os << ',';
+    os << '[';
+    fNeedComma = false;
+}
+
+void CJSONStreamWriter::endArray()
+{
+    os << ']';
+    fNeedComma = true;
+}
+
+void CJSONStreamWriter::key(const std::string& strKey)
+{
+    if (fNeedComma)
+        os << ',';
+    json_spirit::write_stream(json_spirit::Value(strKey), os, false);
+    os << ':';
+    fNeedComma = false;
+}
+
+void CJSONStreamWriter::value(const json_spirit::Value& val)
+{
+    if (fNeedComma)
+        os << ',';
+    json_spirit::write_stream(val, os, false);
+    fNeedComma = true;
+}
+
+json_spirit::Value* CJSONValueWriter::add(const json_spirit::Value& val)
+{
+    if (vStack.empty())
+    {
+        root = val;
+        return &root;
+    }
+    // Containers only ever grow at the top of the stack, so the pointers
+    // to the ones below stay valid.
+    json_spirit::Value& top = *vStack.back();
+    if (top.type() == json_spirit::obj_type)
+    {
+        json_spirit::Object& obj = top.get_obj();
+        obj.push_back(json_spirit::Pair(strNextKey, val));
+        return &obj.back().value_;
+    }
+    json_spirit::Array& arr = top.get_array();
+    arr.push_back(val);
+    return &arr.back();
+}
+
+void CJSONValueWriter::beginObject()
+{
+    vStack.push_back(add(json_spirit::Object()));
+}
+
+void CJSONValueWriter::endObject()
+{
+    vStack.pop_back();
+}
+
+void CJSONValueWriter::beginArray()
+{
+    vStack.push_back(add(json_spirit::Array()));
+}
+
+void CJSONValueWriter::endArray()
+{
+    vStack.pop_back();
+}
+
+void CJSONValueWriter::key(const std::string& strKey)
+{
+    strNextKey = strKey;
+}
+
+void CJSONValueWriter::value(const json_spirit::Value& val)
+{
+    add(val);
+}
+
 std::string JSONRPCRequest(const std::string& strMethod, const json_spirit::Array& params, const json_spirit::Value& id)
 {
     json_spirit::Object request;
@@ -8,12 +8,16 @@
 
 #include <list>
 #include <map>
+#include <ostream>
 #include <stdint.h>
+#include <streambuf>
 #include <string>
+#include <vector>
 #include <boost/iostreams/concepts.hpp>
 #include <boost/iostreams/stream.hpp>
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
+#include <boost/function.hpp>
 
 #include "json/json_spirit_reader_template.h"
 #include "json/json_spirit_utils.h"
@@ -40,6 +44,7 @@ enum HTTPStatusCode
     HTTP_FORBIDDEN             = 403,
     HTTP_NOT_FOUND             = 404,
     HTTP_INTERNAL_SERVER_ERROR = 500,
+    HTTP_SERVICE_UNAVAILABLE   = 503,
 };
 
 // Bitcoin RPC error codes
@@ -136,14 +141,120 @@ private:
     boost::asio::ssl::stream<typename Protocol::socket>& stream;
 };
 
+/**
+ * Output buffer for an HTTP reply whose length isn't known up front.
+ * Replies that fit in one chunk go out with a Content-Length header as
+ * before; larger ones switch to chunked transfer encoding (HTTP/1.1 only),
+ * so they never have to be held in memory as a whole.
+ */
+class CHTTPReplyStreambuf : public std::streambuf
+{
+public:
+    static const size_t CHUNK_SIZE = 64 * 1024;
+
+    CHTTPReplyStreambuf(std::ostream& osIn, int nStatusIn, bool fKeepAliveIn, bool fChunkedIn);
+
+    // True once anything has been written to the underlying stream
+    bool Started() const { return fStarted; }
+    // Drop everything buffered but not sent yet
+    void Discard();
+    // Send what is left and terminate the reply
+    void Finish();
+    // Have fn called before each write to the underlying stream
+    void SetWriteNotify(const boost::function<void(void)>& fn) { fnWriteNotify = fn; }
+
+protected:
+    int_type overflow(int_type ch);
+
+private:
+    std::ostream& os;
+    int nStatus;
+    bool fKeepAlive;
+    bool fChunked;
+    bool fStarted;
+    std::vector<char> vBuf;
+    std::string strBody;
+    boost::function<void(void)> fnWriteNotify;
+
+    void Drain();
+    void SendChunk();
+};
+
+/**
+ * Receiver for JSON output produced one token at a time, so that large
+ * results can be written out as they are generated instead of being built
+ * up as a json_spirit::Value first.
+ */
+class CJSONWriter
+{
+public:
+    virtual ~CJSONWriter() {}
+    virtual void beginObject() = 0;
+    virtual void endObject() = 0;
+    virtual void beginArray() = 0;
+    virtual void endArray() = 0;
+    virtual void key(const std::string& strKey) = 0;
+    virtual void value(const json_spirit::Value& val) = 0;
+
+    void pair(const std::string& strKey, const json_spirit::Value& val) { key(strKey); value(val); }
+};
+
+/** Writes compact JSON text to a stream, as write_string(value, false) would */
+class CJSONStreamWriter : public CJSONWriter
+{
+public:
+    CJSONStreamWriter(std::ostream& osIn) : os(osIn), fNeedComma(false) {}
+    void beginObject();
+    void endObject();
+    void beginArray();
+    void endArray();
+    void key(const std::string& strKey);
+    void value(const json_spirit::Value& val);
+
+private:
+    std::ostream& os;
+    bool fNeedComma;
+};
+
+/** Builds a json_spirit::Value, for callers that need the whole result */
+class CJSONValueWriter : public CJSONWriter
+{
+public:
+    void beginObject();
+    void endObject();
+    void beginArray();
+    void endArray();
+    void key(const std::string& strKey);
+    void value(const json_spirit::Value& val);
+
+    json_spirit::Value& get() { return root; }
+
+private:
+    json_spirit::Value root;
+    std::vector<json_spirit::Value*> vStack;
+    std::string strNextKey;
+
+    json_spirit::Value* add(const json_spirit::Value& val);
+};
+
 std::string HTTPPost(const std::string& strMsg, const std::map<std::string,std::string>& mapRequestHeaders);
-std::string HTTPReply(int nStatus, const std::string& strMsg, bool keepalive);
+std::string HTTPReplyHeader(int nStatus, bool keepalive, size_t nContentLength, bool fChunked=false,
+                            const char *contentType="application/json");
+std::string HTTPReply(int nStatus, const std::string& strMsg, bool keepalive,
+                      const char *contentType="application/json");
 bool ReadHTTPRequestLine(std::basic_istream<char>& stream, int &proto,
                          std::string& http_method, std::string& http_uri);
 int ReadHTTPStatus(std::basic_istream<char>& stream, int &proto);
 int ReadHTTPHeaders(std::basic_istream<char>& stream, std::map<std::string, std::string>& mapHeadersRet);
 int ReadHTTPMessage(std::basic_istream<char>& stream, std::map<std::string, std::string>& mapHeadersRet,
                     std::string& strMessageRet, int nProto);
+/**
+ * Parse a JSON text into a json_spirit::Value. A hand-written replacement
+ * for json_spirit::read_string on the RPC paths: it builds the Value in
+ * place in a single pass, without Spirit's backtracking and copies, and
+ * limits nesting depth. Only whitespace may follow the value.
+ */
+bool ParseJSON(const std::string& strJSON, json_spirit::Value& valRet);
 std::string JSONRPCRequest(const std::string& strMethod, const json_spirit::Array& params, const json_spirit::Value& id);
 json_spirit::Object JSONRPCReplyObj(const json_spirit::Value& result, const json_spirit::Value& error, const json_spirit::Value& id);
 std::string JSONRPCReply(const json_spirit::Value& result, const json_spirit::Value& error, const json_spirit::Value& id);
@@ -87,6 +87,7 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, json_spirit::Obje
     if (hashBlock != 0)
     {
         entry.push_back(json_spirit::Pair("blockhash", hashBlock.GetHex()));
+        RPC_LOCK(cs_main);
         std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end() && (*mi).second)
         {
@@ -105,16 +106,19 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, json_spirit::Obje
 
 json_spirit::Value getrawtransaction(const json_spirit::Array& params, bool fHelp)
 {
-    if (fHelp || params.size() < 1 || params.size() > 2)
+    if (fHelp || params.size() < 1 || params.size() > 3)
         throw std::runtime_error(
-            "getrawtransaction \"txid\" ( verbose )\n"
+            "getrawtransaction \"txid\" ( verbose \"blockhash\"|height )\n"
             "\nReturn the raw transaction data.\n"
             "\nIf verbose=0, returns a string that is serialized, hex-encoded data for 'txid'.\n"
             "If verbose is non-zero, returns an Object with information about 'txid'.\n"
+            "Without -txindex, only mempool transactions and ones with unspent outputs can be found,\n"
+            "unless the block containing the transaction is given.\n"
 
             "\nArguments:\n"
             "1. \"txid\"      (string, required) The transaction id\n"
             "2. verbose       (numeric, optional, default=0) If 0, return a string, other return a json object\n"
+            "3. \"blockhash\"|height (string or numeric, optional) The block to look for the transaction in\n"
 
             "\nResult (if verbose is not set or set to 0):\n"
             "\"data\"      (string) The serialized, hex-encoded data for 'txid'\n"
@@ -163,6 +167,7 @@ json_spirit::Value getrawtransaction(const json_spirit::Array& params, bool fHel
             "\nExamples:\n"
             + HelpExampleCli("getrawtransaction", "\"mytxid\"")
             + HelpExampleCli("getrawtransaction", "\"mytxid\" 1")
+            + HelpExampleCli("getrawtransaction", "\"mytxid\" 0 1000")
             + HelpExampleRpc("getrawtransaction", "\"mytxid\", 1")
         );
 
@@ -172,10 +177,33 @@ json_spirit::Value getrawtransaction(const json_spirit::Array& params, bool fHel
     if (params.size() > 1)
         fVerbose = (params[1].get_int() != 0);
 
+    const CBlockIndex* pindexHint = NULL;
+    if (params.size() > 2)
+    {
+        RPC_LOCK(cs_main);
+        if (params[2].type() == json_spirit::int_type)
+        {
+            int nHeight = params[2].get_int();
+            if (nHeight < 0 || nHeight > chainActive.Height())
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Block height out of range");
+            pindexHint = chainActive[nHeight];
+        }
+        else
+        {
+            uint256 hashBlockHint = ParseHashV(params[2], "parameter 3");
+            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlockHint);
+            if (mi == mapBlockIndex.end())
+                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+            pindexHint = mi->second;
+        }
+        if (!(pindexHint->nStatus & BLOCK_HAVE_DATA))
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available");
+    }
+
     CTransaction tx;
     uint256 hashBlock = 0;
-    if (!GetTransaction(hash, tx, hashBlock, true))
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available about transaction");
+    if (!GetTransaction(hash, tx, hashBlock, true, pindexHint))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, pindexHint ? "No such transaction found in the provided block" : "No information available about transaction");
 
     CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
     ssTx << tx;
@@ -229,6 +257,31 @@ json_spirit::Value listunspent(const json_spirit::Array& params, bool fHelp)
             + HelpExampleRpc("listunspent", "6, 9999999 \"[\\\"1PGFqEzfmQch1gKD3ra4k18PNj3tTUUSqg\\\",\\\"1LtvqCaApEdUGFkpKMM4MstjcaL4dKg8SP\\\"]\"")
         );
 
+    CJSONValueWriter writer;
+    listunspent_stream(params, writer);
+    return writer.get();
+}
+
+/** An output listunspent reports, copied out of the wallet */
+struct CUnspentEntry
+{
+    uint256 txid;
+    int nOut;
+    std::string strAddress;
+    bool fAccount;
+    std::string strAccount;
+    CScript scriptPubKey;
+    bool fRedeemScript;
+    CScript redeemScript;
+    int64_t nValue;
+    int nDepth;
+};
+
+void listunspent_stream(const json_spirit::Array& params, CJSONWriter& writer)
+{
+    if (params.size() > 3)
+        listunspent(params, true); // throws the usage text
+
     RPCTypeCheck(params, boost::assign::list_of(json_spirit::int_type)(json_spirit::int_type)(json_spirit::array_type));
 
     int nMinDepth = 1;
@@ -254,55 +307,68 @@ json_spirit::Value listunspent(const json_spirit::Array& params, bool fHelp)
         }
     }
 
-    json_spirit::Array results;
-    std::vector<COutput> vecOutputs;
-    assert(pwalletMain != NULL);
-    pwalletMain->AvailableCoins(vecOutputs, false);
-    BOOST_FOREACH(const COutput& out, vecOutputs)
+    // The outputs are copied out under the locks at once, as plain entries
+    // that take much less memory than their JSON objects, and written out
+    // after the locks are released.
+    std::vector<CUnspentEntry> vEntries;
     {
-        if (out.nDepth < nMinDepth || out.nDepth > nMaxDepth)
-            continue;
-
-        if (setAddress.size())
+        assert(pwalletMain != NULL);
+        RPC_LOCK2(cs_main, pwalletMain->cs_wallet);
+        std::vector<COutput> vecOutputs;
+        pwalletMain->AvailableCoins(vecOutputs, false);
+        vEntries.reserve(vecOutputs.size());
+        BOOST_FOREACH(const COutput& out, vecOutputs)
         {
-            CTxDestination address;
-            if (!ExtractDestination(out.tx->vout[out.i].scriptPubKey, address))
+            if (out.nDepth < nMinDepth || out.nDepth > nMaxDepth)
                 continue;
 
-            if (!setAddress.count(address))
+            const CScript& pk = out.tx->vout[out.i].scriptPubKey;
+            CTxDestination address;
+            bool fAddress = ExtractDestination(pk, address);
+            if (setAddress.size() && (!fAddress || !setAddress.count(address)))
                 continue;
-        }
 
-        int64_t nValue = out.tx->vout[out.i].nValue;
-        const CScript& pk = out.tx->vout[out.i].scriptPubKey;
-        json_spirit::Object entry;
-        entry.push_back(json_spirit::Pair("txid", out.tx->GetHash().GetHex()));
-        entry.push_back(json_spirit::Pair("vout", out.i));
-        CTxDestination address;
-        if (ExtractDestination(out.tx->vout[out.i].scriptPubKey, address))
-        {
-            entry.push_back(json_spirit::Pair("address", CBitcoinAddress(address).ToString()));
-            if (pwalletMain->mapAddressBook.count(address))
-                entry.push_back(json_spirit::Pair("account", pwalletMain->mapAddressBook[address].name));
-        }
-        entry.push_back(json_spirit::Pair("scriptPubKey", HexStr(pk.begin(), pk.end())));
-        if (pk.IsPayToScriptHash())
-        {
-            CTxDestination address;
-            if (ExtractDestination(pk, address))
+            vEntries.push_back(CUnspentEntry());
+            CUnspentEntry& entry = vEntries.back();
+            entry.txid = out.tx->GetHash();
+            entry.nOut = out.i;
+            entry.fAccount = false;
+            if (fAddress)
             {
-                const CScriptID& hash = boost::get<CScriptID>(address);
-                CScript redeemScript;
-                if (pwalletMain->GetCScript(hash, redeemScript))
-                    entry.push_back(json_spirit::Pair("redeemScript", HexStr(redeemScript.begin(), redeemScript.end())));
+                entry.strAddress = CBitcoinAddress(address).ToString();
+                std::map<CTxDestination, CAddressBookData>::const_iterator mi = pwalletMain->mapAddressBook.find(address);
+                if (mi != pwalletMain->mapAddressBook.end())
+                {
+                    entry.fAccount = true;
+                    entry.strAccount = mi->second.name;
+                }
             }
+            entry.scriptPubKey = pk;
+            entry.fRedeemScript = fAddress && pk.IsPayToScriptHash() &&
+                                  pwalletMain->GetCScript(boost::get<CScriptID>(address), entry.redeemScript);
+            entry.nValue = out.tx->vout[out.i].nValue;
+            entry.nDepth = out.nDepth;
         }
-        entry.push_back(json_spirit::Pair("amount",ValueFromAmount(nValue)));
-        entry.push_back(json_spirit::Pair("confirmations",out.nDepth));
-        results.push_back(entry);
     }
 
-    return results;
+    writer.beginArray();
+    BOOST_FOREACH(const CUnspentEntry& entry, vEntries)
+    {
+        writer.beginObject();
+        writer.pair("txid", entry.txid.GetHex());
+        writer.pair("vout", entry.nOut);
+        if (!entry.strAddress.empty())
+            writer.pair("address", entry.strAddress);
+        if (entry.fAccount)
+            writer.pair("account", entry.strAccount);
+        writer.pair("scriptPubKey", HexStr(entry.scriptPubKey.begin(), entry.scriptPubKey.end()));
+        if (entry.fRedeemScript)
+            writer.pair("redeemScript", HexStr(entry.redeemScript.begin(), entry.redeemScript.end()));
+        writer.pair("amount", ValueFromAmount(entry.nValue));
+        writer.pair("confirmations", entry.nDepth);
+        writer.endObject();
+    }
+    writer.endArray();
 }
 #endif
 
@@ -690,7 +756,10 @@ json_spirit::Value signrawtransaction(const json_spirit::Array& params, bool fHe
 
     bool fHashSingle = ((nHashType & ~SIGHASH_ANYONECANPAY) == SIGHASH_SINGLE);
 
-    // Sign what we can:
+    // Sign what we can, all inputs at once:
+    std::vector<char> vfHaveCoins(mergedTx.vin.size(), false);
+    std::vector<CScript> vPrevPubKeys(mergedTx.vin.size());
+    std::vector<CScript> vSignPubKeys(mergedTx.vin.size());
     for (unsigned int i = 0; i < mergedTx.vin.size(); i++)
     {
         CTxIn& txin = mergedTx.vin[i];
@@ -700,12 +769,22 @@ json_spirit::Value signrawtransaction(const json_spirit::Array& params, bool fHe
             fComplete = false;
             continue;
         }
-        const CScript& prevPubKey = coins.vout[txin.prevout.n].scriptPubKey;
+        vfHaveCoins[i] = true;
+        vPrevPubKeys[i] = coins.vout[txin.prevout.n].scriptPubKey;
 
         txin.scriptSig.clear();
         // Only sign SIGHASH_SINGLE if there's a corresponding output:
         if (!fHashSingle || (i < mergedTx.vout.size()))
-            SignSignature(keystore, prevPubKey, mergedTx, i, nHashType);
+            vSignPubKeys[i] = vPrevPubKeys[i];
+    }
+    SignSignatures(keystore, std::vector<CTransaction*>(1, &mergedTx), std::vector<std::vector<CScript> >(1, vSignPubKeys), nHashType);
+
+    for (unsigned int i = 0; i < mergedTx.vin.size(); i++)
+    {
+        CTxIn& txin = mergedTx.vin[i];
+        if (!vfHaveCoins[i])
+            continue;
+        const CScript& prevPubKey = vPrevPubKeys[i];
 
         // ... and merge in other signatures:
         BOOST_FOREACH(const CTransaction& txv, txVariants)
@@ -17,12 +17,16 @@
 #include <boost/algorithm/string.hpp>
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
+#include <boost/atomic.hpp>
 #include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/foreach.hpp>
 #include <boost/iostreams/concepts.hpp>
 #include <boost/iostreams/stream.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/tss.hpp>
 #include "json/json_spirit_writer_template.h"
 
 static std::string strRPCUserColonPass;
@@ -209,6 +213,130 @@ json_spirit::Value stop(const json_spirit::Array& params, bool fHelp)
 }
 
 
+//
+// Call statistics
+//
+
+/** Lock timing of the RPC call being executed by a thread */
+struct CRPCCallTimes
+{
+    int nLockDepth;
+    int64_t nLockWaitMicros;
+    int64_t nLockHoldMicros;
+    int64_t nMaxLockHoldMicros;
+
+    CRPCCallTimes() : nLockDepth(0), nLockWaitMicros(0), nLockHoldMicros(0), nMaxLockHoldMicros(0) {}
+};
+
+static CCriticalSection cs_rpcStats;
+static std::map<std::string, CRPCMethodStats> mapRPCStats;
+
+static void NoCleanup(CRPCCallTimes*) {}
+static boost::thread_specific_ptr<CRPCCallTimes> pcallTimes(NoCleanup);
+
+/** Accounts the run time and lock times of one call to its method */
+class CRPCCallTimer
+{
+public:
+    CRPCCallTimer(const std::string& strMethodIn) : strMethod(strMethodIn), pprev(pcallTimes.get()), nStart(GetTimeMicros())
+    {
+        pcallTimes.reset(&times);
+    }
+
+    ~CRPCCallTimer()
+    {
+        int64_t nElapsed = GetTimeMicros() - nStart;
+        pcallTimes.reset(pprev);
+
+        LOCK(cs_rpcStats);
+        CRPCMethodStats& stats = mapRPCStats[strMethod];
+        stats.nCalls++;
+        stats.nTotalMicros += nElapsed;
+        stats.nMaxMicros = std::max(stats.nMaxMicros, nElapsed);
+        stats.nLockWaitMicros += times.nLockWaitMicros;
+        stats.nLockHoldMicros += times.nLockHoldMicros;
+        stats.nMaxLockHoldMicros = std::max(stats.nMaxLockHoldMicros, times.nMaxLockHoldMicros);
+    }
+
+private:
+    std::string strMethod;
+    CRPCCallTimes times;
+    CRPCCallTimes* pprev;
+    int64_t nStart;
+};
+
+CRPCLock::CRPCLock(CCriticalSection& csIn, const char* pszName, const char* pszFile, int nLine) : cs(csIn), ptimes(pcallTimes.get()), nLocked(0)
+{
+    // Only the outermost lock is timed, nested ones are part of its hold time
+    bool fTimed = ptimes && ptimes->nLockDepth++ == 0;
+    int64_t nStart = fTimed ? GetTimeMicros() : 0;
+    EnterCritical(pszName, pszFile, nLine, (void*)(&cs));
+    cs.lock();
+    if (fTimed)
+    {
+        nLocked = GetTimeMicros();
+        ptimes->nLockWaitMicros += nLocked - nStart;
+    }
+}
+
+CRPCLock::~CRPCLock()
+{
+    cs.unlock();
+    LeaveCritical();
+    if (ptimes && --ptimes->nLockDepth == 0)
+    {
+        int64_t nHeld = GetTimeMicros() - nLocked;
+        ptimes->nLockHoldMicros += nHeld;
+        ptimes->nMaxLockHoldMicros = std::max(ptimes->nMaxLockHoldMicros, nHeld);
+    }
+}
+
+std::map<std::string, CRPCMethodStats> GetRPCMethodStats()
+{
+    LOCK(cs_rpcStats);
+    return mapRPCStats;
+}
+
+json_spirit::Value getrpcinfo(const json_spirit::Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw std::runtime_error(
+            "getrpcinfo\n"
+            "\nReturns timing statistics for the RPC methods called since startup.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"method\" : {                (json object) one entry per method called\n"
+            "    \"calls\" : n,               (numeric) Number of calls\n"
+            "    \"time_ms\" : n,             (numeric) Total time spent in the calls\n"
+            "    \"max_time_ms\" : n,         (numeric) Longest call\n"
+            "    \"lock_wait_ms\" : n,        (numeric) Total time spent waiting for cs_main and cs_wallet\n"
+            "    \"lock_hold_ms\" : n,        (numeric) Total time they were held\n"
+            "    \"max_lock_hold_ms\" : n     (numeric) Longest time they were held at once\n"
+            "  }, ...\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getrpcinfo", "")
+            + HelpExampleRpc("getrpcinfo", "")
+        );
+
+    json_spirit::Object ret;
+    std::map<std::string, CRPCMethodStats> mapStats = GetRPCMethodStats();
+    BOOST_FOREACH(const PAIRTYPE(std::string, CRPCMethodStats)& item, mapStats)
+    {
+        const CRPCMethodStats& stats = item.second;
+        json_spirit::Object obj;
+        obj.push_back(json_spirit::Pair("calls", (uint64_t)stats.nCalls));
+        obj.push_back(json_spirit::Pair("time_ms", stats.nTotalMicros / 1000.0));
+        obj.push_back(json_spirit::Pair("max_time_ms", stats.nMaxMicros / 1000.0));
+        obj.push_back(json_spirit::Pair("lock_wait_ms", stats.nLockWaitMicros / 1000.0));
+        obj.push_back(json_spirit::Pair("lock_hold_ms", stats.nLockHoldMicros / 1000.0));
+        obj.push_back(json_spirit::Pair("max_lock_hold_ms", stats.nMaxLockHoldMicros / 1000.0));
+        ret.push_back(json_spirit::Pair(item.first, obj));
+    }
+    return ret;
+}
+
+
 
 //
 // Call Table
@@ -222,6 +350,7 @@ static const CRPCCommand vRPCCommands[] =
     { "getinfo",                &getinfo,                true,      false,      false }, /* uses wallet if enabled */
     { "help",                   &help,                   true,      true,       false },
     { "stop",                   &stop,                   true,      true,       false },
+    { "getrpcinfo",             &getrpcinfo,             true,      true,       false },
 
     /* P2P networking */
     { "getnetworkinfo",         &getnetworkinfo,         true,      false,      false },
@@ -234,14 +363,15 @@ static const CRPCCommand vRPCCommands[] =
 
     /* Block chain and UTXO */
     { "getblockchaininfo",      &getblockchaininfo,      true,      false,      false },
-    { "getbestblockhash",       &getbestblockhash,       true,      false,      false },
-    { "getblockcount",          &getblockcount,          true,      false,      false },
-    { "getblock",               &getblock,               false,     false,      false },
-    { "getblockhash",           &getblockhash,           false,     false,      false },
-    { "getdifficulty",          &getdifficulty,          true,      false,      false },
-    { "getrawmempool",          &getrawmempool,          true,      false,      false },
-    { "gettxout",               &gettxout,               true,      false,      false },
-    { "gettxoutsetinfo",        &gettxoutsetinfo,        true,      false,      false },
+    { "getbestblockhash",       &getbestblockhash,       true,      true ,      false },
+    { "getblockcount",          &getblockcount,          true,      true ,      false },
+    { "getblock",               &getblock,               false,     true ,      false },
+    { "getblockhash",           &getblockhash,           false,     true ,      false },
+    { "getdifficulty",          &getdifficulty,          true,      true ,      false },
+    { "getmempoolinfo",         &getmempoolinfo,         true,      true ,      false },
+    { "getrawmempool",          &getrawmempool,          true,      true ,      false },
+    { "gettxout",               &gettxout,               true,      true ,      false },
+    { "gettxoutsetinfo",        &gettxoutsetinfo,        true,      true ,      false },
     { "verifychain",            &verifychain,            true,      false,      false },
 
     /* Mining */
@@ -255,7 +385,7 @@ static const CRPCCommand vRPCCommands[] =
     { "createrawtransaction",   &createrawtransaction,   false,     false,      false },
     { "decoderawtransaction",   &decoderawtransaction,   false,     false,      false },
     { "decodescript",           &decodescript,           false,     false,      false },
-    { "getrawtransaction",      &getrawtransaction,      false,     false,      false },
+    { "getrawtransaction",      &getrawtransaction,      false,     true ,      false },
     { "sendrawtransaction",     &sendrawtransaction,     false,     false,      false },
     { "signrawtransaction",     &signrawtransaction,     false,     false,      false }, /* uses wallet if enabled */
 
@@ -264,6 +394,12 @@ static const CRPCCommand vRPCCommands[] =
     { "validateaddress",        &validateaddress,        true,      false,      false }, /* uses wallet if enabled */
     { "verifymessage",          &verifymessage,          false,     false,      false },
 
+    /* Address index */
+    { "getaddressutxos",        &getaddressutxos,        true,      false,      false },
+    { "getaddresstxids",        &getaddresstxids,        true,      false,      false },
+    { "getaddressbalance",      &getaddressbalance,      true,      false,      false },
+    { "getspentinfo",           &getspentinfo,           true,      false,      false },
+
 #ifdef ENABLE_WALLET
     /* Wallet */
     { "addmultisigaddress",     &addmultisigaddress,     false,     false,      true },
@@ -282,8 +418,8 @@ static const CRPCCommand vRPCCommands[] =
     { "gettransaction",         &gettransaction,         false,     false,      true },
     { "getunconfirmedbalance",  &getunconfirmedbalance,  false,     false,      true },
     { "getwalletinfo",          &getwalletinfo,          true,      false,      true },
-    { "importprivkey",          &importprivkey,          false,     false,      true },
-    { "importwallet",           &importwallet,           false,     false,      true },
+    { "importprivkey",          &importprivkey,          false,     true ,      true },
+    { "importwallet",           &importwallet,           false,     true ,      true },
     { "keypoolrefill",          &keypoolrefill,          true,      false,      true },
     { "listaccounts",           &listaccounts,           false,     false,      true },
     { "listaddressgroupings",   &listaddressgroupings,   false,     false,      true },
@@ -295,6 +431,7 @@ static const CRPCCommand vRPCCommands[] =
     { "listunspent",            &listunspent,            false,     false,      true },
     { "lockunspent",            &lockunspent,            false,     false,      true },
     { "move",                   &movecmd,                false,     false,      true },
+    { "sendbatch",              &sendbatch,              false,     false,      true },
     { "sendfrom",               &sendfrom,               false,     false,      true },
     { "sendmany",               &sendmany,               false,     false,      true },
     { "sendtoaddress",          &sendtoaddress,          false,     false,      true },
@@ -313,6 +450,22 @@ static const CRPCCommand vRPCCommands[] =
 #endif // ENABLE_WALLET
 };
 
+/* Commands whose result can get large enough that it is written out as it is
+ * generated, when the reply goes straight to an RPC client */
+static const struct
+{
+    const char* name;
+    rpcstreamfn_type streamer;
+} vRPCStreamCommands[] =
+{
+    { "getblock",               &getblock_stream },
+    { "getrawmempool",          &getrawmempool_stream },
+#ifdef ENABLE_WALLET
+    { "listtransactions",       &listtransactions_stream },
+    { "listunspent",            &listunspent_stream },
+#endif
+};
+
 CRPCTable::CRPCTable()
 {
     unsigned int vcidx;
@@ -323,6 +476,8 @@ CRPCTable::CRPCTable()
         pcmd = &vRPCCommands[vcidx];
         mapCommands[pcmd->name] = pcmd;
     }
+    for (vcidx = 0; vcidx < (sizeof(vRPCStreamCommands) / sizeof(vRPCStreamCommands[0])); vcidx++)
+        mapStreamCommands[vRPCStreamCommands[vcidx].name] = vRPCStreamCommands[vcidx].streamer;
 }
 
 const CRPCCommand *CRPCTable::operator[](std::string name) const
@@ -378,14 +533,43 @@ bool ClientAllowed(const boost::asio::ip::address& address)
     return false;
 }
 
-class AcceptedConnection
+/** Where a connection is, as it moves between the event loop and the worker pool */
+enum RPCConnectionState
+{
+    RPC_CONN_IDLE,      //! waiting in the event loop for the next request
+    RPC_CONN_QUEUED,    //! has data to read, waiting for a worker
+    RPC_CONN_SERVING,   //! a worker is reading or answering a request
+    RPC_CONN_CLOSED,
+};
+
+class AcceptedConnection;
+static void RPCReplySent(boost::shared_ptr<AcceptedConnection> conn, boost::shared_ptr<std::string> pstrReply);
+
+class AcceptedConnection : public boost::enable_shared_from_this<AcceptedConnection>
 {
 public:
+    AcceptedConnection(ioContext& io_context, bool fUseSSLIn) : timer(io_context), nTimeoutSeq(0), nState(RPC_CONN_IDLE), fUseSSL(fUseSSLIn) {}
     virtual ~AcceptedConnection() {}
 
     virtual std::iostream& stream() = 0;
     virtual std::string peer_address_to_string() const = 0;
     virtual void close() = 0;
+
+    /** Whether (part of) a further request has already been read off the socket */
+    virtual bool HaveBufferedInput() = 0;
+    /** Have the event loop call handler once the socket is readable */
+    virtual void AsyncWaitReadable(const boost::function<void(const boost::system::error_code&)>& handler) = 0;
+    /** Make blocking reads and writes on the connection fail; callable from any thread */
+    virtual void Abort() = 0;
+    /** Send strReply from the event loop without blocking on it, then close; plain HTTP only */
+    virtual void AsyncReplyAndClose(const std::string& strReply) = 0;
+
+    /** Idle or I/O timeout, only touched from the event loop */
+    boost::asio::deadline_timer timer;
+    /** Bumped whenever the timer is re-armed or stopped, so a stale expiry is ignored */
+    boost::atomic<unsigned int> nTimeoutSeq;
+    boost::atomic<int> nState;
+    const bool fUseSSL;
 };
 
 template <typename Protocol>
@@ -397,6 +581,7 @@ public:
             boost::asio::basic_socket_acceptor<boost::asio::ip::tcp>::executor_type executor,
             boost::asio::ssl::context &context,
             bool fUseSSL) :
+        AcceptedConnection(io_context, fUseSSL),
         sslStream(executor, context),
         _d(sslStream, fUseSSL),
         _stream(_d)
@@ -416,6 +601,38 @@ public:
     virtual void close()
     {
         _stream.close();
+        boost::system::error_code ec;
+        sslStream.lowest_layer().close(ec);
+    }
+
+    virtual bool HaveBufferedInput()
+    {
+        if (_stream.rdbuf()->in_avail() > 0)
+            return true;
+        if (!fUseSSL)
+            return false;
+        // Records the TLS layer has already pulled off the socket
+        SSL *ssl = sslStream.native_handle();
+        return SSL_pending(ssl) > 0 || BIO_ctrl_pending(SSL_get_rbio(ssl)) > 0;
+    }
+
+    virtual void AsyncWaitReadable(const boost::function<void(const boost::system::error_code&)>& handler)
+    {
+        sslStream.next_layer().async_read_some(boost::asio::null_buffers(),
+                boost::bind(handler, boost::asio::placeholders::error));
+    }
+
+    virtual void Abort()
+    {
+        boost::system::error_code ec;
+        sslStream.lowest_layer().shutdown(boost::asio::socket_base::shutdown_both, ec);
+    }
+
+    virtual void AsyncReplyAndClose(const std::string& strReply)
+    {
+        boost::shared_ptr<std::string> pstrReply(new std::string(strReply));
+        boost::asio::async_write(sslStream.next_layer(), boost::asio::buffer(*pstrReply),
+                boost::bind(&RPCReplySent, shared_from_this(), pstrReply));
     }
 
     typename Protocol::endpoint peer;
@@ -426,7 +643,142 @@ private:
     boost::iostreams::stream< SSLIOStreamDevice<Protocol> > _stream;
 };
 
-void ServiceConnection(AcceptedConnection *conn);
+static CRPCWorkQueue* rpc_work_queue = NULL;
+static int64_t nRPCServerTimeout = DEFAULT_RPC_SERVER_TIMEOUT;
+static int nRPCThreads = DEFAULT_RPC_THREADS;
+
+// Connections a worker is busy with, so shutdown can unblock them
+static boost::mutex cs_rpcServing;
+static std::set< boost::shared_ptr<AcceptedConnection> > setRPCServing;
+
+bool ServiceConnection(AcceptedConnection *conn);
+static void RPCWaitForRequest(boost::shared_ptr<AcceptedConnection> conn);
+
+/**
+ * Idle connections are closed when their timer runs out. While a worker
+ * serves a connection the timer only runs as the request is read and the
+ * reply written, so slow clients can't hold on to a worker but a command
+ * that takes long to run is not cut off.
+ */
+static void RPCTimeoutHandler(boost::shared_ptr<AcceptedConnection> conn, unsigned int nSeq, const boost::system::error_code& error)
+{
+    if (error || nSeq != conn->nTimeoutSeq)
+        return;
+    if (conn->nState == RPC_CONN_IDLE)
+    {
+        conn->nState = RPC_CONN_CLOSED;
+        conn->close();
+    }
+    else if (conn->nState == RPC_CONN_SERVING || conn->nState == RPC_CONN_CLOSED)
+        conn->Abort();
+}
+
+static void RPCArmTimeout(boost::shared_ptr<AcceptedConnection> conn, unsigned int nSeq)
+{
+    if (nSeq != conn->nTimeoutSeq)
+        return;
+    conn->timer.expires_from_now(boost::posix_time::seconds(nRPCServerTimeout));
+    conn->timer.async_wait(boost::bind(&RPCTimeoutHandler, conn, nSeq, boost::asio::placeholders::error));
+}
+
+static void RPCStopTimeout(boost::shared_ptr<AcceptedConnection> conn, unsigned int nSeq)
+{
+    if (nSeq != conn->nTimeoutSeq)
+        return;
+    boost::system::error_code ec;
+    conn->timer.cancel(ec);
+}
+
+/** Event loop side: (re)start the connection's timer */
+static void RPCSetTimeout(boost::shared_ptr<AcceptedConnection> conn)
+{
+    RPCArmTimeout(conn, ++conn->nTimeoutSeq);
+}
+
+/** Worker side: time the connection from now on as it does I/O, or stop timing it while a command runs */
+static void RPCTimeIO(AcceptedConnection* conn, bool fIO)
+{
+    unsigned int nSeq = ++conn->nTimeoutSeq;
+    if (fIO)
+        rpc_io_service->post(boost::bind(&RPCArmTimeout, conn->shared_from_this(), nSeq));
+    else
+        rpc_io_service->post(boost::bind(&RPCStopTimeout, conn->shared_from_this(), nSeq));
+}
+
+/** Event loop side: close a connection, which the timer may otherwise still Abort() */
+static void RPCCloseConnection(boost::shared_ptr<AcceptedConnection> conn)
+{
+    conn->nState = RPC_CONN_CLOSED;
+    boost::system::error_code ec;
+    conn->timer.cancel(ec);
+    conn->close();
+}
+
+static void RPCReplySent(boost::shared_ptr<AcceptedConnection> conn, boost::shared_ptr<std::string> pstrReply)
+{
+    RPCCloseConnection(conn);
+}
+
+/** Worker side: answer the waiting request(s), then hand the connection back to the event loop */
+static void RPCServeConnection(boost::shared_ptr<AcceptedConnection> conn)
+{
+    conn->nState = RPC_CONN_SERVING;
+    {
+        boost::unique_lock<boost::mutex> lock(cs_rpcServing);
+        setRPCServing.insert(conn);
+    }
+    bool fKeepAlive = ServiceConnection(conn.get());
+    {
+        boost::unique_lock<boost::mutex> lock(cs_rpcServing);
+        setRPCServing.erase(conn);
+    }
+
+    // The socket is only closed on the event loop, where the timer uses it too
+    if (fKeepAlive && !ShutdownRequested())
+        rpc_io_service->post(boost::bind(&RPCWaitForRequest, conn));
+    else
+        rpc_io_service->post(boost::bind(&RPCCloseConnection, conn));
+}
+
+/** Pass a connection that has a request waiting to the worker pool, or refuse it if the pool is swamped */
+static void RPCQueueConnection(boost::shared_ptr<AcceptedConnection> conn)
+{
+    conn->nState = RPC_CONN_QUEUED;
+    if (rpc_work_queue->Enqueue(boost::bind(&RPCServeConnection, conn)))
+        return;
+
+    LogPrint("rpc", "RPC work queue full, refusing request from %s\n", conn->peer_address_to_string());
+    conn->nState = RPC_CONN_CLOSED;
+    // Plain HTTP only, the TLS handshake could itself block the event loop
+    if (conn->fUseSSL)
+    {
+        conn->close();
+        return;
+    }
+    // The timer aborts the write if the client doesn't take the reply
+    RPCSetTimeout(conn);
+    conn->AsyncReplyAndClose(HTTPReply(HTTP_SERVICE_UNAVAILABLE, "", false));
+}
+
+static void RPCReadableHandler(boost::shared_ptr<AcceptedConnection> conn, const boost::system::error_code& error)
+{
+    boost::system::error_code ec;
+    conn->timer.cancel(ec);
+    if (error || conn->nState != RPC_CONN_IDLE)
+        return;
+    RPCQueueConnection(conn);
+}
+
+/**
+ * Event loop side: park a connection until its next request starts to
+ * arrive. Idle keep-alive connections cost no worker thread.
+ */
+static void RPCWaitForRequest(boost::shared_ptr<AcceptedConnection> conn)
+{
+    conn->nState = RPC_CONN_IDLE;
+    RPCSetTimeout(conn);
+    conn->AsyncWaitReadable(boost::bind(&RPCReadableHandler, conn, _1));
+}
 
 // Forward declaration required for RPCListen
 template <typename Protocol, typename SocketAcceptorService>
@@ -445,7 +797,7 @@ static void RPCListen(boost::shared_ptr< boost::asio::basic_socket_acceptor<Prot
                    const bool fUseSSL)
 {
     // Accept connection
-    boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn(new AcceptedConnectionImpl<Protocol>(acceptor->get_executor(), context, fUseSSL));
+    boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn(new AcceptedConnectionImpl<Protocol>(*rpc_io_service, acceptor->get_executor(), context, fUseSSL));
 
     acceptor->async_accept(
             conn->sslStream.lowest_layer(),
@@ -490,10 +842,8 @@ static void RPCAcceptHandler(boost::shared_ptr< boost::asio::basic_socket_accept
             conn->stream() << HTTPReply(HTTP_FORBIDDEN, "", false) << std::flush;
         conn->close();
     }
-    else {
-        ServiceConnection(conn.get());
-        conn->close();
-    }
+    else
+        RPCWaitForRequest(conn);
 }
 
 void StartRPCThreads()
@@ -530,6 +880,9 @@ void StartRPCThreads()
 
     assert(rpc_io_service == NULL);
     rpc_io_service = new ioContext();
+    nRPCThreads = std::max((int)GetArg("-rpcthreads", DEFAULT_RPC_THREADS), 1);
+    nRPCServerTimeout = std::max(GetArg("-rpcservertimeout", DEFAULT_RPC_SERVER_TIMEOUT), (int64_t)1);
+    rpc_work_queue = new CRPCWorkQueue(std::max((int)GetArg("-rpcworkqueue", DEFAULT_RPC_WORK_QUEUE), 1));
     rpc_ssl_context = new boost::asio::ssl::context(boost::asio::ssl::context::sslv23);
 
     const bool fUseSSL = GetBoolArg("-rpcssl", false);
@@ -611,9 +964,12 @@ void StartRPCThreads()
         return;
     }
 
+    // A single thread runs the event loop: accepting, waiting on idle
+    // connections and timers. Requests are answered by the worker pool.
     rpc_worker_group = new boost::thread_group();
-    for (int i = 0; i < GetArg("-rpcthreads", 4); i++)
-        rpc_worker_group->create_thread(boost::bind(&ioContext::run, rpc_io_service));
+    rpc_worker_group->create_thread(boost::bind(&ioContext::run, rpc_io_service));
+    for (int i = 0; i < nRPCThreads; i++)
+        rpc_worker_group->create_thread(boost::bind(&CRPCWorkQueue::Run, rpc_work_queue));
 }
 
 void StartDummyRPCThread()
@@ -652,9 +1008,19 @@ void StopRPCThreads()
     }
     deadlineTimers.clear();
 
+    // Stop the workers, unblocking any that wait on a client
+    if (rpc_work_queue != NULL)
+        rpc_work_queue->Interrupt();
+    {
+        boost::unique_lock<boost::mutex> lock(cs_rpcServing);
+        BOOST_FOREACH(const boost::shared_ptr<AcceptedConnection>& conn, setRPCServing)
+            conn->Abort();
+    }
+
     rpc_io_service->stop();
     if (rpc_worker_group != NULL)
         rpc_worker_group->join_all();
+    delete rpc_work_queue; rpc_work_queue = NULL;
     delete rpc_dummy_work; rpc_dummy_work = NULL;
     delete rpc_worker_group; rpc_worker_group = NULL;
     delete rpc_ssl_context; rpc_ssl_context = NULL;
@@ -702,7 +1068,7 @@ void JSONRequest::parse(const json_spirit::Value& valRequest)
     id = json_spirit::find_value(request, "id");
 
     // Parse method
-    json_spirit::Value valMethod = json_spirit::find_value(request, "method");
+    const json_spirit::Value& valMethod = json_spirit::find_value(request, "method");
     if (valMethod.type() == json_spirit::null_type)
         throw JSONRPCError(RPC_INVALID_REQUEST, "Missing method");
     if (valMethod.type() != json_spirit::str_type)
@@ -712,7 +1078,7 @@ void JSONRequest::parse(const json_spirit::Value& valRequest)
         LogPrint("rpc", "ThreadRPCServer method=%s\n", strMethod);
 
     // Parse params
-    json_spirit::Value valParams = json_spirit::find_value(request, "params");
+    const json_spirit::Value& valParams = json_spirit::find_value(request, "params");
     if (valParams.type() == json_spirit::array_type)
         params = valParams.get_array();
     else if (valParams.type() == json_spirit::null_type)
@@ -746,41 +1112,149 @@ static json_spirit::Object JSONRPCExecOne(const json_spirit::Value& req)
     return rpc_result;
 }
 
-static std::string JSONRPCExecBatch(const json_spirit::Array& vReq)
+/** Whether the elements of a batch may run concurrently, i.e. all of its commands are thread safe */
+static bool JSONRPCBatchThreadSafe(const json_spirit::Array& vReq)
+{
+    BOOST_FOREACH(const json_spirit::Value& req, vReq)
+    {
+        // Malformed elements only produce an error reply
+        if (req.type() != json_spirit::obj_type)
+            continue;
+        const json_spirit::Value& valMethod = json_spirit::find_value(req.get_obj(), "method");
+        if (valMethod.type() != json_spirit::str_type)
+            continue;
+        const CRPCCommand *pcmd = tableRPC[valMethod.get_str()];
+        if (pcmd && !pcmd->threadSafe)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * A batch whose elements are answered in parallel. Threads take elements in
+ * order until none are left; the thread that owns the batch takes part, so
+ * it never waits on a helper that has not started yet, only on elements
+ * already being answered.
+ */
+class CRPCBatch
 {
-    json_spirit::Array ret;
+public:
+    CRPCBatch(const json_spirit::Array& vReqIn) : vReq(vReqIn), nSize(vReqIn.size()), vReply(vReqIn.size()), nNext(0), nDone(0) {}
+
+    /** Answer elements until all are taken. Helpers that start after that
+     *  return at once, without touching vReq, which may be gone by then. */
+    void Run()
+    {
+        unsigned int reqIdx;
+        while ((reqIdx = nNext++) < nSize)
+        {
+            vReply[reqIdx] = JSONRPCExecOne(vReq[reqIdx]);
+            boost::unique_lock<boost::mutex> lock(cs);
+            if (++nDone == nSize)
+                cond.notify_all();
+        }
+    }
+
+    /** Wait for the elements other threads are answering */
+    void Wait()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (nDone < nSize)
+            cond.wait(lock);
+    }
+
+    const std::vector<json_spirit::Object>& GetReplies() const { return vReply; }
+
+private:
+    const json_spirit::Array& vReq;
+    const unsigned int nSize;
+    std::vector<json_spirit::Object> vReply;
+    boost::atomic<unsigned int> nNext;
+    boost::mutex cs;
+    boost::condition_variable cond;
+    unsigned int nDone;
+};
+
+void JSONRPCExecBatch(const json_spirit::Array& vReq, CJSONWriter& writer, CRPCWorkQueue* pqueue, int nHelpers)
+{
+    nHelpers = std::min(nHelpers, (int)vReq.size() - 1);
+    if (pqueue != NULL && nHelpers > 0 && JSONRPCBatchThreadSafe(vReq))
+    {
+        // Let idle workers of the pool help; a full queue just means fewer helpers
+        boost::shared_ptr<CRPCBatch> batch(new CRPCBatch(vReq));
+        for (int i = 0; i < nHelpers; i++)
+            if (!pqueue->Enqueue(boost::bind(&CRPCBatch::Run, batch)))
+                break;
+        batch->Run();
+        batch->Wait();
+
+        writer.beginArray();
+        BOOST_FOREACH(const json_spirit::Object& reply, batch->GetReplies())
+            writer.value(reply);
+        writer.endArray();
+        return;
+    }
+
+    writer.beginArray();
     for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
+        writer.value(JSONRPCExecOne(vReq[reqIdx]));
+    writer.endArray();
+}
 
-    return write_string(json_spirit::Value(ret), false) + "\n";
+static void ErrorReply(AcceptedConnection *conn, CHTTPReplyStreambuf& reply, const json_spirit::Object& objError, const json_spirit::Value& id)
+{
+    // Once part of a streamed reply has gone out its status can't be changed
+    // any more; the caller drops the connection so the client sees it cut short.
+    if (reply.Started())
+    {
+        LogPrintf("ThreadRPCServer error after reply was started: %s\n", write_string(json_spirit::Value(objError), false));
+        return;
+    }
+    reply.Discard();
+    ErrorReply(conn->stream(), objError, id);
 }
 
-void ServiceConnection(AcceptedConnection *conn)
+/**
+ * Answer the request waiting on conn, and any pipelined after it. Returns
+ * whether the connection should be kept open for further requests.
+ */
+bool ServiceConnection(AcceptedConnection *conn)
 {
     bool fRun = true;
-    while (fRun && !ShutdownRequested())
+    do
     {
         int nProto = 0;
         std::map<std::string, std::string> mapHeaders;
         std::string strRequest, strMethod, strURI;
+        RPCTimeIO(conn, true);
 
         // Read HTTP request line
         if (!ReadHTTPRequestLine(conn->stream(), nProto, strMethod, strURI))
-            break;
+            return false;
 
         // Read HTTP message headers and body
         ReadHTTPMessage(conn->stream(), mapHeaders, strRequest, nProto);
 
+        // Read-only REST interface, unauthenticated so it is off by default
+        if (boost::algorithm::starts_with(strURI, "/rest/") && GetBoolArg("-rest", false))
+        {
+            if (mapHeaders["connection"] == "close")
+                fRun = false;
+            if (!HTTPReq_REST(conn->stream(), strURI, fRun))
+                return false;
+            continue;
+        }
+
         if (strURI != "/") {
             conn->stream() << HTTPReply(HTTP_NOT_FOUND, "", false) << std::flush;
-            break;
+            return false;
         }
 
         // Check authorization
         if (mapHeaders.count("authorization") == 0)
         {
             conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
+            return false;
         }
         if (!HTTPAuthorized(mapHeaders))
         {
@@ -792,55 +1266,69 @@ void ServiceConnection(AcceptedConnection *conn)
                 MilliSleep(250);
 
             conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
+            return false;
         }
         if (mapHeaders["connection"] == "close")
             fRun = false;
 
+        // The command itself may take as long as it needs, only the reply is timed again
+        RPCTimeIO(conn, false);
+
         JSONRequest jreq;
+        // The reply is written straight to the connection as it is produced,
+        // using chunked transfer encoding for large replies to HTTP/1.1 clients.
+        CHTTPReplyStreambuf reply(conn->stream(), HTTP_OK, fRun, nProto >= 1);
+        reply.SetWriteNotify(boost::bind(&RPCTimeIO, conn, true));
+        std::ostream osReply(&reply);
+        CJSONStreamWriter writer(osReply);
         try
         {
             // Parse request
             json_spirit::Value valRequest;
-            if (!json_spirit::read_string(strRequest, valRequest))
+            if (!ParseJSON(strRequest, valRequest))
                 throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
 
-            std::string strReply;
-
             // singleton request
             if (valRequest.type() == json_spirit::obj_type) {
                 jreq.parse(valRequest);
 
-                json_spirit::Value result = tableRPC.execute(jreq.strMethod, jreq.params);
-
-                // Send reply
-                strReply = JSONRPCReply(result, json_spirit::Value::null, jreq.id);
+                // Same layout as JSONRPCReply
+                writer.beginObject();
+                writer.key("result");
+                tableRPC.execute(jreq.strMethod, jreq.params, writer);
+                writer.pair("error", json_spirit::Value::null);
+                writer.pair("id", jreq.id);
+                writer.endObject();
 
             // array of requests
             } else if (valRequest.type() == json_spirit::array_type)
-                strReply = JSONRPCExecBatch(valRequest.get_array());
+                JSONRPCExecBatch(valRequest.get_array(), writer, rpc_work_queue, nRPCThreads - 1);
             else
                 throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
 
-            conn->stream() << HTTPReply(HTTP_OK, strReply, fRun) << std::flush;
+            osReply << "\n";
+            reply.Finish();
         }
         catch (json_spirit::Object& objError)
         {
-            ErrorReply(conn->stream(), objError, jreq.id);
-            break;
+            RPCTimeIO(conn, true);
+            ErrorReply(conn, reply, objError, jreq.id);
+            return false;
         }
         catch (std::exception& e)
         {
-            ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
-            break;
+            RPCTimeIO(conn, true);
+            ErrorReply(conn, reply, JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
+            return false;
         }
-    }
+    } while (fRun && !ShutdownRequested() && conn->HaveBufferedInput());
+    return fRun;
 }
 
-json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
+const CRPCCommand *CRPCTable::find(const std::string &strMethod) const
 {
     // Find method
-    const CRPCCommand *pcmd = tableRPC[strMethod];
+    const CRPCCommand *pcmd = (*this)[strMethod];
     if (!pcmd)
         throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found");
 #ifdef ENABLE_WALLET
@@ -854,6 +1342,14 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
         !pcmd->okSafeMode)
         throw JSONRPCError(RPC_FORBIDDEN_BY_SAFE_MODE, std::string("Safe mode: ") + strWarning);
 
+    return pcmd;
+}
+
+json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
+{
+    const CRPCCommand *pcmd = find(strMethod);
+    CRPCCallTimer timer(strMethod);
+
     try
     {
         // Execute
@@ -863,15 +1359,15 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
                 result = pcmd->actor(params, false);
 #ifdef ENABLE_WALLET
             else if (!pwalletMain) {
-                LOCK(cs_main);
+                RPC_LOCK(cs_main);
                 result = pcmd->actor(params, false);
             } else {
-                LOCK2(cs_main, pwalletMain->cs_wallet);
+                RPC_LOCK2(cs_main, pwalletMain->cs_wallet);
                 result = pcmd->actor(params, false);
             }
 #else // ENABLE_WALLET
             else {
-                LOCK(cs_main);
+                RPC_LOCK(cs_main);
                 result = pcmd->actor(params, false);
             }
 #endif // !ENABLE_WALLET
@@ -884,6 +1380,28 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
     }
 }
 
+void CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params, CJSONWriter& writer) const
+{
+    std::map<std::string, rpcstreamfn_type>::const_iterator it = mapStreamCommands.find(strMethod);
+    if (it == mapStreamCommands.end())
+    {
+        writer.value(execute(strMethod, params));
+        return;
+    }
+
+    find(strMethod);
+    CRPCCallTimer timer(strMethod);
+    try
+    {
+        // Streaming commands take their own locks
+        (*it->second)(params, writer);
+    }
+    catch (std::exception& e)
+    {
+        throw JSONRPCError(RPC_MISC_ERROR, e.what());
+    }
+}
+
 std::string HelpExampleCli(std::string methodname, std::string args){
     return "> auroracoin-cli " + methodname + " " + args + "\n";
 }
@@ -8,18 +8,88 @@
 
 #include "uint256.h"
 #include "rpcprotocol.h"
+#include "sync.h"
 
+#include <deque>
 #include <list>
 #include <map>
 #include <stdint.h>
 #include <string>
 
+#include <boost/function.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
 #include "json/json_spirit_reader_template.h"
 #include "json/json_spirit_utils.h"
 #include "json/json_spirit_writer_template.h"
 
 class CBlockIndex;
 
+/** Number of RPC worker threads */
+static const int DEFAULT_RPC_THREADS = 4;
+/** Requests that may wait for a worker before new ones are refused with a 503 */
+static const int DEFAULT_RPC_WORK_QUEUE = 16;
+/** Seconds an idle connection is kept open, and that a request may take to read or write */
+static const int64_t DEFAULT_RPC_SERVER_TIMEOUT = 30;
+
+/**
+ * Bounded queue of work for the -rpcthreads worker pool. Keeping it short
+ * means an overloaded server turns new requests away with a 503 right away
+ * instead of letting them pile up behind slow ones.
+ */
+class CRPCWorkQueue
+{
+public:
+    typedef boost::function<void(void)> WorkItem;
+
+    CRPCWorkQueue(size_t nMaxDepthIn) : nMaxDepth(nMaxDepthIn), fRunning(true) {}
+
+    /** Queue an item, returns false if the queue is full */
+    bool Enqueue(const WorkItem& item)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (!fRunning || queue.size() >= nMaxDepth)
+            return false;
+        queue.push_back(item);
+        cond.notify_one();
+        return true;
+    }
+
+    /** Worker thread: run items until interrupted */
+    void Run()
+    {
+        while (true)
+        {
+            WorkItem item;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                while (fRunning && queue.empty())
+                    cond.wait(lock);
+                if (!fRunning)
+                    break;
+                item = queue.front();
+                queue.pop_front();
+            }
+            item();
+        }
+    }
+
+    void Interrupt()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fRunning = false;
+        cond.notify_all();
+    }
+
+private:
+    boost::mutex cs;
+    boost::condition_variable cond;
+    std::deque<WorkItem> queue;
+    size_t nMaxDepth;
+    bool fRunning;
+};
+
 /* Start RPC threads */
 void StartRPCThreads();
 /* Alternative to StartRPCThreads for the GUI, when no server is
@@ -44,14 +114,67 @@ void RPCTypeCheck(const json_spirit::Array& params,
 void RPCTypeCheck(const json_spirit::Object& o,
                   const std::map<std::string, json_spirit::Value_type>& typesExpected, bool fAllowNull=false);
 
+/*
+  Answer the elements of a batch request into writer, in order. When all of
+  their commands are thread safe up to nHelpers items are queued on pqueue to
+  answer elements alongside the calling thread.
+ */
+void JSONRPCExecBatch(const json_spirit::Array& vReq, CJSONWriter& writer, CRPCWorkQueue* pqueue, int nHelpers);
+
 /*
   Run func nSeconds from now. Uses boost deadline timers.
   Overrides previous timer <name> (if any).
  */
 void RPCRunLater(const std::string& name, boost::function<void(void)> func, int64_t nSeconds);
 
+/** Timing of the calls to one RPC method, as reported by getrpcinfo */
+struct CRPCMethodStats
+{
+    uint64_t nCalls;
+    int64_t nTotalMicros;
+    int64_t nMaxMicros;
+    int64_t nLockWaitMicros;    // waiting for RPC_LOCKed critical sections
+    int64_t nLockHoldMicros;    // holding them
+    int64_t nMaxLockHoldMicros; // longest single hold
+
+    CRPCMethodStats() : nCalls(0), nTotalMicros(0), nMaxMicros(0), nLockWaitMicros(0), nLockHoldMicros(0), nMaxLockHoldMicros(0) {}
+};
+
+std::map<std::string, CRPCMethodStats> GetRPCMethodStats();
+
+struct CRPCCallTimes;
+
+/*
+  Lock for RPC handlers that need cs_main (or another lock) for part of their
+  work only. Behaves like LOCK, and the time spent waiting for and holding the
+  outermost RPC_LOCK is accounted to the method being executed by this thread.
+ */
+class CRPCLock
+{
+public:
+    CRPCLock(CCriticalSection& csIn, const char* pszName, const char* pszFile, int nLine);
+    ~CRPCLock();
+
+private:
+    CCriticalSection& cs;
+    CRPCCallTimes* ptimes;
+    int64_t nLocked;
+};
+
+#define RPC_LOCK(cs) CRPCLock rpclock(cs, #cs, __FILE__, __LINE__)
+#define RPC_LOCK2(cs1,cs2) CRPCLock rpclock1(cs1, #cs1, __FILE__, __LINE__),rpclock2(cs2, #cs2, __FILE__, __LINE__)
+
 typedef json_spirit::Value(*rpcfn_type)(const json_spirit::Array& params, bool fHelp);
 
+/*
+  Streaming implementation of a command, writing its result incrementally.
+  These run without the cs_main/cs_wallet locks execute() would take for the
+  command: they take what they need themselves, copying out a consistent
+  snapshot under one lock, and should not hold locks while writing out large
+  amounts of data to a possibly slow client.
+ */
+typedef void(*rpcstreamfn_type)(const json_spirit::Array& params, CJSONWriter& writer);
+
 class CRPCCommand
 {
 public:
@@ -69,6 +192,9 @@ class CRPCTable
 {
 private:
     std::map<std::string, const CRPCCommand*> mapCommands;
+    std::map<std::string, rpcstreamfn_type> mapStreamCommands;
+
+    const CRPCCommand* find(const std::string& strMethod) const;
 public:
     CRPCTable();
     const CRPCCommand* operator[](std::string name) const;
@@ -82,6 +208,12 @@ public:
      * @throws an exception (json_spirit::Value) when an error happens.
      */
     json_spirit::Value execute(const std::string &method, const json_spirit::Array &params) const;
+
+    /**
+     * Execute a method, writing the result to writer. Methods with a
+     * streaming implementation emit their result as it is generated.
+     */
+    void execute(const std::string &method, const json_spirit::Array &params, CJSONWriter& writer) const;
 };
 
 extern const CRPCTable tableRPC;
@@ -109,12 +241,24 @@ extern std::string HelpExampleRpc(std::string methodname, std::string args);
 
 extern void EnsureWalletIsUnlocked();
 
+class CBlock;
+class CTransaction;
+extern void blockToJSON(const CBlock& block, const CBlockIndex* blockindex, CJSONWriter& writer); // in rpcblockchain.cpp
+extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, json_spirit::Object& entry); // in rpcrawtransaction.cpp
+
+/*
+  Answer a request for one of the /rest/ URIs on stream. Returns whether the
+  connection can be kept open for further requests.
+ */
+extern bool HTTPReq_REST(std::iostream& stream, const std::string& strURI, bool fKeepAlive); // in rest.cpp
+
 extern json_spirit::Value getconnectioncount(const json_spirit::Array& params, bool fHelp); // in rpcnet.cpp
 extern json_spirit::Value getpeerinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value ping(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value addnode(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getaddednodeinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getnettotals(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getrpcinfo(const json_spirit::Array& params, bool fHelp); // in rpcserver.cpp
 
 extern json_spirit::Value dumpprivkey(const json_spirit::Array& params, bool fHelp); // in rpcdump.cpp
 extern json_spirit::Value importprivkey(const json_spirit::Array& params, bool fHelp);
@@ -147,11 +291,13 @@ extern json_spirit::Value getunconfirmedbalance(const json_spirit::Array& params
 extern json_spirit::Value movecmd(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value sendfrom(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value sendmany(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value sendbatch(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value addmultisigaddress(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value createmultisig(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listreceivedbyaddress(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listreceivedbyaccount(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listtransactions(const json_spirit::Array& params, bool fHelp);
+extern void listtransactions_stream(const json_spirit::Array& params, CJSONWriter& writer);
 extern json_spirit::Value listaddressgroupings(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listaccounts(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listsinceblock(const json_spirit::Array& params, bool fHelp);
@@ -163,6 +309,10 @@ extern json_spirit::Value walletpassphrasechange(const json_spirit::Array& param
 extern json_spirit::Value walletlock(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value encryptwallet(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value validateaddress(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getaddressutxos(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getaddresstxids(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getaddressbalance(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getspentinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getwalletinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblockchaininfo(const json_spirit::Array& params, bool fHelp);
@@ -170,6 +320,7 @@ extern json_spirit::Value getnetworkinfo(const json_spirit::Array& params, bool
 
 extern json_spirit::Value getrawtransaction(const json_spirit::Array& params, bool fHelp); // in rcprawtransaction.cpp
 extern json_spirit::Value listunspent(const json_spirit::Array& params, bool fHelp);
+extern void listunspent_stream(const json_spirit::Array& params, CJSONWriter& writer);
 extern json_spirit::Value lockunspent(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listlockunspent(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value createrawtransaction(const json_spirit::Array& params, bool fHelp);
@@ -183,8 +334,11 @@ extern json_spirit::Value getbestblockhash(const json_spirit::Array& params, boo
 extern json_spirit::Value getdifficulty(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value settxfee(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getrawmempool(const json_spirit::Array& params, bool fHelp);
+extern void getrawmempool_stream(const json_spirit::Array& params, CJSONWriter& writer);
+extern json_spirit::Value getmempoolinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblockhash(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblock(const json_spirit::Array& params, bool fHelp);
+extern void getblock_stream(const json_spirit::Array& params, CJSONWriter& writer);
 extern json_spirit::Value gettxoutsetinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value gettxout(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value verifychain(const json_spirit::Array& params, bool fHelp);
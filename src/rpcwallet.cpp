@@ -865,6 +865,117 @@ json_spirit::Value sendmany(const json_spirit::Array& params, bool fHelp)
     return wtx.GetHash().GetHex();
 }
 
+/** Most outputs sendbatch puts in one transaction, more would not fit MAX_STANDARD_TX_SIZE with their inputs */
+static const int MAX_BATCH_OUTPUTS_PER_TX = 2000;
+
+json_spirit::Value sendbatch(const json_spirit::Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw std::runtime_error(
+            "sendbatch [{\"address\":\"address\",\"amount\":amount},...] ( outputspertx \"comment\" )\n"
+            "\nSend many payments at once, in as many transactions as it takes. Coins are chosen for all\n"
+            "of them in one pass, the transactions are signed in parallel and stored and relayed together.\n"
+            "Amounts are double-precision floating point numbers."
+            + HelpRequiringPassphrase() + "\n"
+            "\nArguments:\n"
+            "1. \"payments\"            (array, required) A json array of payments, an address may appear more than once\n"
+            "    [\n"
+            "      {\n"
+            "        \"address\":\"address\",  (string, required) The auroracoin address to pay\n"
+            "        \"amount\":amount         (numeric, required) The amount in btc to pay it\n"
+            "      }\n"
+            "      ,...\n"
+            "    ]\n"
+            "2. outputspertx            (numeric, optional, default=250) Most payments in one transaction\n"
+            "3. \"comment\"             (string, optional) A comment stored with every transaction\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"txids\":[               (json array of string)\n"
+            "    \"transactionid\"      (string) The id of each transaction, in the order of the payments\n"
+            "    ,...\n"
+            "  ],\n"
+            "  \"rejected\":[            (json array of string) Transactions stored in the wallet but not relayed\n"
+            "    \"transactionid\"      (string) The id of a transaction the memory pool did not accept\n"
+            "    ,...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("sendbatch", "\"[{\\\"address\\\":\\\"1D1ZrZNe3JUo7ZycKEYQQiQAWd9y54F4XZ\\\",\\\"amount\\\":0.01},{\\\"address\\\":\\\"1353tsE8YMTA4EuV7dgUXGjNFf9KpVvKHz\\\",\\\"amount\\\":0.02}]\"") +
+            "\nAs a json rpc call\n"
+            + HelpExampleRpc("sendbatch", "[{\"address\":\"1D1ZrZNe3JUo7ZycKEYQQiQAWd9y54F4XZ\",\"amount\":0.01}], 100, \"payout\"")
+        );
+
+    RPCTypeCheck(params, boost::assign::list_of(json_spirit::array_type)(json_spirit::int_type)(json_spirit::str_type), true);
+
+    json_spirit::Array payments = params[0].get_array();
+    if (payments.empty())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, no payments");
+    int nOutputsPerTx = 250;
+    if (params.size() > 1 && params[1].type() != json_spirit::null_type)
+        nOutputsPerTx = params[1].get_int();
+    if (nOutputsPerTx < 1 || nOutputsPerTx > MAX_BATCH_OUTPUTS_PER_TX)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Invalid parameter, outputspertx must be between 1 and %d", MAX_BATCH_OUTPUTS_PER_TX));
+    std::string strComment;
+    if (params.size() > 2 && params[2].type() != json_spirit::null_type)
+        strComment = params[2].get_str();
+
+    std::vector<std::vector<std::pair<CScript, int64_t> > > vecSends;
+    int64_t totalAmount = 0;
+    BOOST_FOREACH(const json_spirit::Value& payment, payments)
+    {
+        const json_spirit::Object& o = payment.get_obj();
+        RPCTypeCheck(o, boost::assign::map_list_of("address", json_spirit::str_type));
+
+        std::string strAddress = find_value(o, "address").get_str();
+        CBitcoinAddress address(strAddress);
+        if (!address.IsValid())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, std::string("Invalid Auroracoin address: ")+strAddress);
+
+        CScript scriptPubKey;
+        scriptPubKey.SetDestination(address.Get());
+        int64_t nAmount = AmountFromValue(find_value(o, "amount"));
+        totalAmount += nAmount;
+
+        if (vecSends.empty() || vecSends.back().size() == (size_t)nOutputsPerTx)
+            vecSends.push_back(std::vector<std::pair<CScript, int64_t> >());
+        vecSends.back().push_back(make_pair(scriptPubKey, nAmount));
+    }
+
+    EnsureWalletIsUnlocked();
+
+    if (totalAmount > pwalletMain->GetBalance())
+        throw JSONRPCError(RPC_WALLET_INSUFFICIENT_FUNDS, "Insufficient funds");
+
+    std::vector<CWalletTx> vwtx;
+    std::list<CReserveKey> keysChange;
+    int64_t nFeeRequired = 0;
+    std::string strFailReason;
+    if (!pwalletMain->CreateTransactionBatch(vecSends, vwtx, keysChange, nFeeRequired, strFailReason))
+        throw JSONRPCError(RPC_WALLET_INSUFFICIENT_FUNDS, strFailReason);
+    if (!strComment.empty())
+    {
+        BOOST_FOREACH(CWalletTx& wtx, vwtx)
+            wtx.mapValue["comment"] = strComment;
+    }
+    std::vector<uint256> vRejected;
+    if (!pwalletMain->CommitTransactionBatch(vwtx, keysChange, vRejected))
+        throw JSONRPCError(RPC_WALLET_ERROR, "Transaction commit failed");
+
+    // Once stored, the transactions are always returned, so that a retry
+    // does not pay the same recipients again
+    json_spirit::Array txids;
+    BOOST_FOREACH(const CWalletTx& wtx, vwtx)
+        txids.push_back(wtx.GetHash().GetHex());
+    json_spirit::Array rejected;
+    BOOST_FOREACH(const uint256& hash, vRejected)
+        rejected.push_back(hash.GetHex());
+
+    json_spirit::Object ret;
+    ret.push_back(json_spirit::Pair("txids", txids));
+    ret.push_back(json_spirit::Pair("rejected", rejected));
+    return ret;
+}
+
 // Defined in rpcmisc.cpp
 extern CScript _createmultisig(const json_spirit::Array& params);
 
@@ -1226,6 +1337,16 @@ json_spirit::Value listtransactions(const json_spirit::Array& params, bool fHelp
             + HelpExampleRpc("listtransactions", "\"tabby\", 20, 100")
         );
 
+    CJSONValueWriter writer;
+    listtransactions_stream(params, writer);
+    return writer.get();
+}
+
+void listtransactions_stream(const json_spirit::Array& params, CJSONWriter& writer)
+{
+    if (params.size() > 3)
+        listtransactions(params, true); // throws the usage text
+
     std::string strAccount = "*";
     if (params.size() > 0)
         strAccount = params[0].get_str();
@@ -1243,20 +1364,26 @@ json_spirit::Value listtransactions(const json_spirit::Array& params, bool fHelp
 
     json_spirit::Array ret;
 
-    std::list<CAccountingEntry> acentries;
-    CWallet::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, strAccount);
-
-    // iterate backwards until we have nCount items to return:
-    for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+    // The entries read the wallet and the chain, so they are all taken under
+    // the locks at once and written out after they are released; count
+    // bounds how many there are.
     {
-        CWalletTx *const pwtx = (*it).second.first;
-        if (pwtx != 0)
-            ListTransactions(*pwtx, strAccount, 0, true, ret);
-        CAccountingEntry *const pacentry = (*it).second.second;
-        if (pacentry != 0)
-            AcentryToJSON(*pacentry, strAccount, ret);
-
-        if ((int)ret.size() >= (nCount+nFrom)) break;
+        RPC_LOCK2(cs_main, pwalletMain->cs_wallet);
+        std::list<CAccountingEntry> acentries;
+        CWallet::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, strAccount);
+
+        // iterate backwards until we have nCount items to return:
+        for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+        {
+            CWalletTx *const pwtx = (*it).second.first;
+            if (pwtx != 0)
+                ListTransactions(*pwtx, strAccount, 0, true, ret);
+            CAccountingEntry *const pacentry = (*it).second.second;
+            if (pacentry != 0)
+                AcentryToJSON(*pacentry, strAccount, ret);
+
+            if ((int)ret.size() >= (nCount+nFrom)) break;
+        }
     }
     // ret is newest to oldest
 
@@ -1272,9 +1399,11 @@ json_spirit::Value listtransactions(const json_spirit::Array& params, bool fHelp
     if (last != ret.end()) ret.erase(last, ret.end());
     if (first != ret.begin()) ret.erase(ret.begin(), first);
 
-    std::reverse(ret.begin(), ret.end()); // Return oldest to newest
-
-    return ret;
+    // Return oldest to newest
+    writer.beginArray();
+    for (json_spirit::Array::reverse_iterator it = ret.rbegin(); it != ret.rend(); ++it)
+        writer.value(*it);
+    writer.endArray();
 }
 
 json_spirit::Value listaccounts(const json_spirit::Array& params, bool fHelp)
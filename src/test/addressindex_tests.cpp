@@ -0,0 +1,206 @@
+// Copyright (c) 2018 The Auroracoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "serialize.h"
+#include "txdb.h"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+typedef vector<pair<CAddressIndexKey, int64_t> > AddressIndexVec;
+typedef vector<pair<CAddressUnspentKey, CAddressUnspentValue> > AddressUnspentVec;
+typedef vector<pair<CSpentIndexKey, CSpentIndexValue> > SpentIndexVec;
+
+// The database key of an address index entry, as LevelDB orders it
+static string AddressIndexDBKey(const CAddressIndexKey& key)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << make_pair('a', key);
+    return ss.str();
+}
+
+static bool WriteIndexes(CBlockTreeDB& blocktree, const AddressIndexVec& vAddressIndex, bool fErase,
+                         const AddressUnspentVec& vAddressUnspent, const SpentIndexVec& vSpentIndex,
+                         const uint256& hashBlock = 0)
+{
+    CLevelDBBatch batch;
+    blocktree.UpdateAddressIndex(batch, vAddressIndex, fErase);
+    blocktree.UpdateAddressUnspentIndex(batch, vAddressUnspent);
+    blocktree.UpdateSpentIndex(batch, vSpentIndex);
+    blocktree.WriteAddressIndexBestBlock(batch, hashBlock);
+    return blocktree.WriteBatch(batch);
+}
+
+BOOST_AUTO_TEST_SUITE(addressindex_tests)
+
+BOOST_AUTO_TEST_CASE(addressindex_key_serialize)
+{
+    uint160 hashScript = Hash160(CScript() << OP_TRUE);
+    uint256 txhash = GetRandHash();
+    // Heights with the top bit of each byte set, and the largest one
+    int heights[] = { 0, 1, 0x80, 0x8000, 0x800000, 0x7f808080, 0x7fffffff };
+    for (unsigned int i = 0; i < sizeof(heights) / sizeof(heights[0]); i++) {
+        CAddressIndexKey key(hashScript, heights[i], txhash, 3, true);
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << key;
+        BOOST_CHECK_EQUAL(ss.size(), key.GetSerializeSize(SER_DISK, CLIENT_VERSION));
+        // big endian after the script hash
+        BOOST_CHECK_EQUAL((unsigned char)ss[20], (unsigned char)(heights[i] >> 24));
+        BOOST_CHECK_EQUAL((unsigned char)ss[23], (unsigned char)heights[i]);
+
+        CAddressIndexKey key2;
+        ss >> key2;
+        BOOST_CHECK(key2.hashScript == hashScript);
+        BOOST_CHECK_EQUAL(key2.nHeight, heights[i]);
+        BOOST_CHECK(key2.txhash == txhash);
+        BOOST_CHECK_EQUAL(key2.nIndex, 3U);
+        BOOST_CHECK(key2.fSpending);
+        BOOST_CHECK(ss.empty());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_key_order)
+{
+    uint160 hashScript1 = Hash160(CScript() << OP_1);
+    uint160 hashScript2 = Hash160(CScript() << OP_2);
+    if (AddressIndexDBKey(CAddressIndexKey(hashScript2, 0, 0, 0, false)) < AddressIndexDBKey(CAddressIndexKey(hashScript1, 0, 0, 0, false)))
+        swap(hashScript1, hashScript2);
+    uint256 txhashLow = 0, txhashHigh = ~uint256(0);
+
+    // The script comes first, whatever the height and txid
+    BOOST_CHECK(AddressIndexDBKey(CAddressIndexKey(hashScript1, 0x7fffffff, txhashHigh, 9, true)) <
+                AddressIndexDBKey(CAddressIndexKey(hashScript2, 0, txhashLow, 0, false)));
+
+    // then the height, numerically, whatever the txid
+    int heights[] = { 0, 1, 0xff, 0x100, 0xffff, 0x10000, 0x800000, 0x1000000 };
+    for (unsigned int i = 1; i < sizeof(heights) / sizeof(heights[0]); i++)
+        BOOST_CHECK(AddressIndexDBKey(CAddressIndexKey(hashScript1, heights[i-1], txhashHigh, 9, true)) <
+                    AddressIndexDBKey(CAddressIndexKey(hashScript1, heights[i], txhashLow, 0, false)));
+
+    // then the txid, as stored
+    BOOST_CHECK(AddressIndexDBKey(CAddressIndexKey(hashScript1, 5, txhashLow, 9, true)) <
+                AddressIndexDBKey(CAddressIndexKey(hashScript1, 5, txhashHigh, 0, false)));
+
+    // A range read returns a script's entries in chain order
+    CBlockTreeDB blocktree(1 << 20, true);
+    AddressIndexVec vAddressIndex;
+    for (int i = 0x200; i >= 0; i -= 0x80) {
+        vAddressIndex.push_back(make_pair(CAddressIndexKey(hashScript1, i, GetRandHash(), 0, false), (int64_t)i));
+        vAddressIndex.push_back(make_pair(CAddressIndexKey(hashScript2, i, GetRandHash(), 0, false), (int64_t)i));
+    }
+    BOOST_CHECK(WriteIndexes(blocktree, vAddressIndex, false, AddressUnspentVec(), SpentIndexVec()));
+
+    AddressIndexVec vEntries;
+    BOOST_CHECK(blocktree.ReadAddressIndex(hashScript1, vEntries));
+    BOOST_CHECK_EQUAL(vEntries.size(), 5U);
+    for (unsigned int i = 0; i < vEntries.size(); i++) {
+        BOOST_CHECK(vEntries[i].first.hashScript == hashScript1);
+        BOOST_CHECK_EQUAL(vEntries[i].first.nHeight, (int)i * 0x80);
+    }
+
+    vEntries.clear();
+    BOOST_CHECK(blocktree.ReadAddressIndex(hashScript2, vEntries, 0x80, 0x100));
+    BOOST_CHECK_EQUAL(vEntries.size(), 2U);
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_connect_disconnect)
+{
+    CBlockTreeDB blocktree(1 << 20, true);
+    uint160 hashScriptFrom = Hash160(CScript() << OP_1);
+    uint160 hashScriptTo = Hash160(CScript() << OP_2);
+    uint256 txhashFund = GetRandHash(), txhashSpend = GetRandHash();
+    uint256 hashBlock1 = GetRandHash(), hashBlock2 = GetRandHash(), hashBest;
+    BOOST_CHECK(!blocktree.ReadAddressIndexBestBlock(hashBest));
+
+    // Height 1: txhashFund pays 50 to hashScriptFrom, as ConnectBlock records it
+    AddressIndexVec vAddressIndex1;
+    AddressUnspentVec vAddressUnspent1;
+    vAddressIndex1.push_back(make_pair(CAddressIndexKey(hashScriptFrom, 1, txhashFund, 0, false), 50 * COIN));
+    vAddressUnspent1.push_back(make_pair(CAddressUnspentKey(hashScriptFrom, txhashFund, 0), CAddressUnspentValue(50 * COIN, 1)));
+    BOOST_CHECK(WriteIndexes(blocktree, vAddressIndex1, false, vAddressUnspent1, SpentIndexVec(), hashBlock1));
+
+    // Height 2: txhashSpend spends it, paying 49 to hashScriptTo
+    AddressIndexVec vAddressIndex2;
+    AddressUnspentVec vAddressUnspent2;
+    SpentIndexVec vSpentIndex2;
+    vAddressIndex2.push_back(make_pair(CAddressIndexKey(hashScriptFrom, 2, txhashSpend, 0, true), -50 * COIN));
+    vAddressUnspent2.push_back(make_pair(CAddressUnspentKey(hashScriptFrom, txhashFund, 0), CAddressUnspentValue()));
+    vSpentIndex2.push_back(make_pair(CSpentIndexKey(txhashFund, 0), CSpentIndexValue(txhashSpend, 0, 2)));
+    vAddressIndex2.push_back(make_pair(CAddressIndexKey(hashScriptTo, 2, txhashSpend, 0, false), 49 * COIN));
+    vAddressUnspent2.push_back(make_pair(CAddressUnspentKey(hashScriptTo, txhashSpend, 0), CAddressUnspentValue(49 * COIN, 2)));
+    BOOST_CHECK(WriteIndexes(blocktree, vAddressIndex2, false, vAddressUnspent2, vSpentIndex2, hashBlock2));
+    BOOST_CHECK(blocktree.ReadAddressIndexBestBlock(hashBest));
+    BOOST_CHECK(hashBest == hashBlock2);
+
+    AddressIndexVec vEntries;
+    AddressUnspentVec vUnspent;
+    CSpentIndexValue spent;
+    BOOST_CHECK(blocktree.ReadAddressIndex(hashScriptFrom, vEntries));
+    BOOST_CHECK_EQUAL(vEntries.size(), 2U);
+    BOOST_CHECK(!vEntries[0].first.fSpending && vEntries[0].second == 50 * COIN);
+    BOOST_CHECK(vEntries[1].first.fSpending && vEntries[1].second == -50 * COIN);
+    BOOST_CHECK(blocktree.ReadAddressUnspentIndex(hashScriptFrom, vUnspent));
+    BOOST_CHECK(vUnspent.empty());
+    BOOST_CHECK(blocktree.ReadAddressUnspentIndex(hashScriptTo, vUnspent));
+    BOOST_CHECK_EQUAL(vUnspent.size(), 1U);
+    BOOST_CHECK(vUnspent[0].first.txhash == txhashSpend && vUnspent[0].second.nValue == 49 * COIN);
+    BOOST_CHECK(blocktree.ReadSpentIndex(CSpentIndexKey(txhashFund, 0), spent));
+    BOOST_CHECK(spent.txid == txhashSpend && spent.nIndex == 0 && spent.nHeight == 2);
+    CAddressBalanceValue balance;
+    BOOST_CHECK(blocktree.ReadAddressBalance(hashScriptFrom, balance));
+    BOOST_CHECK(balance.nBalance == 0 && balance.nReceived == 50 * COIN);
+    BOOST_CHECK(blocktree.ReadAddressBalance(hashScriptTo, balance));
+    BOOST_CHECK(balance.nBalance == 49 * COIN && balance.nReceived == 49 * COIN);
+
+    // Disconnect height 2, as DisconnectBlock records it: the new output
+    // goes, and the spent one comes back
+    AddressIndexVec vAddressIndexUndo;
+    AddressUnspentVec vAddressUnspentUndo;
+    SpentIndexVec vSpentIndexUndo;
+    vAddressIndexUndo.push_back(make_pair(CAddressIndexKey(hashScriptTo, 2, txhashSpend, 0, false), 49 * COIN));
+    vAddressUnspentUndo.push_back(make_pair(CAddressUnspentKey(hashScriptTo, txhashSpend, 0), CAddressUnspentValue()));
+    vAddressIndexUndo.push_back(make_pair(CAddressIndexKey(hashScriptFrom, 2, txhashSpend, 0, true), -50 * COIN));
+    vAddressUnspentUndo.push_back(make_pair(CAddressUnspentKey(hashScriptFrom, txhashFund, 0), CAddressUnspentValue(50 * COIN, 1)));
+    vSpentIndexUndo.push_back(make_pair(CSpentIndexKey(txhashFund, 0), CSpentIndexValue()));
+    BOOST_CHECK(WriteIndexes(blocktree, vAddressIndexUndo, true, vAddressUnspentUndo, vSpentIndexUndo, hashBlock1));
+    BOOST_CHECK(blocktree.ReadAddressIndexBestBlock(hashBest));
+    BOOST_CHECK(hashBest == hashBlock1);
+
+    vEntries.clear();
+    BOOST_CHECK(blocktree.ReadAddressIndex(hashScriptFrom, vEntries));
+    BOOST_CHECK_EQUAL(vEntries.size(), 1U);
+    BOOST_CHECK(vEntries[0].first.txhash == txhashFund && vEntries[0].second == 50 * COIN);
+    vEntries.clear();
+    BOOST_CHECK(blocktree.ReadAddressIndex(hashScriptTo, vEntries));
+    BOOST_CHECK(vEntries.empty());
+    vUnspent.clear();
+    BOOST_CHECK(blocktree.ReadAddressUnspentIndex(hashScriptFrom, vUnspent));
+    BOOST_CHECK_EQUAL(vUnspent.size(), 1U);
+    BOOST_CHECK(vUnspent[0].first.txhash == txhashFund && vUnspent[0].second.nValue == 50 * COIN && vUnspent[0].second.nHeight == 1);
+    vUnspent.clear();
+    BOOST_CHECK(blocktree.ReadAddressUnspentIndex(hashScriptTo, vUnspent));
+    BOOST_CHECK(vUnspent.empty());
+    BOOST_CHECK(!blocktree.ReadSpentIndex(CSpentIndexKey(txhashFund, 0), spent));
+    BOOST_CHECK(blocktree.ReadAddressBalance(hashScriptFrom, balance));
+    BOOST_CHECK(balance.nBalance == 50 * COIN && balance.nReceived == 50 * COIN);
+    // totals back at zero are removed
+    BOOST_CHECK(!blocktree.ReadAddressBalance(hashScriptTo, balance));
+
+    // and disconnecting height 1 empties the index
+    AddressUnspentVec vAddressUnspentUndo1;
+    vAddressUnspentUndo1.push_back(make_pair(CAddressUnspentKey(hashScriptFrom, txhashFund, 0), CAddressUnspentValue()));
+    BOOST_CHECK(WriteIndexes(blocktree, vAddressIndex1, true, vAddressUnspentUndo1, SpentIndexVec()));
+    vEntries.clear();
+    BOOST_CHECK(blocktree.ReadAddressIndex(hashScriptFrom, vEntries));
+    BOOST_CHECK(vEntries.empty());
+    BOOST_CHECK(!blocktree.ReadAddressBalance(hashScriptFrom, balance));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
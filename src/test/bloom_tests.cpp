@@ -451,4 +451,30 @@ BOOST_AUTO_TEST_CASE(merkle_block_4_test_update_none)
     BOOST_CHECK(!filter.contains(COutPoint(uint256("0x02981fa052f0481dbc5868f4fc2166035a10f27a03cfd2de67326471df5bc041"), 0)));
 }
 
+BOOST_AUTO_TEST_CASE(rolling_bloom)
+{
+    // Remembers at least the last 50 inserted items
+    CRollingBloomFilter rb(100, 0.000001, 0);
+    std::vector<uint256> vHashes;
+    for (int i = 0; i < 400; i++)
+    {
+        uint256 hash = GetRandHash();
+        vHashes.push_back(hash);
+        rb.insert(hash);
+        for (int j = std::max(0, i - 49); j <= i; j++)
+            BOOST_CHECK(rb.contains(vHashes[j]));
+    }
+
+    // ... and forgets older ones, apart from the odd false positive
+    int nFound = 0;
+    for (int i = 0; i < 250; i++)
+        if (rb.contains(vHashes[i]))
+            nFound++;
+    BOOST_CHECK(nFound <= 2);
+
+    rb.clear();
+    for (int i = 0; i < 400; i++)
+        BOOST_CHECK(!rb.contains(vHashes[i]));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,167 @@
+// Copyright (c) 2018 The Auroracoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "serialize.h"
+#include "txmempool.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+static CBlock BuildBlock(unsigned int nTx)
+{
+    CBlock block;
+    block.nBits = 0x1e0ffff0;
+    for (unsigned int i = 0; i < nTx; i++) {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vin[0].prevout.n = i;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = i * CENT;
+        block.vtx.push_back(tx);
+    }
+    block.vtx[0].vin[0].prevout.SetNull();
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+static void AddToPool(CTxMemPool& pool, const CTransaction& tx)
+{
+    pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 0, 0, 0.0, 1));
+}
+
+BOOST_AUTO_TEST_SUITE(compactblock_tests)
+
+BOOST_AUTO_TEST_CASE(compactblock_serialize)
+{
+    CBlock block = BuildBlock(10);
+    CCompactBlock cmpctblock(block);
+    BOOST_CHECK_EQUAL(cmpctblock.BlockTxCount(), 10U);
+    BOOST_CHECK_EQUAL(cmpctblock.vPrefilledTxn.size(), 1U);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << cmpctblock;
+    CCompactBlock cmpctblock2;
+    ss >> cmpctblock2;
+
+    BOOST_CHECK(cmpctblock2.header.GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(cmpctblock2.nNonce, cmpctblock.nNonce);
+    BOOST_CHECK_EQUAL(cmpctblock2.vShortTxIDs.size(), 9U);
+    for (unsigned int i = 1; i < block.vtx.size(); i++) {
+        uint64_t nShortID = cmpctblock2.GetShortID(block.vtx[i].GetHash());
+        BOOST_CHECK(nShortID < (1ULL << 48));
+        BOOST_CHECK_EQUAL(cmpctblock2.vShortTxIDs[i-1].GetUint64(), nShortID);
+    }
+
+    // short ids are 6 bytes on the wire
+    CDataStream ssID(SER_NETWORK, PROTOCOL_VERSION);
+    ssID << cmpctblock.vShortTxIDs[0];
+    BOOST_CHECK_EQUAL(ssID.size(), 6U);
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_fill)
+{
+    CBlock block = BuildBlock(6);
+    CCompactBlock cmpctblock(block);
+
+    CTxMemPool pool;
+    AddToPool(pool, block.vtx[2]);
+    AddToPool(pool, block.vtx[4]);
+    AddToPool(pool, BuildBlock(2).vtx[1]); // unrelated
+
+    CBlock block2;
+    vector<unsigned int> vMissing;
+    BOOST_CHECK(cmpctblock.FillBlock(block2, pool, vMissing));
+    BOOST_CHECK_EQUAL(vMissing.size(), 3U);
+    BOOST_CHECK_EQUAL(vMissing[0], 1U);
+    BOOST_CHECK_EQUAL(vMissing[1], 3U);
+    BOOST_CHECK_EQUAL(vMissing[2], 5U);
+    BOOST_CHECK(block2.vtx[0].GetHash() == block.vtx[0].GetHash());
+    BOOST_CHECK(block2.vtx[2].GetHash() == block.vtx[2].GetHash());
+    BOOST_CHECK(block2.vtx[4].GetHash() == block.vtx[4].GetHash());
+
+    // supply the rest as blocktxn would
+    BOOST_FOREACH(unsigned int nIndex, vMissing)
+        block2.vtx[nIndex] = block.vtx[nIndex];
+    BOOST_CHECK(block2.BuildMerkleTree() == block.hashMerkleRoot);
+    BOOST_CHECK(block2.GetHash() == block.GetHash());
+
+    // everything in the pool: nothing to request
+    AddToPool(pool, block.vtx[1]);
+    AddToPool(pool, block.vtx[3]);
+    AddToPool(pool, block.vtx[5]);
+    BOOST_CHECK(cmpctblock.FillBlock(block2, pool, vMissing));
+    BOOST_CHECK(vMissing.empty());
+    BOOST_CHECK(block2.BuildMerkleTree() == block.hashMerkleRoot);
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_malformed)
+{
+    CBlock block = BuildBlock(4);
+    CTxMemPool pool;
+    CBlock block2;
+    vector<unsigned int> vMissing;
+
+    // prefilled index out of range
+    CCompactBlock cmpctblock(block);
+    cmpctblock.vPrefilledTxn[0].nIndex = 4;
+    BOOST_CHECK(!cmpctblock.FillBlock(block2, pool, vMissing));
+
+    // the same short id twice
+    cmpctblock = CCompactBlock(block);
+    cmpctblock.vShortTxIDs[1] = cmpctblock.vShortTxIDs[0];
+    BOOST_CHECK(!cmpctblock.FillBlock(block2, pool, vMissing));
+
+    // no transactions at all
+    cmpctblock = CCompactBlock(block);
+    cmpctblock.vShortTxIDs.clear();
+    cmpctblock.vPrefilledTxn.clear();
+    BOOST_CHECK(!cmpctblock.FillBlock(block2, pool, vMissing));
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_blocktxn_request)
+{
+    CBlockTxRequest req;
+    req.blockhash = GetRandHash();
+    req.vIndexes.push_back(0);
+    req.vIndexes.push_back(1);
+    req.vIndexes.push_back(5);
+    req.vIndexes.push_back(6);
+
+    // Sent as the gaps between the indexes: 0, 0, 3, 0
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << req;
+    CDataStream ssCopy(ss);
+    uint256 hash;
+    vector<unsigned int> vDiffs;
+    ssCopy >> hash >> vDiffs;
+    BOOST_CHECK_EQUAL(vDiffs.size(), 4U);
+    BOOST_CHECK_EQUAL(vDiffs[2], 3U);
+
+    CBlockTxRequest req2;
+    ss >> req2;
+    BOOST_CHECK(req2.blockhash == req.blockhash);
+    BOOST_CHECK(req2.vIndexes == req.vIndexes);
+
+    // Repeating an index can't be expressed, a peer sending the same gap
+    // over and over asks for ever higher ones
+    vDiffs.assign(1000, 0);
+    CDataStream ssRepeat(SER_NETWORK, PROTOCOL_VERSION);
+    ssRepeat << hash << vDiffs;
+    ssRepeat >> req2;
+    BOOST_CHECK_EQUAL(req2.vIndexes.size(), 1000U);
+    BOOST_CHECK_EQUAL(req2.vIndexes.back(), 999U);
+
+    // Indexes past what an unsigned int holds are refused
+    vDiffs.assign(2, std::numeric_limits<unsigned int>::max());
+    CDataStream ssOverflow(SER_NETWORK, PROTOCOL_VERSION);
+    ssOverflow << hash << vDiffs;
+    BOOST_CHECK_THROW(ssOverflow >> req2, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -5,6 +5,7 @@
 #include "key.h"
 
 #include "base58.h"
+#include "keystore.h"
 #include "script.h"
 #include "uint256.h"
 #include "util.h"
@@ -144,4 +145,76 @@ BOOST_AUTO_TEST_CASE(key_test1)
     }
 }
 
+BOOST_AUTO_TEST_CASE(key_deterministic_sign)
+{
+    // The secrets of strSecret1 and strSecret2
+    vector<unsigned char> vchSecret1 = ParseHex("12b004fff7f4b69ef8650e767f18f11ede158148b425660723b9f9a66e61f747");
+    vector<unsigned char> vchSecret2 = ParseHex("b524c28b61c9b2c49b2c7dd4c2d75887abb78768c054bd7c01af4029f6c0d117");
+    CKey key1, key2, key1C, key2C;
+    key1.Set (vchSecret1.begin(), vchSecret1.end(), false);
+    key2.Set (vchSecret2.begin(), vchSecret2.end(), false);
+    key1C.Set(vchSecret1.begin(), vchSecret1.end(), true);
+    key2C.Set(vchSecret2.begin(), vchSecret2.end(), true);
+
+    string strMsg = "Very deterministic message";
+    uint256 hashMsg = Hash(strMsg.begin(), strMsg.end());
+
+    // RFC6979 nonces: the signature only depends on the secret and the hash
+    vector<unsigned char> detsig, detsigc;
+    BOOST_CHECK(key1.Sign(hashMsg, detsig));
+    BOOST_CHECK(key1C.Sign(hashMsg, detsigc));
+    BOOST_CHECK(detsig == detsigc);
+    BOOST_CHECK(detsig == ParseHex("304402205dbbddda71772d95ce91cd2d14b592cfbc1dd0aabd6a394b6c2d377bbe59d31d022014ddda21494a4e221f0824f0b8b924c43fa43c0ad57dccdaa11f81a6bd4582f6"));
+    BOOST_CHECK(key2.Sign(hashMsg, detsig));
+    BOOST_CHECK(key2C.Sign(hashMsg, detsigc));
+    BOOST_CHECK(detsig == detsigc);
+    BOOST_CHECK(detsig == ParseHex("3044022052d8a32079c11e79db95af63bb9600c5b04f21a9ca33dc129c2bfa8ac9dc1cd5022061d8ae5e0f6c1a16bde3719c64c2fd70e404b6428ab9a69566962e8771b5944d"));
+
+    BOOST_CHECK(key1.SignCompact(hashMsg, detsig));
+    BOOST_CHECK(key1C.SignCompact(hashMsg, detsigc));
+    BOOST_CHECK(detsig == ParseHex("1c5dbbddda71772d95ce91cd2d14b592cfbc1dd0aabd6a394b6c2d377bbe59d31d14ddda21494a4e221f0824f0b8b924c43fa43c0ad57dccdaa11f81a6bd4582f6"));
+    BOOST_CHECK(detsigc == ParseHex("205dbbddda71772d95ce91cd2d14b592cfbc1dd0aabd6a394b6c2d377bbe59d31d14ddda21494a4e221f0824f0b8b924c43fa43c0ad57dccdaa11f81a6bd4582f6"));
+    BOOST_CHECK(key2.SignCompact(hashMsg, detsig));
+    BOOST_CHECK(key2C.SignCompact(hashMsg, detsigc));
+    BOOST_CHECK(detsig == ParseHex("1c52d8a32079c11e79db95af63bb9600c5b04f21a9ca33dc129c2bfa8ac9dc1cd561d8ae5e0f6c1a16bde3719c64c2fd70e404b6428ab9a69566962e8771b5944d"));
+    BOOST_CHECK(detsigc == ParseHex("2052d8a32079c11e79db95af63bb9600c5b04f21a9ca33dc129c2bfa8ac9dc1cd561d8ae5e0f6c1a16bde3719c64c2fd70e404b6428ab9a69566962e8771b5944d"));
+}
+
+BOOST_AUTO_TEST_CASE(key_sign_verify)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+
+    for (int i = 0; i < 4; i++)
+    {
+        uint256 hash = Hash(BEGIN(i), END(i));
+        vector<unsigned char> vchSig;
+        BOOST_CHECK(key.Sign(hash, vchSig));
+        BOOST_CHECK(pubkey.Verify(hash, vchSig));
+    }
+
+    // Signing throughput
+    const int nSigs = 1000;
+    vector<uint256> vHashes;
+    for (int i = 0; i < nSigs; i++)
+        vHashes.push_back(Hash(BEGIN(i), END(i)));
+    vector<vector<unsigned char> > vSigs(nSigs);
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < nSigs; i++)
+        BOOST_CHECK(key.Sign(vHashes[i], vSigs[i]));
+    int64_t nElapsed = std::max(GetTimeMicros() - nStart, (int64_t)1);
+    if (fDebug) printf("key_sign_verify: %d signatures: %ldus, %ld signatures per second\n",
+                       nSigs, (long)nElapsed, (long)(nSigs * 1000000LL / nElapsed));
+    for (int i = 0; i < nSigs; i += 50)
+        BOOST_CHECK(pubkey.Verify(vHashes[i], vSigs[i]));
+
+    // Signing through a key store looks the public key up instead of recomputing it
+    CBasicKeyStore keystore;
+    keystore.AddKeyPubKey(key, pubkey);
+    CPubKey pubkeyStored;
+    BOOST_CHECK(keystore.GetPubKey(pubkey.GetID(), pubkeyStored));
+    BOOST_CHECK(pubkeyStored == pubkey);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
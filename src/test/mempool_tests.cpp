@@ -0,0 +1,244 @@
+// Copyright (c) 2018 The Auroracoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "txmempool.h"
+
+#include <list>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+// A transaction spending output n of each parent, or an outside coin if none
+static CTransaction MakeTx(const vector<CTransaction>& vParents, unsigned int nOutputs)
+{
+    CTransaction tx;
+    if (vParents.empty()) {
+        tx.vin.resize(1);
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vin[0].prevout.n = 0;
+    }
+    for (unsigned int i = 0; i < vParents.size(); i++) {
+        tx.vin.push_back(CTxIn(COutPoint(vParents[i].GetHash(), 0)));
+    }
+    tx.vout.resize(nOutputs);
+    for (unsigned int i = 0; i < nOutputs; i++) {
+        tx.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx.vout[i].nValue = 33000LL;
+    }
+    return tx;
+}
+
+static void AddToPool(CTxMemPool& pool, const CTransaction& tx, int64_t nFee, int64_t nTime = 0)
+{
+    pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, nFee, nTime, 0.0, 1));
+}
+
+static const CTxMemPoolEntry& Entry(CTxMemPool& pool, const CTransaction& tx)
+{
+    CTxMemPool::txiter it = pool.mapTx.find(tx.GetHash());
+    assert(it != pool.mapTx.end());
+    return *it;
+}
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+BOOST_AUTO_TEST_CASE(MempoolAncestorDescendantTotals)
+{
+    CTxMemPool pool;
+    pool.setSanityCheck(true);
+    CCoinsView coinsDummy;
+    CCoinsViewCache coins(coinsDummy);
+
+    //   parent
+    //   |    |
+    // child1 child2
+    //   |    |
+    //  grandchild
+    CTransaction txParent = MakeTx(vector<CTransaction>(), 2);
+    CCoins coinsIn;
+    coinsIn.vout.resize(1);
+    coinsIn.vout[0].nValue = 100000;
+    coins.SetCoins(txParent.vin[0].prevout.hash, coinsIn);
+    AddToPool(pool, txParent, 1000);
+    CTransaction txChild1 = MakeTx(vector<CTransaction>(1, txParent), 1);
+    AddToPool(pool, txChild1, 2000);
+    CTransaction txChild2;
+    txChild2.vin.push_back(CTxIn(COutPoint(txParent.GetHash(), 1)));
+    txChild2.vout = txChild1.vout;
+    txChild2.vout[0].nValue++;
+    AddToPool(pool, txChild2, 3000);
+    vector<CTransaction> vParents;
+    vParents.push_back(txChild1);
+    vParents.push_back(txChild2);
+    CTransaction txGrandChild = MakeTx(vParents, 1);
+    AddToPool(pool, txGrandChild, 4000);
+
+    BOOST_CHECK_EQUAL(pool.size(), 4U);
+    const CTxMemPoolEntry& parent = Entry(pool, txParent);
+    BOOST_CHECK_EQUAL(parent.GetCountWithDescendants(), 4U);
+    BOOST_CHECK_EQUAL(parent.GetFeesWithDescendants(), 10000);
+    BOOST_CHECK_EQUAL(parent.GetCountWithAncestors(), 1U);
+    const CTxMemPoolEntry& grandchild = Entry(pool, txGrandChild);
+    // The parent is counted once even though it is reached twice
+    BOOST_CHECK_EQUAL(grandchild.GetCountWithAncestors(), 4U);
+    BOOST_CHECK_EQUAL(grandchild.GetFeesWithAncestors(), 10000);
+    BOOST_CHECK_EQUAL(grandchild.GetSizeWithAncestors(), parent.GetSizeWithDescendants());
+    BOOST_CHECK_EQUAL(pool.GetMemPoolParents(pool.mapTx.find(txGrandChild.GetHash())).size(), 2U);
+    pool.check(&coins);
+
+    // Mined parent: the rest stays and forgets about it
+    coins.SetCoins(txParent.GetHash(), CCoins(txParent, 2));
+    list<CTransaction> removed;
+    pool.remove(txParent, removed);
+    BOOST_CHECK_EQUAL(removed.size(), 1U);
+    BOOST_CHECK_EQUAL(Entry(pool, txGrandChild).GetCountWithAncestors(), 3U);
+    BOOST_CHECK_EQUAL(Entry(pool, txChild1).GetCountWithAncestors(), 1U);
+    BOOST_CHECK_EQUAL(Entry(pool, txChild1).GetCountWithDescendants(), 2U);
+    pool.check(&coins);
+
+    // Block disconnected: the parent comes back after its children
+    AddToPool(pool, txParent, 1000);
+    BOOST_CHECK_EQUAL(Entry(pool, txParent).GetCountWithDescendants(), 4U);
+    BOOST_CHECK_EQUAL(Entry(pool, txGrandChild).GetCountWithAncestors(), 4U);
+    BOOST_CHECK_EQUAL(Entry(pool, txChild2).GetFeesWithAncestors(), 4000);
+    pool.check(&coins);
+
+    // Conflict: everything that depends on child1 goes, parents first
+    removed.clear();
+    pool.remove(txChild1, removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 2U);
+    BOOST_CHECK(removed.front() == txChild1);
+    BOOST_CHECK_EQUAL(Entry(pool, txParent).GetCountWithDescendants(), 2U);
+    BOOST_CHECK_EQUAL(Entry(pool, txParent).GetFeesWithDescendants(), 4000);
+    pool.check(&coins);
+
+    pool.clear();
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
+{
+    CTxMemPool pool;
+
+    // Same size, different fees and times
+    CTransaction tx1 = MakeTx(vector<CTransaction>(), 1);
+    AddToPool(pool, tx1, 10000, 3);
+    CTransaction tx2 = MakeTx(vector<CTransaction>(), 1);
+    AddToPool(pool, tx2, 20000, 1);
+    CTransaction tx3 = MakeTx(vector<CTransaction>(), 1);
+    AddToPool(pool, tx3, 0, 2);
+    // A low fee parent with a high fee child
+    CTransaction tx4 = MakeTx(vector<CTransaction>(1, tx3), 1);
+    AddToPool(pool, tx4, 50000, 4);
+
+    vector<uint256> vByTime;
+    CTxMemPool::indexed_transaction_set::index<entry_time>::type::iterator ti = pool.mapTx.get<entry_time>().begin();
+    for (; ti != pool.mapTx.get<entry_time>().end(); ++ti)
+        vByTime.push_back(ti->GetHash());
+    BOOST_CHECK(vByTime[0] == tx2.GetHash());
+    BOOST_CHECK(vByTime[1] == tx3.GetHash());
+    BOOST_CHECK(vByTime[2] == tx1.GetHash());
+    BOOST_CHECK(vByTime[3] == tx4.GetHash());
+
+    // Alone, tx3 is the worst; its child makes it worth keeping
+    BOOST_CHECK(pool.mapTx.get<mining_score>().rbegin()->GetHash() == tx3.GetHash());
+    BOOST_CHECK(pool.mapTx.get<descendant_score>().begin()->GetHash() == tx1.GetHash());
+
+    // Mining: tx4 with its parent pays 50000 over two transactions, still
+    // more per byte than tx2 alone
+    vector<uint256> vByAncestor;
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator ai = pool.mapTx.get<ancestor_score>().begin();
+    for (; ai != pool.mapTx.get<ancestor_score>().end(); ++ai)
+        vByAncestor.push_back(ai->GetHash());
+    BOOST_CHECK(vByAncestor[0] == tx4.GetHash());
+    BOOST_CHECK(vByAncestor[1] == tx2.GetHash());
+    BOOST_CHECK(vByAncestor[2] == tx1.GetHash());
+    BOOST_CHECK(vByAncestor[3] == tx3.GetHash());
+
+    // Indexes follow the cached totals when relatives go
+    list<CTransaction> removed;
+    pool.remove(tx4, removed);
+    BOOST_CHECK(pool.mapTx.get<descendant_score>().begin()->GetHash() == tx3.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolAncestorLimits)
+{
+    CTxMemPool pool;
+    vector<CTransaction> vChain(1, MakeTx(vector<CTransaction>(), 1));
+    AddToPool(pool, vChain.back(), 1000);
+    for (unsigned int i = 1; i < 5; i++) {
+        vChain.push_back(MakeTx(vector<CTransaction>(1, vChain.back()), 1));
+        AddToPool(pool, vChain.back(), 1000);
+    }
+
+    CTransaction txNext = MakeTx(vector<CTransaction>(1, vChain.back()), 1);
+    CTxMemPoolEntry entry(txNext, 1000, 0, 0.0, 1);
+    CTxMemPool::setEntries setAncestors;
+    string errString;
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(entry, setAncestors, 6, 1000000, 6, 1000000, errString));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 5U);
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entry, setAncestors, 5, 1000000, 6, 1000000, errString));
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entry, setAncestors, 6, 1000000, 5, 1000000, errString));
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool;
+    pool.setSanityCheck(true);
+
+    CTransaction txLow = MakeTx(vector<CTransaction>(), 1);
+    AddToPool(pool, txLow, 100, 1000);
+    CTransaction txLowChild = MakeTx(vector<CTransaction>(1, txLow), 1);
+    AddToPool(pool, txLowChild, 1000, 1000);
+    CTransaction txHigh = MakeTx(vector<CTransaction>(), 1);
+    AddToPool(pool, txHigh, 100000, 1000);
+
+    size_t nUsage = pool.DynamicMemoryUsage();
+    BOOST_CHECK(nUsage > 0);
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), Entry(pool, txLow).GetTxSize() + Entry(pool, txLowChild).GetTxSize() + Entry(pool, txHigh).GetTxSize());
+    BOOST_CHECK_EQUAL(pool.GetMinFeeRate(nUsage), 0);
+
+    // Nothing to do while the pool fits
+    pool.TrimToSize(nUsage);
+    BOOST_CHECK_EQUAL(pool.size(), 3U);
+
+    // The cheapest package goes, parent and child together
+    const CTxMemPoolEntry& entryLow = Entry(pool, txLow);
+    int64_t nRemovedRate = entryLow.GetFeesWithDescendants() * 1000 / entryLow.GetSizeWithDescendants() + CTransaction::nMinRelayTxFee;
+    pool.TrimToSize(nUsage - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 1U);
+    BOOST_CHECK(pool.exists(txHigh.GetHash()));
+    BOOST_CHECK(pool.DynamicMemoryUsage() < nUsage);
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), Entry(pool, txHigh).GetTxSize());
+
+    // The bar stays where eviction left it until blocks come in, then decays
+    BOOST_CHECK_EQUAL(pool.GetMinFeeRate(nUsage), nRemovedRate);
+    SetMockTime(GetTime() + 60 * 60);
+    BOOST_CHECK_EQUAL(pool.GetMinFeeRate(nUsage), nRemovedRate);
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(vector<CTransaction>(), conflicts);
+    SetMockTime(GetTime() + 60 * 60);
+    int64_t nDecayed = pool.GetMinFeeRate(nUsage);
+    BOOST_CHECK(nDecayed < nRemovedRate);
+    SetMockTime(GetTime() + 24 * 60 * 60);
+    BOOST_CHECK_EQUAL(pool.GetMinFeeRate(nUsage), 0);
+    SetMockTime(0);
+
+    // Expiry takes what spends an expired transaction along with it
+    CTransaction txOld = MakeTx(vector<CTransaction>(), 1);
+    AddToPool(pool, txOld, 1000, 10);
+    AddToPool(pool, MakeTx(vector<CTransaction>(1, txOld), 1), 1000, 2000);
+    BOOST_CHECK_EQUAL(pool.size(), 3U);
+    BOOST_CHECK_EQUAL(pool.Expire(500), 2);
+    BOOST_CHECK_EQUAL(pool.size(), 1U);
+    BOOST_CHECK(pool.exists(txHigh.GetHash()));
+    BOOST_CHECK_EQUAL(pool.Expire(500), 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
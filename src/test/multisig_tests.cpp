@@ -293,4 +293,78 @@ BOOST_AUTO_TEST_CASE(multisig_Sign)
 }
 
 
+BOOST_AUTO_TEST_CASE(multisig_SignSignatures)
+{
+    // SignSignatures() signs the inputs on the script check threads, with
+    // the same outcome as SignSignature() on each in turn
+    CBasicKeyStore keystore;
+    CKey key[3];
+    for (int i = 0; i < 3; i++)
+        key[i].MakeNewKey(i != 1);
+    keystore.AddKey(key[0]);
+    keystore.AddKey(key[1]);
+
+    CScript a_and_b;
+    a_and_b << OP_2 << key[0].GetPubKey() << key[1].GetPubKey() << OP_2 << OP_CHECKMULTISIG;
+    CScript a_and_c;
+    a_and_c << OP_2 << key[0].GetPubKey() << key[2].GetPubKey() << OP_2 << OP_CHECKMULTISIG;
+
+    CTransaction txFrom;
+    txFrom.vout.resize(20);
+    for (int i = 0; i < 20; i++)
+    {
+        if (i == 18)
+            txFrom.vout[i].scriptPubKey = a_and_c; // only half signable
+        else if (i == 19)
+            txFrom.vout[i].scriptPubKey.SetDestination(key[2].GetPubKey().GetID());
+        else if (i % 3 == 0)
+            txFrom.vout[i].scriptPubKey = a_and_b;
+        else
+            txFrom.vout[i].scriptPubKey.SetDestination(key[i % 2].GetPubKey().GetID());
+    }
+
+    CTransaction txTo[2];
+    std::vector<std::vector<CScript> > vScriptPubKeys(2);
+    for (int n = 0; n < 2; n++)
+    {
+        txTo[n].vin.resize(10);
+        txTo[n].vout.resize(1);
+        txTo[n].vout[0].nValue = 1;
+        for (int i = 0; i < 10; i++)
+        {
+            txTo[n].vin[i].prevout = COutPoint(txFrom.GetHash(), n * 10 + i);
+            vScriptPubKeys[n].push_back(txFrom.vout[n * 10 + i].scriptPubKey);
+        }
+    }
+    // An input left alone keeps its scriptSig
+    txTo[0].vin[5].scriptSig << OP_1;
+    vScriptPubKeys[0][5] = CScript();
+
+    std::vector<CTransaction*> vpTxTo;
+    vpTxTo.push_back(&txTo[0]);
+    vpTxTo.push_back(&txTo[1]);
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(SignSignatures(keystore, std::vector<CTransaction*>(1, &txTo[0]), std::vector<std::vector<CScript> >(1, vScriptPubKeys[0])));
+        BOOST_CHECK(!SignSignatures(keystore, vpTxTo, vScriptPubKeys));
+    }
+
+    BOOST_CHECK(txTo[0].vin[5].scriptSig == CScript() << OP_1);
+    for (int n = 0; n < 2; n++)
+        for (int i = 0; i < 10; i++)
+        {
+            if (n == 0 && i == 5)
+                continue;
+            bool fMine = (n * 10 + i < 18);
+            BOOST_CHECK_EQUAL(VerifyScript(txTo[n].vin[i].scriptSig, vScriptPubKeys[n][i], txTo[n], i, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, 0), fMine);
+
+            // Signing the same input alone verifies the same way
+            CTransaction txCopy = txTo[n];
+            BOOST_CHECK_EQUAL(SignSignature(keystore, vScriptPubKeys[n][i], txCopy, i), fMine);
+        }
+    // The partly signed multisig keeps the signature there is
+    BOOST_CHECK(!txTo[1].vin[8].scriptSig.empty());
+}
+
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -6,9 +6,14 @@
 #include "rpcclient.h"
 
 #include "base58.h"
+#include "chainparams.h"
+#include "main.h"
 
 #include <boost/algorithm/string.hpp>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 using namespace json_spirit;
@@ -138,4 +143,365 @@ BOOST_AUTO_TEST_CASE(rpc_parse_monetary_values)
     BOOST_CHECK(AmountFromValue(ValueFromString("20999999.99999999")) == 2099999999999999LL);
 }
 
+static void WriteSample(CJSONWriter& writer, int nItems)
+{
+    writer.beginObject();
+    writer.pair("name", "a \"quoted\" string");
+    writer.pair("amount", ValueFromAmount(17622195LL));
+    writer.key("list");
+    writer.beginArray();
+    for (int i = 0; i < nItems; i++)
+    {
+        writer.beginObject();
+        writer.pair("n", i);
+        writer.key("empty");
+        writer.beginArray();
+        writer.endArray();
+        writer.endObject();
+    }
+    writer.endArray();
+    writer.pair("none", Value::null);
+    writer.endObject();
+}
+
+BOOST_AUTO_TEST_CASE(rpc_json_writers)
+{
+    CJSONValueWriter valueWriter;
+    WriteSample(valueWriter, 3);
+    string strExpected = write_string(valueWriter.get(), false);
+    BOOST_CHECK_EQUAL(strExpected, "{\"name\":\"a \\\"quoted\\\" string\",\"amount\":0.17622195,"
+                      "\"list\":[{\"n\":0,\"empty\":[]},{\"n\":1,\"empty\":[]},{\"n\":2,\"empty\":[]}],\"none\":null}");
+
+    std::ostringstream os;
+    CJSONStreamWriter streamWriter(os);
+    WriteSample(streamWriter, 3);
+    BOOST_CHECK_EQUAL(os.str(), strExpected);
+}
+
+BOOST_AUTO_TEST_CASE(rpc_http_reply_streambuf)
+{
+    // Small replies are sent in one go with a Content-Length
+    {
+        std::stringstream ss;
+        CHTTPReplyStreambuf reply(ss, HTTP_OK, true, true);
+        std::ostream os(&reply);
+        CJSONStreamWriter writer(os);
+        WriteSample(writer, 3);
+        reply.Finish();
+        BOOST_CHECK(!reply.Started());
+
+        int nProto;
+        map<string, string> mapHeaders;
+        string strBody;
+        BOOST_CHECK_EQUAL(ReadHTTPStatus(ss, nProto), HTTP_OK);
+        ReadHTTPMessage(ss, mapHeaders, strBody, nProto);
+        BOOST_CHECK(mapHeaders.count("content-length"));
+        BOOST_CHECK(!mapHeaders.count("transfer-encoding"));
+        Value value;
+        BOOST_CHECK(read_string(strBody, value));
+    }
+
+    // Large ones switch to chunked encoding, which ReadHTTPMessage decodes
+    {
+        CJSONValueWriter valueWriter;
+        WriteSample(valueWriter, 20000);
+        string strExpected = write_string(valueWriter.get(), false);
+        BOOST_CHECK(strExpected.size() > 2 * CHTTPReplyStreambuf::CHUNK_SIZE);
+
+        std::stringstream ss;
+        CHTTPReplyStreambuf reply(ss, HTTP_OK, true, true);
+        std::ostream os(&reply);
+        CJSONStreamWriter writer(os);
+        WriteSample(writer, 20000);
+        BOOST_CHECK(reply.Started());
+        reply.Finish();
+
+        int nProto;
+        map<string, string> mapHeaders;
+        string strBody;
+        BOOST_CHECK_EQUAL(ReadHTTPStatus(ss, nProto), HTTP_OK);
+        BOOST_CHECK_EQUAL(ReadHTTPMessage(ss, mapHeaders, strBody, nProto), HTTP_OK);
+        BOOST_CHECK_EQUAL(mapHeaders["transfer-encoding"], "chunked");
+        BOOST_CHECK(strBody == strExpected);
+    }
+
+    // Without chunking (HTTP/1.0 clients) everything is buffered
+    {
+        std::stringstream ss;
+        CHTTPReplyStreambuf reply(ss, HTTP_OK, false, false);
+        std::ostream os(&reply);
+        CJSONStreamWriter writer(os);
+        WriteSample(writer, 20000);
+        BOOST_CHECK(!reply.Started());
+        reply.Finish();
+
+        int nProto;
+        map<string, string> mapHeaders;
+        string strBody;
+        ReadHTTPStatus(ss, nProto);
+        ReadHTTPMessage(ss, mapHeaders, strBody, nProto);
+        BOOST_CHECK_EQUAL(atoi(mapHeaders["content-length"].c_str()), (int)strBody.size());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(rpc_parse_json)
+{
+    // Same result as json_spirit's reader for everything it handles correctly
+    const char* vValid[] = {
+        "{\"method\":\"getblockhash\",\"params\":[1000],\"id\":1}\n",
+        "{\"method\":\"gettxout\",\"params\":[\"2b4f80a7ba3a5f9c7e1e2fe8b0b2a5ac06b12fd25d3bcab9dab9b5cd0c9b2c06\",1,true],\"id\":42}\n",
+        " { \"method\" : \"sendtoaddress\" , \"params\" : [ \"addr\" , 0.5 , \"a\\\"b\\\\c\\/d\\n\" ] , \"id\" : \"x\" } ",
+        "[{\"id\":null,\"params\":[true,false,null,[],{}]},{\"n\":-12,\"r\":-1.25e-3,\"e\":2E+2}]",
+        "{\"big\":18446744073709551615,\"min\":-9223372036854775808,\"max\":9223372036854775807}",
+        "\"string\"", "12", "0.1", "true", "null",
+    };
+    BOOST_FOREACH(const char* psz, vValid)
+    {
+        Value valSpirit, valParsed;
+        BOOST_CHECK(read_string(string(psz), valSpirit));
+        BOOST_CHECK_MESSAGE(ParseJSON(psz, valParsed), psz);
+        BOOST_CHECK_EQUAL(write_string(valParsed, false), write_string(valSpirit, false));
+    }
+
+    Value value;
+    BOOST_CHECK(ParseJSON("[5, 9223372036854775808, 1.5]", value));
+    BOOST_CHECK(value.get_array()[0].type() == int_type && value.get_array()[0].get_int64() == 5);
+    BOOST_CHECK(value.get_array()[1].get_uint64() == 9223372036854775808ULL);
+    BOOST_CHECK(value.get_array()[2].type() == real_type && value.get_array()[2].get_real() == 1.5);
+
+    // \u escapes become UTF-8, including surrogate pairs
+    BOOST_CHECK(ParseJSON("\"\\u0041\\u00e9\\u20ac\\ud83d\\ude00\"", value));
+    BOOST_CHECK_EQUAL(value.get_str(), "A\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80");
+
+    const char* vInvalid[] = {
+        "", " ", "{", "}", "[1,]", "[1 2]", "{\"a\" 1}", "{\"a\":}", "{1:2}", "\"abc", "\"\\q\"",
+        "tru", "nul", "-", "1.", "1e", ".5", "18446744073709551616", "-9223372036854775809",
+        "{\"method\":\"stop\"} trailing", "[]]",
+    };
+    BOOST_FOREACH(const char* psz, vInvalid)
+        BOOST_CHECK_MESSAGE(!ParseJSON(psz, value), psz);
+
+    // Nesting is limited
+    BOOST_CHECK(ParseJSON(string(100, '[') + string(100, ']'), value));
+    BOOST_CHECK(!ParseJSON(string(100000, '['), value));
+    BOOST_CHECK(!ParseJSON(string(1000, '[') + string(1000, ']'), value));
+}
+
+BOOST_AUTO_TEST_CASE(rpc_parse_json_throughput)
+{
+    const string strRequest = "{\"method\":\"gettxout\",\"params\":[\"2b4f80a7ba3a5f9c7e1e2fe8b0b2a5ac06b12fd25d3bcab9dab9b5cd0c9b2c06\",1,true],\"id\":42}\n";
+    const int nRuns = 5000;
+    Value value;
+
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < nRuns; i++)
+        read_string(strRequest, value);
+    int64_t nSpirit = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    for (int i = 0; i < nRuns; i++)
+        BOOST_CHECK(ParseJSON(strRequest, value));
+    int64_t nParsed = GetTimeMicros() - nStart;
+
+    if (fDebug) printf("rpc_parse_json_throughput: %d requests: json_spirit::read_string %ldus, ParseJSON %ldus\n",
+                       nRuns, (long)nSpirit, (long)nParsed);
+}
+
+BOOST_AUTO_TEST_CASE(rpc_method_stats)
+{
+    uint64_t nCalls = GetRPCMethodStats()["getblockcount"].nCalls;
+    BOOST_CHECK_NO_THROW(tableRPC.execute("getblockcount", Array()));
+    BOOST_CHECK_NO_THROW(tableRPC.execute("getblockcount", Array()));
+    CRPCMethodStats stats = GetRPCMethodStats()["getblockcount"];
+    BOOST_CHECK_EQUAL(stats.nCalls, nCalls + 2);
+    BOOST_CHECK(stats.nLockHoldMicros >= 0 && stats.nMaxLockHoldMicros <= stats.nLockHoldMicros);
+
+    // Failed calls are counted too
+    BOOST_CHECK_THROW(tableRPC.execute("getblockhash", Array()), Object);
+    BOOST_CHECK(GetRPCMethodStats()["getblockhash"].nCalls >= 1);
+
+    Value result = CallRPC("getrpcinfo");
+    BOOST_CHECK(find_value(find_value(result.get_obj(), "getblockcount").get_obj(), "calls").get_uint64() >= 2);
+}
+
+static void CountWorkItem(boost::atomic<int>* pnRun)
+{
+    (*pnRun)++;
+}
+
+BOOST_AUTO_TEST_CASE(rpc_work_queue)
+{
+    CRPCWorkQueue queue(2);
+    boost::atomic<int> nRun(0);
+
+    // Nothing takes items off yet, so the third is refused
+    BOOST_CHECK(queue.Enqueue(boost::bind(&CountWorkItem, &nRun)));
+    BOOST_CHECK(queue.Enqueue(boost::bind(&CountWorkItem, &nRun)));
+    BOOST_CHECK(!queue.Enqueue(boost::bind(&CountWorkItem, &nRun)));
+
+    boost::thread worker(boost::bind(&CRPCWorkQueue::Run, &queue));
+    while (nRun < 2)
+        MilliSleep(1);
+    BOOST_CHECK(queue.Enqueue(boost::bind(&CountWorkItem, &nRun)));
+    while (nRun < 3)
+        MilliSleep(1);
+
+    // Once interrupted the worker returns and nothing more is taken
+    queue.Interrupt();
+    worker.join();
+    BOOST_CHECK(!queue.Enqueue(boost::bind(&CountWorkItem, &nRun)));
+    BOOST_CHECK_EQUAL(nRun, 3);
+}
+
+static Object BatchElement(const string& strMethod, int nId)
+{
+    Object req;
+    req.push_back(Pair("method", strMethod));
+    req.push_back(Pair("params", Array()));
+    req.push_back(Pair("id", nId));
+    return req;
+}
+
+BOOST_AUTO_TEST_CASE(rpc_batch)
+{
+    // Thread safe commands, an unknown one and an element that isn't a request
+    Array vReq;
+    for (int i = 0; i < 20; i++)
+        vReq.push_back(BatchElement(i % 5 == 0 ? "getbestblockhash" : "getblockcount", i));
+    vReq.push_back(BatchElement("nosuchmethod", 20));
+    vReq.push_back(21);
+
+    CJSONValueWriter serial;
+    JSONRPCExecBatch(vReq, serial, NULL, 0);
+    const Array& vReply = serial.get().get_array();
+    BOOST_CHECK_EQUAL(vReply.size(), vReq.size());
+    for (int i = 0; i < 20; i++)
+    {
+        BOOST_CHECK_EQUAL(find_value(vReply[i].get_obj(), "id").get_int(), i);
+        BOOST_CHECK(find_value(vReply[i].get_obj(), "error").is_null());
+    }
+    BOOST_CHECK_EQUAL(find_value(find_value(vReply[20].get_obj(), "error").get_obj(), "code").get_int(), (int)RPC_METHOD_NOT_FOUND);
+    BOOST_CHECK(!find_value(vReply[21].get_obj(), "error").is_null());
+
+    // Workers of the pool help answer it, the replies stay in order
+    CRPCWorkQueue queue(16);
+    boost::thread_group workers;
+    for (int i = 0; i < 3; i++)
+        workers.create_thread(boost::bind(&CRPCWorkQueue::Run, &queue));
+    for (int nRun = 0; nRun < 10; nRun++)
+    {
+        CJSONValueWriter parallel;
+        JSONRPCExecBatch(vReq, parallel, &queue, 3);
+        BOOST_CHECK_EQUAL(write_string(parallel.get(), false), write_string(serial.get(), false));
+    }
+
+    // More helpers than elements
+    Array vSmall(vReq.begin(), vReq.begin() + 2);
+    CJSONValueWriter small;
+    JSONRPCExecBatch(vSmall, small, &queue, 3);
+    BOOST_CHECK_EQUAL(small.get().get_array().size(), 2U);
+
+    queue.Interrupt();
+    workers.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(rpc_getrawtransaction_hint)
+{
+    // Without an index the genesis coinbase can only be found given its block
+    const CBlock& genesis = Params().GenesisBlock();
+    string strTxid = genesis.vtx[0].GetHash().GetHex();
+    CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+    ssTx << genesis.vtx[0];
+    string strHex = HexStr(ssTx.begin(), ssTx.end());
+
+    BOOST_CHECK_THROW(CallRPC("getrawtransaction " + strTxid), runtime_error);
+
+    Value r;
+    BOOST_CHECK_NO_THROW(r = CallRPC("getrawtransaction " + strTxid + " 0 0"));
+    BOOST_CHECK_EQUAL(r.get_str(), strHex);
+    // The second lookup is served from the block's cached transaction positions
+    BOOST_CHECK_NO_THROW(r = CallRPC("getrawtransaction " + strTxid + " 1 " + genesis.GetHash().GetHex()));
+    BOOST_CHECK_EQUAL(find_value(r.get_obj(), "hex").get_str(), strHex);
+    BOOST_CHECK_EQUAL(find_value(r.get_obj(), "blockhash").get_str(), genesis.GetHash().GetHex());
+
+    BOOST_CHECK_THROW(CallRPC("getrawtransaction " + uint256(1).GetHex() + " 0 0"), runtime_error);
+    BOOST_CHECK_THROW(CallRPC("getrawtransaction " + strTxid + " 0 1000000"), runtime_error);
+    BOOST_CHECK_THROW(CallRPC("getrawtransaction " + strTxid + " 0 " + uint256(1).GetHex()), runtime_error);
+}
+
+/** Issue a REST request, returning the HTTP status and body of the reply */
+static int CallREST(const string& strURI, string& strBody, map<string, string>& mapHeaders)
+{
+    std::stringstream ss;
+    BOOST_CHECK(HTTPReq_REST(ss, strURI, true));
+    int nProto;
+    int nStatus = ReadHTTPStatus(ss, nProto);
+    ReadHTTPMessage(ss, mapHeaders, strBody, nProto);
+    return nStatus;
+}
+
+BOOST_AUTO_TEST_CASE(rpc_rest)
+{
+    const CBlock& genesis = Params().GenesisBlock();
+    string strHash = genesis.GetHash().GetHex();
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << genesis;
+    string strRawBlock = ssBlock.str();
+
+    string strBody;
+    map<string, string> mapHeaders;
+
+    // Blocks come straight off disk
+    BOOST_CHECK_EQUAL(CallREST("/rest/block/" + strHash + ".bin", strBody, mapHeaders), HTTP_OK);
+    BOOST_CHECK_EQUAL(mapHeaders["content-type"], "application/octet-stream");
+    BOOST_CHECK(strBody == strRawBlock);
+
+    mapHeaders.clear();
+    BOOST_CHECK_EQUAL(CallREST("/rest/block/" + strHash + ".hex", strBody, mapHeaders), HTTP_OK);
+    BOOST_CHECK_EQUAL(strBody, HexStr(strRawBlock.begin(), strRawBlock.end()) + "\n");
+
+    mapHeaders.clear();
+    BOOST_CHECK_EQUAL(CallREST("/rest/block/" + strHash + ".json", strBody, mapHeaders), HTTP_OK);
+    Value value;
+    BOOST_CHECK(ParseJSON(strBody, value));
+    BOOST_CHECK_EQUAL(find_value(value.get_obj(), "hash").get_str(), strHash);
+
+    // Headers of the active chain from the given block on
+    mapHeaders.clear();
+    BOOST_CHECK_EQUAL(CallREST("/rest/headers/5/" + strHash + ".bin", strBody, mapHeaders), HTTP_OK);
+    BOOST_CHECK(strBody == strRawBlock.substr(0, 80));
+
+    // The genesis coinbase is not in any index
+    mapHeaders.clear();
+    string strTxid = genesis.vtx[0].GetHash().GetHex();
+    BOOST_CHECK_EQUAL(CallREST("/rest/tx/" + strTxid + ".hex", strBody, mapHeaders), HTTP_NOT_FOUND);
+
+    mapHeaders.clear();
+    BOOST_CHECK_EQUAL(CallREST("/rest/block/" + strHash + ".xml", strBody, mapHeaders), HTTP_NOT_FOUND);
+    mapHeaders.clear();
+    BOOST_CHECK_EQUAL(CallREST("/rest/block/xyz.bin", strBody, mapHeaders), HTTP_BAD_REQUEST);
+    mapHeaders.clear();
+    BOOST_CHECK_EQUAL(CallREST("/rest/headers/0/" + strHash + ".bin", strBody, mapHeaders), HTTP_BAD_REQUEST);
+    mapHeaders.clear();
+    BOOST_CHECK_EQUAL(CallREST("/rest/block/" + uint256(1).GetHex() + ".bin", strBody, mapHeaders), HTTP_NOT_FOUND);
+}
+
+BOOST_AUTO_TEST_CASE(rpc_gettxoutsetinfo)
+{
+    // The running statistics and a full scan describe the same set
+    Value r, rScan;
+    BOOST_CHECK_NO_THROW(r = CallRPC("gettxoutsetinfo"));
+    BOOST_CHECK_NO_THROW(rScan = CallRPC("gettxoutsetinfo true"));
+    BOOST_CHECK_EQUAL(find_value(r.get_obj(), "bestblock").get_str(), Params().GenesisBlock().GetHash().GetHex());
+    BOOST_CHECK(find_value(r.get_obj(), "hash_serialized").type() == null_type);
+    BOOST_CHECK(find_value(rScan.get_obj(), "hash_serialized").type() == str_type);
+    BOOST_CHECK_EQUAL(find_value(r.get_obj(), "bestblock").get_str(), find_value(rScan.get_obj(), "bestblock").get_str());
+    BOOST_CHECK_EQUAL(find_value(r.get_obj(), "txouts").get_int64(), find_value(rScan.get_obj(), "txouts").get_int64());
+    BOOST_CHECK_EQUAL(find_value(r.get_obj(), "bytes_serialized").get_int64(), find_value(rScan.get_obj(), "bytes_serialized").get_int64());
+    BOOST_CHECK_EQUAL(find_value(r.get_obj(), "hash_multiset").get_str(), find_value(rScan.get_obj(), "hash_multiset").get_str());
+
+    BOOST_CHECK_THROW(CallRPC("gettxoutsetinfo not_bool"), runtime_error);
+    BOOST_CHECK_THROW(CallRPC("gettxoutsetinfo true extra"), runtime_error);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
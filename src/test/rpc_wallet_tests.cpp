@@ -9,6 +9,7 @@
 #include "wallet.h"
 
 #include <boost/algorithm/string.hpp>
+#include <boost/assign/list_of.hpp>
 #include <boost/test/unit_test.hpp>
 
 using namespace std;
@@ -88,6 +89,57 @@ BOOST_AUTO_TEST_CASE(rpc_wallet)
     BOOST_CHECK_THROW(CallRPC("listreceivedbyaccount 0 not_bool"), runtime_error);
     BOOST_CHECK_NO_THROW(CallRPC("listreceivedbyaccount 0 true"));
     BOOST_CHECK_THROW(CallRPC("listreceivedbyaccount 0 true extra"), runtime_error);
+
+    BOOST_CHECK_THROW(CallRPC("sendbatch"), runtime_error);
+    BOOST_CHECK_THROW(CallRPC("sendbatch not_array"), runtime_error);
+    BOOST_CHECK_THROW(CallRPC("sendbatch []"), runtime_error);
+    BOOST_CHECK_THROW(CallRPC("sendbatch [{\"address\":\"not_address\",\"amount\":1}]"), runtime_error);
+    BOOST_CHECK_THROW(CallRPC("sendbatch [{\"amount\":1}]"), runtime_error);
+    BOOST_CHECK_THROW(CallRPC("sendbatch [] 0"), runtime_error);
+    BOOST_CHECK_THROW(CallRPC("sendbatch [] not_int"), runtime_error);
+    BOOST_CHECK_THROW(CallRPC("sendbatch [] 1 comment extra"), runtime_error);
+}
+
+static string StreamRPC(const string& strMethod, const Array& params)
+{
+    std::ostringstream os;
+    CJSONStreamWriter writer(os);
+    tableRPC.execute(strMethod, params, writer);
+    return os.str();
+}
+
+BOOST_AUTO_TEST_CASE(rpc_wallet_stream)
+{
+    // Something for listtransactions to report
+    CKey key;
+    key.MakeNewKey(true);
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(uint256(1), 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 5 * COIN;
+    tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    {
+        LOCK(pwalletMain->cs_wallet);
+        BOOST_CHECK(pwalletMain->AddKeyPubKey(key, key.GetPubKey()));
+        BOOST_CHECK(pwalletMain->AddToWallet(CWalletTx(pwalletMain, tx)));
+    }
+
+    // The streamed replies take their own locks, and match the Value ones
+    Value r;
+    BOOST_CHECK_NO_THROW(r = CallRPC("listtransactions * 10 0"));
+    BOOST_CHECK_EQUAL(StreamRPC("listtransactions", RPCConvertValues("listtransactions", boost::assign::list_of("*")("10")("0"))),
+                      write_string(r, false));
+    const Object& entry = r.get_array().back().get_obj();
+    BOOST_CHECK_EQUAL(find_value(entry, "txid").get_str(), tx.GetHash().GetHex());
+    BOOST_CHECK_EQUAL(find_value(entry, "category").get_str(), "receive");
+    BOOST_CHECK_EQUAL(find_value(entry, "amount").get_real(), 5.0);
+
+    BOOST_CHECK_NO_THROW(r = CallRPC("listunspent 0"));
+    BOOST_CHECK_EQUAL(StreamRPC("listunspent", RPCConvertValues("listunspent", boost::assign::list_of("0"))),
+                      write_string(r, false));
+
+    pwalletMain->EraseFromWallet(tx.GetHash());
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -9,6 +9,7 @@
 #include "keystore.h"
 #include "main.h"
 #include "script.h"
+#include "txdb.h"
 
 #include <map>
 #include <string>
@@ -252,6 +253,76 @@ BOOST_AUTO_TEST_CASE(test_Get)
     BOOST_CHECK(!AreInputsStandard(t1, coins));
 }
 
+BOOST_AUTO_TEST_CASE(test_CoinsStats)
+{
+    CBasicKeyStore keystore;
+    CCoinsView coinsDummy;
+    CCoinsViewCache coins(coinsDummy);
+    std::vector<CTransaction> dummyTransactions = SetupDummyInputs(keystore, coins);
+    uint256 hash0 = dummyTransactions[0].GetHash(), hash1 = dummyTransactions[1].GetHash();
+    CCoins coins0(dummyTransactions[0], 0), coins1(dummyTransactions[1], 0);
+
+    CCoinsStats stats01, stats10;
+    stats01.AddCoins(hash0, coins0);
+    stats01.AddCoins(hash1, coins1);
+    stats10.AddCoins(hash1, coins1);
+    stats10.AddCoins(hash0, coins0);
+    BOOST_CHECK_EQUAL(stats01.nTransactions, 2U);
+    BOOST_CHECK_EQUAL(stats01.nTransactionOutputs, 4U);
+    BOOST_CHECK_EQUAL(stats01.nTotalAmount, 104*CENT);
+    // Order does not matter
+    BOOST_CHECK(stats01.hashMultiset == stats10.hashMultiset);
+    BOOST_CHECK(stats01.hashMultiset != 0);
+
+    // Spending an output replaces the record
+    stats01.RemoveCoins(hash0, coins0);
+    coins0.Spend(1);
+    stats01.AddCoins(hash0, coins0);
+    BOOST_CHECK_EQUAL(stats01.nTransactionOutputs, 3U);
+    BOOST_CHECK_EQUAL(stats01.nTotalAmount, 54*CENT);
+
+    // And taking everything back leaves nothing
+    stats01.RemoveCoins(hash0, coins0);
+    stats01.RemoveCoins(hash1, coins1);
+    BOOST_CHECK_EQUAL(stats01.nTransactions, 0U);
+    BOOST_CHECK_EQUAL(stats01.nSerializedSize, 0U);
+    BOOST_CHECK_EQUAL(stats01.nTotalAmount, 0);
+    BOOST_CHECK(stats01.hashMultiset == 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_CoinsStatsBestBlock)
+{
+    CCoinsViewDB db(1 << 20, true);
+    std::map<uint256, CCoins> mapCoins;
+    CCoinsStats stats;
+
+    // A new chainstate is empty
+    BOOST_CHECK(db.GetRunningStats(stats));
+    BOOST_CHECK_EQUAL(stats.nTransactions, 0U);
+
+    // Written along with the coins, the statistics are used
+    uint256 hashA = GetRandHash(), hashB = GetRandHash();
+    stats.hashBlock = hashA;
+    stats.nTransactions = 7;
+    BOOST_CHECK(db.BatchWrite(mapCoins, hashA, &stats));
+    CCoinsStats statsRead;
+    BOOST_CHECK(db.GetRunningStats(statsRead));
+    BOOST_CHECK_EQUAL(statsRead.nTransactions, 7U);
+
+    // The coins moved on to another block without them: stale
+    BOOST_CHECK(db.BatchWrite(mapCoins, hashB, NULL));
+    BOOST_CHECK(!db.GetRunningStats(statsRead));
+
+    // Flushed with statistics for some other block: stale too
+    BOOST_CHECK(db.BatchWrite(mapCoins, hashB, &stats));
+    BOOST_CHECK(!db.GetRunningStats(statsRead));
+
+    stats.hashBlock = hashB;
+    BOOST_CHECK(db.BatchWrite(mapCoins, hashB, &stats));
+    BOOST_CHECK(db.GetRunningStats(statsRead));
+    BOOST_CHECK(statsRead.hashBlock == hashB);
+}
+
 BOOST_AUTO_TEST_CASE(test_IsStandard)
 {
     LOCK(cs_main);
@@ -21,6 +21,8 @@
 
 using namespace std;
 
+extern CWallet* pwalletMain;
+
 typedef set<pair<const CWalletTx*,unsigned int> > CoinSet;
 
 BOOST_AUTO_TEST_SUITE(wallet_tests)
@@ -303,4 +305,308 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+BOOST_AUTO_TEST_CASE(coin_selection_changeless)
+{
+    CoinSet setCoinsRet;
+    int64_t nValueRet;
+
+    LOCK(wallet.cs_wallet);
+
+    empty_wallet();
+    add_coin(2*CENT);
+    add_coin(3*CENT);
+    add_coin(4*CENT);
+    add_coin(1*COIN);
+
+    // 2+3 is less over the target than a change output would cost, so it
+    // is taken without looking for anything with change
+    BOOST_CHECK(wallet.SelectCoinsMinConf(5*CENT - 10000, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 5*CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 2U);
+
+    // 4 would overpay by more than that, 2+3 leaves a cent of change instead
+    BOOST_CHECK(wallet.SelectCoinsMinConf(4*CENT - 100000, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 5*CENT);
+
+    // With a high -paytxfee a change output costs more than the 2+3 excess,
+    // but that excess is not dust and would still get a change output, so
+    // 2+4 leaves a cent of change instead
+    int64_t nTransactionFeeSaved = nTransactionFee;
+    nTransactionFee = 10 * CTransaction::nMinRelayTxFee;
+    BOOST_CHECK(wallet.SelectCoinsMinConf(5*CENT - 100000, 1, 6, vCoins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 6*CENT);
+    nTransactionFee = nTransactionFeeSaved;
+    empty_wallet();
+}
+
+BOOST_AUTO_TEST_CASE(coin_selection_large_wallet)
+{
+    CoinSet setCoinsRet;
+    int64_t nValueRet;
+
+    LOCK(wallet.cs_wallet);
+
+    // An exchange-like wallet: many deposits of assorted small amounts
+    empty_wallet();
+    const int nCoins = 100000;
+    int64_t nTotal = 0;
+    for (int i = 0; i < nCoins; i++)
+    {
+        int64_t nValue = CENT / 10 + (insecure_rand() % (10 * CENT));
+        add_coin(nValue);
+        nTotal += nValue;
+    }
+
+    int64_t nStart = GetTimeMicros();
+    const int nRuns = 10;
+    for (int i = 0; i < nRuns; i++)
+    {
+        int64_t nTarget = (1 + insecure_rand() % 50) * COIN + insecure_rand() % COIN;
+        BOOST_CHECK(wallet.SelectCoinsMinConf(nTarget, 1, 6, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK_GE(nValueRet, nTarget);
+        int64_t nSelected = 0;
+        BOOST_FOREACH(const PAIRTYPE(const CWalletTx*, unsigned int)& coin, setCoinsRet)
+            nSelected += coin.first->vout[coin.second].nValue;
+        BOOST_CHECK_EQUAL(nSelected, nValueRet);
+    }
+    int64_t nElapsed = GetTimeMicros() - nStart;
+    if (fDebug) printf("coin_selection_large_wallet: %d selections from %d coins: %ldus\n", nRuns, nCoins, (long)nElapsed);
+
+    // More than the wallet holds still fails
+    BOOST_CHECK(!wallet.SelectCoinsMinConf(nTotal + 1, 1, 6, vCoins, setCoinsRet, nValueRet));
+    empty_wallet();
+}
+
+BOOST_AUTO_TEST_CASE(wallet_utxo_index)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_CHECK(pwalletMain->AddKeyPubKey(key, key.GetPubKey()));
+    CScript scriptMine;
+    scriptMine.SetDestination(key.GetPubKey().GetID());
+    CScript scriptOther = CScript() << OP_11 << OP_EQUAL;
+
+    int64_t nUnconfirmedBefore = pwalletMain->GetUnconfirmedBalance();
+    vector<COutput> vAvailableBefore, vAvailable;
+    pwalletMain->AvailableCoins(vAvailableBefore, false);
+
+    // Someone pays us, not confirmed yet
+    CTransaction txFund;
+    txFund.vin.resize(1);
+    txFund.vin[0].prevout.hash = GetRandHash();
+    txFund.vout.resize(2);
+    txFund.vout[0].nValue = 5 * COIN;
+    txFund.vout[0].scriptPubKey = scriptMine;
+    txFund.vout[1].nValue = 3 * COIN;
+    txFund.vout[1].scriptPubKey = scriptOther;
+    mempool.addUnchecked(txFund.GetHash(), CTxMemPoolEntry(txFund, 0, GetTime(), 0.0, 1));
+    pwalletMain->SyncTransaction(txFund.GetHash(), txFund, NULL);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmedBefore + 5 * COIN);
+    pwalletMain->AvailableCoins(vAvailable, false);
+    BOOST_CHECK_EQUAL(vAvailable.size(), vAvailableBefore.size() + 1);
+
+    // Spending it takes it out of the balance and of coin selection
+    CTransaction txSpend;
+    txSpend.vin.push_back(CTxIn(COutPoint(txFund.GetHash(), 0)));
+    txSpend.vout.resize(1);
+    txSpend.vout[0].nValue = 5 * COIN - 10000;
+    txSpend.vout[0].scriptPubKey = scriptOther;
+    mempool.addUnchecked(txSpend.GetHash(), CTxMemPoolEntry(txSpend, 10000, GetTime(), 0.0, 1));
+    pwalletMain->SyncTransaction(txSpend.GetHash(), txSpend, NULL);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmedBefore);
+    pwalletMain->AvailableCoins(vAvailable, false);
+    BOOST_CHECK_EQUAL(vAvailable.size(), vAvailableBefore.size());
+
+    // The spend leaving the mempool gives the output back, although the
+    // wallet is not told about it
+    std::list<CTransaction> removed;
+    mempool.remove(txSpend, removed);
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmedBefore + 5 * COIN);
+    pwalletMain->AvailableCoins(vAvailable, false);
+    BOOST_CHECK_EQUAL(vAvailable.size(), vAvailableBefore.size() + 1);
+
+    mempool.remove(txFund, removed, true);
+    pwalletMain->EraseFromWallet(txSpend.GetHash());
+    pwalletMain->EraseFromWallet(txFund.GetHash());
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmedBefore);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_ismine_scripts)
+{
+    CWallet keystore;
+    LOCK(keystore.cs_wallet);
+
+    // A large keystore, a third of it uncompressed keys
+    const int nKeys = 3000;
+    vector<CPubKey> vPubKeys;
+    for (int i = 0; i < nKeys; i++)
+    {
+        CKey key;
+        key.MakeNewKey(i % 3 != 0);
+        BOOST_CHECK(keystore.AddKeyPubKey(key, key.GetPubKey()));
+        vPubKeys.push_back(key.GetPubKey());
+    }
+    CKey keyOther;
+    keyOther.MakeNewKey(true);
+    CKey keyLater;
+    keyLater.MakeNewKey(true);
+
+    // 1-of-1 multisig, ours; 2-of-2 needing a key we only get later
+    vector<CPubKey> vMultiMine(1, vPubKeys[1]);
+    CScript scriptMultiMine;
+    scriptMultiMine.SetMultisig(1, vMultiMine);
+    vector<CPubKey> vMultiLater;
+    vMultiLater.push_back(vPubKeys[2]);
+    vMultiLater.push_back(keyLater.GetPubKey());
+    CScript scriptMultiLater;
+    scriptMultiLater.SetMultisig(2, vMultiLater);
+    BOOST_CHECK(keystore.AddCScript(scriptMultiMine));
+    BOOST_CHECK(keystore.AddCScript(scriptMultiLater));
+
+    vector<CScript> vScripts;
+    for (int i = 0; i < nKeys; i++)
+    {
+        CScript script;
+        script.SetDestination(vPubKeys[i].GetID());
+        vScripts.push_back(script);
+        vScripts.push_back(CScript() << vPubKeys[i] << OP_CHECKSIG);
+    }
+    CScript script;
+    script.SetDestination(keyOther.GetPubKey().GetID());
+    vScripts.push_back(script);
+    vScripts.push_back(CScript() << keyOther.GetPubKey() << OP_CHECKSIG);
+    script.SetDestination(scriptMultiMine.GetID());
+    vScripts.push_back(script);
+    script.SetDestination(scriptMultiLater.GetID());
+    vScripts.push_back(script);
+    vScripts.push_back(scriptMultiMine);
+    vScripts.push_back(scriptMultiLater);
+    // P2PKH of our key with the hash pushed by OP_PUSHDATA1
+    std::vector<unsigned char> vchKeyID(vPubKeys[0].GetID().begin(), vPubKeys[0].GetID().end());
+    script.clear();
+    script << OP_DUP << OP_HASH160;
+    script.push_back(OP_PUSHDATA1);
+    script.push_back(20);
+    script.insert(script.end(), vchKeyID.begin(), vchKeyID.end());
+    script << OP_EQUALVERIFY << OP_CHECKSIG;
+    vScripts.push_back(script);
+
+    // Agrees with solving the script, before and after the key that
+    // completes scriptMultiLater
+    for (int nPass = 0; nPass < 2; nPass++)
+    {
+        BOOST_FOREACH(const CScript& scriptPubKey, vScripts)
+            BOOST_CHECK_EQUAL(keystore.IsMine(CTxOut(1, scriptPubKey)), ::IsMine(keystore, scriptPubKey));
+        BOOST_CHECK(keystore.AddKeyPubKey(keyLater, keyLater.GetPubKey()));
+    }
+    CScript scriptLater;
+    scriptLater.SetDestination(scriptMultiLater.GetID());
+    BOOST_CHECK(keystore.IsMine(CTxOut(1, scriptLater)));
+    BOOST_CHECK(keystore.IsMine(CTxOut(1, script)));
+    BOOST_CHECK(!keystore.IsMine(CTxOut(1, CScript() << keyOther.GetPubKey() << OP_CHECKSIG)));
+
+    // Matching a block's worth of outputs, a few of them ours
+    vector<CTxOut> vOutputs;
+    for (int i = 0; i < nKeys; i++)
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        CScript scriptPubKey;
+        scriptPubKey.SetDestination(i % 100 == 0 ? vPubKeys[i].GetID() : key.GetPubKey().GetID());
+        vOutputs.push_back(CTxOut(1, scriptPubKey));
+    }
+    int nMineSolved = 0, nMineSet = 0;
+    int64_t nStart = GetTimeMicros();
+    BOOST_FOREACH(const CTxOut& txout, vOutputs)
+        nMineSolved += ::IsMine(keystore, txout.scriptPubKey);
+    int64_t nSolved = GetTimeMicros() - nStart;
+    nStart = GetTimeMicros();
+    BOOST_FOREACH(const CTxOut& txout, vOutputs)
+        nMineSet += keystore.IsMine(txout);
+    int64_t nSet = GetTimeMicros() - nStart;
+    BOOST_CHECK_EQUAL(nMineSolved, nKeys / 100);
+    BOOST_CHECK_EQUAL(nMineSet, nKeys / 100);
+    if (fDebug) printf("wallet_ismine_scripts: %u outputs against %d keys: ::IsMine %ldus, CWallet::IsMine %ldus\n",
+                       (unsigned int)vOutputs.size(), nKeys, (long)nSolved, (long)nSet);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_keypool_topup)
+{
+    LOCK(pwalletMain->cs_wallet);
+    unsigned int nTarget = pwalletMain->GetKeyPoolSize() + 2500;
+
+    BOOST_CHECK(pwalletMain->TopUpKeyPool(nTarget));
+    BOOST_CHECK_EQUAL(pwalletMain->GetKeyPoolSize(), nTarget + 1);
+
+    // Every pool entry made it to disk, with its key in the wallet
+    CWalletDB walletdb(pwalletMain->strWalletFile);
+    std::set<CKeyID> setKeyIDs;
+    BOOST_FOREACH(int64_t nIndex, pwalletMain->setKeyPool)
+    {
+        CKeyPool keypool;
+        BOOST_CHECK(walletdb.ReadPool(nIndex, keypool));
+        CKey key;
+        BOOST_CHECK(pwalletMain->GetKey(keypool.vchPubKey.GetID(), key));
+        BOOST_CHECK(key.GetPubKey() == keypool.vchPubKey);
+        BOOST_CHECK(pwalletMain->mapKeyMetadata.count(keypool.vchPubKey.GetID()));
+        setKeyIDs.insert(keypool.vchPubKey.GetID());
+    }
+    BOOST_CHECK_EQUAL(setKeyIDs.size(), nTarget + 1);
+
+    // Already full: nothing to add
+    BOOST_CHECK(pwalletMain->TopUpKeyPool(nTarget));
+    BOOST_CHECK_EQUAL(pwalletMain->GetKeyPoolSize(), nTarget + 1);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_load_batches)
+{
+    // Enough records for more than one load batch, key records included
+    const string strFile = "wallet_load_test.dat";
+    const int nTxs = 500;
+    unsigned int nKeyPool = 3500;
+    set<uint256> setTxids;
+    set<CKeyID> setKeyIDs;
+    {
+        CWallet walletWrite(strFile);
+        bool fFirstRun;
+        BOOST_CHECK_EQUAL(walletWrite.LoadWallet(fFirstRun), DB_LOAD_OK);
+        LOCK(walletWrite.cs_wallet);
+        BOOST_CHECK(walletWrite.TopUpKeyPool(nKeyPool));
+        walletWrite.GetKeys(setKeyIDs);
+        BOOST_CHECK_EQUAL(setKeyIDs.size(), nKeyPool + 1);
+
+        CScript scriptMine;
+        scriptMine.SetDestination(*setKeyIDs.begin());
+        for (int i = 0; i < nTxs; i++)
+        {
+            CTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].prevout.hash = GetRandHash();
+            tx.vout.push_back(CTxOut((i + 1) * CENT, scriptMine));
+            CWalletTx wtx(&walletWrite, tx);
+            BOOST_CHECK(walletWrite.AddToWallet(wtx));
+            setTxids.insert(wtx.GetHash());
+        }
+    }
+
+    CWallet walletRead(strFile);
+    bool fFirstRun;
+    BOOST_CHECK_EQUAL(walletRead.LoadWallet(fFirstRun), DB_LOAD_OK);
+
+    LOCK(walletRead.cs_wallet);
+    BOOST_CHECK_EQUAL(walletRead.mapWallet.size(), (size_t)nTxs);
+    BOOST_FOREACH(const uint256& hash, setTxids)
+        BOOST_CHECK(walletRead.mapWallet.count(hash));
+    set<CKeyID> setKeyIDsRead;
+    walletRead.GetKeys(setKeyIDsRead);
+    BOOST_CHECK(setKeyIDsRead == setKeyIDs);
+    BOOST_CHECK_EQUAL(walletRead.GetKeyPoolSize(), nKeyPool + 1);
+    BOOST_FOREACH(const CKeyID& keyID, setKeyIDs)
+    {
+        CKey key;
+        BOOST_CHECK(walletRead.GetKey(keyID, key));
+        BOOST_CHECK(key.GetPubKey().GetID() == keyID);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,257 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "walletlog.h"
+
+#include "util.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(walletlog_tests)
+
+static CSerializeData Data(const string& str)
+{
+    return CSerializeData(str.begin(), str.end());
+}
+
+static string Str(const CSerializeData& vch)
+{
+    return string(vch.begin(), vch.end());
+}
+
+static boost::filesystem::path LogPath(const string& strName)
+{
+    boost::filesystem::path path = GetDataDir() / strName;
+    boost::filesystem::remove(path);
+    return path;
+}
+
+static bool Put(CWalletLog& log, const string& strKey, const string& strValue)
+{
+    CWalletStoreBatch batch;
+    batch.Write(Data(strKey), Data(strValue));
+    return log.Commit(batch);
+}
+
+static string Get(const CWalletLog& log, const string& strKey)
+{
+    CSerializeData vchValue;
+    if (!log.Read(Data(strKey), vchValue))
+        return "<none>";
+    return Str(vchValue);
+}
+
+BOOST_AUTO_TEST_CASE(walletlog_replay)
+{
+    boost::filesystem::path path = LogPath("walletlog_replay.log");
+    {
+        CWalletLog log(path);
+        BOOST_CHECK(log.Open());
+        BOOST_CHECK(Put(log, "a", "1"));
+        BOOST_CHECK(Put(log, "b", "2"));
+        BOOST_CHECK(Put(log, "a", "3"));
+
+        CWalletStoreBatch batch;
+        batch.Write(Data("c"), Data("4"));
+        batch.Erase(Data("b"));
+        batch.Write(Data("\x80"), Data("5"));
+        BOOST_CHECK(log.Commit(batch));
+        BOOST_CHECK(batch.Find(Data("b"))->fErase);
+        BOOST_CHECK(batch.Find(Data("d")) == NULL);
+    }
+
+    CWalletLog log(path);
+    BOOST_CHECK(log.Open());
+    BOOST_CHECK_EQUAL(Get(log, "a"), "3");
+    BOOST_CHECK_EQUAL(Get(log, "b"), "<none>");
+    BOOST_CHECK_EQUAL(Get(log, "c"), "4");
+    BOOST_CHECK(log.Exists(Data("\x80")));
+    BOOST_CHECK(!log.Exists(Data("b")));
+
+    // Keys come back in unsigned byte order, as from Berkeley DB
+    string strKeys;
+    CSerializeData vchKey, vchValue;
+    bool fAfter = false;
+    while (log.Seek(vchKey, fAfter, vchKey, vchValue))
+    {
+        strKeys += Str(vchKey);
+        fAfter = true;
+    }
+    BOOST_CHECK_EQUAL(strKeys, "ac\x80");
+    BOOST_CHECK(log.Seek(Data("b"), false, vchKey, vchValue));
+    BOOST_CHECK_EQUAL(Str(vchKey), "c");
+    BOOST_CHECK(log.Seek(Data("c"), false, vchKey, vchValue));
+    BOOST_CHECK_EQUAL(Str(vchKey), "c");
+    BOOST_CHECK(!log.Seek(Data("\x80"), true, vchKey, vchValue));
+}
+
+BOOST_AUTO_TEST_CASE(walletlog_torn_tail)
+{
+    boost::filesystem::path path = LogPath("walletlog_torn.log");
+    uint64_t nFirstFrame, nLiveSize;
+    {
+        CWalletLog log(path);
+        BOOST_CHECK(log.Open());
+        BOOST_CHECK(Put(log, "key", "first"));
+        log.GetSizes(nFirstFrame, nLiveSize);
+        BOOST_CHECK(Put(log, "key", "second"));
+    }
+    uint64_t nFileSize = boost::filesystem::file_size(path);
+
+    // A crash in the middle of the second frame
+    boost::filesystem::resize_file(path, nFileSize - 3);
+    {
+        CWalletLog log(path);
+        BOOST_CHECK(log.Open());
+        BOOST_CHECK_EQUAL(Get(log, "key"), "first");
+    }
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(path), nFirstFrame);
+
+    // Space that was allocated but never written
+    boost::filesystem::resize_file(path, nFirstFrame + 100);
+    {
+        CWalletLog log(path);
+        BOOST_CHECK(log.Open());
+        BOOST_CHECK_EQUAL(Get(log, "key"), "first");
+        BOOST_CHECK(Put(log, "key", "third"));
+    }
+    BOOST_CHECK(boost::filesystem::file_size(path) > nFirstFrame);
+
+    // A damaged frame with good data after it is not a torn write
+    FILE* file = fopen(path.string().c_str(), "rb+");
+    fseek(file, nFirstFrame - 1, SEEK_SET);
+    fputc(0x55, file);
+    fclose(file);
+    {
+        CWalletLog log(path);
+        BOOST_CHECK(!log.Open());
+    }
+
+    // Damage in the last frame is cut off
+    boost::filesystem::resize_file(path, nFirstFrame);
+    {
+        CWalletLog log(path);
+        BOOST_CHECK(log.Open());
+        BOOST_CHECK_EQUAL(Get(log, "key"), "<none>");
+    }
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(path), 0);
+}
+
+BOOST_AUTO_TEST_CASE(walletlog_compaction)
+{
+    boost::filesystem::path path = LogPath("walletlog_compaction.log");
+    uint64_t nLogSize, nLiveSize;
+    size_t nRecords;
+    uint64_t nSyncs, nCompactions;
+    {
+        CWalletLog log(path, 16 * 1024);
+        BOOST_CHECK(log.Open());
+        for (int i = 0; i < 100; i++)
+            BOOST_CHECK(Put(log, strprintf("\x04pool%03d", i), string(100, 'p')));
+        for (int n = 0; n < 20; n++)
+            for (int i = 0; i < 50; i++)
+                BOOST_CHECK(Put(log, strprintf("key%02d", i), strprintf("%d", n)));
+
+        // Overwriting the same keys made the log grow past twice the live
+        // records a few times, each time it was compacted in the background
+        log.Close();
+        log.GetStats(nRecords, nSyncs, nCompactions);
+        BOOST_CHECK_EQUAL(nRecords, 150U);
+        BOOST_CHECK(nCompactions > 0);
+        log.GetSizes(nLogSize, nLiveSize);
+        BOOST_CHECK_EQUAL(boost::filesystem::file_size(path), nLogSize);
+        BOOST_CHECK(nLogSize <= 2 * nLiveSize + 16 * 1024);
+    }
+    {
+        CWalletLog log(path, 16 * 1024);
+        BOOST_CHECK(log.Open());
+        log.GetStats(nRecords, nSyncs, nCompactions);
+        BOOST_CHECK_EQUAL(nRecords, 150U);
+        BOOST_CHECK_EQUAL(Get(log, "key07"), "19");
+        BOOST_CHECK_EQUAL(Get(log, "\x04pool042"), string(100, 'p'));
+
+        // Rewrite drops the skipped records and leaves only live ones in the file
+        BOOST_CHECK(log.Rewrite("\x04pool"));
+        BOOST_CHECK_EQUAL(Get(log, "\x04pool042"), "<none>");
+        log.GetSizes(nLogSize, nLiveSize);
+        BOOST_CHECK(nLogSize <= nLiveSize);
+        BOOST_CHECK(Put(log, "key07", "20"));
+    }
+    CWalletLog log(path);
+    BOOST_CHECK(log.Open());
+    log.GetStats(nRecords, nSyncs, nCompactions);
+    BOOST_CHECK_EQUAL(nRecords, 50U);
+    BOOST_CHECK_EQUAL(Get(log, "key07"), "20");
+    BOOST_CHECK_EQUAL(Get(log, "key08"), "19");
+}
+
+static void WriteRecords(CWalletLog* plog, int nThread, int nRecords, int nPerBatch, bool* pfOK)
+{
+    for (int i = 0; i < nRecords; i += nPerBatch)
+    {
+        CWalletStoreBatch batch;
+        for (int j = i; j < i + nPerBatch && j < nRecords; j++)
+            batch.Write(Data(strprintf("\x02tx%02d%06d", nThread, j)), Data(string(250, 't')));
+        if (!plog->Commit(batch))
+            *pfOK = false;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(walletlog_group_commit)
+{
+    const int nThreads = 8;
+    const int nRecords = 2000;
+    for (int nRun = 0; nRun < 3; nRun++)
+    {
+        // One writer committing record by record, several writers sharing
+        // syncs, and one writer committing batches of 100
+        int nWriters = (nRun == 1 ? nThreads : 1);
+        int nPerBatch = (nRun == 2 ? 100 : 1);
+        boost::filesystem::path path = LogPath("walletlog_group_commit.log");
+        {
+            CWalletLog log(path);
+            BOOST_CHECK(log.Open());
+
+            int64_t nStart = GetTimeMicros();
+            bool fOK[nThreads];
+            boost::thread_group threadGroup;
+            for (int i = 1; i < nWriters; i++)
+            {
+                fOK[i] = true;
+                threadGroup.create_thread(boost::bind(&WriteRecords, &log, i, nRecords / nWriters, nPerBatch, &fOK[i]));
+            }
+            fOK[0] = true;
+            WriteRecords(&log, 0, nRecords / nWriters, nPerBatch, &fOK[0]);
+            threadGroup.join_all();
+            int64_t nElapsed = std::max(GetTimeMicros() - nStart, (int64_t)1);
+
+            size_t nCount;
+            uint64_t nSyncs, nCompactions;
+            log.GetStats(nCount, nSyncs, nCompactions);
+            for (int i = 0; i < nWriters; i++)
+                BOOST_CHECK(fOK[i]);
+            BOOST_CHECK_EQUAL(nCount, (size_t)nRecords);
+            BOOST_CHECK(nSyncs <= (uint64_t)(nRecords / nPerBatch));
+            if (fDebug) printf("walletlog_group_commit: %d records, %d writers, %d per commit: %ldus, %lu syncs, %ld records/s\n",
+                               nRecords, nWriters, nPerBatch, (long)nElapsed, (unsigned long)nSyncs, (long)(nRecords * 1000000LL / nElapsed));
+        }
+
+        // Every commit was on disk when it returned
+        CWalletLog log(path);
+        BOOST_CHECK(log.Open());
+        for (int i = 0; i < nWriters; i++)
+            BOOST_CHECK_EQUAL(Get(log, strprintf("\x02tx%02d%06d", i, nRecords / nWriters - 1)), string(250, 't'));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
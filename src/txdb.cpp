@@ -51,7 +51,7 @@ bool CCoinsViewDB::SetBestBlock(const uint256 &hashBlock) {
     return db.WriteBatch(batch);
 }
 
-bool CCoinsViewDB::BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock) {
+bool CCoinsViewDB::BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock, const CCoinsStats *pstats) {
     LogPrint("coindb", "Committing %u changed transactions to coin database...\n", (unsigned int)mapCoins.size());
 
     CLevelDBBatch batch;
@@ -59,10 +59,30 @@ bool CCoinsViewDB::BatchWrite(const std::map<uint256, CCoins> &mapCoins, const u
         BatchWriteCoins(batch, it->first, it->second);
     if (hashBlock != uint256(0))
         BatchWriteHashBestChain(batch, hashBlock);
+    // The running statistics ('S') go in the same batch as the best block, so
+    // they always describe exactly the coins on disk
+    if (pstats)
+        batch.Write('S', *pstats);
 
     return db.WriteBatch(batch);
 }
 
+bool CCoinsViewDB::GetRunningStats(CCoinsStats &stats) {
+    // 'S' only counts for the coins on disk when it was written along with
+    // them; a chainstate advanced without it (by an older version, say)
+    // keeps a stale one
+    uint256 hashBestBlock = GetBestBlock();
+    if (db.Read('S', stats) && stats.hashBlock == hashBestBlock)
+        return true;
+    // A brand new chainstate is trivially empty; any other needs a full
+    // scan first
+    if (hashBestBlock == uint256(0)) {
+        stats = CCoinsStats();
+        return true;
+    }
+    return false;
+}
+
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
 }
 
@@ -71,6 +91,11 @@ bool CBlockTreeDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
     return Write(std::make_pair('b', blockindex.GetBlockHash()), blockindex);
 }
 
+void CBlockTreeDB::WriteBlockIndex(CLevelDBBatch &batch, const CDiskBlockIndex& blockindex)
+{
+    batch.Write(std::make_pair('b', blockindex.GetBlockHash()), blockindex);
+}
+
 bool CBlockTreeDB::WriteBestInvalidWork(const CBigNum& bnBestInvalidWork)
 {
     // Obsolete; only written for backward compatibility.
@@ -143,6 +168,9 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
                 }
                 stats.nSerializedSize += 32 + slValue.size();
                 ss << VARINT(0);
+                CCoinsStats entry;
+                entry.AddCoins(txhash, coins);
+                stats.hashMultiset += entry.hashMultiset;
             }
             pcursor->Next();
         } catch (std::exception &e) {
@@ -156,17 +184,166 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
     return true;
 }
 
+// The compact transaction index ('T') is keyed by the first 8 bytes of the
+// txid instead of all 32, roughly halving its size. Readers must check the
+// transaction they find: on the rare collision the later one wins.
+static uint64_t CompactTxIndexKey(const uint256 &txid) {
+    return txid.Get64(0);
+}
+
 bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
+    if (fCompactTxIndex)
+        return Read(std::make_pair('T', CompactTxIndexKey(txid)), pos);
     return Read(std::make_pair('t', txid), pos);
 }
 
 bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >&vect) {
     CLevelDBBatch batch;
-    for (std::vector<std::pair<uint256,CDiskTxPos> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
-        batch.Write(std::make_pair('t', it->first), it->second);
+    WriteTxIndex(batch, vect);
     return WriteBatch(batch);
 }
 
+void CBlockTreeDB::WriteTxIndex(CLevelDBBatch &batch, const std::vector<std::pair<uint256, CDiskTxPos> >&vect) {
+    for (std::vector<std::pair<uint256,CDiskTxPos> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
+        if (fCompactTxIndex)
+            batch.Write(std::make_pair('T', CompactTxIndexKey(it->first)), it->second);
+        else
+            batch.Write(std::make_pair('t', it->first), it->second);
+    }
+}
+
+void CBlockTreeDB::UpdateAddressIndex(CLevelDBBatch &batch, const std::vector<std::pair<CAddressIndexKey, int64_t> >&vect, bool fErase) {
+    // The running totals ('s') change by exactly the entries added or
+    // removed, in the same batch
+    std::map<uint160, CAddressBalanceValue> mapBalance;
+    for (std::vector<std::pair<CAddressIndexKey, int64_t> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
+        if (fErase)
+            batch.Erase(std::make_pair('a', it->first));
+        else
+            batch.Write(std::make_pair('a', it->first), it->second);
+
+        std::map<uint160, CAddressBalanceValue>::iterator mi = mapBalance.find(it->first.hashScript);
+        if (mi == mapBalance.end()) {
+            mi = mapBalance.insert(std::make_pair(it->first.hashScript, CAddressBalanceValue())).first;
+            ReadAddressBalance(it->first.hashScript, mi->second);
+        }
+        int64_t nValue = fErase ? -it->second : it->second;
+        mi->second.nBalance += nValue;
+        if (!it->first.fSpending)
+            mi->second.nReceived += nValue;
+    }
+    for (std::map<uint160, CAddressBalanceValue>::const_iterator mi=mapBalance.begin(); mi!=mapBalance.end(); mi++) {
+        if (mi->second.IsNull())
+            batch.Erase(std::make_pair('s', mi->first));
+        else
+            batch.Write(std::make_pair('s', mi->first), mi->second);
+    }
+}
+
+void CBlockTreeDB::UpdateAddressUnspentIndex(CLevelDBBatch &batch, const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >&vect) {
+    for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
+        if (it->second.IsNull())
+            batch.Erase(std::make_pair('u', it->first));
+        else
+            batch.Write(std::make_pair('u', it->first), it->second);
+    }
+}
+
+void CBlockTreeDB::UpdateSpentIndex(CLevelDBBatch &batch, const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >&vect) {
+    for (std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
+        if (it->second.IsNull())
+            batch.Erase(std::make_pair('p', it->first));
+        else
+            batch.Write(std::make_pair('p', it->first), it->second);
+    }
+}
+
+bool CBlockTreeDB::ReadAddressIndex(const uint160 &hashScript, std::vector<std::pair<CAddressIndexKey, int64_t> > &vect, int nStart, int nEnd) {
+    leveldb::Iterator *pcursor = NewIterator();
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << std::make_pair('a', CAddressIndexKey(hashScript, nStart, uint256(0), 0, false));
+    pcursor->Seek(ssKeySet.str());
+
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddressIndexKey key;
+            ssKey >> chType;
+            if (chType != 'a')
+                break;
+            ssKey >> key;
+            if (key.hashScript != hashScript || (nEnd > 0 && key.nHeight > nEnd))
+                break;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            int64_t nValue;
+            ssValue >> nValue;
+            vect.push_back(std::make_pair(key, nValue));
+            pcursor->Next();
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    delete pcursor;
+    return true;
+}
+
+bool CBlockTreeDB::ReadAddressUnspentIndex(const uint160 &hashScript, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vect) {
+    leveldb::Iterator *pcursor = NewIterator();
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << std::make_pair('u', CAddressUnspentKey(hashScript, uint256(0), 0));
+    pcursor->Seek(ssKeySet.str());
+
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddressUnspentKey key;
+            ssKey >> chType;
+            if (chType != 'u')
+                break;
+            ssKey >> key;
+            if (key.hashScript != hashScript)
+                break;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CAddressUnspentValue value;
+            ssValue >> value;
+            vect.push_back(std::make_pair(key, value));
+            pcursor->Next();
+        } catch (std::exception &e) {
+            delete pcursor;
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    delete pcursor;
+    return true;
+}
+
+bool CBlockTreeDB::ReadAddressBalance(const uint160 &hashScript, CAddressBalanceValue &value) {
+    return Read(std::make_pair('s', hashScript), value);
+}
+
+bool CBlockTreeDB::ReadAddressIndexBestBlock(uint256 &hashBlock) {
+    return Read('A', hashBlock);
+}
+
+void CBlockTreeDB::WriteAddressIndexBestBlock(CLevelDBBatch &batch, const uint256 &hashBlock) {
+    batch.Write('A', hashBlock);
+}
+
+bool CBlockTreeDB::ReadSpentIndex(const CSpentIndexKey &key, CSpentIndexValue &value) {
+    return Read(std::make_pair('p', key), value);
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
     return Write(std::make_pair('F', name), fValue ? '1' : '0');
 }
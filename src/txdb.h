@@ -25,6 +25,140 @@ static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 4096 : 1024;
 // min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
 
+/**
+ * Address index entry key: an output paying to, or an input spending from,
+ * a script. Scripts are identified by the Hash160 of the scriptPubKey. The
+ * height is stored big endian so a script's entries iterate in chain order.
+ */
+struct CAddressIndexKey
+{
+    uint160 hashScript;
+    int nHeight;
+    uint256 txhash;
+    unsigned int nIndex;
+    bool fSpending;
+
+    CAddressIndexKey() : nHeight(0), nIndex(0), fSpending(false) {}
+    CAddressIndexKey(const uint160& hashScriptIn, int nHeightIn, const uint256& txhashIn, unsigned int nIndexIn, bool fSpendingIn) :
+        hashScript(hashScriptIn), nHeight(nHeightIn), txhash(txhashIn), nIndex(nIndexIn), fSpending(fSpendingIn) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        return 20 + 4 + 32 + 4 + 1;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int nType, int nVersion) const {
+        ::Serialize(s, hashScript, nType, nVersion);
+        uint32_t nHeightBE = (uint32_t)nHeight;
+        unsigned char pchHeight[4] = { (unsigned char)(nHeightBE >> 24), (unsigned char)(nHeightBE >> 16), (unsigned char)(nHeightBE >> 8), (unsigned char)nHeightBE };
+        s.write((const char*)pchHeight, 4);
+        ::Serialize(s, txhash, nType, nVersion);
+        ::Serialize(s, nIndex, nType, nVersion);
+        ::Serialize(s, fSpending, nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion) {
+        ::Unserialize(s, hashScript, nType, nVersion);
+        unsigned char pchHeight[4];
+        s.read((char*)pchHeight, 4);
+        uint32_t nHeightBE = ((uint32_t)pchHeight[0] << 24) | ((uint32_t)pchHeight[1] << 16) | ((uint32_t)pchHeight[2] << 8) | (uint32_t)pchHeight[3];
+        nHeight = (int)nHeightBE;
+        ::Unserialize(s, txhash, nType, nVersion);
+        ::Unserialize(s, nIndex, nType, nVersion);
+        ::Unserialize(s, fSpending, nType, nVersion);
+    }
+};
+
+/** Address index key of an unspent output paying to a script */
+struct CAddressUnspentKey
+{
+    uint160 hashScript;
+    uint256 txhash;
+    unsigned int nIndex;
+
+    CAddressUnspentKey() : nIndex(0) {}
+    CAddressUnspentKey(const uint160& hashScriptIn, const uint256& txhashIn, unsigned int nIndexIn) :
+        hashScript(hashScriptIn), txhash(txhashIn), nIndex(nIndexIn) {}
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(hashScript);
+        READWRITE(txhash);
+        READWRITE(nIndex);
+    )
+};
+
+struct CAddressUnspentValue
+{
+    int64_t nValue;
+    int nHeight;
+
+    CAddressUnspentValue() { SetNull(); }
+    CAddressUnspentValue(int64_t nValueIn, int nHeightIn) : nValue(nValueIn), nHeight(nHeightIn) {}
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(nValue);
+        READWRITE(nHeight);
+    )
+
+    // A null value in an update removes the entry
+    void SetNull() { nValue = -1; nHeight = 0; }
+    bool IsNull() const { return nValue == -1; }
+};
+
+/** Running totals of a script's address index entries, kept so a balance is one read */
+struct CAddressBalanceValue
+{
+    int64_t nBalance;
+    int64_t nReceived;
+
+    CAddressBalanceValue() { SetNull(); }
+    CAddressBalanceValue(int64_t nBalanceIn, int64_t nReceivedIn) : nBalance(nBalanceIn), nReceived(nReceivedIn) {}
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(nBalance);
+        READWRITE(nReceived);
+    )
+
+    void SetNull() { nBalance = 0; nReceived = 0; }
+    bool IsNull() const { return nBalance == 0 && nReceived == 0; }
+};
+
+/** Spent index: which input spent an output */
+struct CSpentIndexKey
+{
+    uint256 txid;
+    unsigned int nIndex;
+
+    CSpentIndexKey() : nIndex(0) {}
+    CSpentIndexKey(const uint256& txidIn, unsigned int nIndexIn) : txid(txidIn), nIndex(nIndexIn) {}
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(txid);
+        READWRITE(nIndex);
+    )
+};
+
+struct CSpentIndexValue
+{
+    uint256 txid;
+    unsigned int nIndex;
+    int nHeight;
+
+    CSpentIndexValue() { SetNull(); }
+    CSpentIndexValue(const uint256& txidIn, unsigned int nIndexIn, int nHeightIn) : txid(txidIn), nIndex(nIndexIn), nHeight(nHeightIn) {}
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(txid);
+        READWRITE(nIndex);
+        READWRITE(nHeight);
+    )
+
+    // A null value in an update removes the entry
+    void SetNull() { txid = 0; nIndex = 0; nHeight = -1; }
+    bool IsNull() const { return nHeight == -1; }
+};
+
 /** CCoinsView backed by the LevelDB coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
 {
@@ -38,8 +172,9 @@ public:
     bool HaveCoins(const uint256 &txid);
     uint256 GetBestBlock();
     bool SetBestBlock(const uint256 &hashBlock);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock);
+    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, const uint256 &hashBlock, const CCoinsStats *pstats);
     bool GetStats(CCoinsStats &stats);
+    bool GetRunningStats(CCoinsStats &stats);
 };
 
 /** Access to the block database (blocks/index/) */
@@ -52,6 +187,7 @@ private:
     void operator=(const CBlockTreeDB&);
 public:
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
+    void WriteBlockIndex(CLevelDBBatch &batch, const CDiskBlockIndex& blockindex);
     bool WriteBestInvalidWork(const CBigNum& bnBestInvalidWork);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &fileinfo);
     bool WriteBlockFileInfo(int nFile, const CBlockFileInfo &fileinfo);
@@ -61,6 +197,19 @@ public:
     bool ReadReindexing(bool &fReindex);
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
+    void WriteTxIndex(CLevelDBBatch &batch, const std::vector<std::pair<uint256, CDiskTxPos> > &list);
+    /** Add (or with fErase remove) history entries, updating the scripts' running totals to match */
+    void UpdateAddressIndex(CLevelDBBatch &batch, const std::vector<std::pair<CAddressIndexKey, int64_t> > &vect, bool fErase);
+    void UpdateAddressUnspentIndex(CLevelDBBatch &batch, const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vect);
+    void UpdateSpentIndex(CLevelDBBatch &batch, const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > &vect);
+    /** Entries for a script, optionally limited to heights nStart..nEnd (inclusive, 0 for open ended) */
+    bool ReadAddressIndex(const uint160 &hashScript, std::vector<std::pair<CAddressIndexKey, int64_t> > &vect, int nStart = 0, int nEnd = 0);
+    bool ReadAddressUnspentIndex(const uint160 &hashScript, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vect);
+    bool ReadAddressBalance(const uint160 &hashScript, CAddressBalanceValue &value);
+    /** The block the address index was last brought up to, written in the batch of each update */
+    bool ReadAddressIndexBestBlock(uint256 &hashBlock);
+    void WriteAddressIndexBestBlock(CLevelDBBatch &batch, const uint256 &hashBlock);
+    bool ReadSpentIndex(const CSpentIndexKey &key, CSpentIndexValue &value);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts();
@@ -4,7 +4,23 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "core.h"
+#include "memusage.h"
 #include "txmempool.h"
+#include "util.h"
+
+#include <limits>
+#include <math.h>
+
+// Heap memory behind a transaction: its input and output vectors and the scripts in them
+static size_t TxDynamicUsage(const CTransaction& tx)
+{
+    size_t nUsage = memusage::DynamicUsage(tx.vin) + memusage::DynamicUsage(tx.vout);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nUsage += memusage::DynamicUsage(txin.scriptSig);
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nUsage += memusage::DynamicUsage(txout.scriptPubKey);
+    return nUsage;
+}
 
 CTxMemPoolEntry::CTxMemPoolEntry()
 {
@@ -16,7 +32,16 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, int64_t _nFee,
                                  unsigned int _nHeight):
     tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight)
 {
+    hash = tx.GetHash();
     nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    nUsageSize = TxDynamicUsage(tx);
+
+    nCountWithDescendants = 1;
+    nSizeWithDescendants = nTxSize;
+    nFeesWithDescendants = nFee;
+    nCountWithAncestors = 1;
+    nSizeWithAncestors = nTxSize;
+    nFeesWithAncestors = nFee;
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -33,12 +58,36 @@ CTxMemPoolEntry::GetPriority(unsigned int currentHeight) const
     return dResult;
 }
 
+void CTxMemPoolEntry::UpdateDescendantState(int64_t modifySize, int64_t modifyFee, int64_t modifyCount)
+{
+    nSizeWithDescendants += modifySize;
+    assert(int64_t(nSizeWithDescendants) > 0);
+    nFeesWithDescendants += modifyFee;
+    nCountWithDescendants += modifyCount;
+    assert(int64_t(nCountWithDescendants) > 0);
+}
+
+void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, int64_t modifyFee, int64_t modifyCount)
+{
+    nSizeWithAncestors += modifySize;
+    assert(int64_t(nSizeWithAncestors) > 0);
+    nFeesWithAncestors += modifyFee;
+    nCountWithAncestors += modifyCount;
+    assert(int64_t(nCountWithAncestors) > 0);
+}
+
 CTxMemPool::CTxMemPool()
 {
     // Sanity checks off by default for performance, because otherwise
     // accepting transactions becomes O(N^2) where N is the number
     // of transactions in the pool
     fSanityCheck = false;
+
+    totalTxSize = 0;
+    cachedInnerUsage = 0;
+    rollingMinimumFeeRate = 0;
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = false;
 }
 
 void CTxMemPool::pruneSpent(const uint256 &hashTx, CCoins &coins)
@@ -66,23 +115,288 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
     nTransactionsUpdated += n;
 }
 
+const CTxMemPool::setEntries & CTxMemPool::GetMemPoolParents(txiter entry) const
+{
+    assert(entry != mapTx.end());
+    txlinksMap::const_iterator it = mapLinks.find(entry);
+    assert(it != mapLinks.end());
+    return it->second.parents;
+}
+
+const CTxMemPool::setEntries & CTxMemPool::GetMemPoolChildren(txiter entry) const
+{
+    assert(entry != mapTx.end());
+    txlinksMap::const_iterator it = mapLinks.find(entry);
+    assert(it != mapLinks.end());
+    return it->second.children;
+}
+
+void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
+{
+    setEntries &parents = mapLinks[entry].parents;
+    if (add) {
+        if (parents.insert(parent).second)
+            cachedInnerUsage += memusage::IncrementalDynamicUsage(parents);
+    } else {
+        if (parents.erase(parent))
+            cachedInnerUsage -= memusage::IncrementalDynamicUsage(parents);
+    }
+}
+
+void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+{
+    setEntries &children = mapLinks[entry].children;
+    if (add) {
+        if (children.insert(child).second)
+            cachedInnerUsage += memusage::IncrementalDynamicUsage(children);
+    } else {
+        if (children.erase(child))
+            cachedInnerUsage -= memusage::IncrementalDynamicUsage(children);
+    }
+}
+
+bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors,
+                                           uint64_t limitAncestorCount, uint64_t limitAncestorSize,
+                                           uint64_t limitDescendantCount, uint64_t limitDescendantSize,
+                                           std::string &errString, bool fSearchForParents) const
+{
+    setEntries setParents;
+    const CTransaction &tx = entry.GetTx();
+
+    if (fSearchForParents) {
+        BOOST_FOREACH(const CTxIn &txin, tx.vin) {
+            txiter piter = mapTx.find(txin.prevout.hash);
+            if (piter == mapTx.end())
+                continue;
+            setParents.insert(piter);
+            if (setParents.size() + 1 > limitAncestorCount) {
+                errString = strprintf("too many unconfirmed parents [limit: %u]", limitAncestorCount);
+                return false;
+            }
+        }
+    } else {
+        setParents = GetMemPoolParents(mapTx.find(entry.GetHash()));
+    }
+
+    uint64_t nSizeWithAncestors = entry.GetTxSize();
+    while (!setParents.empty()) {
+        txiter stageit = *setParents.begin();
+        setParents.erase(setParents.begin());
+        setAncestors.insert(stageit);
+        nSizeWithAncestors += stageit->GetTxSize();
+
+        if (stageit->GetSizeWithDescendants() + entry.GetTxSize() > limitDescendantSize) {
+            errString = strprintf("exceeds descendant size limit for tx %s [limit: %u]", stageit->GetHash().ToString(), limitDescendantSize);
+            return false;
+        }
+        if (stageit->GetCountWithDescendants() + 1 > limitDescendantCount) {
+            errString = strprintf("too many descendants for tx %s [limit: %u]", stageit->GetHash().ToString(), limitDescendantCount);
+            return false;
+        }
+        if (nSizeWithAncestors > limitAncestorSize) {
+            errString = strprintf("exceeds ancestor size limit [limit: %u]", limitAncestorSize);
+            return false;
+        }
+
+        BOOST_FOREACH(const txiter &pit, GetMemPoolParents(stageit)) {
+            if (!setAncestors.count(pit))
+                setParents.insert(pit);
+            if (setParents.size() + setAncestors.size() + 1 > limitAncestorCount) {
+                errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+void CTxMemPool::CalculateDescendants(txiter entryit, setEntries &setDescendants) const
+{
+    setEntries stage;
+    if (!setDescendants.count(entryit))
+        stage.insert(entryit);
+    while (!stage.empty()) {
+        txiter it = *stage.begin();
+        stage.erase(stage.begin());
+        setDescendants.insert(it);
+        BOOST_FOREACH(const txiter &childit, GetMemPoolChildren(it)) {
+            if (!setDescendants.count(childit))
+                stage.insert(childit);
+        }
+    }
+}
+
+// Add or take away the entry from the descendant totals of its ancestors,
+// and link or unlink it from its parents
+void CTxMemPool::UpdateAncestorsOf(bool add, txiter it, setEntries &setAncestors)
+{
+    setEntries setParents;
+    BOOST_FOREACH(const CTxIn &txin, it->GetTx().vin) {
+        txiter piter = mapTx.find(txin.prevout.hash);
+        if (piter != mapTx.end())
+            setParents.insert(piter);
+    }
+    BOOST_FOREACH(txiter piter, setParents)
+        UpdateChild(piter, it, add);
+
+    const int64_t updateCount = (add ? 1 : -1);
+    const int64_t updateSize = updateCount * it->GetTxSize();
+    const int64_t updateFee = updateCount * it->GetFee();
+    BOOST_FOREACH(txiter ancestorIt, setAncestors)
+        mapTx.modify(ancestorIt, update_descendant_state(updateSize, updateFee, updateCount));
+}
+
+// Recompute the cached totals of one entry by walking its relatives. Only
+// needed when an entry joins the pool after some of its children, which
+// happens when a block is disconnected and its transactions come back.
+void CTxMemPool::UpdateStateFromScratch(txiter it)
+{
+    setEntries setAncestors, setDescendants;
+    std::string dummy;
+    CalculateMemPoolAncestors(*it, setAncestors, std::numeric_limits<uint64_t>::max(), std::numeric_limits<uint64_t>::max(),
+                              std::numeric_limits<uint64_t>::max(), std::numeric_limits<uint64_t>::max(), dummy, false);
+    CalculateDescendants(it, setDescendants);
+
+    int64_t nSize = it->GetTxSize(), nFees = it->GetFee(), nCount = 1;
+    BOOST_FOREACH(txiter ait, setAncestors) {
+        nSize += ait->GetTxSize();
+        nFees += ait->GetFee();
+        nCount++;
+    }
+    mapTx.modify(it, update_ancestor_state(nSize - it->GetSizeWithAncestors(), nFees - it->GetFeesWithAncestors(),
+                                           nCount - it->GetCountWithAncestors()));
+
+    nSize = 0, nFees = 0, nCount = 0;
+    BOOST_FOREACH(txiter dit, setDescendants) {
+        nSize += dit->GetTxSize();
+        nFees += dit->GetFee();
+        nCount++;
+    }
+    mapTx.modify(it, update_descendant_state(nSize - it->GetSizeWithDescendants(), nFees - it->GetFeesWithDescendants(),
+                                             nCount - it->GetCountWithDescendants()));
+}
 
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry)
+{
+    LOCK(cs);
+    setEntries setAncestors;
+    std::string dummy;
+    CalculateMemPoolAncestors(entry, setAncestors, std::numeric_limits<uint64_t>::max(), std::numeric_limits<uint64_t>::max(),
+                              std::numeric_limits<uint64_t>::max(), std::numeric_limits<uint64_t>::max(), dummy);
+    return addUnchecked(hash, entry, setAncestors);
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, setEntries &setAncestors)
 {
     // Add to memory pool without checking anything.
     // Used by main.cpp AcceptToMemoryPool(), which DOES do
     // all the appropriate checks.
     LOCK(cs);
     {
-        mapTx[hash] = entry;
-        const CTransaction& tx = mapTx[hash].GetTx();
+        std::pair<txiter, bool> ret = mapTx.insert(entry);
+        if (!ret.second)
+            return false;
+        txiter newit = ret.first;
+        mapLinks.insert(std::make_pair(newit, TxLinks()));
+        totalTxSize += newit->GetTxSize();
+        cachedInnerUsage += newit->DynamicMemoryUsage();
+
+        const CTransaction& tx = newit->GetTx();
         for (unsigned int i = 0; i < tx.vin.size(); i++)
             mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+
+        // The new entry is a child of its parents and a descendant of each
+        // of its ancestors
+        BOOST_FOREACH(const CTxIn &txin, tx.vin) {
+            txiter parentit = mapTx.find(txin.prevout.hash);
+            if (parentit != mapTx.end())
+                UpdateParent(newit, parentit, true);
+        }
+        UpdateAncestorsOf(true, newit, setAncestors);
+        int64_t nSize = 0, nFees = 0;
+        BOOST_FOREACH(txiter ait, setAncestors) {
+            nSize += ait->GetTxSize();
+            nFees += ait->GetFee();
+        }
+        mapTx.modify(newit, update_ancestor_state(nSize, nFees, setAncestors.size()));
+
+        // Children already in the pool: link them and bring everything the
+        // new entry now connects up to date
+        setEntries setChildren;
+        std::map<COutPoint, CInPoint>::iterator it = mapNextTx.lower_bound(COutPoint(hash, 0));
+        for (; it != mapNextTx.end() && it->first.hash == hash; ++it) {
+            txiter childit = mapTx.find(it->second.ptx->GetHash());
+            if (childit != mapTx.end())
+                setChildren.insert(childit);
+        }
+        if (!setChildren.empty()) {
+            BOOST_FOREACH(txiter childit, setChildren) {
+                UpdateChild(newit, childit, true);
+                UpdateParent(childit, newit, true);
+            }
+            setEntries setDescendants;
+            CalculateDescendants(newit, setDescendants);
+            setDescendants.insert(setAncestors.begin(), setAncestors.end());
+            BOOST_FOREACH(txiter updateit, setDescendants)
+                UpdateStateFromScratch(updateit);
+        }
+
         nTransactionsUpdated++;
     }
     return true;
 }
 
+struct CompareIteratorByAncestorCount {
+    bool operator()(const CTxMemPool::txiter &a, const CTxMemPool::txiter &b) const {
+        return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+    }
+};
+
+// Remove a set of entries that is closed under descendants, unless
+// updateDescendants is set: then the descendants left behind lose the removed
+// entries from their ancestor totals.
+void CTxMemPool::RemoveStaged(setEntries &stage, bool updateDescendants, std::list<CTransaction>& removed)
+{
+    if (updateDescendants) {
+        BOOST_FOREACH(txiter removeit, stage) {
+            setEntries setDescendants;
+            CalculateDescendants(removeit, setDescendants);
+            BOOST_FOREACH(txiter dit, setDescendants) {
+                if (!stage.count(dit))
+                    mapTx.modify(dit, update_ancestor_state(-(int64_t)removeit->GetTxSize(), -removeit->GetFee(), -1));
+            }
+        }
+    }
+    BOOST_FOREACH(txiter removeit, stage) {
+        setEntries setAncestors;
+        std::string dummy;
+        CalculateMemPoolAncestors(*removeit, setAncestors, std::numeric_limits<uint64_t>::max(), std::numeric_limits<uint64_t>::max(),
+                                  std::numeric_limits<uint64_t>::max(), std::numeric_limits<uint64_t>::max(), dummy, false);
+        UpdateAncestorsOf(false, removeit, setAncestors);
+    }
+    BOOST_FOREACH(txiter removeit, stage) {
+        BOOST_FOREACH(txiter childit, GetMemPoolChildren(removeit))
+            UpdateParent(childit, removeit, false);
+    }
+
+    // Parents before children in the list of what was removed
+    std::vector<txiter> vRemove(stage.begin(), stage.end());
+    std::sort(vRemove.begin(), vRemove.end(), CompareIteratorByAncestorCount());
+    BOOST_FOREACH(txiter removeit, vRemove) {
+        const CTransaction& tx = removeit->GetTx();
+        removed.push_back(tx);
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            mapNextTx.erase(txin.prevout);
+        totalTxSize -= removeit->GetTxSize();
+        cachedInnerUsage -= removeit->DynamicMemoryUsage();
+        txlinksMap::iterator linksit = mapLinks.find(removeit);
+        cachedInnerUsage -= memusage::DynamicUsage(linksit->second.parents) + memusage::DynamicUsage(linksit->second.children);
+        mapLinks.erase(linksit);
+        mapTx.erase(removeit);
+        nTransactionsUpdated++;
+    }
+}
 
 void CTxMemPool::remove(const CTransaction &tx, std::list<CTransaction>& removed, bool fRecursive)
 {
@@ -90,22 +404,23 @@ void CTxMemPool::remove(const CTransaction &tx, std::list<CTransaction>& removed
     {
         LOCK(cs);
         uint256 hash = tx.GetHash();
-        if (fRecursive) {
-            for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
-                if (it == mapNextTx.end())
-                    continue;
-                remove(*it->second.ptx, removed, true);
+        setEntries stage;
+        txiter origit = mapTx.find(hash);
+        if (origit != mapTx.end()) {
+            if (fRecursive)
+                CalculateDescendants(origit, stage);
+            else
+                stage.insert(origit);
+        } else if (fRecursive) {
+            // Not in the pool itself, but what spends it may be
+            std::map<COutPoint, CInPoint>::iterator it = mapNextTx.lower_bound(COutPoint(hash, 0));
+            for (; it != mapNextTx.end() && it->first.hash == hash; ++it) {
+                txiter childit = mapTx.find(it->second.ptx->GetHash());
+                if (childit != mapTx.end())
+                    CalculateDescendants(childit, stage);
             }
         }
-        if (mapTx.count(hash))
-        {
-            removed.push_front(tx);
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-                mapNextTx.erase(txin.prevout);
-            mapTx.erase(hash);
-            nTransactionsUpdated++;
-        }
+        RemoveStaged(stage, !fRecursive, removed);
     }
 }
 
@@ -126,11 +441,29 @@ void CTxMemPool::removeConflicts(const CTransaction &tx, std::list<CTransaction>
     }
 }
 
+void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, std::list<CTransaction>& conflicts)
+{
+    LOCK(cs);
+    BOOST_FOREACH(const CTransaction& tx, vtx) {
+        std::list<CTransaction> dummy;
+        remove(tx, dummy, false);
+        removeConflicts(tx, conflicts);
+    }
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = true;
+}
+
 void CTxMemPool::clear()
 {
     LOCK(cs);
+    mapLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
+    totalTxSize = 0;
+    cachedInnerUsage = 0;
+    rollingMinimumFeeRate = 0;
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = false;
     ++nTransactionsUpdated;
 }
 
@@ -142,15 +475,22 @@ void CTxMemPool::check(CCoinsViewCache *pcoins) const
     LogPrint("mempool", "Checking mempool with %u transactions and %u inputs\n", (unsigned int)mapTx.size(), (unsigned int)mapNextTx.size());
 
     LOCK(cs);
-    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+    uint64_t checkTotal = 0;
+    uint64_t innerUsage = 0;
+    for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
         unsigned int i = 0;
-        const CTransaction& tx = it->second.GetTx();
+        const CTransaction& tx = it->GetTx();
+        checkTotal += it->GetTxSize();
+        innerUsage += it->DynamicMemoryUsage() + memusage::DynamicUsage(GetMemPoolParents(it)) +
+                      memusage::DynamicUsage(GetMemPoolChildren(it));
+        setEntries setParentCheck;
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
             // Check that every mempool transaction's inputs refer to available coins, or other mempool tx's.
-            std::map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(txin.prevout.hash);
+            indexed_transaction_set::const_iterator it2 = mapTx.find(txin.prevout.hash);
             if (it2 != mapTx.end()) {
-                const CTransaction& tx2 = it2->second.GetTx();
+                const CTransaction& tx2 = it2->GetTx();
                 assert(tx2.vout.size() > txin.prevout.n && !tx2.vout[txin.prevout.n].IsNull());
+                setParentCheck.insert(it2);
             } else {
                 CCoins &coins = pcoins->GetCoins(txin.prevout.hash);
                 assert(coins.IsAvailable(txin.prevout.n));
@@ -162,16 +502,59 @@ void CTxMemPool::check(CCoinsViewCache *pcoins) const
             assert(it3->second.n == i);
             i++;
         }
+        assert(setParentCheck == GetMemPoolParents(it));
+
+        // Cached totals against a walk of the graph
+        setEntries setAncestors;
+        std::string dummy;
+        CalculateMemPoolAncestors(*it, setAncestors, std::numeric_limits<uint64_t>::max(), std::numeric_limits<uint64_t>::max(),
+                                  std::numeric_limits<uint64_t>::max(), std::numeric_limits<uint64_t>::max(), dummy);
+        uint64_t nCountCheck = setAncestors.size() + 1;
+        uint64_t nSizeCheck = it->GetTxSize();
+        int64_t nFeesCheck = it->GetFee();
+        BOOST_FOREACH(txiter ancestorIt, setAncestors) {
+            nSizeCheck += ancestorIt->GetTxSize();
+            nFeesCheck += ancestorIt->GetFee();
+        }
+        assert(it->GetCountWithAncestors() == nCountCheck);
+        assert(it->GetSizeWithAncestors() == nSizeCheck);
+        assert(it->GetFeesWithAncestors() == nFeesCheck);
+
+        setEntries setChildrenCheck;
+        std::map<COutPoint, CInPoint>::const_iterator iter = mapNextTx.lower_bound(COutPoint(it->GetHash(), 0));
+        for (; iter != mapNextTx.end() && iter->first.hash == it->GetHash(); ++iter) {
+            indexed_transaction_set::const_iterator childit = mapTx.find(iter->second.ptx->GetHash());
+            assert(childit != mapTx.end());
+            setChildrenCheck.insert(childit);
+        }
+        assert(setChildrenCheck == GetMemPoolChildren(it));
+
+        setEntries setDescendants;
+        CalculateDescendants(it, setDescendants);
+        nCountCheck = 0;
+        nSizeCheck = 0;
+        nFeesCheck = 0;
+        BOOST_FOREACH(txiter descendantIt, setDescendants) {
+            nCountCheck++;
+            nSizeCheck += descendantIt->GetTxSize();
+            nFeesCheck += descendantIt->GetFee();
+        }
+        assert(it->GetCountWithDescendants() == nCountCheck);
+        assert(it->GetSizeWithDescendants() == nSizeCheck);
+        assert(it->GetFeesWithDescendants() == nFeesCheck);
     }
     for (std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
         uint256 hash = it->second.ptx->GetHash();
-        std::map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(hash);
-        const CTransaction& tx = it2->second.GetTx();
+        indexed_transaction_set::const_iterator it2 = mapTx.find(hash);
         assert(it2 != mapTx.end());
+        const CTransaction& tx = it2->GetTx();
         assert(&tx == it->second.ptx);
         assert(tx.vin.size() > it->second.n);
         assert(it->first == it->second.ptx->vin[it->second.n].prevout);
     }
+    assert(mapLinks.size() == mapTx.size());
+    assert(totalTxSize == checkTotal);
+    assert(innerUsage == cachedInnerUsage);
 }
 
 void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
@@ -180,19 +563,104 @@ void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (std::map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
-        vtxid.push_back((*mi).first);
+    for (indexed_transaction_set::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+        vtxid.push_back(mi->GetHash());
 }
 
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
-    std::map<uint256, CTxMemPoolEntry>::const_iterator i = mapTx.find(hash);
+    indexed_transaction_set::const_iterator i = mapTx.find(hash);
     if (i == mapTx.end()) return false;
-    result = i->second.GetTx();
+    result = i->GetTx();
     return true;
 }
 
+size_t CTxMemPool::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    // Every entry sits in one multi_index node, with three pointers for each of the five indexes
+    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 15 * sizeof(void*)) * mapTx.size() +
+           memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapLinks) + cachedInnerUsage;
+}
+
+int CTxMemPool::Expire(int64_t time, std::list<CTransaction>* premoved)
+{
+    LOCK(cs);
+    indexed_transaction_set::index<entry_time>::type::iterator it = mapTx.get<entry_time>().begin();
+    setEntries toremove;
+    while (it != mapTx.get<entry_time>().end() && it->GetTime() < time) {
+        toremove.insert(mapTx.project<0>(it));
+        it++;
+    }
+    setEntries stage;
+    BOOST_FOREACH(txiter removeit, toremove)
+        CalculateDescendants(removeit, stage);
+    std::list<CTransaction> removed;
+    RemoveStaged(stage, false, premoved ? *premoved : removed);
+    return stage.size();
+}
+
+void CTxMemPool::trackPackageRemoved(double dFeeRate)
+{
+    if (dFeeRate > rollingMinimumFeeRate) {
+        rollingMinimumFeeRate = dFeeRate;
+        blockSinceLastRollingFeeBump = false;
+    }
+}
+
+void CTxMemPool::TrimToSize(size_t sizelimit, std::list<CTransaction>* premoved)
+{
+    LOCK(cs);
+    unsigned int nTxnRemoved = 0;
+    double dMaxFeeRateRemoved = 0;
+    while (!mapTx.empty() && DynamicMemoryUsage() > sizelimit) {
+        indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
+
+        // What comes in next has to pay more than the package that made room
+        // for it, by the relay fee, or it could just push the package out again
+        double dRemovedRate = (double)it->GetFeesWithDescendants() * 1000 / it->GetSizeWithDescendants() + CTransaction::nMinRelayTxFee;
+        trackPackageRemoved(dRemovedRate);
+        dMaxFeeRateRemoved = std::max(dMaxFeeRateRemoved, dRemovedRate);
+
+        setEntries stage;
+        CalculateDescendants(mapTx.project<0>(it), stage);
+        std::list<CTransaction> removed;
+        RemoveStaged(stage, false, premoved ? *premoved : removed);
+        nTxnRemoved += stage.size();
+    }
+    if (dMaxFeeRateRemoved > 0)
+        LogPrint("mempool", "Removed %u txn, rolling minimum fee bumped to %d\n", nTxnRemoved, (int64_t)dMaxFeeRateRemoved);
+}
+
+int64_t CTxMemPool::GetMinFeeRate(size_t sizelimit) const
+{
+    static const double ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+
+    LOCK(cs);
+    if (!blockSinceLastRollingFeeBump || rollingMinimumFeeRate == 0)
+        return (int64_t)rollingMinimumFeeRate;
+
+    int64_t nNow = GetTime();
+    if (nNow > lastRollingFeeUpdate + 10) {
+        double halflife = ROLLING_FEE_HALFLIFE;
+        size_t nUsage = DynamicMemoryUsage();
+        if (nUsage < sizelimit / 4)
+            halflife /= 4;
+        else if (nUsage < sizelimit / 2)
+            halflife /= 2;
+
+        rollingMinimumFeeRate = rollingMinimumFeeRate / pow(2.0, (nNow - lastRollingFeeUpdate) / halflife);
+        lastRollingFeeUpdate = nNow;
+
+        if (rollingMinimumFeeRate < (double)CTransaction::nMinRelayTxFee / 2) {
+            rollingMinimumFeeRate = 0;
+            return 0;
+        }
+    }
+    return std::max((int64_t)rollingMinimumFeeRate, CTransaction::nMinRelayTxFee);
+}
+
 CCoinsViewMemPool::CCoinsViewMemPool(CCoinsView &baseIn, CTxMemPool &mempoolIn) : CCoinsViewBacked(baseIn), mempool(mempoolIn) { }
 
 bool CCoinsViewMemPool::GetCoins(const uint256 &txid, CCoins &coins) {
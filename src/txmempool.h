@@ -6,26 +6,46 @@
 #define BITCOIN_TXMEMPOOL_H
 
 #include <list>
+#include <set>
 
 #include "coins.h"
 #include "core.h"
 #include "sync.h"
 
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/identity.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+
 /** Fake height value used in CCoins to signify they are only in the memory pool (since 0.8) */
 static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 
 /*
  * CTxMemPool stores these:
+ *
+ * Besides the transaction itself, each entry caches the totals (count, size
+ * and fees) over itself and all its in-pool ancestors, and over itself and
+ * all its in-pool descendants. They are kept up to date as related
+ * transactions enter and leave the pool, so miners and eviction can rank
+ * transactions together with what they depend on without walking the graph.
  */
 class CTxMemPoolEntry
 {
 private:
     CTransaction tx;
+    uint256 hash; // Cached, CTransaction recomputes it on every GetHash()
     int64_t nFee; // Cached to avoid expensive parent-transaction lookups
     size_t nTxSize; // ... and avoid recomputing tx size
     int64_t nTime; // Local time when entering the mempool
     double dPriority; // Priority when entering the mempool
     unsigned int nHeight; // Chain height when entering the mempool
+    size_t nUsageSize; // Heap memory used by the transaction
+
+    uint64_t nCountWithDescendants; // Number of descendants, including this one
+    uint64_t nSizeWithDescendants;
+    int64_t nFeesWithDescendants;
+    uint64_t nCountWithAncestors; // Number of ancestors, including this one
+    uint64_t nSizeWithAncestors;
+    int64_t nFeesWithAncestors;
 
 public:
     CTxMemPoolEntry(const CTransaction& _tx, int64_t _nFee,
@@ -34,13 +54,161 @@ public:
     CTxMemPoolEntry(const CTxMemPoolEntry& other);
 
     const CTransaction& GetTx() const { return this->tx; }
+    const uint256& GetHash() const { return hash; }
     double GetPriority(unsigned int currentHeight) const;
     int64_t GetFee() const { return nFee; }
     size_t GetTxSize() const { return nTxSize; }
     int64_t GetTime() const { return nTime; }
     unsigned int GetHeight() const { return nHeight; }
+    size_t DynamicMemoryUsage() const { return nUsageSize; }
+
+    // Adjust the totals for a descendant or ancestor that came or went
+    void UpdateDescendantState(int64_t modifySize, int64_t modifyFee, int64_t modifyCount);
+    void UpdateAncestorState(int64_t modifySize, int64_t modifyFee, int64_t modifyCount);
+
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    int64_t GetFeesWithDescendants() const { return nFeesWithDescendants; }
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    int64_t GetFeesWithAncestors() const { return nFeesWithAncestors; }
+};
+
+// Entries in the pool are const; these change them through mapTx.modify()
+struct update_descendant_state
+{
+    update_descendant_state(int64_t _modifySize, int64_t _modifyFee, int64_t _modifyCount) :
+        modifySize(_modifySize), modifyFee(_modifyFee), modifyCount(_modifyCount)
+    {}
+
+    void operator() (CTxMemPoolEntry &e)
+        { e.UpdateDescendantState(modifySize, modifyFee, modifyCount); }
+
+private:
+    int64_t modifySize;
+    int64_t modifyFee;
+    int64_t modifyCount;
+};
+
+struct update_ancestor_state
+{
+    update_ancestor_state(int64_t _modifySize, int64_t _modifyFee, int64_t _modifyCount) :
+        modifySize(_modifySize), modifyFee(_modifyFee), modifyCount(_modifyCount)
+    {}
+
+    void operator() (CTxMemPoolEntry &e)
+        { e.UpdateAncestorState(modifySize, modifyFee, modifyCount); }
+
+private:
+    int64_t modifySize;
+    int64_t modifyFee;
+    int64_t modifyCount;
+};
+
+/** Extracts the transaction hash of an entry, the primary key of the pool */
+struct mempoolentry_txid
+{
+    typedef uint256 result_type;
+    const result_type& operator() (const CTxMemPoolEntry &entry) const
+    {
+        return entry.GetHash();
+    }
 };
 
+/** Is fee a/size a strictly below fee b/size b? Compared as products, without dividing. */
+inline bool FeeRateLess(int64_t nFeeA, uint64_t nSizeA, int64_t nFeeB, uint64_t nSizeB)
+{
+    return (double)nFeeA * nSizeB < (double)nFeeB * nSizeA;
+}
+
+/** Highest fee rate of the transaction alone first */
+class CompareTxMemPoolEntryByFee
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        if (FeeRateLess(b.GetFee(), b.GetTxSize(), a.GetFee(), a.GetTxSize()))
+            return true;
+        if (FeeRateLess(a.GetFee(), a.GetTxSize(), b.GetFee(), b.GetTxSize()))
+            return false;
+        return a.GetHash() < b.GetHash();
+    }
+};
+
+/**
+ * Lowest descendant score first, the first candidates for eviction. The score
+ * is the higher of the fee rate of the transaction alone and that of it with
+ * all its descendants: a low fee parent with a high fee child is worth
+ * keeping, a high fee parent is not worth less because of a low fee child.
+ */
+class CompareTxMemPoolEntryByDescendantScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        int64_t nFeeA, nFeeB;
+        uint64_t nSizeA, nSizeB;
+        GetScore(a, nFeeA, nSizeA);
+        GetScore(b, nFeeB, nSizeB);
+        if (FeeRateLess(nFeeA, nSizeA, nFeeB, nSizeB))
+            return true;
+        if (FeeRateLess(nFeeB, nSizeB, nFeeA, nSizeA))
+            return false;
+        // Among equals, the one that has been waiting longer goes first
+        if (a.GetTime() != b.GetTime())
+            return a.GetTime() < b.GetTime();
+        return a.GetHash() < b.GetHash();
+    }
+
+private:
+    static void GetScore(const CTxMemPoolEntry& e, int64_t& nFee, uint64_t& nSize)
+    {
+        if (FeeRateLess(e.GetFee(), e.GetTxSize(), e.GetFeesWithDescendants(), e.GetSizeWithDescendants())) {
+            nFee = e.GetFeesWithDescendants();
+            nSize = e.GetSizeWithDescendants();
+        } else {
+            nFee = e.GetFee();
+            nSize = e.GetTxSize();
+        }
+    }
+};
+
+/** Oldest first */
+class CompareTxMemPoolEntryByEntryTime
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        if (a.GetTime() != b.GetTime())
+            return a.GetTime() < b.GetTime();
+        return a.GetHash() < b.GetHash();
+    }
+};
+
+/**
+ * Highest ancestor score first, the order to mine in: the fee rate of the
+ * transaction together with all the unconfirmed ancestors it needs, so a
+ * high fee child pulls its low fee parents forward.
+ */
+class CompareTxMemPoolEntryByAncestorScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        if (FeeRateLess(b.GetFeesWithAncestors(), b.GetSizeWithAncestors(), a.GetFeesWithAncestors(), a.GetSizeWithAncestors()))
+            return true;
+        if (FeeRateLess(a.GetFeesWithAncestors(), a.GetSizeWithAncestors(), b.GetFeesWithAncestors(), b.GetSizeWithAncestors()))
+            return false;
+        return a.GetHash() < b.GetHash();
+    }
+};
+
+// Index tags for CTxMemPool::mapTx
+struct descendant_score {};
+struct entry_time {};
+struct mining_score {};
+struct ancestor_score {};
+
 /*
  * CTxMemPool stores valid-according-to-the-current-best-chain
  * transactions that may be included in the next block.
@@ -50,6 +218,19 @@ public:
  * are added to the pool: if a new transaction double-spends
  * an input of a transaction in the pool, it is dropped,
  * as are non-standard transactions.
+ *
+ * mapTx holds the entries once, indexed by
+ *  - txid (the default index, iterated in hash order like the old map),
+ *  - descendant score (lowest first, see CompareTxMemPoolEntryByDescendantScore),
+ *  - entry time (oldest first),
+ *  - mining score (highest fee rate of the transaction alone first),
+ *  - ancestor score (highest package fee rate first).
+ * The indexes are maintained as entries are added, removed and their cached
+ * ancestor/descendant totals change, so nothing needs to be re-sorted per use.
+ *
+ * mapLinks records the direct in-pool parents and children of each entry.
+ * Cached totals assume that when a transaction leaves the pool without its
+ * descendants (because it was mined), its in-pool ancestors were mined too.
  */
 class CTxMemPool
 {
@@ -57,31 +238,146 @@ private:
     bool fSanityCheck; // Normally false, true if -checkmempool
     unsigned int nTransactionsUpdated;
 
+    uint64_t totalTxSize; // Sum of the serialized sizes of all entries
+    uint64_t cachedInnerUsage; // Heap memory of the entries and their links, see DynamicMemoryUsage()
+
+    // After the pool had to evict, the minimum fee rate (satoshis per 1000
+    // bytes) to get in is what was evicted. It decays once blocks come in.
+    mutable double rollingMinimumFeeRate;
+    mutable int64_t lastRollingFeeUpdate;
+    mutable bool blockSinceLastRollingFeeBump;
+
+    void trackPackageRemoved(double dFeeRate);
+
 public:
+    typedef boost::multi_index_container<
+        CTxMemPoolEntry,
+        boost::multi_index::indexed_by<
+            // sorted by txid
+            boost::multi_index::ordered_unique<mempoolentry_txid>,
+            // sorted by fee rate with descendants
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<descendant_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByDescendantScore
+            >,
+            // sorted by entry time
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<entry_time>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByEntryTime
+            >,
+            // sorted by fee rate
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<mining_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByFee
+            >,
+            // sorted by fee rate with ancestors
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<ancestor_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByAncestorScore
+            >
+        >
+    > indexed_transaction_set;
+
+    typedef indexed_transaction_set::nth_index<0>::type::iterator txiter;
+    struct CompareIteratorByHash {
+        bool operator()(const txiter &a, const txiter &b) const {
+            return a->GetHash() < b->GetHash();
+        }
+    };
+    typedef std::set<txiter, CompareIteratorByHash> setEntries;
+
     mutable CCriticalSection cs;
-    std::map<uint256, CTxMemPoolEntry> mapTx;
+    indexed_transaction_set mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
 
+private:
+    struct TxLinks {
+        setEntries parents;
+        setEntries children;
+    };
+    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
+    txlinksMap mapLinks;
+
+    void UpdateParent(txiter entry, txiter parent, bool add);
+    void UpdateChild(txiter entry, txiter child, bool add);
+    void UpdateAncestorsOf(bool add, txiter hash, setEntries &setAncestors);
+    void UpdateStateFromScratch(txiter entry);
+    void RemoveStaged(setEntries &stage, bool updateDescendants, std::list<CTransaction>& removed);
+
+public:
     CTxMemPool();
 
     /*
      * If sanity-checking is turned on, check makes sure the pool is
      * consistent (does not contain two transactions that spend the same inputs,
-     * all inputs are in the mapNextTx array). If sanity-checking is turned off,
+     * all inputs are in the mapNextTx array, links and cached ancestor and
+     * descendant totals are right). If sanity-checking is turned off,
      * check does nothing.
      */
     void check(CCoinsViewCache *pcoins) const;
     void setSanityCheck(bool _fSanityCheck) { fSanityCheck = _fSanityCheck; }
 
+    /*
+     * Add to the pool without checking anything but its place among the
+     * other entries. setAncestors, if given, must be the result of
+     * CalculateMemPoolAncestors for the entry.
+     */
     bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry);
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, setEntries &setAncestors);
     void remove(const CTransaction &tx, std::list<CTransaction>& removed, bool fRecursive = false);
     void removeConflicts(const CTransaction &tx, std::list<CTransaction>& removed);
+    /* Remove what a newly connected block confirms, and what conflicts with it */
+    void removeForBlock(const std::vector<CTransaction>& vtx, std::list<CTransaction>& conflicts);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
     void pruneSpent(const uint256& hash, CCoins &coins);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
 
+    /*
+     * Collect the in-pool ancestors of entry into setAncestors. Fails, with
+     * the reason in errString, if adding the entry would take it or any of
+     * its ancestors over the given limits. With fSearchForParents false the
+     * entry must already be in the pool, and its recorded parents are used.
+     */
+    bool CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors,
+                                   uint64_t limitAncestorCount, uint64_t limitAncestorSize,
+                                   uint64_t limitDescendantCount, uint64_t limitDescendantSize,
+                                   std::string &errString, bool fSearchForParents = true) const;
+
+    /* Add entry and all its in-pool descendants to setDescendants */
+    void CalculateDescendants(txiter entry, setEntries &setDescendants) const;
+
+    const setEntries & GetMemPoolParents(txiter entry) const;
+    const setEntries & GetMemPoolChildren(txiter entry) const;
+
+    /*
+     * The fee rate, in satoshis per 1000 bytes, a transaction has to pay to
+     * enter a pool limited to sizelimit bytes: zero until it had to evict,
+     * then what was evicted, halving every 12 hours (faster when the pool is
+     * well below the limit) once blocks come in again.
+     */
+    int64_t GetMinFeeRate(size_t sizelimit) const;
+
+    /* Evict the lowest descendant score packages until the pool fits in sizelimit bytes */
+    void TrimToSize(size_t sizelimit, std::list<CTransaction>* premoved = NULL);
+
+    /* Remove transactions that entered before time, and their descendants; returns how many */
+    int Expire(int64_t time, std::list<CTransaction>* premoved = NULL);
+
+    uint64_t GetTotalTxSize()
+    {
+        LOCK(cs);
+        return totalTxSize;
+    }
+
+    /* Heap memory used by the pool, transactions and indexes included */
+    size_t DynamicMemoryUsage() const;
+
     unsigned long size()
     {
         LOCK(cs);
@@ -373,6 +373,12 @@ public:
         return pn[0] | (uint64_t)pn[1] << 32;
     }
 
+    uint64_t Get64(int n=0) const
+    {
+        assert(n >= 0 && n < WIDTH / 2);
+        return pn[2*n] | (uint64_t)pn[2*n+1] << 32;
+    }
+
 //    unsigned int GetSerializeSize(int nType=0, int nVersion=PROTOCOL_VERSION) const
     unsigned int GetSerializeSize(int nType, int nVersion) const
     {
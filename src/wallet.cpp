@@ -8,9 +8,15 @@
 #include "base58.h"
 #include "checkpoints.h"
 #include "coincontrol.h"
+#include "init.h"
 #include "net.h"
 
+#include <deque>
+
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
 #include <openssl/rand.h>
 
 // Settings
@@ -71,6 +77,7 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
     AssertLockHeld(cs_wallet); // mapKeyMetadata
     if (!CCryptoKeyStore::AddKeyPubKey(secret, pubkey))
         return false;
+    AddMineScripts(pubkey);
     if (!fFileBacked)
         return true;
     if (!IsCrypted()) {
@@ -86,6 +93,7 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey,
 {
     if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
         return false;
+    AddMineScripts(vchPubKey);
     if (!fFileBacked)
         return true;
     {
@@ -112,20 +120,80 @@ bool CWallet::LoadKeyMetadata(const CPubKey &pubkey, const CKeyMetadata &meta)
     return true;
 }
 
+bool CWallet::LoadKey(const CKey& key, const CPubKey &pubkey)
+{
+    if (!CCryptoKeyStore::AddKeyPubKey(key, pubkey))
+        return false;
+    AddMineScripts(pubkey);
+    return true;
+}
+
 bool CWallet::LoadCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret)
 {
-    return CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret);
+    if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
+        return false;
+    AddMineScripts(vchPubKey);
+    return true;
 }
 
 bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    AddMineScripts(redeemScript);
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
 }
 
+bool CWallet::LoadCScript(const CScript& redeemScript)
+{
+    if (!CCryptoKeyStore::AddCScript(redeemScript))
+        return false;
+    AddMineScripts(redeemScript);
+    return true;
+}
+
+void CWallet::AddMineScripts(const CPubKey& pubkey)
+{
+    LOCK(cs_KeyStore);
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(pubkey.GetID());
+    setMineScripts.insert(scriptPubKey);
+    scriptPubKey.clear();
+    scriptPubKey << pubkey << OP_CHECKSIG;
+    setMineScripts.insert(scriptPubKey);
+
+    // A multisig redeem script may have just become ours
+    std::set<CScriptID>::iterator it = setPendingScripts.begin();
+    while (it != setPendingScripts.end())
+    {
+        CScript redeemScript;
+        if (GetCScript(*it, redeemScript) && ::IsMine(*this, redeemScript))
+        {
+            scriptPubKey.SetDestination(*it);
+            setMineScripts.insert(scriptPubKey);
+            setPendingScripts.erase(it++);
+        }
+        else
+            it++;
+    }
+}
+
+void CWallet::AddMineScripts(const CScript& redeemScript)
+{
+    LOCK(cs_KeyStore);
+    CScriptID scriptID = redeemScript.GetID();
+    if (::IsMine(*this, redeemScript))
+    {
+        CScript scriptPubKey;
+        scriptPubKey.SetDestination(scriptID);
+        setMineScripts.insert(scriptPubKey);
+    }
+    else
+        setPendingScripts.insert(scriptID);
+}
+
 bool CWallet::Unlock(const SecureString& strWalletPassphrase)
 {
     CCrypter crypter;
@@ -335,6 +403,72 @@ void CWallet::AddToSpends(const uint256& wtxid)
         AddToSpends(txin.prevout, wtxid);
 }
 
+// Unlike IsSpent, this only changes when blocks are connected or disconnected
+bool CWallet::IsSpentInMainChain(const COutPoint& outpoint) const
+{
+    std::pair<TxSpends::const_iterator, TxSpends::const_iterator> range;
+    range = mapTxSpends.equal_range(outpoint);
+
+    for (TxSpends::const_iterator it = range.first; it != range.second; ++it)
+    {
+        std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(it->second);
+        if (mit != mapWallet.end() && mit->second.IsInMainChain())
+            return true;
+    }
+    return false;
+}
+
+const std::set<COutPoint>& CWallet::GetWalletUTXO() const
+{
+    AssertLockHeld(cs_wallet);
+    if (fWalletUTXODirty)
+    {
+        setWalletUTXO.clear();
+        for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        {
+            const CWalletTx& wtx = it->second;
+            for (unsigned int i = 0; i < wtx.vout.size(); i++)
+            {
+                COutPoint outpoint(it->first, i);
+                if (IsMine(wtx.vout[i]) && !IsSpentInMainChain(outpoint))
+                    setWalletUTXO.insert(setWalletUTXO.end(), outpoint);
+            }
+        }
+        fWalletUTXODirty = false;
+        fBalancesCached = false;
+    }
+    return setWalletUTXO;
+}
+
+void CWallet::UpdateWalletUTXO(const COutPoint& outpoint)
+{
+    std::map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+    if (mi != mapWallet.end() && outpoint.n < mi->second.vout.size() &&
+        IsMine(mi->second.vout[outpoint.n]) && !IsSpentInMainChain(outpoint))
+        setWalletUTXO.insert(outpoint);
+    else
+        setWalletUTXO.erase(outpoint);
+}
+
+// Called for every transaction added, changed or erased: brings its own
+// outputs and the ones it spends up to date
+void CWallet::UpdateWalletUTXO(const CTransaction& tx)
+{
+    AssertLockHeld(cs_wallet);
+    fBalancesCached = false;
+    if (fWalletUTXODirty)
+        return;
+
+    uint256 hash = tx.GetHash();
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+        UpdateWalletUTXO(COutPoint(hash, i));
+    if (!tx.IsCoinBase())
+    {
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            UpdateWalletUTXO(txin.prevout);
+    }
+}
+
 bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
 {
     if (IsCrypted())
@@ -459,6 +593,20 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        fWalletUTXODirty = true;
+        fBalancesCached = false;
+    }
+}
+
+// Runs -walletnotify for a transaction added to the wallet or updated
+static void WalletNotify(const uint256& hash)
+{
+    std::string strCmd = GetArg("-walletnotify", "");
+
+    if ( !strCmd.empty())
+    {
+        boost::replace_all(strCmd, "%s", hash.GetHex());
+        boost::thread t(runCommand, strCmd); // thread runs free
     }
 }
 
@@ -471,6 +619,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         mapWallet[hash] = wtxIn;
         mapWallet[hash].BindWallet(this);
         AddToSpends(hash);
+        fWalletUTXODirty = true;
     }
     else
     {
@@ -565,18 +714,13 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
 
         // Break debit/credit balance caches:
         wtx.MarkDirty();
+        UpdateWalletUTXO(wtx);
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
 
         // notify an external script when a wallet transaction comes in or is updated
-        std::string strCmd = GetArg("-walletnotify", "");
-
-        if ( !strCmd.empty())
-        {
-            boost::replace_all(strCmd, "%s", wtxIn.GetHash().GetHex());
-            boost::thread t(runCommand, strCmd); // thread runs free
-        }
+        WalletNotify(hash);
 
     }
     return true;
@@ -606,6 +750,8 @@ bool CWallet::AddToWalletIfInvolvingMe(const uint256 &hash, const CTransaction&
 void CWallet::SyncTransaction(const uint256 &hash, const CTransaction& tx, const CBlock* pblock)
 {
     LOCK2(cs_main, cs_wallet);
+    // Updating one of ours, for instance as it enters or leaves the
+    // mempool, also resets the cached balances
     if (!AddToWalletIfInvolvingMe(hash, tx, pblock, true))
         return; // Not one of ours
 
@@ -625,13 +771,44 @@ void CWallet::EraseFromWallet(const uint256 &hash)
         return;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        std::map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            CTransaction tx = mi->second;
+            mapWallet.erase(mi);
             CWalletDB(strWalletFile).EraseTx(hash);
+            UpdateWalletUTXO(tx);
+        }
     }
     return;
 }
 
 
+// Whether setMineScripts holds every script of this exact form that is ours:
+// canonically encoded P2PKH, P2PK of a 33 or 65 byte key and P2SH. A miss on
+// one of these is final, anything else has to be solved.
+static bool IsMineScriptsForm(const CScript& script)
+{
+    if (script.size() == 25)
+        return script[0] == OP_DUP && script[1] == OP_HASH160 && script[2] == 20 &&
+               script[23] == OP_EQUALVERIFY && script[24] == OP_CHECKSIG;
+    if (script.size() == 35 || script.size() == 67)
+        return script[0] == script.size() - 2 && script.back() == OP_CHECKSIG;
+    return script.IsPayToScriptHash();
+}
+
+bool CWallet::IsMine(const CTxOut& txout) const
+{
+    {
+        LOCK(cs_KeyStore);
+        if (setMineScripts.count(txout.scriptPubKey))
+            return true;
+    }
+    if (IsMineScriptsForm(txout.scriptPubKey))
+        return false;
+    return ::IsMine(*this, txout.scriptPubKey);
+}
+
 bool CWallet::IsMine(const CTxIn &txin) const
 {
     {
@@ -818,11 +995,168 @@ void CWalletTx::GetAccountAmounts(const std::string& strAccount, int64_t& nRecei
 }
 
 
-bool CWalletTx::WriteToDisk()
+bool CWalletTx::WriteToDisk(CWalletDB* pwalletdb)
 {
+    if (pwalletdb)
+        return pwalletdb->WriteTx(GetHash(), *this);
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+/** Blocks the rescan workers may read ahead of the block being added to the wallet */
+static const unsigned int RESCAN_READ_AHEAD = 64;
+/** Most threads reading blocks for a rescan */
+static const int MAX_RESCAN_THREADS = 8;
+
+// Rescan pipeline: worker threads read blocks and pick out the transactions
+// that may involve the wallet, using sets taken from the wallet when the scan
+// starts. The scanning thread adds those to the wallet, block by block in
+// chain order, and takes cs_main and cs_wallet only for that.
+class CWalletScanner
+{
+public:
+    struct CScanBlock
+    {
+        CBlockIndex* pindex;
+        CBlock block;
+        std::vector<uint256> vHashes;
+        std::vector<bool> vMatch;
+        bool fDone;
+        bool fRead;
+
+        CScanBlock(CBlockIndex* pindexIn) : pindex(pindexIn), fDone(false), fRead(false) {}
+    };
+
+    CWalletScanner(const CWallet* pwalletIn) : pwallet(pwalletIn), nNextRead(0), fStop(false)
+    {
+        {
+            // Rebuilding the unspent set looks at the depth of wallet transactions
+            LOCK2(cs_main, pwallet->cs_wallet);
+            for (std::map<uint256, CWalletTx>::const_iterator it = pwallet->mapWallet.begin(); it != pwallet->mapWallet.end(); ++it)
+                setTxids.insert(setTxids.end(), it->first);
+            // Unspent is enough: whatever spends the rest is in the wallet already
+            setOutpoints = pwallet->GetWalletUTXO();
+        }
+        int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_RESCAN_THREADS));
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CWalletScanner::ThreadRead, this));
+    }
+
+    ~CWalletScanner()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+        }
+        condWork.notify_all();
+        threadGroup.join_all();
+        BOOST_FOREACH(CScanBlock* pblock, queue)
+            delete pblock;
+    }
+
+    bool IsFull()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return queue.size() >= RESCAN_READ_AHEAD;
+    }
+
+    void Push(CBlockIndex* pindex)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            queue.push_back(new CScanBlock(pindex));
+        }
+        condWork.notify_one();
+    }
+
+    // Next block in chain order once the workers are done with it, NULL when
+    // nothing is queued; the caller owns it
+    CScanBlock* Pop()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (queue.empty())
+            return NULL;
+        while (!queue.front()->fDone)
+            condDone.wait(lock);
+        CScanBlock* pblock = queue.front();
+        queue.pop_front();
+        nNextRead--;
+        return pblock;
+    }
+
+private:
+    const CWallet* pwallet;
+    std::set<uint256> setTxids;
+    std::set<COutPoint> setOutpoints;
+
+    boost::mutex mutex;
+    boost::condition_variable condWork;
+    boost::condition_variable condDone;
+    std::deque<CScanBlock*> queue;
+    size_t nNextRead;
+    bool fStop;
+    boost::thread_group threadGroup;
+
+    bool IsCandidate(const CTransaction& tx, const uint256& hash) const
+    {
+        if (setTxids.count(hash))
+            return true;
+        BOOST_FOREACH(const CTxOut& txout, tx.vout)
+            if (pwallet->IsMine(txout))
+                return true;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            if (setOutpoints.count(txin.prevout))
+                return true;
+        return false;
+    }
+
+    void Read(CScanBlock& scan) const
+    {
+        // The raw read checks the header hash against the index and skips
+        // the proof of work hash, which the block passed long ago
+        std::vector<unsigned char> vchBlock;
+        if (!ReadRawBlockFromDisk(vchBlock, scan.pindex))
+            return;
+        try {
+            CDataStream ssBlock(vchBlock, SER_DISK, CLIENT_VERSION);
+            ssBlock >> scan.block;
+        }
+        catch (std::exception &e) {
+            LogPrintf("CWalletScanner : Deserialize error in block %s - %s\n", scan.pindex->GetBlockHash().ToString(), e.what());
+            return;
+        }
+        scan.vHashes.resize(scan.block.vtx.size());
+        scan.vMatch.resize(scan.block.vtx.size());
+        for (unsigned int i = 0; i < scan.block.vtx.size(); i++)
+        {
+            scan.vHashes[i] = scan.block.vtx[i].GetHash();
+            scan.vMatch[i] = IsCandidate(scan.block.vtx[i], scan.vHashes[i]);
+        }
+        scan.fRead = true;
+    }
+
+    void ThreadRead()
+    {
+        while (true)
+        {
+            CScanBlock* pscan;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && nNextRead >= queue.size())
+                    condWork.wait(lock);
+                if (fStop)
+                    return;
+                pscan = queue[nNextRead++];
+            }
+            Read(*pscan);
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                pscan->fDone = true;
+            }
+            condDone.notify_all();
+        }
+    }
+};
+
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
@@ -832,37 +1166,99 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
     int64_t nNow = GetTime();
 
     CBlockIndex* pindex = pindexStart;
+    double dProgressStart, dProgressTip;
     {
-        LOCK2(cs_main, cs_wallet);
+        LOCK(cs_main);
 
         // no need to read and scan block, if block was created before
         // our wallet birthday (as adjusted for block time variability)
         while (pindex && nTimeFirstKey && (pindex->nTime < (nTimeFirstKey - 7200)))
             pindex = chainActive.Next(pindex);
 
-        ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
-        double dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
-        while (pindex)
+        dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
+        dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
+    }
+    ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
+
+    // Outputs of ours found by this scan, for the transactions spending them
+    std::set<COutPoint> setFound;
+    CBlockIndex* pindexQueued = NULL;
+    CWalletScanner scanner(this);
+    while (!ShutdownRequested())
+    {
+        // Queue what comes next on the active chain, following it as it
+        // grows or reorganizes while the scan runs
+        if (!scanner.IsFull())
+        {
+            LOCK(cs_main);
+            if (!pindexQueued)
+            {
+                if (pindex)
+                    scanner.Push(pindexQueued = pindex);
+            }
+            else
+            {
+                while (pindexQueued && !chainActive.Contains(pindexQueued))
+                    pindexQueued = pindexQueued->pprev;
+                while (pindexQueued && !scanner.IsFull() && chainActive.Next(pindexQueued))
+                    scanner.Push(pindexQueued = chainActive.Next(pindexQueued));
+            }
+        }
+
+        boost::scoped_ptr<CWalletScanner::CScanBlock> pscan(scanner.Pop());
+        if (!pscan)
+            break;
+        pindex = pscan->pindex;
+        if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
+            ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+
+        if (!pscan->fRead)
         {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+            LogPrintf("ScanForWalletTransactions() : failed to read block %s, skipping it\n", pindex->GetBlockHash().ToString());
+            continue;
+        }
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+        const CBlock& block = pscan->block;
+        bool fAny = false;
+        for (unsigned int i = 0; i < block.vtx.size() && !fAny; i++)
+        {
+            fAny = pscan->vMatch[i];
+            BOOST_FOREACH(const CTxIn& txin, block.vtx[i].vin)
+                fAny = fAny || setFound.count(txin.prevout);
+        }
+        if (fAny)
+        {
+            LOCK2(cs_main, cs_wallet);
+            for (unsigned int i = 0; i < block.vtx.size(); i++)
             {
-                if (AddToWalletIfInvolvingMe(tx.GetHash(), tx, &block, fUpdate))
+                const CTransaction& tx = block.vtx[i];
+                bool fCandidate = pscan->vMatch[i];
+                BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                    fCandidate = fCandidate || setFound.count(txin.prevout);
+                if (fCandidate && AddToWalletIfInvolvingMe(pscan->vHashes[i], tx, &block, fUpdate))
+                {
                     ret++;
+                    for (unsigned int n = 0; n < tx.vout.size(); n++)
+                        if (IsMine(tx.vout[n]))
+                            setFound.insert(COutPoint(pscan->vHashes[i], n));
+                }
             }
-            pindex = chainActive.Next(pindex);
-            if (GetTime() >= nNow + 60) {
-                nNow = GetTime();
-                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex));
+        }
+
+        if (GetTime() >= nNow + 60) {
+            nNow = GetTime();
+            LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex));
+            // Let an interrupted scan carry on from here
+            if (fFileBacked)
+            {
+                LOCK(cs_main);
+                CWalletDB(strWalletFile).WriteRescanBlock(chainActive.GetLocator(pindex));
             }
         }
-        ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     }
+    if (fFileBacked && !ShutdownRequested())
+        CWalletDB(strWalletFile).EraseRescanBlock();
+    ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     return ret;
 }
 
@@ -959,49 +1355,59 @@ void CWallet::ResendWalletTransactions()
 //
 
 
-int64_t CWallet::GetBalance() const
+// Transactions without an output in setWalletUTXO have no credit available,
+// so summing over the ones that do gives what walking mapWallet would
+void CWallet::CacheBalances() const
 {
-    int64_t nTotal = 0;
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    const std::set<COutPoint>& setUTXO = GetWalletUTXO();
+    if (fBalancesCached && pindexBalancesCached == chainActive.Tip())
+        return;
+
+    nBalanceCached = 0;
+    nUnconfirmedBalanceCached = 0;
+    nImmatureBalanceCached = 0;
+    std::set<COutPoint>::const_iterator it = setUTXO.begin();
+    while (it != setUTXO.end())
     {
-        LOCK2(cs_main, cs_wallet);
-        for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
-        }
+        const uint256 wtxid = it->hash;
+        const CWalletTx* pcoin = &mapWallet.find(wtxid)->second;
+        // Not the per transaction cache: it misses spends leaving the mempool
+        int64_t nAvailable = pcoin->GetAvailableCredit(false);
+        if (pcoin->IsTrusted())
+            nBalanceCached += nAvailable;
+        if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
+            nUnconfirmedBalanceCached += nAvailable;
+        nImmatureBalanceCached += pcoin->GetImmatureCredit();
+
+        while (it != setUTXO.end() && it->hash == wtxid)
+            ++it;
     }
 
-    return nTotal;
+    fBalancesCached = true;
+    pindexBalancesCached = chainActive.Tip();
+}
+
+int64_t CWallet::GetBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    CacheBalances();
+    return nBalanceCached;
 }
 
 int64_t CWallet::GetUnconfirmedBalance() const
 {
-    int64_t nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    CacheBalances();
+    return nUnconfirmedBalanceCached;
 }
 
 int64_t CWallet::GetImmatureBalance() const
 {
-    int64_t nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    CacheBalances();
+    return nImmatureBalanceCached;
 }
 
 // populate vCoins with vector of spendable COutputs
@@ -1011,52 +1417,62 @@ void CWallet::AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed,
 
     {
         LOCK(cs_wallet);
-        for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        const std::set<COutPoint>& setUTXO = GetWalletUTXO();
+        std::set<COutPoint>::const_iterator it = setUTXO.begin();
+        while (it != setUTXO.end())
         {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+            const uint256 wtxid = it->hash;
+            const CWalletTx* pcoin = &mapWallet.find(wtxid)->second;
 
-            if (!IsFinalTx(*pcoin))
-                continue;
-
-            if (fOnlyConfirmed && !pcoin->IsTrusted())
-                continue;
-
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity(chainActive.Height() - pcoin->GetDepthInMainChain()) > 0)
-                continue;
+            std::set<COutPoint>::const_iterator itNext = it;
+            while (itNext != setUTXO.end() && itNext->hash == wtxid)
+                ++itNext;
 
             int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < 0)
+            if (!IsFinalTx(*pcoin) ||
+                (fOnlyConfirmed && !pcoin->IsTrusted()) ||
+                (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity(chainActive.Height() - nDepth) > 0) ||
+                nDepth < 0)
+            {
+                it = itNext;
                 continue;
+            }
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                if (!(IsSpent(wtxid, i)) && IsMine(pcoin->vout[i]) &&
-                    !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue > 0 &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
+            for (; it != itNext; ++it) {
+                unsigned int i = it->n;
+                if (!(IsSpent(wtxid, i)) && !IsLockedCoin(wtxid, i) && pcoin->vout[i].nValue > 0 &&
+                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected(wtxid, i)))
                         vCoins.push_back(COutput(pcoin, i, nDepth));
             }
         }
     }
 }
 
-static void ApproximateBestSubset(std::vector<std::pair<int64_t, std::pair<const CWalletTx*,unsigned int> > >vValue, int64_t nTotalLower, int64_t nTargetValue,
+typedef std::pair<int64_t, std::pair<const CWalletTx*,unsigned int> > CoinValue;
+
+// Coins given to ApproximateBestSubset, it makes 1000 passes over them
+static const unsigned int MAX_SUBSET_CANDIDATES = 1000;
+// Nodes visited by SelectCoinsBnB before settling for what it has found
+static const int MAX_BNB_TRIES = 100000;
+
+static void ApproximateBestSubset(const std::vector<CoinValue>& vValue, size_t nCandidates, int64_t nTotalLower, int64_t nTargetValue,
                                   std::vector<char>& vfBest, int64_t& nBest, int iterations = 1000)
 {
     std::vector<char> vfIncluded;
 
-    vfBest.assign(vValue.size(), true);
+    vfBest.assign(nCandidates, true);
     nBest = nTotalLower;
 
     seed_insecure_rand();
 
     for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++)
     {
-        vfIncluded.assign(vValue.size(), false);
+        vfIncluded.assign(nCandidates, false);
         int64_t nTotal = 0;
         bool fReachedTarget = false;
         for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
         {
-            for (unsigned int i = 0; i < vValue.size(); i++)
+            for (unsigned int i = 0; i < nCandidates; i++)
             {
                 //The solver here uses a randomized algorithm,
                 //the randomness serves no real security purpose but is just
@@ -1083,24 +1499,90 @@ static void ApproximateBestSubset(std::vector<std::pair<int64_t, std::pair<const
             }
         }
     }
+    vfBest.resize(vValue.size(), false);
+}
+
+// Depth first search for the subset of vValue (sorted by decreasing value)
+// closest above nTargetValue, among those no more than nMaxExcess above it,
+// so that the transaction needs no change output. Including a coin is tried
+// before leaving it out; a branch is cut as soon as it overshoots or the
+// coins left can't reach the target, and after leaving a coin out the coins
+// of the same value are left out too, they would only repeat what was tried.
+static bool SelectCoinsBnB(const std::vector<CoinValue>& vValue, int64_t nTargetValue, int64_t nMaxExcess,
+                           std::vector<char>& vfBest, int64_t& nBest)
+{
+    // vRemaining[i] is the value of the coins from i on
+    std::vector<int64_t> vRemaining(vValue.size() + 1, 0);
+    for (size_t i = vValue.size(); i > 0; i--)
+        vRemaining[i - 1] = vRemaining[i] + vValue[i - 1].first;
+    if (vRemaining[0] < nTargetValue)
+        return false;
+
+    std::vector<size_t> vSelected;
+    size_t i = 0;
+    int64_t nTotal = 0;
+    nBest = std::numeric_limits<int64_t>::max();
+    for (int nTries = 0; nTries < MAX_BNB_TRIES; nTries++)
+    {
+        bool fBacktrack = false;
+        if (nTotal + vRemaining[i] < nTargetValue || nTotal > nTargetValue + nMaxExcess)
+            fBacktrack = true;
+        else if (nTotal >= nTargetValue)
+        {
+            if (nTotal < nBest)
+            {
+                nBest = nTotal;
+                vfBest.assign(vValue.size(), false);
+                BOOST_FOREACH(size_t n, vSelected)
+                    vfBest[n] = true;
+                if (nBest == nTargetValue)
+                    break;
+            }
+            fBacktrack = true;
+        }
+
+        if (fBacktrack)
+        {
+            if (vSelected.empty())
+                break;
+            // Leave out the last coin included instead
+            size_t nLast = vSelected.back();
+            vSelected.pop_back();
+            nTotal -= vValue[nLast].first;
+            for (i = nLast + 1; i < vValue.size() && vValue[i].first == vValue[nLast].first; i++)
+                ;
+        }
+        else
+        {
+            nTotal += vValue[i].first;
+            vSelected.push_back(i++);
+        }
+    }
+    return nBest != std::numeric_limits<int64_t>::max();
 }
 
-bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins,
+bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins,
                                  std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const
 {
     setCoinsRet.clear();
     nValueRet = 0;
 
     // List of values less than target
-    std::pair<int64_t, std::pair<const CWalletTx*,unsigned int> > coinLowestLarger;
+    CoinValue coinLowestLarger;
     coinLowestLarger.first = std::numeric_limits<int64_t>::max();
     coinLowestLarger.second.first = NULL;
-    std::vector<std::pair<int64_t, std::pair<const CWalletTx*,unsigned int> > > vValue;
+    std::vector<CoinValue> vValue;
     int64_t nTotalLower = 0;
+    int nLowestLarger = 0;
+    CoinValue coinExact;
+    coinExact.second.first = NULL;
+    int nExact = 0;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
+    seed_insecure_rand();
 
-    BOOST_FOREACH(COutput output, vCoins)
+    // Of several coins equally good as the exact or the lowest larger one,
+    // any is picked with the same chance
+    BOOST_FOREACH(const COutput& output, vCoins)
     {
         const CWalletTx *pcoin = output.tx;
 
@@ -1110,13 +1592,12 @@ bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, int nConfMine, int nConfT
         int i = output.i;
         int64_t n = pcoin->vout[i].nValue;
 
-        std::pair<int64_t,std::pair<const CWalletTx*,unsigned int> > coin = std::make_pair(n,std::make_pair(pcoin, i));
+        CoinValue coin = std::make_pair(n,std::make_pair(pcoin, i));
 
         if (n == nTargetValue)
         {
-            setCoinsRet.insert(coin.second);
-            nValueRet += coin.first;
-            return true;
+            if (insecure_rand() % ++nExact == 0)
+                coinExact = coin;
         }
         else if (n < nTargetValue + CENT)
         {
@@ -1124,11 +1605,23 @@ bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, int nConfMine, int nConfT
             nTotalLower += n;
         }
         else if (n < coinLowestLarger.first)
+        {
+            coinLowestLarger = coin;
+            nLowestLarger = 1;
+        }
+        else if (n == coinLowestLarger.first && insecure_rand() % ++nLowestLarger == 0)
         {
             coinLowestLarger = coin;
         }
     }
 
+    if (coinExact.second.first)
+    {
+        setCoinsRet.insert(coinExact.second);
+        nValueRet += coinExact.first;
+        return true;
+    }
+
     if (nTotalLower == nTargetValue)
     {
         for (unsigned int i = 0; i < vValue.size(); ++i)
@@ -1148,14 +1641,45 @@ bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, int nConfMine, int nConfT
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
+    // Shuffled first so that which of equal coins get picked is random
+    random_shuffle(vValue.begin(), vValue.end(), GetRandInt);
     std::sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
     std::vector<char> vfBest;
     int64_t nBest;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
-    if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+    // A subset that pays at most what a change output would cost (its
+    // bytes now and spending it later) over the target needs no change.
+    // The excess only goes to the fee while a change output of it would be
+    // dust, so it is kept below that for the smallest change output, a
+    // 32 byte pay-to-script-hash one; above it the match would get change
+    // after all.
+    int64_t nCostOfChange = (34 + 148) * std::max(nTransactionFee, CTransaction::nMinTxFee) / 1000;
+    int64_t nMaxDustChange = 3 * (32 + 148) * CTransaction::nMinRelayTxFee / 1000 - 1;
+    nCostOfChange = std::max((int64_t)0, std::min(nCostOfChange, nMaxDustChange));
+    if (SelectCoinsBnB(vValue, nTargetValue, nCostOfChange, vfBest, nBest))
+    {
+        for (unsigned int i = 0; i < vValue.size(); i++)
+            if (vfBest[i])
+            {
+                setCoinsRet.insert(vValue[i].second);
+                nValueRet += vValue[i].first;
+            }
+        LogPrint("selectcoins", "SelectCoins() changeless subset of %d coins, total %s\n", setCoinsRet.size(), FormatMoney(nBest));
+        return true;
+    }
+
+    // Solve subset sum by stochastic approximation, over the largest coins
+    // only when there are many: enough of them to still reach the target
+    // with a cent of change to spare
+    size_t nCandidates = 0;
+    int64_t nCandidatesTotal = 0;
+    while (nCandidates < vValue.size() &&
+           (nCandidates < MAX_SUBSET_CANDIDATES || nCandidatesTotal < nTargetValue + CENT))
+        nCandidatesTotal += vValue[nCandidates++].first;
+
+    ApproximateBestSubset(vValue, nCandidates, nCandidatesTotal, nTargetValue, vfBest, nBest, 1000);
+    if (nBest != nTargetValue && nCandidatesTotal >= nTargetValue + CENT)
+        ApproximateBestSubset(vValue, nCandidates, nCandidatesTotal, nTargetValue + CENT, vfBest, nBest, 1000);
 
     // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
@@ -1183,15 +1707,12 @@ bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, int nConfMine, int nConfT
     return true;
 }
 
-bool CWallet::SelectCoins(int64_t nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl* coinControl) const
+bool CWallet::SelectCoins(const std::vector<COutput>& vAvailableCoins, int64_t nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl* coinControl) const
 {
-    std::vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, coinControl);
-
     // coin control -> return all selected outputs (we want all selected to go into the transaction for sure)
     if (coinControl && coinControl->HasSelected())
     {
-        BOOST_FOREACH(const COutput& out, vCoins)
+        BOOST_FOREACH(const COutput& out, vAvailableCoins)
         {
             nValueRet += out.tx->vout[out.i].nValue;
             setCoinsRet.insert(std::make_pair(out.tx, out.i));
@@ -1199,9 +1720,9 @@ bool CWallet::SelectCoins(int64_t nTargetValue, std::set<std::pair<const CWallet
         return (nValueRet >= nTargetValue);
     }
 
-    return (SelectCoinsMinConf(nTargetValue, 1, 6, vCoins, setCoinsRet, nValueRet) ||
-            SelectCoinsMinConf(nTargetValue, 1, 1, vCoins, setCoinsRet, nValueRet) ||
-            (bSpendZeroConfChange && SelectCoinsMinConf(nTargetValue, 0, 1, vCoins, setCoinsRet, nValueRet)));
+    return (SelectCoinsMinConf(nTargetValue, 1, 6, vAvailableCoins, setCoinsRet, nValueRet) ||
+            SelectCoinsMinConf(nTargetValue, 1, 1, vAvailableCoins, setCoinsRet, nValueRet) ||
+            (bSpendZeroConfChange && SelectCoinsMinConf(nTargetValue, 0, 1, vAvailableCoins, setCoinsRet, nValueRet)));
 }
 
 
@@ -1210,6 +1731,20 @@ bool CWallet::SelectCoins(int64_t nTargetValue, std::set<std::pair<const CWallet
 bool CWallet::CreateTransaction(const std::vector<std::pair<CScript, int64_t> >& vecSend,
                                 CWalletTx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, std::string& strFailReason, const CCoinControl* coinControl)
 {
+    LOCK2(cs_main, cs_wallet);
+    // The coins to choose from stay the same while the fee is raised
+    std::vector<COutput> vAvailableCoins;
+    AvailableCoins(vAvailableCoins, true, coinControl);
+    return BuildTransaction(vecSend, vAvailableCoins, wtxNew, reservekey, nFeeRet, strFailReason, coinControl, true);
+}
+
+bool CWallet::BuildTransaction(const std::vector<std::pair<CScript, int64_t> >& vecSend, const std::vector<COutput>& vAvailableCoins,
+                               CWalletTx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, std::string& strFailReason,
+                               const CCoinControl* coinControl, bool fSign)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
     int64_t nValue = 0;
     BOOST_FOREACH (const PAIRTYPE(CScript, int64_t)& s, vecSend)
     {
@@ -1229,7 +1764,6 @@ bool CWallet::CreateTransaction(const std::vector<std::pair<CScript, int64_t> >&
     wtxNew.BindWallet(this);
 
     {
-        LOCK2(cs_main, cs_wallet);
         {
             nFeeRet = nTransactionFee;
             while (true)
@@ -1255,7 +1789,7 @@ bool CWallet::CreateTransaction(const std::vector<std::pair<CScript, int64_t> >&
                 // Choose coins to use
                 std::set<std::pair<const CWalletTx*,unsigned int> > setCoins;
                 int64_t nValueIn = 0;
-                if (!SelectCoins(nTotalValue, setCoins, nValueIn, coinControl))
+                if (!SelectCoins(vAvailableCoins, nTotalValue, setCoins, nValueIn, coinControl))
                 {
                     strFailReason = _("Insufficient funds");
                     return false;
@@ -1334,14 +1868,23 @@ bool CWallet::CreateTransaction(const std::vector<std::pair<CScript, int64_t> >&
                 BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
                     wtxNew.vin.push_back(CTxIn(coin.first->GetHash(),coin.second));
 
-                // Sign
-                int nIn = 0;
-                BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
-                    if (!SignSignature(*this, *coin.first, wtxNew, nIn++))
+                // Sign, or leave room for the signatures
+                if (fSign)
+                {
+                    std::vector<CScript> vScriptPubKeys;
+                    BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
+                        vScriptPubKeys.push_back(coin.first->vout[coin.second].scriptPubKey);
+                    if (!SignSignatures(*this, std::vector<CTransaction*>(1, &wtxNew), std::vector<std::vector<CScript> >(1, vScriptPubKeys)))
                     {
                         strFailReason = _("Signing transaction failed");
                         return false;
                     }
+                }
+                else
+                {
+                    BOOST_FOREACH(CTxIn& txin, wtxNew.vin)
+                        txin.scriptSig.assign(MAX_PUBKEYHASH_SCRIPTSIG_SIZE, 0);
+                }
 
                 // Limit size
                 unsigned int nBytes = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK, PROTOCOL_VERSION);
@@ -1364,6 +1907,12 @@ bool CWallet::CreateTransaction(const std::vector<std::pair<CScript, int64_t> >&
 
                 wtxNew.fTimeReceivedIsTxTime = true;
 
+                if (!fSign)
+                {
+                    BOOST_FOREACH(CTxIn& txin, wtxNew.vin)
+                        txin.scriptSig.clear();
+                }
+
                 break;
             }
         }
@@ -1429,6 +1978,152 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
 
 
 
+bool CWallet::CreateTransactionBatch(const std::vector<std::vector<std::pair<CScript, int64_t> > >& vecSends,
+                                     std::vector<CWalletTx>& vwtxNew, std::list<CReserveKey>& lReserveKeys,
+                                     int64_t& nFeeRet, std::string& strFailReason)
+{
+    vwtxNew.assign(vecSends.size(), CWalletTx());
+    nFeeRet = 0;
+
+    LOCK2(cs_main, cs_wallet);
+
+    // One list of coins for the whole batch, each transaction takes its
+    // coins out of it. Only coins paying to a key are used: their
+    // signatures have a known largest size, so the transactions can be
+    // planned unsigned and signed together afterwards.
+    std::vector<COutput> vAvailableCoins;
+    AvailableCoins(vAvailableCoins, true);
+    std::vector<COutput> vCoins;
+    vCoins.reserve(vAvailableCoins.size());
+    BOOST_FOREACH(const COutput& out, vAvailableCoins)
+    {
+        std::vector<std::vector<unsigned char> > vSolutions;
+        txnouttype whichType;
+        if (Solver(out.tx->vout[out.i].scriptPubKey, whichType, vSolutions) &&
+            (whichType == TX_PUBKEYHASH || whichType == TX_PUBKEY))
+            vCoins.push_back(out);
+    }
+
+    std::vector<std::vector<CScript> > vScriptPubKeys(vecSends.size());
+    for (size_t n = 0; n < vecSends.size(); n++)
+    {
+        lReserveKeys.push_back(CReserveKey(this));
+        int64_t nFee;
+        if (!BuildTransaction(vecSends[n], vCoins, vwtxNew[n], lReserveKeys.back(), nFee, strFailReason, NULL, false))
+            return false;
+        nFeeRet += nFee;
+
+        std::set<COutPoint> setSpent;
+        BOOST_FOREACH(const CTxIn& txin, vwtxNew[n].vin)
+        {
+            setSpent.insert(txin.prevout);
+            vScriptPubKeys[n].push_back(mapWallet[txin.prevout.hash].vout[txin.prevout.n].scriptPubKey);
+        }
+        size_t nKept = 0;
+        for (size_t i = 0; i < vCoins.size(); i++)
+            if (!setSpent.count(COutPoint(vCoins[i].tx->GetHash(), vCoins[i].i)))
+                vCoins[nKept++] = vCoins[i];
+        vCoins.erase(vCoins.begin() + nKept, vCoins.end());
+    }
+
+    // All inputs of all the transactions are signed together
+    std::vector<CTransaction*> vpTx;
+    for (size_t n = 0; n < vwtxNew.size(); n++)
+        vpTx.push_back(&vwtxNew[n]);
+    if (!SignSignatures(*this, vpTx, vScriptPubKeys))
+    {
+        strFailReason = _("Signing transaction failed");
+        return false;
+    }
+    return true;
+}
+
+bool CWallet::CommitTransactionBatch(std::vector<CWalletTx>& vwtxNew, std::list<CReserveKey>& lReserveKeys, std::vector<uint256>& vRejected)
+{
+    vRejected.clear();
+    {
+        LOCK2(cs_main, cs_wallet);
+
+        int64_t nOrderPos = nOrderPosNext;
+        int64_t nTimeReceived = GetAdjustedTime();
+        BOOST_FOREACH(CWalletTx& wtxNew, vwtxNew)
+        {
+            if (mapWallet.count(wtxNew.GetHash()))
+                return false;
+            wtxNew.BindWallet(this);
+            wtxNew.nTimeReceived = nTimeReceived;
+            wtxNew.nTimeSmart = nTimeReceived;
+            wtxNew.nOrderPos = nOrderPos++;
+        }
+
+        if (fFileBacked)
+        {
+            // All the keys and transactions are written in one database
+            // transaction, nothing in memory changes until it commits. The
+            // handle aborts the transaction if anything throws.
+            CWalletDB walletdb(strWalletFile);
+            if (!walletdb.TxnBegin())
+                return false;
+            bool fWritten = walletdb.WriteOrderPosNext(nOrderPos);
+            BOOST_FOREACH(const CReserveKey& reservekey, lReserveKeys)
+                fWritten = fWritten && reservekey.ErasePool(walletdb);
+            BOOST_FOREACH(CWalletTx& wtxNew, vwtxNew)
+                fWritten = fWritten && wtxNew.WriteToDisk(&walletdb);
+            if (!fWritten)
+            {
+                walletdb.TxnAbort();
+                return false;
+            }
+            if (!walletdb.TxnCommit())
+                return false;
+        }
+
+        nOrderPosNext = nOrderPos;
+        BOOST_FOREACH(CReserveKey& reservekey, lReserveKeys)
+            reservekey.KeepErasedKey();
+
+        BOOST_FOREACH(CWalletTx& wtxNew, vwtxNew)
+        {
+            uint256 hash = wtxNew.GetHash();
+            LogPrint("wallet", "CommitTransactionBatch:\n%s", wtxNew.ToString());
+            CWalletTx& wtx = mapWallet.insert(std::make_pair(hash, wtxNew)).first->second;
+            AddToSpends(hash);
+            wtx.MarkDirty();
+            UpdateWalletUTXO(wtx);
+            NotifyTransactionChanged(this, hash, CT_NEW);
+            WalletNotify(hash);
+
+            BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+            {
+                CWalletTx &coin = mapWallet[txin.prevout.hash];
+                coin.BindWallet(this);
+                NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
+            }
+        }
+        LogPrintf("CommitTransactionBatch() : %u transactions\n", vwtxNew.size());
+
+        // The transactions are stored whatever the mempool makes of them, so
+        // a rejection is reported rather than failing the batch. Relaying
+        // only queues the inventory, it goes out to each peer with the rest
+        // of its queue.
+        BOOST_FOREACH(CWalletTx& wtxNew, vwtxNew)
+        {
+            mapRequestCount[wtxNew.GetHash()] = 0;
+            if (!wtxNew.AcceptToMemoryPool(false))
+            {
+                LogPrintf("CommitTransactionBatch() : Error: Transaction %s not valid\n", wtxNew.GetHash().ToString());
+                vRejected.push_back(wtxNew.GetHash());
+                continue;
+            }
+            wtxNew.RelayWalletTransaction();
+        }
+    }
+    return true;
+}
+
+
+
+
 std::string CWallet::SendMoney(CScript scriptPubKey, int64_t nValue, CWalletTx& wtxNew)
 {
     CReserveKey reservekey(this);
@@ -1585,6 +2280,107 @@ bool CWallet::SetDefaultKey(const CPubKey &vchPubKey)
     return true;
 }
 
+/** Keys generated and written in one database transaction by AddKeyPoolKeys */
+static const unsigned int KEYPOOL_BATCH_SIZE = 1000;
+/** Most threads doing the EC math for new keypool keys */
+static const int MAX_KEYPOOL_THREADS = 8;
+
+// Public keys, and unless vPrivKeys is empty the serialized private keys,
+// of vKeys[nBegin, nEnd)
+static void DeriveKeyPoolKeys(const std::vector<CKey>& vKeys, std::vector<CPubKey>& vPubKeys, std::vector<CPrivKey>& vPrivKeys,
+                              size_t nBegin, size_t nEnd)
+{
+    for (size_t i = nBegin; i < nEnd; i++)
+    {
+        vPubKeys[i] = vKeys[i].GetPubKey();
+        if (!vPrivKeys.empty())
+            vPrivKeys[i] = vKeys[i].GetPrivKey();
+    }
+}
+
+void CWallet::AddKeyPoolKeys(CWalletDB& walletdb, int64_t nIndex, unsigned int nKeys)
+{
+    AssertLockHeld(cs_wallet); // mapKeyMetadata, setKeyPool
+    if (nKeys == 0)
+        return;
+
+    bool fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
+    // Compressed public keys were introduced in version 0.6.0. This writes
+    // through a database handle of its own, so it must come before any batch.
+    if (fCompressed)
+        SetMinVersion(FEATURE_COMPRPUBKEY);
+
+    int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_KEYPOOL_THREADS));
+    int64_t nStart = GetTimeMillis();
+    int64_t nFirst = nIndex;
+    while (nKeys > 0)
+    {
+        unsigned int nBatch = std::min(nKeys, KEYPOOL_BATCH_SIZE);
+
+        RandAddSeedPerfmon();
+        std::vector<CKey> vKeys(nBatch);
+        BOOST_FOREACH(CKey& key, vKeys)
+            key.MakeNewKey(fCompressed);
+
+        // The point multiplications, split over the threads; encrypted wallets
+        // store the encrypted secret instead of the serialized private key
+        std::vector<CPubKey> vPubKeys(nBatch);
+        std::vector<CPrivKey> vPrivKeys(IsCrypted() ? 0 : nBatch);
+        size_t nPerThread = (nBatch + nThreads - 1) / nThreads;
+        boost::thread_group threadGroup;
+        for (size_t nBegin = nPerThread; nBegin < nBatch; nBegin += nPerThread)
+            threadGroup.create_thread(boost::bind(&DeriveKeyPoolKeys, boost::cref(vKeys), boost::ref(vPubKeys), boost::ref(vPrivKeys),
+                                                  nBegin, std::min((size_t)nBatch, nBegin + nPerThread)));
+        DeriveKeyPoolKeys(vKeys, vPubKeys, vPrivKeys, 0, std::min((size_t)nBatch, nPerThread));
+        threadGroup.join_all();
+
+        // Keys, metadata and pool entries of the batch go to disk together,
+        // and into memory only once they are there
+        int64_t nCreationTime = GetTime();
+        CKeyMetadata meta(nCreationTime);
+        std::vector<std::vector<unsigned char> > vCryptedSecrets(IsCrypted() ? nBatch : 0);
+        if (!walletdb.TxnBegin())
+            throw std::runtime_error("CWallet::AddKeyPoolKeys() : TxnBegin failed");
+        for (unsigned int i = 0; i < nBatch; i++)
+        {
+            const CPubKey& pubkey = vPubKeys[i];
+            bool fOk;
+            if (IsCrypted())
+                fOk = EncryptKey(vKeys[i], pubkey, vCryptedSecrets[i]) &&
+                      walletdb.WriteCryptedKey(pubkey, vCryptedSecrets[i], meta);
+            else
+                fOk = walletdb.WriteKey(pubkey, vPrivKeys[i], meta);
+            if (!fOk || !walletdb.WritePool(nIndex + i, CKeyPool(pubkey)))
+            {
+                walletdb.TxnAbort();
+                throw std::runtime_error("CWallet::AddKeyPoolKeys() : writing generated key failed");
+            }
+        }
+        if (!walletdb.TxnCommit())
+            throw std::runtime_error("CWallet::AddKeyPoolKeys() : TxnCommit failed");
+
+        for (unsigned int i = 0; i < nBatch; i++)
+        {
+            const CPubKey& pubkey = vPubKeys[i];
+            bool fOk;
+            if (IsCrypted())
+                fOk = CCryptoKeyStore::AddCryptedKey(pubkey, vCryptedSecrets[i]);
+            else
+                fOk = CCryptoKeyStore::AddKeyPubKey(vKeys[i], pubkey);
+            if (!fOk)
+                throw std::runtime_error("CWallet::AddKeyPoolKeys() : adding generated key failed");
+            mapKeyMetadata[pubkey.GetID()] = meta;
+            AddMineScripts(pubkey);
+            setKeyPool.insert(nIndex + i);
+        }
+        if (!nTimeFirstKey || nCreationTime < nTimeFirstKey)
+            nTimeFirstKey = nCreationTime;
+        nIndex += nBatch;
+        nKeys -= nBatch;
+    }
+    LogPrintf("keypool added keys %d to %d in %dms, size=%u\n", nFirst, nIndex - 1, GetTimeMillis() - nStart, setKeyPool.size());
+}
+
 //
 // Mark old keypool keys as used,
 // and generate all new keys
@@ -1602,12 +2398,7 @@ bool CWallet::NewKeyPool()
             return false;
 
         int64_t nKeys = std::max(GetArg("-keypool", 100), (int64_t)0);
-        for (int i = 0; i < nKeys; i++)
-        {
-            int64_t nIndex = i+1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
-            setKeyPool.insert(nIndex);
-        }
+        AddKeyPoolKeys(walletdb, 1, nKeys);
         LogPrintf("CWallet::NewKeyPool wrote %d new keys\n", nKeys);
     }
     return true;
@@ -1630,15 +2421,12 @@ bool CWallet::TopUpKeyPool(unsigned int kpSize)
         else
             nTargetSize = std::max(GetArg("-keypool", 100), (int64_t) 0);
 
-        while (setKeyPool.size() < (nTargetSize + 1))
+        if (setKeyPool.size() < (nTargetSize + 1))
         {
             int64_t nEnd = 1;
             if (!setKeyPool.empty())
                 nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw std::runtime_error("TopUpKeyPool() : writing generated key failed");
-            setKeyPool.insert(nEnd);
-            LogPrintf("keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
+            AddKeyPoolKeys(walletdb, nEnd, nTargetSize + 1 - setKeyPool.size());
         }
     }
     return true;
@@ -1913,6 +2701,21 @@ void CReserveKey::KeepKey()
     vchPubKey = CPubKey();
 }
 
+bool CReserveKey::ErasePool(CWalletDB& walletdb) const
+{
+    if (nIndex == -1)
+        return true;
+    return walletdb.ErasePool(nIndex);
+}
+
+void CReserveKey::KeepErasedKey()
+{
+    if (nIndex != -1)
+        LogPrintf("keypool keep %d\n", nIndex);
+    nIndex = -1;
+    vchPubKey = CPubKey();
+}
+
 void CReserveKey::ReturnKey()
 {
     if (nIndex != -1)
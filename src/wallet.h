@@ -15,6 +15,7 @@
 #include "walletdb.h"
 
 #include <algorithm>
+#include <list>
 #include <map>
 #include <set>
 #include <stdexcept>
@@ -23,6 +24,9 @@
 #include <utility>
 #include <vector>
 
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_set.hpp>
+
 // Settings
 extern int64_t nTransactionFee;
 extern bool bSpendZeroConfChange;
@@ -31,6 +35,9 @@ extern bool bSpendZeroConfChange;
 static const int64_t DEFAULT_TRANSACTION_FEE = 0.0001;
 // -paytxfee will warn if called with a higher fee than this amount (in satoshis) per KB
 static const int nHighTransactionFeeWarning = 0.1 * COIN;
+// Largest scriptSig spending a pay-to-pubkey-hash output: a 73 byte
+// signature and a 65 byte uncompressed key, with their pushes
+static const unsigned int MAX_PUBKEYHASH_SCRIPTSIG_SIZE = 140;
 
 class CAccountingEntry;
 class CCoinControl;
@@ -94,13 +101,34 @@ public:
     StringMap destdata;
 };
 
+/** Hashes the bytes of a script, for sets of scriptPubKeys */
+struct CScriptHasher
+{
+    size_t operator()(const CScript& script) const
+    {
+        return boost::hash_range(script.begin(), script.end());
+    }
+};
+
 /** A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
  */
 class CWallet : public CCryptoKeyStore, public CWalletInterface
 {
 private:
-    bool SelectCoins(int64_t nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl *coinControl = NULL) const;
+    friend class CWalletScanner;
+
+    // CreateTransaction from the given coins; unless fSign, the inputs are
+    // left unsigned, with the fee paid as for the largest signatures of
+    // coins paying to a key
+    bool BuildTransaction(const std::vector<std::pair<CScript, int64_t> >& vecSend, const std::vector<COutput>& vAvailableCoins,
+                          CWalletTx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, std::string& strFailReason,
+                          const CCoinControl *coinControl, bool fSign);
+    bool SelectCoins(const std::vector<COutput>& vAvailableCoins, int64_t nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl *coinControl = NULL) const;
+
+    // Generate nKeys new keys into the keypool at indexes nIndex and up,
+    // in batches written through walletdb in one database transaction each
+    void AddKeyPoolKeys(CWalletDB& walletdb, int64_t nIndex, unsigned int nKeys);
 
     CWalletDB *pwalletdbEncryption;
 
@@ -123,6 +151,42 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    // Owned outputs that no wallet transaction in the main chain spends, so
+    // balances and coin selection need not walk all of mapWallet. Spends in
+    // the mempool and the depth of the transactions are still checked for
+    // every output, those change without the wallet being told. Rebuilt on
+    // first use after MarkDirty(), since new keys change what is ours.
+    mutable std::set<COutPoint> setWalletUTXO;
+    mutable bool fWalletUTXODirty;
+    const std::set<COutPoint>& GetWalletUTXO() const;
+    bool IsSpentInMainChain(const COutPoint& outpoint) const;
+    void UpdateWalletUTXO(const COutPoint& outpoint);
+    void UpdateWalletUTXO(const CTransaction& tx);
+
+    // Balances over setWalletUTXO, reused for as long as the chain tip and
+    // the wallet stay the same. A wallet transaction entering or leaving the
+    // mempool reaches the wallet through SyncTransaction, which resets the
+    // cache; mempool changes that touch none of ours leave it be.
+    mutable bool fBalancesCached;
+    mutable const CBlockIndex* pindexBalancesCached;
+    mutable int64_t nBalanceCached;
+    mutable int64_t nUnconfirmedBalanceCached;
+    mutable int64_t nImmatureBalanceCached;
+    void CacheBalances() const;
+
+    // scriptPubKeys paying to our keys (P2PKH and P2PK) and to our P2SH
+    // scripts, so that IsMine(txout) is one hash lookup for the usual forms
+    // instead of Solver and keystore lookups. Other forms, bare multisig and
+    // non-canonical encodings, still go through ::IsMine. Guarded by
+    // cs_KeyStore, keys and scripts are never removed so neither is anything
+    // in here.
+    boost::unordered_set<CScript, CScriptHasher> setMineScripts;
+    // Redeem scripts held that aren't ours yet (a multisig we lack keys
+    // for), tried again whenever a key is added
+    std::set<CScriptID> setPendingScripts;
+    void AddMineScripts(const CPubKey& pubkey);
+    void AddMineScripts(const CScript& redeemScript);
+
 public:
     /// Main wallet lock.
     /// This lock protects all the fields added by CWallet
@@ -163,6 +227,12 @@ public:
         nNextResend = 0;
         nLastResend = 0;
         nTimeFirstKey = 0;
+        fWalletUTXODirty = true;
+        fBalancesCached = false;
+        pindexBalancesCached = NULL;
+        nBalanceCached = 0;
+        nUnconfirmedBalanceCached = 0;
+        nImmatureBalanceCached = 0;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -184,7 +254,7 @@ public:
     bool CanSupportFeature(enum WalletFeature wf) { AssertLockHeld(cs_wallet); return nWalletMaxVersion >= wf; }
 
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl = NULL) const;
-    bool SelectCoinsMinConf(int64_t nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
+    bool SelectCoinsMinConf(int64_t nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
 
     bool IsSpent(const uint256& hash, unsigned int n) const;
 
@@ -200,7 +270,7 @@ public:
     // Adds a key to the store, and saves it to disk.
     bool AddKeyPubKey(const CKey& key, const CPubKey &pubkey);
     // Adds a key to the store, without saving it to disk (used by LoadWallet)
-    bool LoadKey(const CKey& key, const CPubKey &pubkey) { return CCryptoKeyStore::AddKeyPubKey(key, pubkey); }
+    bool LoadKey(const CKey& key, const CPubKey &pubkey);
     // Load metadata (used by LoadWallet)
     bool LoadKeyMetadata(const CPubKey &pubkey, const CKeyMetadata &metadata);
 
@@ -211,7 +281,7 @@ public:
     // Adds an encrypted key to the store, without saving it to disk (used by LoadWallet)
     bool LoadCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret);
     bool AddCScript(const CScript& redeemScript);
-    bool LoadCScript(const CScript& redeemScript) { return CCryptoKeyStore::AddCScript(redeemScript); }
+    bool LoadCScript(const CScript& redeemScript);
 
     /// Adds a destination data tuple to the store, and saves it to disk
     bool AddDestData(const CTxDestination &dest, const std::string &key, const std::string &value);
@@ -258,6 +328,17 @@ public:
     bool CreateTransaction(CScript scriptPubKey, int64_t nValue,
                            CWalletTx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, std::string& strFailReason, const CCoinControl *coinControl = NULL);
     bool CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey);
+    // Plans one transaction per entry of vecSends from a single list of
+    // coins, so that none of them spend the same coin, then signs them all
+    // in parallel. Each gets its change key in lReserveKeys.
+    bool CreateTransactionBatch(const std::vector<std::vector<std::pair<CScript, int64_t> > >& vecSends,
+                                std::vector<CWalletTx>& vwtxNew, std::list<CReserveKey>& lReserveKeys,
+                                int64_t& nFeeRet, std::string& strFailReason);
+    // Records the transactions and spent keys in one database transaction,
+    // and only then adds them to the wallet in memory, to the mempool and
+    // relays them. Returns false if nothing was stored; the ones stored but
+    // not accepted to the mempool are listed in vRejected.
+    bool CommitTransactionBatch(std::vector<CWalletTx>& vwtxNew, std::list<CReserveKey>& lReserveKeys, std::vector<uint256>& vRejected);
     std::string SendMoney(CScript scriptPubKey, int64_t nValue, CWalletTx& wtxNew);
     std::string SendMoneyToDestination(const CTxDestination &address, int64_t nValue, CWalletTx& wtxNew);
 
@@ -278,10 +359,7 @@ public:
 
     bool IsMine(const CTxIn& txin) const;
     int64_t GetDebit(const CTxIn& txin) const;
-    bool IsMine(const CTxOut& txout) const
-    {
-        return ::IsMine(*this, txout.scriptPubKey);
-    }
+    bool IsMine(const CTxOut& txout) const;
     int64_t GetCredit(const CTxOut& txout) const
     {
         if (!MoneyRange(txout.nValue))
@@ -420,6 +498,10 @@ public:
     void ReturnKey();
     bool GetReservedKey(CPubKey &pubkey);
     void KeepKey();
+    // Keeping the key inside a database transaction: ErasePool() writes
+    // through its handle, KeepErasedKey() once the transaction commits
+    bool ErasePool(CWalletDB& walletdb) const;
+    void KeepErasedKey();
 };
 
 
@@ -693,7 +775,7 @@ public:
         return true;
     }
 
-    bool WriteToDisk();
+    bool WriteToDisk(CWalletDB* pwalletdb = NULL);
 
     int64_t GetTxTime() const;
     int GetRequestCount() const;
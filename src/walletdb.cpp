@@ -11,8 +11,10 @@
 #include "sync.h"
 #include "wallet.h"
 
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/foreach.hpp>
+#include <boost/thread.hpp>
 
 static uint64_t nAccountingEntryNumber = 0;
 
@@ -119,6 +121,23 @@ bool CWalletDB::ReadBestBlock(CBlockLocator& locator)
     return Read(std::string("bestblock"), locator);
 }
 
+bool CWalletDB::WriteRescanBlock(const CBlockLocator& locator)
+{
+    nWalletDBUpdated++;
+    return Write(std::string("rescanblock"), locator);
+}
+
+bool CWalletDB::ReadRescanBlock(CBlockLocator& locator)
+{
+    return Read(std::string("rescanblock"), locator);
+}
+
+bool CWalletDB::EraseRescanBlock()
+{
+    nWalletDBUpdated++;
+    return Erase(std::string("rescanblock"));
+}
+
 bool CWalletDB::WriteOrderPosNext(int64_t nOrderPosNext)
 {
     nWalletDBUpdated++;
@@ -190,7 +209,7 @@ void CWalletDB::ListAccountCreditDebit(const std::string& strAccount, std::list<
 {
     bool fAllAccounts = (strAccount == "*");
 
-    Dbc* pcursor = GetCursor();
+    CDBCursor* pcursor = GetCursor();
     if (!pcursor)
         throw std::runtime_error("CWalletDB::ListAccountCreditDebit() : cannot create DB cursor");
     unsigned int fFlags = DB_SET_RANGE;
@@ -207,7 +226,7 @@ void CWalletDB::ListAccountCreditDebit(const std::string& strAccount, std::list<
             break;
         else if (ret != 0)
         {
-            pcursor->close();
+            delete pcursor;
             throw std::runtime_error("CWalletDB::ListAccountCreditDebit() : error scanning DB");
         }
 
@@ -226,7 +245,7 @@ void CWalletDB::ListAccountCreditDebit(const std::string& strAccount, std::list<
         entries.push_back(acentry);
     }
 
-    pcursor->close();
+    delete pcursor;
 }
 
 
@@ -320,36 +339,58 @@ public:
     }
 };
 
-bool
-ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
-             CWalletScanState &wss, std::string& strType, std::string& strErr)
+/** Records read, decoded and added to the wallet per round of LoadWallet */
+static const unsigned int WALLET_LOAD_BATCH_SIZE = 10000;
+/** Most threads decoding records for LoadWallet */
+static const int MAX_WALLET_LOAD_THREADS = 8;
+/** Fewest records worth handing to a thread of their own */
+static const unsigned int MIN_WALLET_LOAD_THREAD_RECORDS = 100;
+
+// A wallet database record on its way into the wallet. Transactions and
+// keys, the records that are expensive to decode and check, are decoded
+// without touching the wallet, so that LoadWallet can do it on worker
+// threads; everything else is read as it is added to the wallet.
+class CWalletRecord
+{
+public:
+    CDataStream ssKey;
+    CDataStream ssValue;
+    std::string strType;
+    std::string strErr;
+    bool fDecoded;
+    bool fDecodeOK;
+
+    // "tx"
+    uint256 hash;
+    CWalletTx wtx;
+    bool fUpgraded;
+
+    // "key", "wkey"
+    CPubKey vchPubKey;
+    CKey key;
+
+    CWalletRecord() : ssKey(SER_DISK, CLIENT_VERSION), ssValue(SER_DISK, CLIENT_VERSION),
+                      fDecoded(false), fDecodeOK(false), fUpgraded(false) {}
+};
+
+static void DecodeKeyValue(CWalletRecord& rec)
 {
+    CDataStream& ssKey = rec.ssKey;
+    CDataStream& ssValue = rec.ssValue;
     try {
         // Unserialize
         // Taking advantage of the fact that pair serialization
         // is just the two items serialized one after the other
-        ssKey >> strType;
-        if (strType == "name")
-        {
-            std::string strAddress;
-            ssKey >> strAddress;
-            ssValue >> pwallet->mapAddressBook[CBitcoinAddress(strAddress).Get()].name;
-        }
-        else if (strType == "purpose")
+        ssKey >> rec.strType;
+        if (rec.strType == "tx")
         {
-            std::string strAddress;
-            ssKey >> strAddress;
-            ssValue >> pwallet->mapAddressBook[CBitcoinAddress(strAddress).Get()].purpose;
-        }
-        else if (strType == "tx")
-        {
-            uint256 hash;
-            ssKey >> hash;
-            CWalletTx wtx;
+            rec.fDecoded = true;
+            ssKey >> rec.hash;
+            CWalletTx& wtx = rec.wtx;
             ssValue >> wtx;
             CValidationState state;
-            if (!(CheckTransaction(wtx, state) && (wtx.GetHash() == hash) && state.IsValid()))
-                return false;
+            if (!(CheckTransaction(wtx, state) && (wtx.GetHash() == rec.hash) && state.IsValid()))
+                return;
 
             // Undo serialize changes in 31600
             if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
@@ -359,65 +400,35 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
                     char fTmp;
                     char fUnused;
                     ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                    strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
-                                       wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
+                    rec.strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
+                                           wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, rec.hash.ToString());
                     wtx.fTimeReceivedIsTxTime = fTmp;
                 }
                 else
                 {
-                    strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
+                    rec.strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, rec.hash.ToString());
                     wtx.fTimeReceivedIsTxTime = 0;
                 }
-                wss.vWalletUpgrade.push_back(hash);
-            }
-
-            if (wtx.nOrderPos == -1)
-                wss.fAnyUnordered = true;
-
-            pwallet->AddToWallet(wtx, true);
-            //// debug print
-            //LogPrintf("LoadWallet  %s\n", wtx.GetHash().ToString());
-            //LogPrintf(" %12d  %s  %s  %s\n",
-            //    wtx.vout[0].nValue,
-            //    DateTimeStrFormat("%Y-%m-%d %H:%M:%S", wtx.GetBlockTime()),
-            //    wtx.hashBlock.ToString(),
-            //    wtx.mapValue["message"]);
-        }
-        else if (strType == "acentry")
-        {
-            std::string strAccount;
-            ssKey >> strAccount;
-            uint64_t nNumber;
-            ssKey >> nNumber;
-            if (nNumber > nAccountingEntryNumber)
-                nAccountingEntryNumber = nNumber;
-
-            if (!wss.fAnyUnordered)
-            {
-                CAccountingEntry acentry;
-                ssValue >> acentry;
-                if (acentry.nOrderPos == -1)
-                    wss.fAnyUnordered = true;
+                rec.fUpgraded = true;
             }
+            rec.fDecodeOK = true;
         }
-        else if (strType == "key" || strType == "wkey")
+        else if (rec.strType == "key" || rec.strType == "wkey")
         {
-            CPubKey vchPubKey;
+            rec.fDecoded = true;
+            CPubKey& vchPubKey = rec.vchPubKey;
             ssKey >> vchPubKey;
             if (!vchPubKey.IsValid())
             {
-                strErr = "Error reading wallet database: CPubKey corrupt";
-                return false;
+                rec.strErr = "Error reading wallet database: CPubKey corrupt";
+                return;
             }
-            CKey key;
             CPrivKey pkey;
             uint256 hash = 0;
 
-            if (strType == "key")
-            {
-                wss.nKeys++;
+            if (rec.strType == "key")
                 ssValue >> pkey;
-            } else {
+            else {
                 CWalletKey wkey;
                 ssValue >> wkey;
                 pkey = wkey.vchPrivKey;
@@ -446,24 +457,95 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
 
                 if (Hash(vchKey.begin(), vchKey.end()) != hash)
                 {
-                    strErr = "Error reading wallet database: CPubKey/CPrivKey corrupt";
-                    return false;
+                    rec.strErr = "Error reading wallet database: CPubKey/CPrivKey corrupt";
+                    return;
                 }
 
                 fSkipCheck = true;
             }
 
-            if (!key.Load(pkey, vchPubKey, fSkipCheck))
+            if (!rec.key.Load(pkey, vchPubKey, fSkipCheck))
             {
-                strErr = "Error reading wallet database: CPrivKey corrupt";
-                return false;
+                rec.strErr = "Error reading wallet database: CPrivKey corrupt";
+                return;
             }
-            if (!pwallet->LoadKey(key, vchPubKey))
+            rec.fDecodeOK = true;
+        }
+    } catch (...)
+    {
+        rec.fDecoded = true;
+        rec.fDecodeOK = false;
+    }
+}
+
+static void DecodeKeyValues(std::vector<CWalletRecord>& vRecords, size_t nBegin, size_t nEnd)
+{
+    for (size_t i = nBegin; i < nEnd; i++)
+        DecodeKeyValue(vRecords[i]);
+}
+
+static bool ApplyKeyValue(CWallet* pwallet, CWalletRecord& rec, CWalletScanState &wss)
+{
+    if (rec.fDecoded)
+    {
+        if (!rec.fDecodeOK)
+            return false;
+        if (rec.strType == "tx")
+        {
+            if (rec.fUpgraded)
+                wss.vWalletUpgrade.push_back(rec.hash);
+            if (rec.wtx.nOrderPos == -1)
+                wss.fAnyUnordered = true;
+
+            pwallet->AddToWallet(rec.wtx, true);
+        }
+        else
+        {
+            if (rec.strType == "key")
+                wss.nKeys++;
+            if (!pwallet->LoadKey(rec.key, rec.vchPubKey))
             {
-                strErr = "Error reading wallet database: LoadKey failed";
+                rec.strErr = "Error reading wallet database: LoadKey failed";
                 return false;
             }
         }
+        return true;
+    }
+
+    const std::string& strType = rec.strType;
+    std::string& strErr = rec.strErr;
+    CDataStream& ssKey = rec.ssKey;
+    CDataStream& ssValue = rec.ssValue;
+    try {
+        if (strType == "name")
+        {
+            std::string strAddress;
+            ssKey >> strAddress;
+            ssValue >> pwallet->mapAddressBook[CBitcoinAddress(strAddress).Get()].name;
+        }
+        else if (strType == "purpose")
+        {
+            std::string strAddress;
+            ssKey >> strAddress;
+            ssValue >> pwallet->mapAddressBook[CBitcoinAddress(strAddress).Get()].purpose;
+        }
+        else if (strType == "acentry")
+        {
+            std::string strAccount;
+            ssKey >> strAccount;
+            uint64_t nNumber;
+            ssKey >> nNumber;
+            if (nNumber > nAccountingEntryNumber)
+                nAccountingEntryNumber = nNumber;
+
+            if (!wss.fAnyUnordered)
+            {
+                CAccountingEntry acentry;
+                ssValue >> acentry;
+                if (acentry.nOrderPos == -1)
+                    wss.fAnyUnordered = true;
+            }
+        }
         else if (strType == "mkey")
         {
             unsigned int nID;
@@ -569,6 +651,20 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
     return true;
 }
 
+bool
+ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
+             CWalletScanState &wss, std::string& strType, std::string& strErr)
+{
+    CWalletRecord rec;
+    rec.ssKey = ssKey;
+    rec.ssValue = ssValue;
+    DecodeKeyValue(rec);
+    bool fReadOK = ApplyKeyValue(pwallet, rec, wss);
+    strType = rec.strType;
+    strErr = rec.strErr;
+    return fReadOK;
+}
+
 static bool IsKeyType(std::string strType)
 {
     return (strType== "key" || strType == "wkey" ||
@@ -593,48 +689,81 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor)
         {
             LogPrintf("Error getting wallet database cursor\n");
             return DB_CORRUPT;
         }
 
-        while (true)
+        // In batches: the records are read from the cursor, transactions and
+        // keys are decoded and checked on worker threads, then everything is
+        // added to the wallet in database order
+        int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_WALLET_LOAD_THREADS));
+        int64_t nTimeRead = 0, nTimeDecode = 0, nTimeApply = 0;
+        unsigned int nRecords = 0;
+        bool fEnd = false;
+        while (!fEnd)
         {
-            // Read next record
-            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-            int ret = ReadAtCursor(pcursor, ssKey, ssValue);
-            if (ret == DB_NOTFOUND)
-                break;
-            else if (ret != 0)
+            int64_t nStart = GetTimeMicros();
+            std::vector<CWalletRecord> vRecords;
+            vRecords.reserve(WALLET_LOAD_BATCH_SIZE);
+            while (vRecords.size() < WALLET_LOAD_BATCH_SIZE)
             {
-                LogPrintf("Error reading next record from wallet database\n");
-                return DB_CORRUPT;
+                // Read next record
+                vRecords.push_back(CWalletRecord());
+                int ret = ReadAtCursor(pcursor, vRecords.back().ssKey, vRecords.back().ssValue);
+                if (ret == DB_NOTFOUND)
+                {
+                    vRecords.pop_back();
+                    fEnd = true;
+                    break;
+                }
+                else if (ret != 0)
+                {
+                    LogPrintf("Error reading next record from wallet database\n");
+                    return DB_CORRUPT;
+                }
             }
-
-            // Try to be tolerant of single corrupt records:
-            std::string strType, strErr;
-            if (!ReadKeyValue(pwallet, ssKey, ssValue, wss, strType, strErr))
+            nRecords += vRecords.size();
+            nTimeRead += GetTimeMicros() - nStart;
+
+            nStart = GetTimeMicros();
+            size_t nPerThread = std::max((vRecords.size() + nThreads - 1) / nThreads, (size_t)MIN_WALLET_LOAD_THREAD_RECORDS);
+            boost::thread_group threadGroup;
+            for (size_t nBegin = nPerThread; nBegin < vRecords.size(); nBegin += nPerThread)
+                threadGroup.create_thread(boost::bind(&DecodeKeyValues, boost::ref(vRecords), nBegin, std::min(vRecords.size(), nBegin + nPerThread)));
+            DecodeKeyValues(vRecords, 0, std::min(vRecords.size(), nPerThread));
+            threadGroup.join_all();
+            nTimeDecode += GetTimeMicros() - nStart;
+
+            nStart = GetTimeMicros();
+            BOOST_FOREACH(CWalletRecord& rec, vRecords)
             {
-                // losing keys is considered a catastrophic error, anything else
-                // we assume the user can live with:
-                if (IsKeyType(strType))
-                    result = DB_CORRUPT;
-                else
+                // Try to be tolerant of single corrupt records:
+                if (!ApplyKeyValue(pwallet, rec, wss))
                 {
-                    // Leave other errors alone, if we try to fix them we might make things worse.
-                    fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
-                    if (strType == "tx")
-                        // Rescan if there is a bad transaction record:
-                        SoftSetBoolArg("-rescan", true);
+                    // losing keys is considered a catastrophic error, anything else
+                    // we assume the user can live with:
+                    if (IsKeyType(rec.strType))
+                        result = DB_CORRUPT;
+                    else
+                    {
+                        // Leave other errors alone, if we try to fix them we might make things worse.
+                        fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
+                        if (rec.strType == "tx")
+                            // Rescan if there is a bad transaction record:
+                            SoftSetBoolArg("-rescan", true);
+                    }
                 }
+                if (!rec.strErr.empty())
+                    LogPrintf("%s\n", rec.strErr);
             }
-            if (!strErr.empty())
-                LogPrintf("%s\n", strErr);
+            nTimeApply += GetTimeMicros() - nStart;
         }
-        pcursor->close();
+        delete pcursor;
+        LogPrintf("LoadWallet: %u records, read %dms, decode %dms on up to %d threads, add to wallet %dms\n",
+                  nRecords, nTimeRead / 1000, nTimeDecode / 1000, nThreads, nTimeApply / 1000);
     }
     catch (boost::thread_interrupted) {
         throw;
@@ -694,7 +823,7 @@ DBErrors CWalletDB::FindWalletTx(CWallet* pwallet, std::vector<uint256>& vTxHash
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor)
         {
             LogPrintf("Error getting wallet database cursor\n");
@@ -724,7 +853,7 @@ DBErrors CWalletDB::FindWalletTx(CWallet* pwallet, std::vector<uint256>& vTxHash
                 vTxHash.push_back(hash);
             }
         }
-        pcursor->close();
+        delete pcursor;
     }
     catch (boost::thread_interrupted) {
         throw;
@@ -822,6 +951,14 @@ bool BackupWallet(const CWallet& wallet, const std::string& strDest)
 {
     if (!wallet.fFileBacked)
         return false;
+    CWalletStore* pstore = bitdb.GetStore(wallet.strWalletFile);
+    if (pstore)
+    {
+        boost::filesystem::path pathDest(strDest);
+        if (boost::filesystem::is_directory(pathDest))
+            pathDest /= bitdb.GetLogStorePath(wallet.strWalletFile).filename();
+        return pstore->Backup(pathDest);
+    }
     while (true)
     {
         {
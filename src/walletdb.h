@@ -96,6 +96,11 @@ public:
     bool WriteBestBlock(const CBlockLocator& locator);
     bool ReadBestBlock(CBlockLocator& locator);
 
+    /// Where an unfinished rescan got to, so the next start can pick it up
+    bool WriteRescanBlock(const CBlockLocator& locator);
+    bool ReadRescanBlock(CBlockLocator& locator);
+    bool EraseRescanBlock();
+
     bool WriteOrderPosNext(int64_t nOrderPosNext);
 
     bool WriteDefaultKey(const CPubKey& vchPubKey);
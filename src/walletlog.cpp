@@ -0,0 +1,519 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "walletlog.h"
+
+#include "hash.h"
+#include "util.h"
+#include "version.h"
+
+#include <algorithm>
+#include <string.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+#include <boost/version.hpp>
+
+/** Start of every frame */
+static const unsigned int WALLETLOG_MAGIC = 0x4c57e1a9;
+/** Magic and payload size */
+static const unsigned int WALLETLOG_HEADER_SIZE = 8;
+/** Truncated double SHA256 of the payload */
+static const unsigned int WALLETLOG_CHECKSUM_SIZE = 4;
+/** Payload size the records are cut into when a log is compacted */
+static const size_t WALLETLOG_COMPACT_FRAME_SIZE = 1024 * 1024;
+
+/** Make a rename in pathDir durable */
+static bool SyncDirectory(const boost::filesystem::path& pathDir)
+{
+#ifdef WIN32
+    // Directories cannot be synced, NTFS journals the rename
+    return true;
+#else
+    int fd = open(pathDir.empty() ? "." : pathDir.string().c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    bool fOK = fsync(fd) == 0;
+    close(fd);
+    return fOK;
+#endif
+}
+
+const CWalletStoreOp* CWalletStoreBatch::Find(const CSerializeData& key) const
+{
+    for (std::vector<CWalletStoreOp>::const_reverse_iterator it = vOps.rbegin(); it != vOps.rend(); ++it)
+        if (it->key == key)
+            return &(*it);
+    return NULL;
+}
+
+bool CWalletStoreKeyCompare::operator()(const CSerializeData& a, const CSerializeData& b) const
+{
+    const unsigned char* pa = a.empty() ? NULL : (const unsigned char*)&a[0];
+    const unsigned char* pb = b.empty() ? NULL : (const unsigned char*)&b[0];
+    return std::lexicographical_compare(pa, pa + a.size(), pb, pb + b.size());
+}
+
+static unsigned int FrameChecksum(const char* pbegin, const char* pend)
+{
+    uint256 hash = Hash(pbegin, pend);
+    unsigned int nChecksum;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    return nChecksum;
+}
+
+/** Append the frame holding vOps to vch */
+static void AppendFrame(CSerializeData& vch, const std::vector<CWalletStoreOp>& vOps)
+{
+    CDataStream ssFrame(SER_DISK, CLIENT_VERSION);
+    ssFrame << WALLETLOG_MAGIC << (unsigned int)0 << vOps;
+    unsigned int nPayloadSize = ssFrame.size() - WALLETLOG_HEADER_SIZE;
+    memcpy(&ssFrame[4], &nPayloadSize, sizeof(nPayloadSize));
+    ssFrame << FrameChecksum(&ssFrame[WALLETLOG_HEADER_SIZE], &ssFrame[0] + ssFrame.size());
+    vch.insert(vch.end(), ssFrame.begin(), ssFrame.end());
+}
+
+/** Roughly what a record takes in the log, so log and live sizes compare */
+static uint64_t RecordSize(const CSerializeData& key, const CSerializeData& value)
+{
+    return key.size() + value.size() + 12;
+}
+
+CWalletLog::CWalletLog(const boost::filesystem::path& pathIn, uint64_t nMinCompactSizeIn) :
+    path(pathIn), nMinCompactSize(nMinCompactSizeIn), file(NULL), nLogSize(0), nLiveSize(0), fFailed(false),
+    nQueuedPos(0), nSyncedPos(0), fWriting(false), nSyncs(0),
+    fCompacting(false), nSnapshotPos(0), pthreadCompact(NULL), nCompactions(0)
+{
+}
+
+CWalletLog::~CWalletLog()
+{
+    Close();
+}
+
+void CWalletLog::Apply(const CWalletStoreOp& op)
+{
+    RecordMap::iterator mi = mapRecords.find(op.key);
+    if (mi != mapRecords.end())
+    {
+        nLiveSize -= RecordSize(mi->first, mi->second);
+        if (op.fErase)
+        {
+            mapRecords.erase(mi);
+            return;
+        }
+        mi->second = op.value;
+        nLiveSize += RecordSize(mi->first, mi->second);
+    }
+    else if (!op.fErase)
+    {
+        mapRecords.insert(std::make_pair(op.key, op.value));
+        nLiveSize += RecordSize(op.key, op.value);
+    }
+}
+
+bool CWalletLog::Replay(FILE* fileIn, uint64_t nFileSize, uint64_t& nGoodSize)
+{
+    nGoodSize = 0;
+    CSerializeData vchFrame;
+    while (nGoodSize < nFileSize)
+    {
+        uint64_t nRemaining = nFileSize - nGoodSize;
+        unsigned int nMagic = 0, nPayloadSize = 0;
+        if (nRemaining >= WALLETLOG_HEADER_SIZE &&
+            fread(&nMagic, sizeof(nMagic), 1, fileIn) == 1 &&
+            fread(&nPayloadSize, sizeof(nPayloadSize), 1, fileIn) == 1 &&
+            nMagic == WALLETLOG_MAGIC && nPayloadSize <= MAX_SIZE &&
+            nRemaining >= WALLETLOG_HEADER_SIZE + nPayloadSize + WALLETLOG_CHECKSUM_SIZE)
+        {
+            vchFrame.resize(nPayloadSize + WALLETLOG_CHECKSUM_SIZE);
+            if (fread(&vchFrame[0], 1, vchFrame.size(), fileIn) == vchFrame.size())
+            {
+                unsigned int nChecksum;
+                memcpy(&nChecksum, &vchFrame[nPayloadSize], sizeof(nChecksum));
+                std::vector<CWalletStoreOp> vOps;
+                bool fDecoded = false;
+                if (nChecksum == FrameChecksum(&vchFrame[0], &vchFrame[0] + nPayloadSize))
+                {
+                    try {
+                        CDataStream ssPayload(vchFrame.begin(), vchFrame.begin() + nPayloadSize, SER_DISK, CLIENT_VERSION);
+                        ssPayload >> vOps;
+                        fDecoded = true;
+                    }
+                    catch (std::exception &e) {
+                    }
+                }
+                if (fDecoded)
+                {
+                    BOOST_FOREACH(const CWalletStoreOp& op, vOps)
+                        Apply(op);
+                    nGoodSize += WALLETLOG_HEADER_SIZE + nPayloadSize + WALLETLOG_CHECKSUM_SIZE;
+                    continue;
+                }
+            }
+        }
+
+        // A crash in the middle of an append leaves a frame running up to the end
+        // of the file, or zeros where the file was extended but not yet written
+        if (nRemaining < WALLETLOG_HEADER_SIZE)
+            return true;
+        if (nMagic == WALLETLOG_MAGIC && nPayloadSize <= MAX_SIZE &&
+            nRemaining <= WALLETLOG_HEADER_SIZE + nPayloadSize + WALLETLOG_CHECKSUM_SIZE)
+            return true;
+        if (fseek(fileIn, nGoodSize, SEEK_SET) != 0)
+            return false;
+        int c;
+        while ((c = fgetc(fileIn)) != EOF)
+            if (c != 0)
+                return false;
+        return true;
+    }
+    return true;
+}
+
+bool CWalletLog::Open()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (file != NULL)
+        return true;
+
+    int64_t nStart = GetTimeMillis();
+    mapRecords.clear();
+    nLiveSize = 0;
+    nLogSize = 0;
+    if (boost::filesystem::exists(path))
+    {
+        uint64_t nFileSize = boost::filesystem::file_size(path);
+        FILE* fileIn = fopen(path.string().c_str(), "rb+");
+        if (fileIn == NULL)
+            return error("CWalletLog::Open : cannot open %s", path.string());
+        if (!Replay(fileIn, nFileSize, nLogSize))
+        {
+            fclose(fileIn);
+            mapRecords.clear();
+            return error("CWalletLog::Open : %s is corrupt at offset %u", path.string(), nLogSize);
+        }
+        if (nLogSize < nFileSize)
+        {
+            LogPrintf("CWalletLog::Open : discarding %u bytes of incomplete data at the end of %s\n", nFileSize - nLogSize, path.string());
+            if (!TruncateFile(fileIn, nLogSize))
+            {
+                fclose(fileIn);
+                return error("CWalletLog::Open : cannot truncate %s", path.string());
+            }
+            FileCommit(fileIn);
+        }
+        fclose(fileIn);
+    }
+
+    file = fopen(path.string().c_str(), "ab");
+    if (file == NULL)
+        return error("CWalletLog::Open : cannot open %s for writing", path.string());
+    fFailed = false;
+    vchQueued.clear();
+    nQueuedPos = nSyncedPos = 0;
+    LogPrintf("CWalletLog::Open : %u records in %s (%u bytes) replayed in %dms\n",
+              mapRecords.size(), path.string(), nLogSize, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CWalletLog::Read(const CSerializeData& key, CSerializeData& value) const
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    RecordMap::const_iterator mi = mapRecords.find(key);
+    if (mi == mapRecords.end())
+        return false;
+    value = mi->second;
+    return true;
+}
+
+bool CWalletLog::Exists(const CSerializeData& key) const
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return mapRecords.count(key) > 0;
+}
+
+bool CWalletLog::Seek(const CSerializeData& key, bool fAfter, CSerializeData& keyRet, CSerializeData& valueRet) const
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    RecordMap::const_iterator mi = fAfter ? mapRecords.upper_bound(key) : mapRecords.lower_bound(key);
+    if (mi == mapRecords.end())
+        return false;
+    keyRet = mi->first;
+    valueRet = mi->second;
+    return true;
+}
+
+bool CWalletLog::NeedCompact() const
+{
+    return !fCompacting && file != NULL && nLogSize >= nMinCompactSize && nLogSize > 2 * nLiveSize;
+}
+
+bool CWalletLog::Commit(const CWalletStoreBatch& batch)
+{
+    if (batch.vOps.empty())
+        return true;
+    CSerializeData vchFrame;
+    AppendFrame(vchFrame, batch.vOps);
+    if (vchFrame.size() > MAX_SIZE)
+        return error("CWalletLog::Commit : batch of %u bytes is too large", vchFrame.size());
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (file == NULL || fFailed)
+        return false;
+    BOOST_FOREACH(const CWalletStoreOp& op, batch.vOps)
+        Apply(op);
+    vchQueued.insert(vchQueued.end(), vchFrame.begin(), vchFrame.end());
+    nQueuedPos += vchFrame.size();
+    uint64_t nEndPos = nQueuedPos;
+
+    while (nSyncedPos < nEndPos && !fFailed)
+    {
+        if (fWriting)
+        {
+            // Our frame goes out with the next write
+            condChanged.wait(lock);
+            continue;
+        }
+
+        // Write and sync everything queued, including frames other threads
+        // queued while the previous write was running
+        fWriting = true;
+        CSerializeData vchWrite;
+        vchWrite.swap(vchQueued);
+        lock.unlock();
+        bool fOK = fwrite(&vchWrite[0], 1, vchWrite.size(), file) == vchWrite.size() && fflush(file) == 0;
+        if (fOK)
+            FileCommit(file);
+        lock.lock();
+
+        fWriting = false;
+        if (fOK)
+        {
+            // A running compaction needs what was written after its snapshot
+            if (fCompacting && nSyncedPos + vchWrite.size() > nSnapshotPos)
+            {
+                size_t nSkip = nSnapshotPos > nSyncedPos ? nSnapshotPos - nSyncedPos : 0;
+                vchCompactTail.insert(vchCompactTail.end(), vchWrite.begin() + nSkip, vchWrite.end());
+            }
+            nSyncedPos += vchWrite.size();
+            nLogSize += vchWrite.size();
+            nSyncs++;
+        }
+        else
+        {
+            // What is in memory is ahead of the file now, refuse any further commits
+            LogPrintf("CWalletLog::Commit : error writing %s\n", path.string());
+            fFailed = true;
+        }
+        condChanged.notify_all();
+    }
+    if (fFailed)
+        return false;
+
+    if (NeedCompact())
+    {
+        if (pthreadCompact)
+        {
+            pthreadCompact->join();
+            delete pthreadCompact;
+        }
+        fCompacting = true;
+        pthreadCompact = new boost::thread(boost::bind(&CWalletLog::ThreadCompact, this));
+    }
+    return true;
+}
+
+void CWalletLog::ThreadCompact()
+{
+    RenameThread("bitcoin-walletlog");
+    boost::unique_lock<boost::mutex> lock(mutex);
+    Compact(lock);
+}
+
+bool CWalletLog::Compact(boost::unique_lock<boost::mutex>& lock)
+{
+    // Called with fCompacting set and the lock held
+    int64_t nStart = GetTimeMillis();
+    uint64_t nOldSize = nLogSize;
+    CSerializeData vchSnapshot;
+    {
+        std::vector<CWalletStoreOp> vOps;
+        size_t nPayloadSize = 0;
+        BOOST_FOREACH(const RecordMap::value_type& item, mapRecords)
+        {
+            vOps.push_back(CWalletStoreOp(false, item.first, item.second));
+            nPayloadSize += RecordSize(item.first, item.second);
+            if (nPayloadSize >= WALLETLOG_COMPACT_FRAME_SIZE)
+            {
+                AppendFrame(vchSnapshot, vOps);
+                vOps.clear();
+                nPayloadSize = 0;
+            }
+        }
+        if (!vOps.empty())
+            AppendFrame(vchSnapshot, vOps);
+    }
+    nSnapshotPos = nQueuedPos;
+    vchCompactTail.clear();
+
+    // Write the snapshot while commits go on against the old file
+    lock.unlock();
+    boost::filesystem::path pathCompact = path.string() + ".compact";
+    FILE* fileCompact = fopen(pathCompact.string().c_str(), "wb");
+    bool fOK = (fileCompact != NULL);
+    if (fOK && !vchSnapshot.empty())
+        fOK = fwrite(&vchSnapshot[0], 1, vchSnapshot.size(), fileCompact) == vchSnapshot.size();
+    if (fOK)
+        fOK = fflush(fileCompact) == 0;
+    if (fOK)
+        FileCommit(fileCompact);
+    lock.lock();
+
+    // Switch files between writes: append what was committed since the
+    // snapshot, and the next write goes to the new file
+    while (fWriting)
+        condChanged.wait(lock);
+    if (file == NULL || fFailed)
+        fOK = false;
+    if (fOK && !vchCompactTail.empty())
+        fOK = fwrite(&vchCompactTail[0], 1, vchCompactTail.size(), fileCompact) == vchCompactTail.size();
+    if (fOK)
+        fOK = fflush(fileCompact) == 0;
+    if (fOK)
+        FileCommit(fileCompact);
+    if (fileCompact != NULL)
+        fclose(fileCompact);
+    if (fOK)
+    {
+        fclose(file);
+        fOK = RenameOver(pathCompact, path);
+        file = fopen(path.string().c_str(), "ab");
+        if (file == NULL)
+        {
+            LogPrintf("CWalletLog::Compact : cannot reopen %s\n", path.string());
+            fFailed = true;
+            fOK = false;
+        }
+        else if (fOK && !SyncDirectory(path.parent_path()))
+        {
+            // Commits satisfied by the snapshot are only on disk once the rename is
+            LogPrintf("CWalletLog::Compact : cannot sync the directory of %s\n", path.string());
+            fFailed = true;
+            fOK = false;
+        }
+    }
+    if (fOK)
+    {
+        // Frames queued before the snapshot are in the new file already
+        if (nSyncedPos < nSnapshotPos)
+        {
+            vchQueued.erase(vchQueued.begin(), vchQueued.begin() + (nSnapshotPos - nSyncedPos));
+            nSyncedPos = nSnapshotPos;
+        }
+        nLogSize = vchSnapshot.size() + vchCompactTail.size();
+        nCompactions++;
+        LogPrintf("CWalletLog::Compact : %s from %u to %u bytes in %dms\n", path.string(), nOldSize, nLogSize, GetTimeMillis() - nStart);
+    }
+    else
+    {
+        LogPrintf("CWalletLog::Compact : failed to compact %s\n", path.string());
+        boost::filesystem::remove(pathCompact);
+    }
+    vchCompactTail.clear();
+    fCompacting = false;
+    condChanged.notify_all();
+    return fOK;
+}
+
+bool CWalletLog::Rewrite(const char* pszSkip)
+{
+    if (pszSkip != NULL)
+    {
+        CWalletStoreBatch batch;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            size_t nSkipLen = strlen(pszSkip);
+            BOOST_FOREACH(const RecordMap::value_type& item, mapRecords)
+                if (item.first.size() >= nSkipLen && memcmp(&item.first[0], pszSkip, nSkipLen) == 0)
+                    batch.Erase(item.first);
+        }
+        if (!Commit(batch))
+            return false;
+    }
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (fCompacting)
+        condChanged.wait(lock);
+    if (file == NULL || fFailed)
+        return false;
+    fCompacting = true;
+    return Compact(lock);
+}
+
+bool CWalletLog::Backup(const boost::filesystem::path& pathDest)
+{
+    // The file holds whole frames between writes, and compaction cannot
+    // replace it while the lock is held
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (fWriting)
+        condChanged.wait(lock);
+    if (file == NULL)
+        return false;
+    try {
+#if BOOST_VERSION >= 104000
+        boost::filesystem::copy_file(path, pathDest, boost::filesystem::copy_option::overwrite_if_exists);
+#else
+        boost::filesystem::copy_file(path, pathDest);
+#endif
+        LogPrintf("copied %s to %s\n", path.string(), pathDest.string());
+        return true;
+    } catch(const boost::filesystem::filesystem_error &e) {
+        LogPrintf("error copying %s to %s - %s\n", path.string(), pathDest.string(), e.what());
+        return false;
+    }
+}
+
+void CWalletLog::Close()
+{
+    boost::thread* pthread = NULL;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (fCompacting || fWriting)
+            condChanged.wait(lock);
+        if (file != NULL)
+        {
+            fclose(file);
+            file = NULL;
+        }
+        pthread = pthreadCompact;
+        pthreadCompact = NULL;
+    }
+    if (pthread)
+    {
+        pthread->join();
+        delete pthread;
+    }
+}
+
+void CWalletLog::GetSizes(uint64_t& nLogSizeRet, uint64_t& nLiveSizeRet) const
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    nLogSizeRet = nLogSize;
+    nLiveSizeRet = nLiveSize;
+}
+
+void CWalletLog::GetStats(size_t& nRecordsRet, uint64_t& nSyncsRet, uint64_t& nCompactionsRet) const
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    nRecordsRet = mapRecords.size();
+    nSyncsRet = nSyncs;
+    nCompactionsRet = nCompactions;
+}
@@ -0,0 +1,170 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_WALLETLOG_H
+#define BITCOIN_WALLETLOG_H
+
+#include "serialize.h"
+
+#include <map>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+/** Log files are compacted in the background once they are at least this big */
+static const uint64_t WALLETLOG_MIN_COMPACT_SIZE = 1024 * 1024;
+
+/** One record written or erased in a wallet store */
+class CWalletStoreOp
+{
+public:
+    bool fErase;
+    CSerializeData key;
+    CSerializeData value;
+
+    CWalletStoreOp() : fErase(false) {}
+    CWalletStoreOp(bool fEraseIn, const CSerializeData& keyIn, const CSerializeData& valueIn) :
+        fErase(fEraseIn), key(keyIn), value(valueIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(fErase);
+        READWRITE(key);
+        READWRITE(value);
+    )
+};
+
+/** Writes and erases that a wallet store applies all or nothing */
+class CWalletStoreBatch
+{
+public:
+    std::vector<CWalletStoreOp> vOps;
+
+    void Write(const CSerializeData& key, const CSerializeData& value)
+    {
+        vOps.push_back(CWalletStoreOp(false, key, value));
+    }
+
+    void Erase(const CSerializeData& key)
+    {
+        vOps.push_back(CWalletStoreOp(true, key, CSerializeData()));
+    }
+
+    /** Last op on key in this batch, NULL if there is none */
+    const CWalletStoreOp* Find(const CSerializeData& key) const;
+};
+
+/**
+ * Storage for a wallet file other than Berkeley DB: serialized keys mapped to
+ * serialized values, in the byte order Berkeley DB keeps them in. CDB routes
+ * its reads, writes, cursors and transactions here for files that have one.
+ */
+class CWalletStore
+{
+public:
+    virtual ~CWalletStore() {}
+
+    virtual bool Read(const CSerializeData& key, CSerializeData& value) const = 0;
+    virtual bool Exists(const CSerializeData& key) const = 0;
+
+    /** First record with a key not less than key, or greater than key if fAfter */
+    virtual bool Seek(const CSerializeData& key, bool fAfter, CSerializeData& keyRet, CSerializeData& valueRet) const = 0;
+
+    /** Apply batch atomically, returns once it is on disk */
+    virtual bool Commit(const CWalletStoreBatch& batch) = 0;
+
+    /** Erase the records whose key starts with pszSkip and rewrite the storage without stale data */
+    virtual bool Rewrite(const char* pszSkip = NULL) = 0;
+
+    /** Copy a consistent image of the storage to pathDest */
+    virtual bool Backup(const boost::filesystem::path& pathDest) = 0;
+
+    virtual void Close() = 0;
+};
+
+/** Orders keys byte by byte as unsigned values, like Berkeley DB's default btree comparison */
+struct CWalletStoreKeyCompare
+{
+    bool operator()(const CSerializeData& a, const CSerializeData& b) const;
+};
+
+/**
+ * Wallet store kept as an append-only log of checksummed batches.
+ *
+ * Each commit appends one frame: magic, payload size, the serialized ops and
+ * the first four bytes of their double SHA256. A commit returns after its
+ * frame is synced. Concurrent commits share syncs: the first one to find no
+ * write in progress writes everything queued so far, the others wait for it.
+ *
+ * All live records are held in memory. Opening replays the log; a torn frame
+ * at the end, left by a crash in the middle of a write, is cut off, while a
+ * bad frame followed by good data fails the open. When the log grows to twice
+ * the size of the live records it is compacted on a background thread: the
+ * records are written to a new file, frames committed in the meantime are
+ * appended to it, and it is renamed over the log.
+ */
+class CWalletLog : public CWalletStore
+{
+public:
+    explicit CWalletLog(const boost::filesystem::path& pathIn, uint64_t nMinCompactSizeIn = WALLETLOG_MIN_COMPACT_SIZE);
+    ~CWalletLog();
+
+    /** Replay the log, creating it if it does not exist */
+    bool Open();
+
+    bool Read(const CSerializeData& key, CSerializeData& value) const;
+    bool Exists(const CSerializeData& key) const;
+    bool Seek(const CSerializeData& key, bool fAfter, CSerializeData& keyRet, CSerializeData& valueRet) const;
+    bool Commit(const CWalletStoreBatch& batch);
+    bool Rewrite(const char* pszSkip = NULL);
+    bool Backup(const boost::filesystem::path& pathDest);
+    void Close();
+
+    /** Bytes in the log file and in the live records it holds */
+    void GetSizes(uint64_t& nLogSizeRet, uint64_t& nLiveSizeRet) const;
+    /** Number of records, syncs and compactions so far */
+    void GetStats(size_t& nRecordsRet, uint64_t& nSyncsRet, uint64_t& nCompactionsRet) const;
+
+private:
+    typedef std::map<CSerializeData, CSerializeData, CWalletStoreKeyCompare> RecordMap;
+
+    boost::filesystem::path path;
+    uint64_t nMinCompactSize;
+
+    mutable boost::mutex mutex;
+    boost::condition_variable condChanged;
+    FILE* file;
+    RecordMap mapRecords;
+    uint64_t nLogSize;
+    uint64_t nLiveSize;
+    bool fFailed;
+
+    // Group commit: frames queued since the last write, how many bytes were
+    // ever queued and synced, and whether a write is running
+    CSerializeData vchQueued;
+    uint64_t nQueuedPos;
+    uint64_t nSyncedPos;
+    bool fWriting;
+    uint64_t nSyncs;
+
+    // Compaction: the queue position of its snapshot, and frames written since
+    bool fCompacting;
+    uint64_t nSnapshotPos;
+    CSerializeData vchCompactTail;
+    boost::thread* pthreadCompact;
+    uint64_t nCompactions;
+
+    void Apply(const CWalletStoreOp& op);
+    bool Replay(FILE* fileIn, uint64_t nFileSize, uint64_t& nGoodSize);
+    bool NeedCompact() const;
+    void ThreadCompact();
+    bool Compact(boost::unique_lock<boost::mutex>& lock);
+};
+
+#endif // BITCOIN_WALLETLOG_H